@@ -2,10 +2,16 @@ from .python.constants import McuType, BASEDIR, FW_PATH, USBPACKET_MAX_SIZE  # n
 from .python.spi import PandaSpiException, PandaProtocolMismatch, STBootloaderSPIHandle  # noqa: F401
 from .python.serial import PandaSerial  # noqa: F401
 from .python.canhandle import CanHandle # noqa: F401
+from .python.asyncpanda import AsyncPanda # noqa: F401
+from .python.canrx import CanRxDispatcher # noqa: F401
+from .python.canreader import CanReader, CanCursor # noqa: F401
 from .python.utils import logger # noqa: F401
 from .python import (Panda, PandaDFU, uds, isotp, # noqa: F401
-                     pack_can_buffer, unpack_can_buffer, calculate_checksum,
-                     DLC_TO_LEN, LEN_TO_DLC, ALTERNATIVE_EXPERIENCE, CANPACKET_HEAD_SIZE)
+                     pack_can_buffer, unpack_can_buffer, calculate_checksum, CanDecompressor,
+                     pack_isotp_open, pack_isotp_send, pack_isotp_close,
+                     DLC_TO_LEN, LEN_TO_DLC, ALTERNATIVE_EXPERIENCE, CANPACKET_HEAD_SIZE,
+                     CAN_RECORD_HEALTH, CAN_RECORD_CAN_HEALTH)
+from .python.fleet import PandaFleet, discover # noqa: F401
 
 
 # panda jungle
@@ -15,11 +15,239 @@
 typedef struct {
   uint32_t ptr;
   uint32_t tail_size;
-  uint8_t data[72];
+  uint8_t data[CAN_COMPRESS_SIZE_MAX];  // fits a CANPacket_t or a record, compressed or not
 } asm_buffer;
 
 static asm_buffer can_read_buffer = {.ptr = 0U, .tail_size = 0U};
 
+// latest record of each kind, replaced if the host hasn't read it yet
+#define CAN_RECORD_SLOTS 4U  // health, CAN health of three buses
+
+typedef struct {
+  bool pending;
+  uint32_t len;
+  uint8_t data[CAN_RECORD_HEAD_SIZE + CAN_RECORD_DATA_SIZE_MAX];
+} can_record_slot_t;
+
+static can_record_slot_t can_record_slots[CAN_RECORD_SLOTS];
+static uint32_t can_records_period_us = 0U;
+static uint32_t can_records_last = 0U;
+
+// 0 disables records
+void comms_can_set_records_period(uint16_t period_ms) {
+  can_records_period_us = (uint32_t)period_ms * 1000U;
+  can_records_last = microsecond_timer_get() - can_records_period_us;
+}
+
+// true once per period, the caller then pushes the records
+bool comms_can_records_due(uint32_t now) {
+  bool ret = false;
+  if ((can_records_period_us != 0U) && ((now - can_records_last) >= can_records_period_us)) {
+    can_records_last = now;
+    ret = true;
+  }
+  return ret;
+}
+
+bool comms_can_push_record(uint8_t type, uint8_t index, const uint8_t *payload, uint32_t len) {
+  bool ret = false;
+  uint8_t slot = CAN_RECORD_SLOTS;
+  if ((type == CAN_RECORD_HEALTH) && (index == 0U)) {
+    slot = 0U;
+  } else if ((type == CAN_RECORD_CAN_HEALTH) && (index < (CAN_RECORD_SLOTS - 1U))) {
+    slot = index + 1U;
+  } else {
+    // invalid record
+  }
+
+  if ((slot < CAN_RECORD_SLOTS) && (len <= CAN_RECORD_DATA_SIZE_MAX) && (can_records_period_us != 0U)) {
+    can_record_header_t header = {
+      .flags = CAN_RECORD_FLAG,
+      .type = type,
+      .index = index,
+      .len = (uint16_t)len,
+      .checksum = 0U,
+      .timestamp = microsecond_timer_get(),
+    };
+    uint8_t checksum = 0U;
+    for (uint32_t i = 0U; i < CAN_RECORD_HEAD_SIZE; i++) {
+      checksum ^= ((uint8_t*)&header)[i];
+    }
+    for (uint32_t i = 0U; i < len; i++) {
+      checksum ^= payload[i];
+    }
+    header.checksum = checksum;
+
+    ENTER_CRITICAL();
+    can_record_slot_t *s = &can_record_slots[slot];
+    (void)memcpy(s->data, (uint8_t*)&header, CAN_RECORD_HEAD_SIZE);
+    (void)memcpy(&s->data[CAN_RECORD_HEAD_SIZE], payload, len);
+    s->len = CAN_RECORD_HEAD_SIZE + len;
+    s->pending = true;
+    EXIT_CRITICAL();
+    ret = true;
+  }
+  return ret;
+}
+
+static bool comms_can_pop_record(uint8_t *data, uint32_t *len) {
+  bool ret = false;
+  ENTER_CRITICAL();
+  for (uint8_t i = 0U; i < CAN_RECORD_SLOTS; i++) {
+    if (can_record_slots[i].pending) {
+      (void)memcpy(data, can_record_slots[i].data, can_record_slots[i].len);
+      *len = can_record_slots[i].len;
+      can_record_slots[i].pending = false;
+      ret = true;
+      break;
+    }
+  }
+  EXIT_CRITICAL();
+  return ret;
+}
+
+// copy a packet or record to the output, the part that doesn't fit goes into the overflow buffer
+static void comms_can_read_copy(uint8_t *data, uint32_t *pos, uint32_t max_len, const uint8_t *src, uint32_t len) {
+  if ((*pos + len) <= max_len) {
+    (void)memcpy(&data[*pos], src, len);
+    *pos += len;
+  } else {
+    (void)memcpy(&data[*pos], src, max_len - *pos);
+    can_read_buffer.ptr += len - (max_len - *pos);
+    (void)memcpy(can_read_buffer.data, &src[(max_len - *pos)], can_read_buffer.ptr);
+    *pos = max_len;
+  }
+}
+
+typedef struct {
+  unsigned char valid : 1;
+  unsigned char extended : 1;
+  unsigned char bus : 3;
+  uint32_t addr;
+  uint8_t data[CAN_COMPRESS_HISTORY];  // zero past the frame's length
+} __attribute__((packed)) can_compress_entry_t;
+
+// packed, 27 bytes a set
+typedef struct {
+  can_compress_entry_t ways[2];
+  uint8_t mru;
+} __attribute__((packed)) can_compress_set_t;
+
+static bool can_compress_enabled = false;
+static uint32_t can_compress_last_ts = 0U;
+#ifdef STM32H7
+__attribute__((section(".axisram"))) static can_compress_set_t can_compress_dict[CAN_COMPRESS_SETS];
+#else
+static can_compress_set_t can_compress_dict[CAN_COMPRESS_SETS];
+#endif
+
+static void can_compress_set(bool enabled) {
+  ENTER_CRITICAL();
+  can_compress_enabled = enabled;
+  can_compress_last_ts = 0U;
+  (void)memset(can_compress_dict, 0, sizeof(can_compress_dict));
+  can_read_buffer.ptr = 0U;
+  can_read_buffer.tail_size = 0U;
+  EXIT_CRITICAL();
+}
+
+// takes effect with the next frame, a partial frame still waiting for the host is
+// dropped. Returns the dictionary size for the host, as set bits, and the
+// payload bytes kept per entry.
+int comms_can_set_compression(bool enabled, uint8_t *resp) {
+  can_compress_set(enabled);
+  resp[0] = (uint8_t)CAN_COMPRESS_SET_BITS;
+  resp[1] = (uint8_t)CAN_COMPRESS_HISTORY;
+  return 2;
+}
+
+static inline uint8_t can_compress_prev(const uint8_t *prev, uint32_t i) {
+  return (i < CAN_COMPRESS_HISTORY) ? prev[i] : 0U;
+}
+
+// zero-run encoding of prev ^ data, prev is zero past the history
+static uint32_t can_compress_xor(const uint8_t *prev, const uint8_t *data, uint32_t len, uint8_t *out) {
+  uint32_t n = 0U;
+  uint32_t i = 0U;
+  while (i < len) {
+    uint32_t run = 0U;
+    while (((i + run) < len) && (run < 0x80U) && (can_compress_prev(prev, i + run) == data[i + run])) {
+      run++;
+    }
+
+    if (run > 0U) {
+      out[n] = (uint8_t)(0x7FU + run);
+      n++;
+      i += run;
+    } else {
+      uint32_t ctrl = n;
+      n++;
+      while ((i < len) && (run < 0x80U) && (can_compress_prev(prev, i) != data[i])) {
+        out[n] = can_compress_prev(prev, i) ^ data[i];
+        n++;
+        i++;
+        run++;
+      }
+      out[ctrl] = (uint8_t)(run - 1U);
+    }
+  }
+  return n;
+}
+
+static uint32_t can_compress_encode(const CANPacket_t *pkt, uint8_t *out) {
+  uint32_t len = dlc_to_len[pkt->data_len_code];
+  uint32_t set_idx = ((pkt->addr ^ ((uint32_t)pkt->bus << 29U)) * 2654435761U) >> (32U - CAN_COMPRESS_SET_BITS);
+  can_compress_set_t *set = &can_compress_dict[set_idx];
+  uint8_t way = 2U;
+  uint32_t n;
+
+  for (uint8_t i = 0U; i < 2U; i++) {
+    const can_compress_entry_t *e = &set->ways[i];
+    if ((e->valid != 0U) && (e->bus == pkt->bus) && (e->extended == pkt->extended) && (e->addr == pkt->addr)) {
+      way = i;
+    }
+  }
+
+  if ((way < 2U) && !((pkt->returned != 0U) && (pkt->rejected != 0U))) {
+    uint32_t slot = (set_idx * 2U) + way;
+    out[0] = (uint8_t)(((uint32_t)pkt->data_len_code << 4U) | ((uint32_t)pkt->returned << 3U) | ((uint32_t)pkt->rejected << 2U) | (slot >> 8U));
+    out[1] = (uint8_t)(slot & 0xFFU);
+    out[2] = pkt->checksum;
+    n = 3U;
+
+    uint32_t delta = pkt->timestamp - can_compress_last_ts;
+    do {
+      out[n] = (uint8_t)(delta & 0x7FU);
+      delta >>= 7U;
+      if (delta != 0U) {
+        out[n] |= 0x80U;
+      }
+      n++;
+    } while (delta != 0U);
+
+    n += can_compress_xor(set->ways[way].data, pkt->data, len, &out[n]);
+  } else {
+    out[0] = CAN_COMPRESS_LITERAL;
+    (void)memcpy(&out[1], (const uint8_t*)pkt, CANPACKET_HEAD_SIZE + len);
+    n = 1U + CANPACKET_HEAD_SIZE + len;
+
+    // replace the least recently used way
+    way = 1U - set->mru;
+    set->ways[way].valid = 1U;
+    set->ways[way].bus = pkt->bus;
+    set->ways[way].extended = pkt->extended;
+    set->ways[way].addr = pkt->addr;
+  }
+
+  can_compress_entry_t *e = &set->ways[way];
+  uint32_t kept = MIN(len, CAN_COMPRESS_HISTORY);
+  (void)memcpy(e->data, pkt->data, kept);
+  (void)memset(&e->data[kept], 0, CAN_COMPRESS_HISTORY - kept);
+  set->mru = way;
+  can_compress_last_ts = pkt->timestamp;
+  return n;
+}
+
 int comms_can_read(uint8_t *data, uint32_t max_len) {
   uint32_t pos = 0U;
 
@@ -33,19 +261,27 @@ int comms_can_read(uint8_t *data, uint32_t max_len) {
   }
 
   if (can_read_buffer.ptr == 0U) {
+    // Records go ahead of the queued CAN packets, tagged in compressed mode
+    uint8_t buf[CAN_COMPRESS_SIZE_MAX];
+    uint32_t record_len = 0U;
+    buf[0] = CAN_COMPRESS_RECORD;
+    while ((pos < max_len) && comms_can_pop_record(&buf[1], &record_len)) {
+      if (can_compress_enabled) {
+        comms_can_read_copy(data, &pos, max_len, buf, record_len + 1U);
+      } else {
+        comms_can_read_copy(data, &pos, max_len, &buf[1], record_len);
+      }
+    }
+
     // Fill rest of buffer with new data
     CANPacket_t can_packet;
     while ((pos < max_len) && can_pop(&can_rx_q, &can_packet)) {
-      uint32_t pckt_len = CANPACKET_HEAD_SIZE + dlc_to_len[can_packet.data_len_code];
-      if ((pos + pckt_len) <= max_len) {
-        (void)memcpy(&data[pos], (uint8_t*)&can_packet, pckt_len);
-        pos += pckt_len;
+      if (can_compress_enabled) {
+        uint32_t enc_len = can_compress_encode(&can_packet, buf);
+        comms_can_read_copy(data, &pos, max_len, buf, enc_len);
       } else {
-        (void)memcpy(&data[pos], (uint8_t*)&can_packet, max_len - pos);
-        can_read_buffer.ptr += pckt_len - (max_len - pos);
-        // cppcheck-suppress objectIndex
-        (void)memcpy(can_read_buffer.data, &((uint8_t*)&can_packet)[(max_len - pos)], can_read_buffer.ptr);
-        pos = max_len;
+        uint32_t pckt_len = CANPACKET_HEAD_SIZE + dlc_to_len[can_packet.data_len_code];
+        comms_can_read_copy(data, &pos, max_len, (uint8_t*)&can_packet, pckt_len);
       }
     }
   }
@@ -55,7 +291,81 @@ int comms_can_read(uint8_t *data, uint32_t max_len) {
 
 static asm_buffer can_write_buffer = {.ptr = 0U, .tail_size = 0U};
 
+// Credit based TX flow control, opt-in per connection with 0xd9. The host sends at most
+// as many frames per bus as it has credits, so a stalled bus no longer holds back writes
+// for the others. Credits leave a reserve for the frames the firmware sends itself.
+// Writes still pause when a bus has less than CAN_TX_CREDIT_FLOOR free slots, for hosts
+// that don't keep to their credits.
+#define CAN_TX_CREDIT_RESERVE 16U
+#define CAN_TX_CREDIT_FLOOR 8U
+
+static bool can_tx_credits_enabled = false;
+
+// uint16 credits per bus, turns credit mode on or off
+int comms_can_tx_credits(bool enabled, uint8_t *data) {
+  can_tx_credits_enabled = enabled;
+  for (uint8_t i = 0U; i < CAN_QUEUES_ARRAY_SIZE; i++) {
+    uint32_t free_slots = can_slots_empty(can_queues[i]);
+    uint16_t credits = (free_slots > CAN_TX_CREDIT_RESERVE) ? (uint16_t)(free_slots - CAN_TX_CREDIT_RESERVE) : 0U;
+    data[(2U * i)] = (uint8_t)(credits & 0xFFU);
+    data[(2U * i) + 1U] = (uint8_t)(credits >> 8U);
+  }
+  return 2U * CAN_QUEUES_ARRAY_SIZE;
+}
+
+bool comms_can_tx_credits_enabled(void) {
+  return can_tx_credits_enabled;
+}
+
 // send on CAN
+static void comms_can_send(CANPacket_t *to_push) {
+  // frames registered for periodic TX only update the payload
+  if (!can_periodic_update(to_push)) {
+    can_send(to_push, to_push->bus, false);
+  }
+}
+
+// Send a complete frame straight from the host buffer. It's copied once, into the free
+// slot of its TX queue, and checked there. The slot is only committed if safety_tx_hook
+// allows the frame, the critical section covers it all since CAN forwarding pushes to
+// the same queues from the RX interrupts. Full queues and invalid buses take the
+// regular path, which handles the overflow and blocked counters.
+static void comms_can_send_in_place(const uint8_t *data, uint32_t pckt_len) {
+  uint8_t bus_number = (data[0] >> 1U) & 0x7U;
+  bool handled = false;
+  bool committed = false;
+
+  if (bus_number < PANDA_BUS_CNT) {
+    can_ring *q = can_queues[bus_number];
+    ENTER_CRITICAL();
+    CANPacket_t *slot = can_push_slot(q);
+    if (slot != NULL) {
+      // bytes past the DLC length are stale, nothing reads them
+      (void)memcpy((uint8_t*)slot, data, pckt_len);
+      if (can_periodic_update(slot)) {
+        // only the payload was updated, the slot stays free
+      } else if (safety_tx_hook(slot) != 0) {
+        can_push_commit(q);
+        committed = true;
+      } else {
+        can_send_rejected(slot);
+      }
+      handled = true;
+    }
+    EXIT_CRITICAL();
+
+    if (committed) {
+      process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
+    }
+  }
+
+  if (!handled) {
+    CANPacket_t to_push = {0};
+    (void)memcpy((uint8_t*)&to_push, data, pckt_len);
+    comms_can_send(&to_push);
+  }
+}
+
 void comms_can_write(const uint8_t *data, uint32_t len) {
   uint32_t pos = 0U;
 
@@ -63,14 +373,12 @@ void comms_can_write(const uint8_t *data, uint32_t len) {
   if (can_write_buffer.ptr != 0U) {
     if (can_write_buffer.tail_size <= (len - pos)) {
       // we have enough data to complete the buffer
-      CANPacket_t to_push = {0};
       (void)memcpy(&can_write_buffer.data[can_write_buffer.ptr], &data[pos], can_write_buffer.tail_size);
       can_write_buffer.ptr += can_write_buffer.tail_size;
       pos += can_write_buffer.tail_size;
 
       // send out
-      (void)memcpy((uint8_t*)&to_push, can_write_buffer.data, can_write_buffer.ptr);
-      can_send(&to_push, to_push.bus, false);
+      comms_can_send_in_place(can_write_buffer.data, can_write_buffer.ptr);
 
       // reset overflow buffer
       can_write_buffer.ptr = 0U;
@@ -85,13 +393,11 @@ void comms_can_write(const uint8_t *data, uint32_t len) {
     }
   }
 
-  // rest of the message
+  // rest of the message, complete frames are sent without staging
   while (pos < len) {
     uint32_t pckt_len = CANPACKET_HEAD_SIZE + dlc_to_len[(data[pos] >> 4U)];
     if ((pos + pckt_len) <= len) {
-      CANPacket_t to_push = {0};
-      (void)memcpy((uint8_t*)&to_push, &data[pos], pckt_len);
-      can_send(&to_push, to_push.bus, false);
+      comms_can_send_in_place(&data[pos], pckt_len);
       pos += pckt_len;
     } else {
       (void)memcpy(can_write_buffer.data, &data[pos], len - pos);
@@ -109,14 +415,24 @@ void comms_can_reset(void) {
   can_write_buffer.tail_size = 0U;
   can_read_buffer.ptr = 0U;
   can_read_buffer.tail_size = 0U;
+
+  // a new connection has to opt in to records, TX credits, compression and RX policies again
+  can_rx_filter_clear();
+  can_tx_credits_enabled = false;
+  can_compress_set(false);
+  can_records_period_us = 0U;
+  for (uint8_t i = 0U; i < CAN_RECORD_SLOTS; i++) {
+    can_record_slots[i].pending = false;
+  }
 }
 
 // TODO: make this more general!
 void refresh_can_tx_slots_available(void) {
-  if (can_tx_check_min_slots_free(MAX_CAN_MSGS_PER_USB_BULK_TRANSFER)) {
+  // with credits the host keeps within the free slots of each bus
+  if (can_tx_check_min_slots_free(can_tx_credits_enabled ? CAN_TX_CREDIT_FLOOR : MAX_CAN_MSGS_PER_USB_BULK_TRANSFER)) {
     can_tx_comms_resume_usb();
   }
-  if (can_tx_check_min_slots_free(MAX_CAN_MSGS_PER_SPI_BULK_TRANSFER)) {
+  if (can_tx_check_min_slots_free(can_tx_credits_enabled ? CAN_TX_CREDIT_FLOOR : MAX_CAN_MSGS_PER_SPI_BULK_TRANSFER)) {
     can_tx_comms_resume_spi();
   }
 }
@@ -1,9 +1,9 @@
 #pragma once
 
 // bump this when changing the CAN packet
-#define CAN_PACKET_VERSION 4
+#define CAN_PACKET_VERSION 5
 
-#define CANPACKET_HEAD_SIZE 6U
+#define CANPACKET_HEAD_SIZE 10U
 
 #if !defined(STM32F4)
   #define CANFD
@@ -21,9 +21,55 @@ typedef struct {
   unsigned char extended : 1;
   unsigned int addr : 29;
   unsigned char checksum;
+  uint32_t timestamp;  // microsecond timer value at RX or TX complete, ignored on TX
   unsigned char data[CANPACKET_DATA_SIZE_MAX];
 } __attribute__((packed, aligned(4))) CANPacket_t;
 
 #define GET_BUS(msg) ((msg)->bus)
 #define GET_LEN(msg) (dlc_to_len[(msg)->data_len_code])
 #define GET_ADDR(msg) ((msg)->addr)
+
+// Inline records, opt-in with control request 0xda. They share the host read
+// stream with CANPacket_t and are marked by the reserved bit, which is never set
+// on CAN packets. The header keeps the checksum and timestamp at the same offsets
+// as CANPacket_t, the payload length is given by len instead of the DLC.
+#define CAN_RECORD_FLAG 0x01U
+#define CAN_RECORD_HEAD_SIZE 10U
+#define CAN_RECORD_DATA_SIZE_MAX 0x50U
+
+#define CAN_RECORD_HEALTH 0U        // struct health_t
+#define CAN_RECORD_CAN_HEALTH 1U    // can_health_t, index is the bus
+
+typedef struct {
+  uint8_t flags;
+  uint8_t type;
+  uint8_t index;
+  uint16_t len;
+  uint8_t checksum;
+  uint32_t timestamp;  // microsecond timer value when the record was taken
+} __attribute__((packed)) can_record_header_t;
+
+// Compressed read stream, opt-in with control request 0xd7. Frames are encoded
+// against the last one with the same bus and address, from a two-way set associative
+// dictionary the host keeps in step. The set is the top bits of
+// (addr ^ bus << 29) * 2654435761, misses replace the least recently used way.
+// Entries only keep the first CAN_COMPRESS_HISTORY bytes of the payload, the rest
+// of a CAN-FD frame is XORed against zeros.
+//  * hit: {dlc << 4 | returned << 3 | rejected << 2 | slot >> 8, slot & 0xFF, checksum},
+//    the timestamp delta to the previous frame as a LEB128 varint and the payload XORed
+//    with the previous one, zero-run encoded: c < 0x80 is followed by c + 1 literal
+//    bytes, c >= 0x80 stands for c - 0x7F zeros. slot is set * 2 + way. checksum is
+//    the frame's CANPacket_t checksum, the host checks the frame it decoded against it.
+//  * CAN_COMPRESS_LITERAL: a CANPacket_t as is, installed in the dictionary
+//  * CAN_COMPRESS_RECORD: an inline record as is
+// Frames are never both returned and rejected, which leaves that for the escapes.
+#if !defined(STM32F4)
+  #define CAN_COMPRESS_SET_BITS 9U
+#else
+  #define CAN_COMPRESS_SET_BITS 6U
+#endif
+#define CAN_COMPRESS_HISTORY 8U
+#define CAN_COMPRESS_SETS (1UL << CAN_COMPRESS_SET_BITS)
+#define CAN_COMPRESS_LITERAL 0x0CU
+#define CAN_COMPRESS_RECORD 0x0DU
+#define CAN_COMPRESS_SIZE_MAX (1U + CAN_RECORD_HEAD_SIZE + CAN_RECORD_DATA_SIZE_MAX)
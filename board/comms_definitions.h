@@ -10,3 +10,9 @@ void comms_endpoint2_write(const uint8_t *data, uint32_t len);
 void comms_can_write(const uint8_t *data, uint32_t len);
 int comms_can_read(uint8_t *data, uint32_t max_len);
 void comms_can_reset(void);
+int comms_can_tx_credits(bool enabled, uint8_t *data);
+bool comms_can_tx_credits_enabled(void);
+void comms_can_set_records_period(uint16_t period_ms);
+bool comms_can_records_due(uint32_t now);
+bool comms_can_push_record(uint8_t type, uint8_t index, const uint8_t *payload, uint32_t len);
+int comms_can_set_compression(bool enabled, uint8_t *resp);
@@ -91,6 +91,7 @@ void process_can(uint8_t can_number) {
           CANPacket_t to_push;
           to_push.returned = 1U;
           to_push.rejected = 0U;
+          to_push.timestamp = microsecond_timer_get();
           to_push.extended = (CANx->sTxMailBox[0].TIR >> 2) & 0x1U;
           to_push.addr = (to_push.extended != 0U) ? (CANx->sTxMailBox[0].TIR >> 3) : (CANx->sTxMailBox[0].TIR >> 21);
           to_push.data_len_code = CANx->sTxMailBox[0].TDTR & 0xFU;
@@ -98,6 +99,7 @@ void process_can(uint8_t can_number) {
           WORD_TO_BYTE_ARRAY(&to_push.data[0], CANx->sTxMailBox[0].TDLR);
           WORD_TO_BYTE_ARRAY(&to_push.data[4], CANx->sTxMailBox[0].TDHR);
           can_set_checksum(&to_push);
+          can_bus_load_add(can_number, &to_push, false, false);
 
           rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
         }
@@ -136,6 +138,7 @@ void can_rx(uint8_t can_number) {
   uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
 
   while ((CANx->RF0R & CAN_RF0R_FMP0) != 0U) {
+    uint32_t rx_time = microsecond_timer_get();
     can_health[can_number].total_rx_cnt += 1U;
 
     // can is live
@@ -146,6 +149,7 @@ void can_rx(uint8_t can_number) {
 
     to_push.returned = 0U;
     to_push.rejected = 0U;
+    to_push.timestamp = rx_time;
     to_push.extended = (CANx->sFIFOMailBox[0].RIR >> 2) & 0x1U;
     to_push.addr = (to_push.extended != 0U) ? (CANx->sFIFOMailBox[0].RIR >> 3) : (CANx->sFIFOMailBox[0].RIR >> 21);
     to_push.data_len_code = CANx->sFIFOMailBox[0].RDTR & 0xFU;
@@ -153,6 +157,7 @@ void can_rx(uint8_t can_number) {
     WORD_TO_BYTE_ARRAY(&to_push.data[0], CANx->sFIFOMailBox[0].RDLR);
     WORD_TO_BYTE_ARRAY(&to_push.data[4], CANx->sFIFOMailBox[0].RDHR);
     can_set_checksum(&to_push);
+    can_bus_load_add(can_number, &to_push, false, false);
 
     // forwarding (panda only)
     int bus_fwd_num = safety_fwd_hook(bus_number, to_push.addr);
@@ -161,6 +166,7 @@ void can_rx(uint8_t can_number) {
 
       to_send.returned = 0U;
       to_send.rejected = 0U;
+      to_send.timestamp = to_push.timestamp;
       to_send.extended = to_push.extended; // TXRQ
       to_send.addr = to_push.addr;
       to_send.bus = to_push.bus;
@@ -176,7 +182,12 @@ void can_rx(uint8_t can_number) {
     ignition_can_hook(&to_push);
 
     current_board->set_led(LED_BLUE, true);
-    rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
+    // frames for an open ISO-TP channel are handled by the firmware
+    if (!isotp_rx_hook(&to_push)) {
+      if (can_rx_filter_check(&to_push)) {
+        rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
+      }
+    }
 
     // next
     CANx->RF0R |= CAN_RF0R_RFOM0;
@@ -16,33 +16,43 @@ int pending_can_live = 0;
 int can_silent = ALL_CAN_SILENT;
 bool can_loopback = false;
 
+can_bus_load_t can_bus_load[CAN_HEALTH_ARRAY_SIZE] = {{0}, {0}, {0}};
+
+can_rx_filter_t can_rx_filters[CAN_RX_FILTER_MAX];
+uint8_t can_rx_filters_cnt = 0U;
+uint32_t can_rx_filtered_cnt = 0U;
+
 // ********************* instantiate queues *********************
 #define can_buffer(x, size) \
   static CANPacket_t elems_##x[size]; \
   extern can_ring can_##x; \
   can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = (size), .elems = (CANPacket_t *)&(elems_##x) };
 
-#define CAN_RX_BUFFER_SIZE 4096U
 #define CAN_TX_BUFFER_SIZE 416U
 
 #ifdef STM32H7
-// ITCM RAM and DTCM RAM are the fastest for Cortex-M7 core access
+// the queues are only touched by the CPU. Most of ITCM RAM now holds the hot path code (ITCM_FUNC),
+// so only tx1_q is left there and the others share the D-cached AXI SRAM. CAN FD frames are
+// 76 bytes, 3072 of them leave room for the two TX queues.
+#define CAN_RX_BUFFER_SIZE 3072U
 __attribute__((section(".axisram"))) can_buffer(rx_q, CAN_RX_BUFFER_SIZE)
-__attribute__((section(".itcmram"))) can_buffer(tx1_q, CAN_TX_BUFFER_SIZE)
-__attribute__((section(".itcmram"))) can_buffer(tx2_q, CAN_TX_BUFFER_SIZE)
+ITCM_DATA can_buffer(tx1_q, CAN_TX_BUFFER_SIZE)
+__attribute__((section(".axisram"))) can_buffer(tx2_q, CAN_TX_BUFFER_SIZE)
+__attribute__((section(".axisram"))) can_buffer(tx3_q, CAN_TX_BUFFER_SIZE)
 #else
+#define CAN_RX_BUFFER_SIZE 4096U
 can_buffer(rx_q, CAN_RX_BUFFER_SIZE)
 can_buffer(tx1_q, CAN_TX_BUFFER_SIZE)
 can_buffer(tx2_q, CAN_TX_BUFFER_SIZE)
-#endif
 can_buffer(tx3_q, CAN_TX_BUFFER_SIZE)
+#endif
 
 // FIXME:
 // cppcheck-suppress misra-c2012-9.3
 can_ring *can_queues[CAN_QUEUES_ARRAY_SIZE] = {&can_tx1_q, &can_tx2_q, &can_tx3_q};
 
 // ********************* interrupt safe queue *********************
-bool can_pop(can_ring *q, CANPacket_t *elem) {
+ITCM_FUNC bool can_pop(can_ring *q, CANPacket_t *elem) {
   bool ret = 0;
 
   ENTER_CRITICAL();
@@ -60,7 +70,7 @@ bool can_pop(can_ring *q, CANPacket_t *elem) {
   return ret;
 }
 
-bool can_push(can_ring *q, const CANPacket_t *elem) {
+ITCM_FUNC bool can_push(can_ring *q, const CANPacket_t *elem) {
   bool ret = false;
   uint32_t next_w_ptr;
 
@@ -96,6 +106,22 @@ bool can_push(can_ring *q, const CANPacket_t *elem) {
   return ret;
 }
 
+// For producers that build the frame in the queue itself: returns the free slot, or NULL
+// if the queue is full. The slot becomes visible to the consumer with can_push_commit,
+// both have to be called in the same critical section.
+ITCM_FUNC CANPacket_t *can_push_slot(can_ring *q) {
+  CANPacket_t *ret = NULL;
+  uint32_t next_w_ptr = ((q->w_ptr + 1U) == q->fifo_size) ? 0U : (q->w_ptr + 1U);
+  if (next_w_ptr != q->r_ptr) {
+    ret = &q->elems[q->w_ptr];
+  }
+  return ret;
+}
+
+ITCM_FUNC void can_push_commit(can_ring *q) {
+  q->w_ptr = ((q->w_ptr + 1U) == q->fifo_size) ? 0U : (q->w_ptr + 1U);
+}
+
 uint32_t can_slots_empty(const can_ring *q) {
   uint32_t ret = 0;
 
@@ -160,7 +186,7 @@ void can_set_forwarding(uint8_t from, uint8_t to) {
 }
 #endif
 
-void ignition_can_hook(CANPacket_t *to_push) {
+ITCM_FUNC void ignition_can_hook(CANPacket_t *to_push) {
   int bus = GET_BUS(to_push);
   if (bus == 0) {
     int addr = GET_ADDR(to_push);
@@ -196,7 +222,7 @@ bool can_tx_check_min_slots_free(uint32_t min) {
     (can_slots_empty(&can_tx3_q) >= min);
 }
 
-uint8_t calculate_checksum(const uint8_t *dat, uint32_t len) {
+ITCM_FUNC uint8_t calculate_checksum(const uint8_t *dat, uint32_t len) {
   uint8_t checksum = 0U;
   for (uint32_t i = 0U; i < len; i++) {
     checksum ^= dat[i];
@@ -204,16 +230,28 @@ uint8_t calculate_checksum(const uint8_t *dat, uint32_t len) {
   return checksum;
 }
 
-void can_set_checksum(CANPacket_t *packet) {
+ITCM_FUNC void can_set_checksum(CANPacket_t *packet) {
   packet->checksum = 0U;
   packet->checksum = calculate_checksum((uint8_t *) packet, CANPACKET_HEAD_SIZE + GET_LEN(packet));
 }
 
-bool can_check_checksum(CANPacket_t *packet) {
-  return (calculate_checksum((uint8_t *) packet, CANPACKET_HEAD_SIZE + GET_LEN(packet)) == 0U);
+bool can_check_checksum(const CANPacket_t *packet) {
+  return (calculate_checksum((const uint8_t *) packet, CANPACKET_HEAD_SIZE + GET_LEN(packet)) == 0U);
 }
 
-void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook) {
+// frame blocked by safety_tx_hook, it goes back to the host
+ITCM_FUNC void can_send_rejected(CANPacket_t *to_push) {
+  safety_tx_blocked += 1U;
+  to_push->returned = 0U;
+  to_push->rejected = 1U;
+  to_push->timestamp = microsecond_timer_get();
+
+  // data changed
+  can_set_checksum(to_push);
+  rx_buffer_overflow += can_push(&can_rx_q, to_push) ? 0U : 1U;
+}
+
+ITCM_FUNC void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook) {
   if (skip_tx_hook || safety_tx_hook(to_push) != 0) {
     if (bus_number < PANDA_BUS_CNT) {
       // add CAN packet to send queue
@@ -221,13 +259,7 @@ void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook) {
       process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
     }
   } else {
-    safety_tx_blocked += 1U;
-    to_push->returned = 0U;
-    to_push->rejected = 1U;
-
-    // data changed
-    can_set_checksum(to_push);
-    rx_buffer_overflow += can_push(&can_rx_q, to_push) ? 0U : 1U;
+    can_send_rejected(to_push);
   }
 }
 
@@ -240,3 +272,162 @@ bool is_speed_valid(uint32_t speed, const uint32_t *all_speeds, uint8_t len) {
   }
   return ret;
 }
+
+// Dynamic stuff bits are estimated at 3/16 of the stuffed region,
+// between the best case (none) and the worst case (1 every 4 bits)
+#define CAN_STUFF_BITS_ESTIMATE(bits) (((bits) * 3U) >> 4)
+
+// Called for every frame received or transmitted, from the CAN interrupts.
+// Frame lengths follow ISO 11898-1 and include the interframe space.
+ITCM_FUNC void can_bus_load_add(uint8_t can_number, const CANPacket_t *pkt, bool canfd, bool brs) {
+  uint32_t payload_bits = (uint32_t)dlc_to_len[pkt->data_len_code] * 8U;
+  uint32_t nominal_bits;
+  uint32_t data_bits = 0U;
+
+  if (!canfd) {
+    // SOF through CRC is stuffed, then CRC delimiter, ACK, EOF and IFS
+    uint32_t stuffed_bits = ((pkt->extended != 0U) ? 54U : 34U) + payload_bits;
+    nominal_bits = stuffed_bits + CAN_STUFF_BITS_ESTIMATE(stuffed_bits) + 13U;
+  } else {
+    // arbitration phase: SOF through BRS, then ACK, EOF and IFS
+    uint32_t arbitration_bits = (pkt->extended != 0U) ? 36U : 17U;
+    nominal_bits = arbitration_bits + CAN_STUFF_BITS_ESTIMATE(arbitration_bits) + 12U;
+
+    // data phase: ESI, DLC and payload are stuffed, then stuff count
+    // and CRC with their fixed stuff bits, and the CRC delimiter
+    uint32_t stuffed_bits = 5U + payload_bits;
+    uint32_t crc_bits = (payload_bits > (16U * 8U)) ? 33U : 28U;
+    data_bits = stuffed_bits + CAN_STUFF_BITS_ESTIMATE(stuffed_bits) + crc_bits;
+
+    if (!brs) {
+      nominal_bits += data_bits;
+      data_bits = 0U;
+    }
+  }
+
+  can_bus_load[can_number].nominal_bits += nominal_bits;
+  can_bus_load[can_number].data_bits += data_bits;
+}
+
+// called at 1Hz
+void can_bus_load_tick(void) {
+  for (uint8_t can_number = 0U; can_number < PANDA_CAN_CNT; can_number++) {
+    can_bus_load_t *bl = &can_bus_load[can_number];
+    const bus_config_t *bc = &bus_config[BUS_NUM_FROM_CAN_NUM(can_number)];
+
+    ENTER_CRITICAL();
+    uint32_t nominal_bits = bl->nominal_bits;
+    uint32_t data_bits = bl->data_bits;
+    bl->nominal_bits = 0U;
+    bl->data_bits = 0U;
+    EXIT_CRITICAL();
+
+    // speeds are in kbps * 10, so bits * 100 / speed is the share of one second in 0.01%
+    uint32_t load = 0U;
+    if (bc->can_speed > 0U) {
+      load += (nominal_bits * 100U) / bc->can_speed;
+    }
+    if (bc->can_data_speed > 0U) {
+      load += (data_bits * 100U) / bc->can_data_speed;
+    }
+    load = MIN(load, 0xFFFFU);
+
+    bl->load_hist_sum -= bl->load_hist[bl->load_hist_idx];
+    bl->load_hist[bl->load_hist_idx] = load;
+    bl->load_hist_sum += load;
+    bl->load_hist_idx = (bl->load_hist_idx + 1U) % CAN_BUS_LOAD_HIST_SIZE;
+
+    can_health[can_number].bus_load_1s = load;
+    can_health[can_number].bus_load_10s = bl->load_hist_sum / CAN_BUS_LOAD_HIST_SIZE;
+  }
+}
+
+static uint32_t can_rx_filter_hash(const CANPacket_t *pkt) {
+  // FNV-1a over DLC and payload
+  uint32_t hash = 2166136261U;
+  hash = (hash ^ pkt->data_len_code) * 16777619U;
+  for (uint8_t i = 0U; i < dlc_to_len[pkt->data_len_code]; i++) {
+    hash = (hash ^ pkt->data[i]) * 16777619U;
+  }
+  return hash;
+}
+
+// Called for every received frame after the safety hooks, decides whether it goes into can_rx_q
+ITCM_FUNC bool can_rx_filter_check(const CANPacket_t *pkt) {
+  bool deliver = true;
+  for (uint8_t i = 0U; i < can_rx_filters_cnt; i++) {
+    can_rx_filter_t *f = &can_rx_filters[i];
+    if ((f->bus == pkt->bus) && (f->addr == pkt->addr)) {
+      uint32_t hash = 0U;
+      bool interval_elapsed = !f->delivered || (get_ts_elapsed(pkt->timestamp, f->last_delivered) >= ((uint32_t)f->interval * 1000U));
+
+      switch (f->mode) {
+        case CAN_RX_FILTER_DROP:
+          deliver = false;
+          break;
+        case CAN_RX_FILTER_ON_CHANGE:
+          // interval is the keyframe period, 0 means changes only
+          hash = can_rx_filter_hash(pkt);
+          deliver = !f->delivered || (hash != f->last_hash) || ((f->interval > 0U) && interval_elapsed);
+          break;
+        case CAN_RX_FILTER_RATE_LIMIT:
+          deliver = interval_elapsed;
+          break;
+        default:
+          break;
+      }
+
+      if (deliver) {
+        f->delivered = true;
+        f->last_delivered = pkt->timestamp;
+        f->last_hash = hash;
+      } else {
+        can_rx_filtered_cnt += 1U;
+      }
+      break;
+    }
+  }
+  return deliver;
+}
+
+// CAN_RX_FILTER_ALL removes the entry, returns false if the table is full or the mode is unknown
+bool can_rx_filter_set(uint8_t bus, uint32_t addr, uint8_t mode, uint16_t interval) {
+  bool ret = true;
+
+  ENTER_CRITICAL();
+  uint8_t idx = 0U;
+  while ((idx < can_rx_filters_cnt) && !((can_rx_filters[idx].bus == bus) && (can_rx_filters[idx].addr == addr))) {
+    idx++;
+  }
+
+  if (mode == CAN_RX_FILTER_ALL) {
+    if (idx < can_rx_filters_cnt) {
+      can_rx_filters_cnt -= 1U;
+      can_rx_filters[idx] = can_rx_filters[can_rx_filters_cnt];
+    }
+  } else if ((mode > CAN_RX_FILTER_RATE_LIMIT) || (idx >= CAN_RX_FILTER_MAX)) {
+    ret = false;
+  } else {
+    can_rx_filter_t *f = &can_rx_filters[idx];
+    f->bus = bus;
+    f->addr = addr;
+    f->mode = mode;
+    f->interval = interval;
+    f->delivered = false;
+    f->last_delivered = 0U;
+    f->last_hash = 0U;
+    if (idx == can_rx_filters_cnt) {
+      can_rx_filters_cnt += 1U;
+    }
+  }
+  EXIT_CRITICAL();
+
+  return ret;
+}
+
+void can_rx_filter_clear(void) {
+  ENTER_CRITICAL();
+  can_rx_filters_cnt = 0U;
+  can_rx_filtered_cnt = 0U;
+  EXIT_CRITICAL();
+}
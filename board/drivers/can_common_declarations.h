@@ -38,6 +38,37 @@ extern int pending_can_live;
 extern int can_silent;
 extern bool can_loopback;
 
+// bits seen on the wire, turned into a bus load percentage once per second
+#define CAN_BUS_LOAD_HIST_SIZE 10U
+typedef struct {
+  uint32_t nominal_bits;
+  uint32_t data_bits;
+  uint16_t load_hist[CAN_BUS_LOAD_HIST_SIZE];
+  uint32_t load_hist_sum;
+  uint8_t load_hist_idx;
+} can_bus_load_t;
+extern can_bus_load_t can_bus_load[CAN_HEALTH_ARRAY_SIZE];
+
+// host configured delivery policy for received frames, per (bus, addr).
+// Safety hooks and forwarding still see every frame, this only affects what reaches can_rx_q.
+#define CAN_RX_FILTER_MAX 64U
+#define CAN_RX_FILTER_ALL 0U         // deliver every frame (default, removes the entry)
+#define CAN_RX_FILTER_DROP 1U        // never deliver
+#define CAN_RX_FILTER_ON_CHANGE 2U   // deliver on payload change, plus a keyframe every interval ms (0 = never)
+#define CAN_RX_FILTER_RATE_LIMIT 3U  // deliver at most once every interval ms
+typedef struct {
+  uint32_t addr;
+  uint8_t bus;
+  uint8_t mode;
+  uint16_t interval;        // ms
+  bool delivered;           // a frame was delivered since the policy was set
+  uint32_t last_delivered;  // RX timestamp of the last delivered frame
+  uint32_t last_hash;       // payload hash of the last delivered frame
+} can_rx_filter_t;
+extern can_rx_filter_t can_rx_filters[CAN_RX_FILTER_MAX];
+extern uint8_t can_rx_filters_cnt;
+extern uint32_t can_rx_filtered_cnt;
+
 // ******************* functions prototypes *********************
 bool can_init(uint8_t can_number);
 void process_can(uint8_t can_number);
@@ -53,6 +84,8 @@ extern can_ring *can_queues[CAN_QUEUES_ARRAY_SIZE];
 // ********************* interrupt safe queue *********************
 bool can_pop(can_ring *q, CANPacket_t *elem);
 bool can_push(can_ring *q, const CANPacket_t *elem);
+CANPacket_t *can_push_slot(can_ring *q);
+void can_push_commit(can_ring *q);
 uint32_t can_slots_empty(const can_ring *q);
 
 // assign CAN numbering
@@ -82,6 +115,12 @@ void ignition_can_hook(CANPacket_t *to_push);
 bool can_tx_check_min_slots_free(uint32_t min);
 uint8_t calculate_checksum(const uint8_t *dat, uint32_t len);
 void can_set_checksum(CANPacket_t *packet);
-bool can_check_checksum(CANPacket_t *packet);
+bool can_check_checksum(const CANPacket_t *packet);
+void can_send_rejected(CANPacket_t *to_push);
 void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook);
 bool is_speed_valid(uint32_t speed, const uint32_t *all_speeds, uint8_t len);
+void can_bus_load_add(uint8_t can_number, const CANPacket_t *pkt, bool canfd, bool brs);
+void can_bus_load_tick(void);
+bool can_rx_filter_check(const CANPacket_t *pkt);
+bool can_rx_filter_set(uint8_t bus, uint32_t addr, uint8_t mode, uint16_t interval);
+void can_rx_filter_clear(void);
@@ -0,0 +1,150 @@
+#include "can_periodic_declarations.h"
+
+can_periodic_t can_periodic[CAN_PERIODIC_MAX];
+
+static can_periodic_t *can_periodic_find(uint8_t bus, uint32_t addr) {
+  can_periodic_t *ret = NULL;
+  for (uint8_t i = 0U; i < CAN_PERIODIC_MAX; i++) {
+    if (can_periodic[i].active && (can_periodic[i].bus == bus) && (can_periodic[i].addr == addr)) {
+      ret = &can_periodic[i];
+      break;
+    }
+  }
+  return ret;
+}
+
+// period 0 removes the frame, phase delays the first send
+bool can_periodic_set(uint8_t bus, uint32_t addr, uint16_t period, uint16_t phase) {
+  bool ret = true;
+
+  ENTER_CRITICAL();
+  can_periodic_t *p = can_periodic_find(bus, addr);
+  if (period == 0U) {
+    if (p != NULL) {
+      p->active = false;
+    }
+  } else {
+    if (p == NULL) {
+      for (uint8_t i = 0U; i < CAN_PERIODIC_MAX; i++) {
+        if (!can_periodic[i].active) {
+          p = &can_periodic[i];
+          (void)memset(p, 0, sizeof(can_periodic_t));
+          p->active = true;
+          p->bus = bus;
+          p->addr = addr;
+          break;
+        }
+      }
+    }
+
+    if (p != NULL) {
+      p->period = period;
+      p->next_due = microsecond_timer_get() + ((uint32_t)phase * 1000U);
+    } else {
+      ret = false;
+    }
+  }
+  EXIT_CRITICAL();
+
+  return ret;
+}
+
+bool can_periodic_set_fields(uint8_t bus, uint32_t addr, uint16_t counter_start, uint8_t counter_len, uint16_t checksum_start, uint8_t checksum_len) {
+  bool ret = (counter_len <= CAN_PERIODIC_COUNTER_LEN_MAX) && (checksum_len <= CAN_PERIODIC_CHECKSUM_LEN_MAX);
+
+  ENTER_CRITICAL();
+  can_periodic_t *p = can_periodic_find(bus, addr);
+  if (ret && (p != NULL)) {
+    p->counter_start = counter_start;
+    p->counter_len = counter_len;
+    p->counter = 0U;
+    p->checksum_start = checksum_start;
+    p->checksum_len = checksum_len;
+  } else {
+    ret = false;
+  }
+  EXIT_CRITICAL();
+
+  return ret;
+}
+
+// called for frames written by the host, returns true if the frame was taken as a payload update.
+// A corrupted frame is dropped and counted like on the TX path, the last good payload keeps going
+bool can_periodic_update(const CANPacket_t *to_push) {
+  ENTER_CRITICAL();
+  can_periodic_t *p = can_periodic_find(to_push->bus, to_push->addr);
+  if (p != NULL) {
+    if (can_check_checksum(to_push)) {
+      (void)memcpy(&p->pkt, to_push, CANPACKET_HEAD_SIZE + dlc_to_len[to_push->data_len_code]);
+      p->has_data = true;
+      p->stale = 0U;
+    } else {
+      uint8_t can_number = CAN_NUM_FROM_BUS_NUM(p->bus);
+      if (can_number != 0xFFU) {
+        can_health[can_number].total_tx_checksum_error_cnt += 1U;
+      }
+    }
+  }
+  EXIT_CRITICAL();
+
+  return (p != NULL);
+}
+
+static void can_periodic_set_field(CANPacket_t *pkt, uint16_t start, uint8_t len, uint32_t value) {
+  uint32_t data_bits = (uint32_t)dlc_to_len[pkt->data_len_code] * 8U;
+  for (uint8_t i = 0U; i < len; i++) {
+    uint32_t bit = (uint32_t)start + i;
+    if (bit < data_bits) {
+      uint8_t mask = (uint8_t)(1U << (bit % 8U));
+      if (((value >> i) & 1U) != 0U) {
+        pkt->data[bit / 8U] |= mask;
+      } else {
+        pkt->data[bit / 8U] &= (uint8_t)(~mask);
+      }
+    }
+  }
+}
+
+// called every CAN_PERIODIC_TICK_US
+void can_periodic_tick(uint32_t now) {
+  for (uint8_t i = 0U; i < CAN_PERIODIC_MAX; i++) {
+    can_periodic_t *p = &can_periodic[i];
+    // due when now is at or past next_due, allowing for timer wraparound
+    if (p->active && p->has_data && (p->stale < CAN_PERIODIC_STALE_MAX) && (get_ts_elapsed(now, p->next_due) < 0x80000000U)) {
+      CANPacket_t to_send;
+      (void)memcpy(&to_send, &p->pkt, sizeof(CANPacket_t));
+
+      if (p->counter_len > 0U) {
+        can_periodic_set_field(&to_send, p->counter_start, p->counter_len, p->counter);
+        p->counter = (uint8_t)((p->counter + 1U) & ((1U << p->counter_len) - 1U));
+      }
+
+      // the checksum field stays as written by the host if the safety mode has no checksum
+      uint32_t checksum;
+      if ((p->checksum_len > 0U) && safety_compute_checksum(&to_send, &checksum)) {
+        can_periodic_set_field(&to_send, p->checksum_start, p->checksum_len, checksum);
+      }
+
+      to_send.returned = 0U;
+      to_send.rejected = 0U;
+      can_set_checksum(&to_send);
+      can_send(&to_send, p->bus, false);
+      p->stale++;
+
+      // skip missed periods instead of sending a burst
+      uint32_t period_us = (uint32_t)p->period * 1000U;
+      p->next_due += period_us;
+      if (get_ts_elapsed(now, p->next_due) < 0x80000000U) {
+        p->next_due = now + period_us;
+      }
+    }
+  }
+}
+
+void can_periodic_clear(void) {
+  ENTER_CRITICAL();
+  for (uint8_t i = 0U; i < CAN_PERIODIC_MAX; i++) {
+    can_periodic[i].active = false;
+  }
+  EXIT_CRITICAL();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// Frames registered by the host and sent by the firmware at a fixed period.
+// Frames the host writes for a registered (bus, addr) update the payload
+// instead of being sent right away. Every send still goes through safety_tx_hook.
+// A frame stops after CAN_PERIODIC_STALE_MAX periods without a payload update, so
+// a host that died doesn't keep its alive counters going.
+#define CAN_PERIODIC_MAX 16U
+#define CAN_PERIODIC_STALE_MAX 10U
+#define CAN_PERIODIC_TICK_US 1000U
+#define CAN_PERIODIC_COUNTER_LEN_MAX 8U
+#define CAN_PERIODIC_CHECKSUM_LEN_MAX 16U
+
+// Counter and checksum fields are little endian bit ranges, bit 0 is the LSB of data[0]
+typedef struct {
+  bool active;
+  bool has_data;            // payload received from the host
+  uint8_t stale;            // sends since the last payload update
+  uint8_t bus;
+  uint32_t addr;
+  uint16_t period;          // ms
+  uint32_t next_due;        // microsecond timer
+  uint16_t counter_start;
+  uint8_t counter_len;      // 0 = no counter
+  uint8_t counter;
+  uint16_t checksum_start;
+  uint8_t checksum_len;     // 0 = no checksum
+  CANPacket_t pkt;
+} can_periodic_t;
+
+extern can_periodic_t can_periodic[CAN_PERIODIC_MAX];
+
+bool can_periodic_set(uint8_t bus, uint32_t addr, uint16_t period, uint16_t phase);
+bool can_periodic_set_fields(uint8_t bus, uint32_t addr, uint16_t counter_start, uint8_t counter_len, uint16_t checksum_start, uint8_t checksum_len);
+bool can_periodic_update(const CANPacket_t *to_push);
+void can_periodic_tick(uint32_t now);
+void can_periodic_clear(void);
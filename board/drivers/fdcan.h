@@ -2,6 +2,10 @@
 
 FDCAN_GlobalTypeDef *cans[CANS_ARRAY_SIZE] = {FDCAN1, FDCAN2, FDCAN3};
 
+#ifdef DEBUG_CAN_RX_CYCLES
+uint32_t can_rx_cycles_max = 0U;
+#endif
+
 static bool can_set_speed(uint8_t can_number) {
   bool ret = true;
   FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
@@ -77,7 +81,7 @@ void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg) {
 
 // ***************************** CAN *****************************
 // FDFDCANx_IT1 IRQ Handler (TX)
-void process_can(uint8_t can_number) {
+ITCM_FUNC void process_can(uint8_t can_number) {
   if (can_number != 0xffU) {
     ENTER_CRITICAL();
 
@@ -111,12 +115,14 @@ void process_can(uint8_t can_number) {
           }
 
           FDCANx->TXBAR = (1UL << tx_index);
+          can_bus_load_add(can_number, &to_send, bus_config[can_number].canfd_enabled, bus_config[can_number].brs_enabled);
 
           // Send back to USB
           CANPacket_t to_push;
 
           to_push.returned = 1U;
           to_push.rejected = 0U;
+          to_push.timestamp = microsecond_timer_get();
           to_push.extended = to_send.extended;
           to_push.addr = to_send.addr;
           to_push.bus = bus_number;
@@ -138,7 +144,10 @@ void process_can(uint8_t can_number) {
 
 // FDFDCANx_IT0 IRQ Handler (RX and errors)
 // blink blue when we are receiving CAN messages
-void can_rx(uint8_t can_number) {
+ITCM_FUNC void can_rx(uint8_t can_number) {
+  #ifdef DEBUG_CAN_RX_CYCLES
+    uint32_t start_cycles = DWT->CYCCNT;
+  #endif
   FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
   uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
 
@@ -147,6 +156,7 @@ void can_rx(uint8_t can_number) {
   // Clear all new messages from Rx FIFO 0
   FDCANx->IR |= FDCAN_IR_RF0N;
   while((FDCANx->RXF0S & FDCAN_RXF0S_F0FL) != 0U) {
+    uint32_t rx_time = microsecond_timer_get();
     can_health[can_number].total_rx_cnt += 1U;
 
     // can is live
@@ -170,6 +180,7 @@ void can_rx(uint8_t can_number) {
 
     to_push.returned = 0U;
     to_push.rejected = 0U;
+    to_push.timestamp = rx_time;
     to_push.extended = (fifo->header[0] >> 30) & 0x1U;
     to_push.addr = ((to_push.extended != 0U) ? (fifo->header[0] & 0x1FFFFFFFU) : ((fifo->header[0] >> 18) & 0x7FFU));
     to_push.bus = bus_number;
@@ -177,6 +188,7 @@ void can_rx(uint8_t can_number) {
 
     bool canfd_frame = ((fifo->header[1] >> 21) & 0x1U);
     bool brs_frame = ((fifo->header[1] >> 20) & 0x1U);
+    can_bus_load_add(can_number, &to_push, canfd_frame, brs_frame);
 
     uint8_t data_len_w = (dlc_to_len[to_push.data_len_code] / 4U);
     data_len_w += ((dlc_to_len[to_push.data_len_code] % 4U) > 0U) ? 1U : 0U;
@@ -195,6 +207,7 @@ void can_rx(uint8_t can_number) {
 
       to_send.returned = 0U;
       to_send.rejected = 0U;
+      to_send.timestamp = to_push.timestamp;
       to_send.extended = to_push.extended;
       to_send.addr = to_push.addr;
       to_send.bus = to_push.bus;
@@ -210,7 +223,12 @@ void can_rx(uint8_t can_number) {
     ignition_can_hook(&to_push);
 
     current_board->set_led(LED_BLUE, true);
-    rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
+    // frames for an open ISO-TP channel are handled by the firmware
+    if (!isotp_rx_hook(&to_push)) {
+      if (can_rx_filter_check(&to_push)) {
+        rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
+      }
+    }
 
     // Enable CAN FD and BRS if CAN FD message was received
     if (!(bus_config[can_number].canfd_enabled) && (canfd_frame)) {
@@ -228,6 +246,10 @@ void can_rx(uint8_t can_number) {
   if ((ir_reg & (FDCAN_IR_PED | FDCAN_IR_PEA | FDCAN_IR_EP | FDCAN_IR_BO | FDCAN_IR_RF0L)) != 0U) {
     update_can_health_pkt(can_number, ir_reg);
   }
+
+  #ifdef DEBUG_CAN_RX_CYCLES
+    can_rx_cycles_max = MAX(can_rx_cycles_max, DWT->CYCCNT - start_cycles);
+  #endif
 }
 
 static void FDCAN1_IT0_IRQ_Handler(void) { can_rx(0); }
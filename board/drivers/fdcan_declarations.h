@@ -16,6 +16,11 @@ extern FDCAN_GlobalTypeDef *cans[CANS_ARRAY_SIZE];
 
 #define CAN_ACK_ERROR 3U
 
+#ifdef DEBUG_CAN_RX_CYCLES
+// worst case can_rx() duration in CPU cycles, measured with the DWT cycle counter
+extern uint32_t can_rx_cycles_max;
+#endif
+
 void can_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number);
 void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg);
 
@@ -0,0 +1,72 @@
+#include "flash_stream_declarations.h"
+
+static uint32_t flash_stream_buf[FLASH_STREAM_SIZE / 4U];
+static uint32_t flash_stream_head = 0U;  // app offset of the next byte from the host
+static uint32_t flash_stream_tail = 0U;  // app offset of the next flash word to program
+
+void flash_stream_reset(void) {
+  ENTER_CRITICAL();
+  flash_stream_head = 0U;
+  flash_stream_tail = 0U;
+  EXIT_CRITICAL();
+}
+
+// programs the next flash word. with flush, a partial last word is padded with erased flash.
+// returns false if there was nothing to program
+static bool flash_stream_program_word(bool flush) {
+  bool ret = false;
+  uint32_t pending = flash_stream_head - flash_stream_tail;
+  if ((pending >= FLASH_PROG_SIZE) || (flush && (pending > 0U))) {
+    uint32_t pos = flash_stream_tail % FLASH_STREAM_SIZE;
+    if (pending < FLASH_PROG_SIZE) {
+      (void)memset(&((uint8_t *)flash_stream_buf)[pos + pending], 0xFF, FLASH_PROG_SIZE - pending);
+      flash_stream_head += FLASH_PROG_SIZE - pending;
+    }
+    flash_write_block((uint32_t *)(APP_START_ADDRESS + flash_stream_tail), &flash_stream_buf[pos / 4U]);
+    flash_stream_tail += FLASH_PROG_SIZE;
+    ret = true;
+  }
+  return ret;
+}
+
+// from the main loop, a flash word per critical section so the interrupts can program inline
+bool flash_stream_program(bool flush) {
+  ENTER_CRITICAL();
+  bool ret = flash_stream_program_word(flush);
+  EXIT_CRITICAL();
+  return ret;
+}
+
+void flash_stream_flush(void) {
+  while (flash_stream_program(true)) {}
+  flush_write_buffer();
+}
+
+// programs what's staged, the next data goes offset bytes into the app. offset has to be flash word aligned
+void flash_stream_seek(uint32_t offset) {
+  flash_stream_flush();
+  ENTER_CRITICAL();
+  flash_stream_head = offset;
+  flash_stream_tail = offset;
+  EXIT_CRITICAL();
+}
+
+// called from the USB and SPI interrupts
+void flash_stream_write(const uint8_t *data, uint32_t len) {
+  uint32_t i = 0U;
+  while (i < len) {
+    if ((flash_stream_head - flash_stream_tail) == FLASH_STREAM_SIZE) {
+      (void)flash_stream_program_word(false);
+    }
+    uint32_t pos = flash_stream_head % FLASH_STREAM_SIZE;
+    uint32_t free = FLASH_STREAM_SIZE - (flash_stream_head - flash_stream_tail);
+    uint32_t n = MIN(MIN(len - i, free), FLASH_STREAM_SIZE - pos);
+    (void)memcpy(&((uint8_t *)flash_stream_buf)[pos], &data[i], n);
+    flash_stream_head += n;
+    i += n;
+  }
+}
+
+uint32_t flash_stream_offset(void) {
+  return flash_stream_head;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// Bootstub firmware writes. Host data from endpoint 2 is staged in a ring buffer,
+// the main loop programs it while the next data comes in over USB/SPI. Programming
+// goes a whole flash word (FLASH_PROG_SIZE) at a time. When the ring is full, the
+// interrupt programs inline, which holds the host off like the old word at a time writes.
+#define FLASH_STREAM_SIZE 0x2000U
+
+void flash_stream_reset(void);
+void flash_stream_seek(uint32_t offset);
+void flash_stream_write(const uint8_t *data, uint32_t len);
+bool flash_stream_program(bool flush);
+void flash_stream_flush(void);
+uint32_t flash_stream_offset(void);
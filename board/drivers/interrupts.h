@@ -14,14 +14,25 @@ static uint32_t idle_time = 0U;
 static uint32_t busy_time = 0U;
 float interrupt_load = 0.0f;
 
-void handle_interrupt(IRQn_Type irq_type){
+ITCM_FUNC static void update_interrupt_duration(interrupt *irq, uint32_t duration) {
+  irq->busy_time_counter += duration;
+  irq->max_duration_counter = MAX(irq->max_duration_counter, duration);
+
+  uint8_t bucket = 0U;
+  while ((bucket < (INTERRUPT_DURATION_HIST_SIZE - 1U)) && (duration >= (1UL << (bucket * INTERRUPT_DURATION_HIST_SHIFT)))) {
+    bucket++;
+  }
+  irq->duration_hist[bucket] += 1U;
+}
+
+ITCM_FUNC void handle_interrupt(IRQn_Type irq_type){
   static uint8_t interrupt_depth = 0U;
   static uint32_t last_time = 0U;
   ENTER_CRITICAL();
+  uint32_t start_time = microsecond_timer_get();
   if (interrupt_depth == 0U) {
-    uint32_t time = microsecond_timer_get();
-    idle_time += get_ts_elapsed(time, last_time);
-    last_time = time;
+    idle_time += get_ts_elapsed(start_time, last_time);
+    last_time = start_time;
   }
   interrupt_depth += 1U;
   EXIT_CRITICAL();
@@ -35,12 +46,22 @@ void handle_interrupt(IRQn_Type irq_type){
   }
 
   ENTER_CRITICAL();
+  uint32_t end_time = microsecond_timer_get();
   interrupt_depth -= 1U;
   if (interrupt_depth == 0U) {
-    uint32_t time = microsecond_timer_get();
-    busy_time += get_ts_elapsed(time, last_time);
-    last_time = time;
+    busy_time += get_ts_elapsed(end_time, last_time);
+    last_time = end_time;
   }
+  update_interrupt_duration(&interrupts[irq_type], get_ts_elapsed(end_time, start_time));
+  EXIT_CRITICAL();
+}
+
+void get_interrupt_stats(uint16_t irq_num, interrupt_stats_t *stats) {
+  ENTER_CRITICAL();
+  stats->call_rate = interrupts[irq_num].call_rate;
+  stats->busy_time = interrupts[irq_num].busy_time;
+  stats->max_duration = interrupts[irq_num].max_duration;
+  (void)memcpy(stats->duration_hist, interrupts[irq_num].duration_hist, sizeof(stats->duration_hist));
   EXIT_CRITICAL();
 }
 
@@ -56,6 +77,10 @@ void interrupt_timer_handler(void) {
       // Reset interrupt counters
       interrupts[i].call_rate = interrupts[i].call_counter;
       interrupts[i].call_counter = 0U;
+      interrupts[i].busy_time = interrupts[i].busy_time_counter;
+      interrupts[i].busy_time_counter = 0U;
+      interrupts[i].max_duration = interrupts[i].max_duration_counter;
+      interrupts[i].max_duration_counter = 0U;
     }
 
     // Calculate interrupt load
@@ -72,6 +97,7 @@ void interrupt_timer_handler(void) {
 void init_interrupts(bool check_rate_limit){
   check_interrupt_rate = check_rate_limit;
 
+  (void)memset(interrupts, 0, sizeof(interrupts));
   for(uint16_t i=0U; i<NUM_INTERRUPTS; i++){
     interrupts[i].handler = unused_interrupt_handler;
   }
@@ -1,5 +1,11 @@
 #pragma once
 
+// bucket i counts handler runs shorter than 4^i us: <1, <4, <16, <64, <256, <1024, <4096us,
+// and the last bucket everything from 4.096ms up. Log4 keeps the table small and still
+// separates a slow handler (100s of us) from one that blocks for milliseconds
+#define INTERRUPT_DURATION_HIST_SIZE 8U
+#define INTERRUPT_DURATION_HIST_SHIFT 2U
+
 typedef struct interrupt {
   IRQn_Type irq_type;
   void (*handler)(void);
@@ -7,8 +13,21 @@ typedef struct interrupt {
   uint32_t call_rate;
   uint32_t max_call_rate;   // Call rate is defined as the amount of calls each second
   uint32_t call_rate_fault;
+  // Handler durations are in us and include time spent in nested higher priority handlers
+  uint32_t busy_time_counter;
+  uint32_t busy_time;       // total handler time during the last second
+  uint32_t max_duration_counter;
+  uint32_t max_duration;    // longest handler run during the last second
+  uint32_t duration_hist[INTERRUPT_DURATION_HIST_SIZE]; // since boot
 } interrupt;
 
+typedef struct __attribute__((packed)) {
+  uint32_t call_rate;
+  uint32_t busy_time;
+  uint32_t max_duration;
+  uint32_t duration_hist[INTERRUPT_DURATION_HIST_SIZE];
+} interrupt_stats_t;
+
 void interrupt_timer_init(void);
 uint32_t microsecond_timer_get(void);
 void unused_interrupt_handler(void);
@@ -26,6 +45,7 @@ extern interrupt interrupts[NUM_INTERRUPTS];
 extern float interrupt_load;
 
 void handle_interrupt(IRQn_Type irq_type);
+void get_interrupt_stats(uint16_t irq_num, interrupt_stats_t *stats);
 // Every second
 void interrupt_timer_handler(void);
 void init_interrupts(bool check_rate_limit);
@@ -0,0 +1,391 @@
+#include "isotp_declarations.h"
+
+isotp_channel_t isotp_channels[ISOTP_CHANNEL_CNT];
+
+static uint32_t isotp_read_u32(const uint8_t *data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint32_t isotp_st_min_us(uint8_t st_min) {
+  uint32_t ret;
+  if (st_min <= 0x7FU) {
+    ret = (uint32_t)st_min * 1000U;
+  } else if ((st_min >= 0xF1U) && (st_min <= 0xF9U)) {
+    ret = ((uint32_t)st_min - 0xF0U) * 100U;
+  } else {
+    // reserved values are treated as the max
+    ret = 127000U;
+  }
+  return ret;
+}
+
+// returns false if the frame was blocked by the safety mode
+static bool isotp_send_frame(const isotp_channel_t *ch, const uint8_t *dat, uint8_t len) {
+  CANPacket_t to_send = {0};
+  uint8_t off = ch->ext_addr_en ? 1U : 0U;
+
+  to_send.extended = (ch->tx_addr >= 0x800U) ? 1U : 0U;
+  to_send.addr = ch->tx_addr;
+  to_send.bus = ch->bus;
+  to_send.data_len_code = 8U;
+  (void)memset(to_send.data, ISOTP_PADDING, 8U);
+  if (ch->ext_addr_en) {
+    to_send.data[0] = ch->ext_addr;
+  }
+  (void)memcpy(&to_send.data[off], dat, len);
+  can_set_checksum(&to_send);
+
+  uint32_t blocked = safety_tx_blocked;
+  can_send(&to_send, ch->bus, false);
+  return (safety_tx_blocked == blocked);
+}
+
+static void isotp_tx_error(isotp_channel_t *ch, uint8_t error) {
+  ch->tx_state = ISOTP_TX_ERROR;
+  ch->error = error;
+}
+
+static void isotp_send_flow_control(isotp_channel_t *ch, uint8_t flow_status) {
+  uint8_t dat[3] = {0x30U | flow_status, ch->block_size, ch->st_min};
+  if (!isotp_send_frame(ch, dat, 3U)) {
+    ch->rx_state = ISOTP_RX_IDLE;
+    ch->error = ISOTP_ERR_BLOCKED;
+  }
+}
+
+static void isotp_tx_service(isotp_channel_t *ch, uint32_t now) {
+  uint8_t frame_len = ch->ext_addr_en ? 7U : 8U;
+  uint8_t sent = 0U;
+
+  // due when now is at or past tx_next, allowing for timer wraparound
+  while ((ch->tx_state == ISOTP_TX_SENDING) && (sent < ISOTP_FRAMES_PER_TICK) &&
+         (get_ts_elapsed(now, ch->tx_next) < 0x80000000U)) {
+    // leave the frame for the next tick instead of overflowing the TX queue
+    if (can_slots_empty(can_queues[ch->bus]) == 0U) {
+      break;
+    }
+
+    uint8_t dat[8];
+    uint8_t n = (uint8_t)MIN((uint32_t)frame_len - 1U, (uint32_t)ch->tx_len - ch->tx_idx);
+    dat[0] = 0x20U | ch->tx_seq;
+    (void)memcpy(&dat[1], &ch->tx_buf[ch->tx_idx], n);
+    if (!isotp_send_frame(ch, dat, n + 1U)) {
+      isotp_tx_error(ch, ISOTP_ERR_BLOCKED);
+      break;
+    }
+    sent++;
+
+    ch->tx_idx += n;
+    ch->tx_seq = (ch->tx_seq + 1U) & 0xFU;
+    ch->tx_last = now;
+    ch->tx_next = now + ch->tx_st_min_us;
+    if (ch->tx_idx >= ch->tx_len) {
+      ch->tx_state = ISOTP_TX_DONE;
+    } else if (ch->tx_block_size != 0U) {
+      ch->tx_block_cnt++;
+      if (ch->tx_block_cnt >= ch->tx_block_size) {
+        ch->tx_state = ISOTP_TX_WAIT_FC;
+        ch->tx_deadline = now + ISOTP_TIMEOUT_US;
+      }
+    } else {
+      // keep sending
+    }
+  }
+}
+
+// dat and len start at the PCI byte, after the extended address
+static void isotp_rx_frame(isotp_channel_t *ch, const uint8_t *dat, uint8_t len, uint32_t now) {
+  uint8_t frame_len = ch->ext_addr_en ? 7U : 8U;
+
+  switch (dat[0] >> 4) {
+    // single frame
+    case 0U: {
+      uint8_t sf_len = dat[0] & 0xFU;
+      if ((sf_len > 0U) && (sf_len < frame_len) && (sf_len < len)) {
+        if (ch->rx_state == ISOTP_RX_DONE) {
+          ch->error = ISOTP_ERR_RX_BUSY;
+        } else {
+          (void)memcpy(ch->rx_buf, &dat[1], sf_len);
+          ch->rx_len = sf_len;
+          ch->rx_state = ISOTP_RX_DONE;
+        }
+      }
+      break;
+    }
+    // first frame
+    case 1U: {
+      uint16_t ff_len = (uint16_t)(((uint16_t)dat[0] & 0xFU) << 8) | dat[1];
+      if ((len == frame_len) && (ff_len >= frame_len)) {
+        if (ch->rx_state == ISOTP_RX_DONE) {
+          ch->error = ISOTP_ERR_RX_BUSY;
+          isotp_send_flow_control(ch, 2U);
+        } else {
+          (void)memcpy(ch->rx_buf, &dat[2], frame_len - 2U);
+          ch->rx_len = ff_len;
+          ch->rx_idx = frame_len - 2U;
+          ch->rx_seq = 1U;
+          ch->rx_block_cnt = 0U;
+          ch->rx_deadline = now + ISOTP_TIMEOUT_US;
+          ch->rx_state = ISOTP_RX_RECEIVING;
+          isotp_send_flow_control(ch, 0U);
+        }
+      }
+      break;
+    }
+    // consecutive frame
+    case 2U:
+      if (ch->rx_state == ISOTP_RX_RECEIVING) {
+        if ((dat[0] & 0xFU) != ch->rx_seq) {
+          ch->rx_state = ISOTP_RX_IDLE;
+          ch->error = ISOTP_ERR_SEQUENCE;
+        } else {
+          uint8_t n = (uint8_t)MIN((uint32_t)len - 1U, (uint32_t)ch->rx_len - ch->rx_idx);
+          (void)memcpy(&ch->rx_buf[ch->rx_idx], &dat[1], n);
+          ch->rx_idx += n;
+          ch->rx_seq = (ch->rx_seq + 1U) & 0xFU;
+          ch->rx_deadline = now + ISOTP_TIMEOUT_US;
+          if (ch->rx_idx >= ch->rx_len) {
+            ch->rx_state = ISOTP_RX_DONE;
+          } else if (ch->block_size != 0U) {
+            ch->rx_block_cnt++;
+            if (ch->rx_block_cnt >= ch->block_size) {
+              ch->rx_block_cnt = 0U;
+              isotp_send_flow_control(ch, 0U);
+            }
+          } else {
+            // wait for the next frame
+          }
+        }
+      }
+      break;
+    // flow control
+    case 3U:
+      if ((ch->tx_state == ISOTP_TX_WAIT_FC) && (len >= 3U)) {
+        switch (dat[0] & 0xFU) {
+          case 0U:
+            ch->tx_block_size = dat[1];
+            ch->tx_block_cnt = 0U;
+            ch->tx_st_min_us = isotp_st_min_us(dat[2]);
+            // STmin also holds across blocks
+            ch->tx_next = ch->tx_last + ch->tx_st_min_us;
+            ch->tx_state = ISOTP_TX_SENDING;
+            isotp_tx_service(ch, now);
+            break;
+          case 1U:
+            ch->tx_deadline = now + ISOTP_TIMEOUT_US;
+            break;
+          default:
+            isotp_tx_error(ch, ISOTP_ERR_OVERFLOW);
+            break;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+bool isotp_open(uint8_t channel, uint8_t bus, uint32_t tx_addr, uint32_t rx_addr, bool ext_addr_en, uint8_t ext_addr, uint8_t block_size, uint8_t st_min) {
+  bool ret = (channel < ISOTP_CHANNEL_CNT) && (bus < PANDA_BUS_CNT) && (tx_addr <= 0x1FFFFFFFU) && (rx_addr <= 0x1FFFFFFFU);
+  if (ret) {
+    ENTER_CRITICAL();
+    isotp_channel_t *ch = &isotp_channels[channel];
+    ch->active = true;
+    ch->bus = bus;
+    ch->tx_addr = tx_addr;
+    ch->rx_addr = rx_addr;
+    ch->ext_addr_en = ext_addr_en;
+    ch->ext_addr = ext_addr;
+    ch->block_size = block_size;
+    ch->st_min = st_min;
+    ch->tx_state = ISOTP_TX_IDLE;
+    ch->rx_state = ISOTP_RX_IDLE;
+    ch->error = ISOTP_ERR_NONE;
+    EXIT_CRITICAL();
+  }
+  return ret;
+}
+
+void isotp_close(uint8_t channel) {
+  if (channel < ISOTP_CHANNEL_CNT) {
+    isotp_channels[channel].active = false;
+  }
+}
+
+bool isotp_load(uint8_t channel, uint16_t offset, const uint8_t *data, uint16_t len) {
+  bool ret = (channel < ISOTP_CHANNEL_CNT) && (((uint32_t)offset + len) <= ISOTP_MAX_LEN);
+  if (ret) {
+    ENTER_CRITICAL();
+    isotp_channel_t *ch = &isotp_channels[channel];
+    // the buffer can't change under a transfer in progress
+    ret = (ch->tx_state != ISOTP_TX_WAIT_FC) && (ch->tx_state != ISOTP_TX_SENDING);
+    if (ret) {
+      (void)memcpy(&ch->tx_buf[offset], data, len);
+    }
+    EXIT_CRITICAL();
+  }
+  return ret;
+}
+
+// starts sending the first len bytes loaded into the channel
+bool isotp_send(uint8_t channel, uint16_t len) {
+  bool ret = (channel < ISOTP_CHANNEL_CNT) && (len > 0U) && (len <= ISOTP_MAX_LEN);
+  if (ret) {
+    ENTER_CRITICAL();
+    isotp_channel_t *ch = &isotp_channels[channel];
+    ret = ch->active && (ch->tx_state != ISOTP_TX_WAIT_FC) && (ch->tx_state != ISOTP_TX_SENDING);
+    if (ret) {
+      uint8_t frame_len = ch->ext_addr_en ? 7U : 8U;
+      uint8_t dat[8];
+      uint32_t now = microsecond_timer_get();
+
+      ch->error = ISOTP_ERR_NONE;
+      ch->tx_len = len;
+      if (len < frame_len) {
+        dat[0] = (uint8_t)len;
+        (void)memcpy(&dat[1], ch->tx_buf, len);
+        ch->tx_state = isotp_send_frame(ch, dat, (uint8_t)len + 1U) ? ISOTP_TX_DONE : ISOTP_TX_ERROR;
+      } else {
+        dat[0] = 0x10U | (uint8_t)(len >> 8);
+        dat[1] = (uint8_t)(len & 0xFFU);
+        (void)memcpy(&dat[2], ch->tx_buf, frame_len - 2U);
+        ch->tx_idx = frame_len - 2U;
+        ch->tx_seq = 1U;
+        ch->tx_last = now;
+        ch->tx_deadline = now + ISOTP_TIMEOUT_US;
+        ch->tx_state = isotp_send_frame(ch, dat, frame_len) ? ISOTP_TX_WAIT_FC : ISOTP_TX_ERROR;
+      }
+      if (ch->tx_state == ISOTP_TX_ERROR) {
+        ch->error = ISOTP_ERR_BLOCKED;
+      }
+    }
+    EXIT_CRITICAL();
+  }
+  return ret;
+}
+
+// called for every received frame, returns true if the frame belongs to a channel
+ITCM_FUNC bool isotp_rx_hook(const CANPacket_t *msg) {
+  bool ret = false;
+  for (uint8_t i = 0U; i < ISOTP_CHANNEL_CNT; i++) {
+    isotp_channel_t *ch = &isotp_channels[i];
+    if (ch->active && (msg->bus == ch->bus) && (msg->addr == ch->rx_addr)) {
+      uint8_t len = dlc_to_len[msg->data_len_code];
+      uint8_t off = ch->ext_addr_en ? 1U : 0U;
+      if ((len > (off + 1U)) && (len <= 8U) && (!ch->ext_addr_en || (msg->data[0] == ch->ext_addr))) {
+        isotp_rx_frame(ch, &msg->data[off], len - off, microsecond_timer_get());
+        ret = true;
+        break;
+      }
+    }
+  }
+  return ret;
+}
+
+// called every CAN_PERIODIC_TICK_US, paces consecutive frames and handles timeouts
+void isotp_tick(uint32_t now) {
+  for (uint8_t i = 0U; i < ISOTP_CHANNEL_CNT; i++) {
+    isotp_channel_t *ch = &isotp_channels[i];
+    if (ch->active) {
+      if ((ch->tx_state == ISOTP_TX_WAIT_FC) && (get_ts_elapsed(now, ch->tx_deadline) < 0x80000000U)) {
+        isotp_tx_error(ch, ISOTP_ERR_TIMEOUT_FC);
+      }
+      isotp_tx_service(ch, now);
+
+      if ((ch->rx_state == ISOTP_RX_RECEIVING) && (get_ts_elapsed(now, ch->rx_deadline) < 0x80000000U)) {
+        ch->rx_state = ISOTP_RX_IDLE;
+        ch->error = ISOTP_ERR_TIMEOUT_CF;
+      }
+    }
+  }
+}
+
+bool isotp_get_status(uint8_t channel, isotp_status_t *status) {
+  bool ret = (channel < ISOTP_CHANNEL_CNT);
+  if (ret) {
+    ENTER_CRITICAL();
+    const isotp_channel_t *ch = &isotp_channels[channel];
+    status->tx_state = ch->tx_state;
+    status->rx_state = ch->rx_state;
+    status->error = ch->error;
+    status->rx_len = (ch->rx_state == ISOTP_RX_DONE) ? ch->rx_len : 0U;
+    // errors are reported once
+    isotp_channels[channel].error = ISOTP_ERR_NONE;
+    EXIT_CRITICAL();
+  }
+  return ret;
+}
+
+// reads part of a received PDU, reading up to the end frees the buffer for the next one
+uint16_t isotp_read(uint8_t channel, uint16_t offset, uint8_t *data, uint16_t len) {
+  uint16_t ret = 0U;
+  if (channel < ISOTP_CHANNEL_CNT) {
+    ENTER_CRITICAL();
+    isotp_channel_t *ch = &isotp_channels[channel];
+    if ((ch->rx_state == ISOTP_RX_DONE) && (offset <= ch->rx_len)) {
+      ret = MIN(len, ch->rx_len - offset);
+      (void)memcpy(data, &ch->rx_buf[offset], ret);
+      if (((uint32_t)offset + ret) >= ch->rx_len) {
+        ch->rx_state = ISOTP_RX_IDLE;
+      }
+    }
+    EXIT_CRITICAL();
+  }
+  return ret;
+}
+
+// host commands have no response, a rejected one is reported in the channel status
+static void isotp_comms_reject(uint8_t channel) {
+  if (channel < ISOTP_CHANNEL_CNT) {
+    ENTER_CRITICAL();
+    isotp_channel_t *ch = &isotp_channels[channel];
+    bool busy = (ch->tx_state == ISOTP_TX_WAIT_FC) || (ch->tx_state == ISOTP_TX_SENDING);
+    ch->error = busy ? ISOTP_ERR_TX_BUSY : ISOTP_ERR_INVALID;
+    EXIT_CRITICAL();
+  }
+}
+
+void isotp_comms_write(const uint8_t *data, uint32_t len) {
+  for (uint32_t pos = 0U; (pos + 3U) <= len; pos += ISOTP_RECORD_SIZE) {
+    const uint8_t *rec = &data[pos];
+    uint32_t rec_len = MIN(len - pos, ISOTP_RECORD_SIZE);
+    if (rec[0] != ISOTP_COMMS_ID) {
+      break;
+    }
+
+    switch (rec[1]) {
+      case ISOTP_CMD_OPEN:
+        if (rec_len >= 16U) {
+          if (!isotp_open(rec[2], rec[3], isotp_read_u32(&rec[4]), isotp_read_u32(&rec[8]), rec[12] != 0U, rec[13], rec[14], rec[15])) {
+            isotp_comms_reject(rec[2]);
+          }
+        }
+        break;
+      case ISOTP_CMD_DATA:
+        if ((rec_len >= 6U) && (rec[5] <= (rec_len - 6U))) {
+          if (!isotp_load(rec[2], (uint16_t)rec[3] | ((uint16_t)rec[4] << 8), &rec[6], rec[5])) {
+            isotp_comms_reject(rec[2]);
+          }
+        }
+        break;
+      case ISOTP_CMD_SEND:
+        if (rec_len >= 5U) {
+          if (!isotp_send(rec[2], (uint16_t)rec[3] | ((uint16_t)rec[4] << 8))) {
+            isotp_comms_reject(rec[2]);
+          }
+        }
+        break;
+      case ISOTP_CMD_CLOSE:
+        isotp_close(rec[2]);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void isotp_clear(void) {
+  for (uint8_t i = 0U; i < ISOTP_CHANNEL_CNT; i++) {
+    isotp_channels[i].active = false;
+  }
+}
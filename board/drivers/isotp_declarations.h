@@ -0,0 +1,92 @@
+#pragma once
+
+// ISO 15765-2 transport done in the firmware. The host hands over whole PDUs,
+// segmentation, reassembly, flow control and block size/STmin pacing happen here.
+// Only classic 8 byte CAN frames are used, and every frame goes through safety_tx_hook.
+#define ISOTP_CHANNEL_CNT 4U
+#define ISOTP_MAX_LEN 4095U
+#define ISOTP_TIMEOUT_US 1000000U    // N_Bs and N_Cr
+#define ISOTP_FRAMES_PER_TICK 8U     // consecutive frames per tick with STmin 0
+#define ISOTP_PADDING 0x00U
+
+// host writes are a series of 64 byte records on endpoint 2: {ISOTP_COMMS_ID, cmd, channel, ...}
+#define ISOTP_COMMS_ID 0xF0U
+#define ISOTP_RECORD_SIZE 0x40U
+#define ISOTP_CMD_OPEN 0U            // bus, tx addr (4), rx addr (4), ext addr enable, ext addr, block size, STmin
+#define ISOTP_CMD_DATA 1U            // offset (2), len, data
+#define ISOTP_CMD_SEND 2U            // len (2)
+#define ISOTP_CMD_CLOSE 3U
+#define ISOTP_DATA_RECORD_MAX (ISOTP_RECORD_SIZE - 6U)
+
+#define ISOTP_TX_IDLE 0U
+#define ISOTP_TX_WAIT_FC 1U
+#define ISOTP_TX_SENDING 2U
+#define ISOTP_TX_DONE 3U
+#define ISOTP_TX_ERROR 4U
+
+#define ISOTP_RX_IDLE 0U
+#define ISOTP_RX_RECEIVING 1U
+#define ISOTP_RX_DONE 2U
+
+#define ISOTP_ERR_NONE 0U
+#define ISOTP_ERR_TIMEOUT_FC 1U      // no flow control from the receiver
+#define ISOTP_ERR_TIMEOUT_CF 2U      // no consecutive frame from the sender
+#define ISOTP_ERR_OVERFLOW 3U        // receiver aborted with flow control overflow
+#define ISOTP_ERR_SEQUENCE 4U        // consecutive frame out of order
+#define ISOTP_ERR_RX_BUSY 5U         // PDU received before the host read the previous one
+#define ISOTP_ERR_BLOCKED 6U         // frame blocked by safety_tx_hook
+#define ISOTP_ERR_TX_BUSY 7U         // host sent a PDU before the previous one was sent
+#define ISOTP_ERR_INVALID 8U         // host command rejected, channel not open or bad arguments
+
+typedef struct {
+  bool active;
+  uint8_t bus;
+  uint32_t tx_addr;
+  uint32_t rx_addr;
+  bool ext_addr_en;
+  uint8_t ext_addr;
+  uint8_t block_size;        // sent in our flow control frames
+  uint8_t st_min;
+
+  uint8_t tx_state;
+  uint16_t tx_len;
+  uint16_t tx_idx;           // next byte to send
+  uint8_t tx_seq;
+  uint8_t tx_block_size;     // from the receiver's flow control
+  uint8_t tx_block_cnt;
+  uint32_t tx_st_min_us;
+  uint32_t tx_last;          // microsecond timer of the last frame sent
+  uint32_t tx_next;
+  uint32_t tx_deadline;
+  uint8_t tx_buf[ISOTP_MAX_LEN];
+
+  uint8_t rx_state;
+  uint16_t rx_len;
+  uint16_t rx_idx;
+  uint8_t rx_seq;
+  uint8_t rx_block_cnt;
+  uint32_t rx_deadline;
+  uint8_t rx_buf[ISOTP_MAX_LEN];
+
+  uint8_t error;             // last error, cleared when read by the host
+} isotp_channel_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t tx_state;
+  uint8_t rx_state;
+  uint8_t error;
+  uint16_t rx_len;
+} isotp_status_t;
+
+extern isotp_channel_t isotp_channels[ISOTP_CHANNEL_CNT];
+
+bool isotp_open(uint8_t channel, uint8_t bus, uint32_t tx_addr, uint32_t rx_addr, bool ext_addr_en, uint8_t ext_addr, uint8_t block_size, uint8_t st_min);
+void isotp_close(uint8_t channel);
+bool isotp_load(uint8_t channel, uint16_t offset, const uint8_t *data, uint16_t len);
+bool isotp_send(uint8_t channel, uint16_t len);
+bool isotp_rx_hook(const CANPacket_t *msg);
+void isotp_tick(uint32_t now);
+bool isotp_get_status(uint8_t channel, isotp_status_t *status);
+uint16_t isotp_read(uint8_t channel, uint16_t offset, uint8_t *data, uint16_t len);
+void isotp_comms_write(const uint8_t *data, uint32_t len);
+void isotp_clear(void);
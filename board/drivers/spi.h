@@ -4,14 +4,12 @@
 #include "crc.h"
 
 #ifdef STM32H7
-#define SPI_BUF_SIZE 2048U
 // H7 DMA2 located in D2 domain, so we need to use SRAM1/SRAM2
 __attribute__((section(".sram12"))) uint8_t spi_buf_rx[SPI_BUF_SIZE];
-__attribute__((section(".sram12"))) uint8_t spi_buf_tx[SPI_BUF_SIZE];
+__attribute__((section(".sram12"))) uint8_t spi_buf_tx[2][SPI_BUF_SIZE];
 #else
-#define SPI_BUF_SIZE 1024U
 uint8_t spi_buf_rx[SPI_BUF_SIZE];
-uint8_t spi_buf_tx[SPI_BUF_SIZE];
+uint8_t spi_buf_tx[2][SPI_BUF_SIZE];
 #endif
 
 uint16_t spi_checksum_error_count = 0;
@@ -22,6 +20,12 @@ static uint16_t spi_data_len_mosi;
 static bool spi_can_tx_ready = false;
 static const unsigned char version_text[] = "VERSION";
 
+// Responses alternate between two TX buffers. While a CAN read response is clocked
+// out of one, the next one is already assembled in the other.
+static uint8_t spi_tx_idx = 0U;             // buffer for the next response
+static uint16_t spi_can_prefetch_len = 0U;  // CAN read data waiting in the other buffer
+static uint16_t spi_can_prefetch_max = 0U;
+
 static uint16_t spi_version_packet(uint8_t *out) {
   // this protocol version request is a stable portion of
   // the panda's SPI protocol. its contents match that of the
@@ -51,9 +55,14 @@ static uint16_t spi_version_packet(uint8_t *out) {
   data_len += 1U;
 
   // SPI protocol version
-  out[data_pos + data_len] = 0x2;
+  out[data_pos + data_len] = SPI_PROTOCOL_VERSION;
   data_len += 1U;
 
+  // max data length of a transfer
+  out[data_pos + data_len] = SPI_MAX_DATA_LEN & 0xFFU;
+  out[data_pos + data_len + 1U] = (SPI_MAX_DATA_LEN >> 8) & 0xFFU;
+  data_len += 2U;
+
   // data length
   out[7] = data_len & 0xFFU;
   out[8] = (data_len >> 8) & 0xFFU;
@@ -75,6 +84,60 @@ void spi_init(void) {
   llspi_mosi_dma(spi_buf_rx, SPI_HEADER_SIZE);
 }
 
+static int spi_control_handler(ControlPacket_t *ctrl, uint8_t *resp) {
+  // a comms reset or compression change drops the prefetched CAN data too
+  if ((ctrl->request == 0xc0U) || (ctrl->request == 0xd7U)) {
+    spi_can_prefetch_len = 0U;
+  }
+  return comms_control_handler(ctrl, resp);
+}
+
+// prefetched data goes out first, the rest comes from the queue
+static uint16_t spi_can_read(uint16_t max_len) {
+  uint16_t len = 0U;
+  if (spi_can_prefetch_len > 0U) {
+    spi_tx_idx ^= 1U;
+    len = MIN(spi_can_prefetch_len, max_len);
+    spi_can_prefetch_len -= len;
+    if (spi_can_prefetch_len > 0U) {
+      // less was asked for than we have, keep the rest in the other buffer
+      (void)memcpy(&spi_buf_tx[spi_tx_idx ^ 1U][3], &spi_buf_tx[spi_tx_idx][3U + len], spi_can_prefetch_len);
+    }
+  }
+  if (len < max_len) {
+    len += comms_can_read(&spi_buf_tx[spi_tx_idx][3U + len], max_len - len);
+  }
+  spi_can_prefetch_max = max_len;
+  return len;
+}
+
+// assemble the next CAN read response while the current one is clocked out
+static void spi_can_prefetch(void) {
+  if (spi_can_prefetch_len == 0U) {
+    spi_can_prefetch_len = comms_can_read(&spi_buf_tx[spi_tx_idx ^ 1U][3], spi_can_prefetch_max);
+  }
+}
+
+// every response is prefixed with its uint16 length and cut to the requested length, like on USB.
+// stops early if the next response might not fit, the host sends the remaining requests again
+static uint16_t spi_control_batch(const uint8_t *data, uint16_t len, uint8_t *out, uint16_t max_len) {
+  uint16_t out_len = 0U;
+  for (uint16_t pos = 0U; (pos + sizeof(ControlPacket_t)) <= len; pos += sizeof(ControlPacket_t)) {
+    ControlPacket_t ctrl = {0};
+    (void)memcpy((uint8_t*)&ctrl, &data[pos], sizeof(ControlPacket_t));
+    if (((out_len + 2U + MAX_CONTROL_RESP_SIZE) > (SPI_BUF_SIZE - 4U)) || ((out_len + 2U + ctrl.length) > max_len)) {
+      break;
+    }
+
+    int resp_len = spi_control_handler(&ctrl, &out[out_len + 2U]);
+    uint16_t n = (resp_len > 0) ? MIN((uint16_t)resp_len, ctrl.length) : 0U;
+    out[out_len] = n & 0xFFU;
+    out[out_len + 1U] = (n >> 8) & 0xFFU;
+    out_len += 2U + n;
+  }
+  return out_len;
+}
+
 static bool validate_checksum(const uint8_t *data, uint16_t len) {
   // TODO: can speed this up by casting the bulk to uint32_t and xor-ing the bytes afterwards
   uint8_t checksum = SPI_CHECKSUM_START;
@@ -88,6 +151,7 @@ void spi_rx_done(void) {
   uint16_t response_len = 0U;
   uint8_t next_rx_state = SPI_STATE_HEADER_NACK;
   bool checksum_valid = false;
+  bool can_read = false;
   static uint8_t spi_endpoint;
   static uint16_t spi_data_len_miso;
 
@@ -95,21 +159,22 @@ void spi_rx_done(void) {
   spi_endpoint = spi_buf_rx[1];
   spi_data_len_mosi = (spi_buf_rx[3] << 8) | spi_buf_rx[2];
   spi_data_len_miso = (spi_buf_rx[5] << 8) | spi_buf_rx[4];
+  spi_data_len_miso = MIN(spi_data_len_miso, SPI_MAX_DATA_LEN);
 
   if (memcmp(spi_buf_rx, version_text, 7) == 0) {
-    response_len = spi_version_packet(spi_buf_tx);
+    response_len = spi_version_packet(spi_buf_tx[spi_tx_idx]);
     next_rx_state = SPI_STATE_HEADER_NACK;;
   } else if (spi_state == SPI_STATE_HEADER) {
     checksum_valid = validate_checksum(spi_buf_rx, SPI_HEADER_SIZE);
-    if ((spi_buf_rx[0] == SPI_SYNC_BYTE) && checksum_valid) {
+    if ((spi_buf_rx[0] == SPI_SYNC_BYTE) && checksum_valid && (spi_data_len_mosi <= SPI_MAX_DATA_LEN)) {
       // response: ACK and start receiving data portion
-      spi_buf_tx[0] = SPI_HACK;
+      spi_buf_tx[spi_tx_idx][0] = SPI_HACK;
       next_rx_state = SPI_STATE_HEADER_ACK;
       response_len = 1U;
     } else {
       // response: NACK and reset state machine
-      print("- incorrect header sync or checksum "); hexdump(spi_buf_rx, SPI_HEADER_SIZE);
-      spi_buf_tx[0] = SPI_NACK;
+      print("- incorrect header sync, checksum or length "); hexdump(spi_buf_rx, SPI_HEADER_SIZE);
+      spi_buf_tx[spi_tx_idx][0] = SPI_NACK;
       next_rx_state = SPI_STATE_HEADER_NACK;
       response_len = 1U;
     }
@@ -122,14 +187,21 @@ void spi_rx_done(void) {
         if (spi_data_len_mosi >= sizeof(ControlPacket_t)) {
           ControlPacket_t ctrl = {0};
           (void)memcpy((uint8_t*)&ctrl, &spi_buf_rx[SPI_HEADER_SIZE], sizeof(ControlPacket_t));
-          response_len = comms_control_handler(&ctrl, &spi_buf_tx[3]);
+          if (ctrl.request == SPI_CONTROL_BATCH) {
+            uint16_t batch_len = MIN(ctrl.param1 * sizeof(ControlPacket_t), spi_data_len_mosi - sizeof(ControlPacket_t));
+            response_len = spi_control_batch(&spi_buf_rx[SPI_HEADER_SIZE + sizeof(ControlPacket_t)], batch_len,
+                                             &spi_buf_tx[spi_tx_idx][3], spi_data_len_miso);
+          } else {
+            response_len = spi_control_handler(&ctrl, &spi_buf_tx[spi_tx_idx][3]);
+          }
           response_ack = true;
         } else {
           print("SPI: insufficient data for control handler\n");
         }
       } else if ((spi_endpoint == 1U) || (spi_endpoint == 0x81U)) {
         if (spi_data_len_mosi == 0U) {
-          response_len = comms_can_read(&(spi_buf_tx[3]), spi_data_len_miso);
+          response_len = spi_can_read(spi_data_len_miso);
+          can_read = true;
           response_ack = true;
         } else {
           print("SPI: did not expect data for can_read\n");
@@ -142,6 +214,10 @@ void spi_rx_done(void) {
           if (spi_can_tx_ready) {
             spi_can_tx_ready = false;
             comms_can_write(&spi_buf_rx[SPI_HEADER_SIZE], spi_data_len_mosi);
+            // credits ride along with every write ACK
+            if (comms_can_tx_credits_enabled()) {
+              response_len = comms_can_tx_credits(true, &spi_buf_tx[spi_tx_idx][3]);
+            }
             response_ack = true;
           } else {
             response_ack = false;
@@ -168,22 +244,23 @@ void spi_rx_done(void) {
       print("\n");
     }
 
+    uint8_t *tx_buf = spi_buf_tx[spi_tx_idx];
     if (!response_ack) {
-      spi_buf_tx[0] = SPI_NACK;
+      tx_buf[0] = SPI_NACK;
       next_rx_state = SPI_STATE_HEADER_NACK;
       response_len = 1U;
     } else {
       // Setup response header
-      spi_buf_tx[0] = SPI_DACK;
-      spi_buf_tx[1] = response_len & 0xFFU;
-      spi_buf_tx[2] = (response_len >> 8) & 0xFFU;
+      tx_buf[0] = SPI_DACK;
+      tx_buf[1] = response_len & 0xFFU;
+      tx_buf[2] = (response_len >> 8) & 0xFFU;
 
       // Add checksum
       uint8_t checksum = SPI_CHECKSUM_START;
       for(uint16_t i = 0U; i < (response_len + 3U); i++) {
-        checksum ^= spi_buf_tx[i];
+        checksum ^= tx_buf[i];
       }
-      spi_buf_tx[response_len + 3U] = checksum;
+      tx_buf[response_len + 3U] = checksum;
       response_len += 4U;
 
       next_rx_state = SPI_STATE_DATA_TX;
@@ -195,11 +272,14 @@ void spi_rx_done(void) {
   // send out response
   if (response_len == 0U) {
     print("SPI: no response\n");
-    spi_buf_tx[0] = SPI_NACK;
+    spi_buf_tx[spi_tx_idx][0] = SPI_NACK;
     spi_state = SPI_STATE_HEADER_NACK;
     response_len = 1U;
   }
-  llspi_miso_dma(spi_buf_tx, response_len);
+  llspi_miso_dma(spi_buf_tx[spi_tx_idx], response_len);
+  if (can_read) {
+    spi_can_prefetch();
+  }
 
   spi_state = next_rx_state;
   if (!checksum_valid && (spi_checksum_error_count < UINT16_MAX)) {
@@ -9,14 +9,14 @@
 #define SPI_IRQ_RATE  16000U
 
 #ifdef STM32H7
-#define SPI_BUF_SIZE 2048U
+#define SPI_BUF_SIZE 8192U
 // H7 DMA2 located in D2 domain, so we need to use SRAM1/SRAM2
 __attribute__((section(".sram12"))) extern uint8_t spi_buf_rx[SPI_BUF_SIZE];
-__attribute__((section(".sram12"))) extern uint8_t spi_buf_tx[SPI_BUF_SIZE];
+__attribute__((section(".sram12"))) extern uint8_t spi_buf_tx[2][SPI_BUF_SIZE];
 #else
 #define SPI_BUF_SIZE 1024U
 extern uint8_t spi_buf_rx[SPI_BUF_SIZE];
-extern uint8_t spi_buf_tx[SPI_BUF_SIZE];
+extern uint8_t spi_buf_tx[2][SPI_BUF_SIZE];
 #endif
 
 #define SPI_CHECKSUM_START 0xABU
@@ -39,6 +39,14 @@ extern uint16_t spi_checksum_error_count;
 
 #define SPI_HEADER_SIZE 7U
 
+// reported in the version packet, along with the max data length of a transfer.
+// 3 added SPI_CONTROL_BATCH, 4 the max data length
+#define SPI_PROTOCOL_VERSION 4U
+#define SPI_MAX_DATA_LEN (SPI_BUF_SIZE - SPI_HEADER_SIZE - 1U)
+
+// control request followed by param1 more control requests, dispatched in one transfer
+#define SPI_CONTROL_BATCH 0xf0U
+
 // low level SPI prototypes
 void llspi_init(void);
 void llspi_mosi_dma(uint8_t *addr, int len);
@@ -11,7 +11,7 @@ void microsecond_timer_init(void) {
   MICROSECOND_TIMER->EGR = TIM_EGR_UG;
 }
 
-uint32_t microsecond_timer_get(void) {
+ITCM_FUNC uint32_t microsecond_timer_get(void) {
   return MICROSECOND_TIMER->CNT;
 }
 
@@ -25,6 +25,13 @@ void interrupt_timer_init(void) {
   NVIC_EnableIRQ(INTERRUPT_TIMER_IRQ);
 }
 
+// compare interrupt on the free running microsecond timer, the handler has to advance CCR1 by interval
+void microsecond_timer_compare_init(uint32_t interval) {
+  MICROSECOND_TIMER->CCR1 = microsecond_timer_get() + interval;
+  register_set_bits(&(MICROSECOND_TIMER->DIER), TIM_DIER_CC1IE);
+  NVIC_EnableIRQ(MICROSECOND_TIMER_IRQ);
+}
+
 void tick_timer_init(void) {
   timer_init(TICK_TIMER, (uint16_t)((15.25*APB2_TIMER_FREQ)/8U));
   NVIC_EnableIRQ(TICK_TIMER_IRQ);
@@ -22,6 +22,7 @@ void puth(unsigned int i) {
 
 typedef struct {
   uint32_t CNT;
+  uint32_t SR;
 } TIM_TypeDef;
 
 TIM_TypeDef timer;
@@ -3,7 +3,7 @@ import os
 import subprocess
 import argparse
 
-from panda import Panda
+from panda import Panda, PandaFleet
 
 board_path = os.path.dirname(os.path.realpath(__file__))
 
@@ -15,13 +15,11 @@ if __name__ == "__main__":
   subprocess.check_call(f"scons -C {board_path}/.. -j$(nproc) {board_path}", shell=True)
 
   if args.all:
-    serials = Panda.list()
-    print(f"found {len(serials)} panda(s) - {serials}")
-  else:
-    serials = [None]
+    with PandaFleet() as fleet:
+      print(f"found {len(fleet)} panda(s) - {fleet.serials}")
+      ret = fleet.flash()
+    exit(1 if len(ret) == 0 or any(isinstance(r, Exception) for r in ret.values()) else 0)
 
-  for s in serials:
-    with Panda(serial=s) as p:
-      print("flashing", p.get_usb_serial())
-      p.flash()
-  exit(1 if len(serials) == 0 else 0)
+  with Panda() as p:
+    print("flashing", p.get_usb_serial())
+    p.flash()
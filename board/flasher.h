@@ -5,8 +5,12 @@
   #define APP_START_ADDRESS 0x8004000U
 #endif
 
+// the largest app, sectors 1 to 7
+#define APP_MAX_LEN 0xE0000U
+
+#include "drivers/flash_stream.h"
+
 // flasher state variables
-uint32_t *prog_ptr = NULL;
 bool unlocked = false;
 
 void spi_init(void);
@@ -20,10 +24,11 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
   resp[0] = 0xff;
   resp[2] = req->request;
   resp[3] = ~req->request;
-  *((uint32_t **)&resp[8]) = prog_ptr;
+  *((uint32_t *)&resp[8]) = APP_START_ADDRESS + flash_stream_offset();
   resp_len = 0xc;
 
   int sec;
+  uint32_t len;
   switch (req->request) {
     // **** 0xb0: flasher echo
     case 0xb0:
@@ -37,7 +42,7 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       }
       current_board->set_led(LED_GREEN, 1);
       unlocked = true;
-      prog_ptr = (uint32_t *)APP_START_ADDRESS;
+      flash_stream_reset();
       break;
     // **** 0xb2: erase sector
     case 0xb2:
@@ -46,6 +51,32 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
         resp[1] = 0xff;
       }
       break;
+    // **** 0xb3: verify, SHA-1 of the first param1 | param2 << 16 bytes of the app
+    case 0xb3:
+      len = (uint32_t)req->param1 | ((uint32_t)req->param2 << 16);
+      if (len <= APP_MAX_LEN) {
+        flash_stream_flush();
+        (void)SHA_hash((void *)APP_START_ADDRESS, (int)len, resp);
+        resp_len = SHA_DIGEST_SIZE;
+      }
+      break;
+    // **** 0xb4: SHA-1 of sector param1, so the host can skip the ones that didn't change
+    case 0xb4:
+      if ((req->param1 != 0U) && (req->param1 < FLASH_SECTOR_CNT)) {
+        flash_stream_flush();
+        sec = req->param1;
+        len = flash_sector_address(sec + 1) - flash_sector_address(sec);
+        (void)SHA_hash((void *)flash_sector_address(sec), (int)len, resp);
+        resp_len = SHA_DIGEST_SIZE;
+      }
+      break;
+    // **** 0xb5: the next endpoint 2 data goes to the start of sector param1
+    case 0xb5:
+      if ((req->param1 != 0U) && (req->param1 < FLASH_SECTOR_CNT)) {
+        flash_stream_seek(flash_sector_address(req->param1) - APP_START_ADDRESS);
+        resp[1] = 0xff;
+      }
+      break;
     // **** 0xc1: get hardware type
     case 0xc1:
       resp[0] = hw_type;
@@ -91,7 +122,7 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       break;
     // **** 0xd8: reset ST
     case 0xd8:
-      flush_write_buffer();
+      flash_stream_flush();
       NVIC_SystemReset();
       break;
   }
@@ -112,14 +143,11 @@ int comms_can_read(uint8_t *data, uint32_t max_len) {
 void refresh_can_tx_slots_available(void) {}
 
 void comms_endpoint2_write(const uint8_t *data, uint32_t len) {
-  current_board->set_led(LED_RED, 0);
-  for (uint32_t i = 0; i < len/4; i++) {
-    flash_write_word(prog_ptr, *(uint32_t*)(data+(i*4)));
-
-    //*(uint64_t*)(&spi_tx_buf[0x30+(i*4)]) = *prog_ptr;
-    prog_ptr++;
+  if (unlocked) {
+    current_board->set_led(LED_RED, 0);
+    flash_stream_write(data, len);
+    current_board->set_led(LED_RED, 1);
   }
-  current_board->set_led(LED_RED, 1);
 }
 
 
@@ -147,11 +175,13 @@ void soft_flasher_start(void) {
 
   enable_interrupts();
 
+  uint32_t cnt = 0U;
   for (;;) {
-    // blink the green LED fast
-    current_board->set_led(LED_GREEN, 0);
-    delay(500000);
-    current_board->set_led(LED_GREEN, 1);
-    delay(500000);
+    // program what came in, blink the green LED fast while idle
+    if (!flash_stream_program(false)) {
+      delay(1000);
+      cnt++;
+      current_board->set_led(LED_GREEN, ((cnt / 500U) % 2U) != 0U);
+    }
   }
 }
@@ -30,7 +30,7 @@ struct __attribute__((packed)) health_t {
   uint8_t som_reset_triggered;
 };
 
-#define CAN_HEALTH_PACKET_VERSION 5
+#define CAN_HEALTH_PACKET_VERSION 6
 typedef struct __attribute__((packed)) {
   uint8_t bus_off;
   uint32_t bus_off_cnt;
@@ -58,4 +58,6 @@ typedef struct __attribute__((packed)) {
   uint32_t irq1_call_rate;
   uint32_t irq2_call_rate;
   uint32_t can_core_reset_cnt;
+  uint16_t bus_load_1s; // Estimated bus load over the last second, in 0.01%
+  uint16_t bus_load_10s; // Estimated bus load over the last 10 seconds, in 0.01%
 } can_health_t;
@@ -13,6 +13,7 @@
 #include "jungle_health.h"
 
 #include "board/drivers/can_common.h"
+#include "board/drivers/isotp.h"
 
 #ifdef STM32H7
   #include "board/drivers/fdcan.h"
@@ -20,6 +21,8 @@
   #include "board/drivers/bxcan.h"
 #endif
 
+#include "board/drivers/can_periodic.h"
+
 #include "board/obj/gitversion.h"
 
 #include "board/can_comms.h"
@@ -74,6 +77,7 @@ void tick_handler(void) {
       #endif
 
       current_board->board_tick();
+      can_bus_load_tick();
 
       // check registers
       check_registers();
@@ -146,6 +150,9 @@ int main(void) {
 
   // init early devices
   clock_init();
+#ifdef STM32H7
+  cache_init();
+#endif
   peripherals_init();
   detect_board_type();
   // red+green leds enabled until succesful USB init, as a debug indicator
@@ -209,6 +216,7 @@ int main(void) {
           CANPacket_t to_send;
           to_send.returned = 0U;
           to_send.rejected = 0U;
+          to_send.timestamp = 0U;
           to_send.extended = 0U;
           to_send.addr = 0x200U + i;
           to_send.bus = i % 3U;
@@ -14,6 +14,7 @@
 #include "health.h"
 
 #include "drivers/can_common.h"
+#include "drivers/isotp.h"
 
 #ifdef STM32H7
   #include "drivers/fdcan.h"
@@ -21,6 +22,8 @@
   #include "drivers/bxcan.h"
 #endif
 
+#include "drivers/can_periodic.h"
+
 #include "power_saving.h"
 
 #include "obj/gitversion.h"
@@ -73,6 +76,10 @@ void set_safety_mode(uint16_t mode, uint16_t param) {
   safety_tx_blocked = 0;
   safety_rx_invalid = 0;
 
+  // periodic frames and ISO-TP channels have to be set up again for the new mode
+  can_periodic_clear();
+  isotp_clear();
+
   switch (mode_copy) {
     case SAFETY_SILENT:
       set_intercept_relay(false, false);
@@ -159,6 +166,10 @@ static void tick_handler(void) {
     harness_tick();
     simple_watchdog_kick();
 
+    if (comms_can_records_due(microsecond_timer_get())) {
+      push_health_records();
+    }
+
     // re-init everything that uses harness status
     if (harness.status != prev_harness_status) {
       prev_harness_status = harness.status;
@@ -187,6 +198,10 @@ static void tick_handler(void) {
         print("tx2:"); puth4(can_tx2_q.r_ptr); print("-"); puth4(can_tx2_q.w_ptr); print("  ");
         print("tx3:"); puth4(can_tx3_q.r_ptr); print("-"); puth4(can_tx3_q.w_ptr); print("\n");
       #endif
+      #ifdef DEBUG_CAN_RX_CYCLES
+        print("can_rx max cycles: "); puth(can_rx_cycles_max); print("\n");
+        can_rx_cycles_max = 0U;
+      #endif
 
       // set green LED to be controls allowed
       current_board->set_led(LED_GREEN, controls_allowed | green_led_enabled);
@@ -199,6 +214,7 @@ static void tick_handler(void) {
 
       // tick drivers at 1Hz
       bootkick_tick(check_started(), recent_heartbeat);
+      can_bus_load_tick();
 
       // increase heartbeat counter and cap it at the uint32 limit
       if (heartbeat_counter < UINT32_MAX) {
@@ -294,6 +310,17 @@ static void tick_handler(void) {
   TICK_TIMER->SR = 0;
 }
 
+// called at 1kHz
+static void can_tx_timer_handler(void) {
+  if ((MICROSECOND_TIMER->SR & TIM_SR_CC1IF) != 0U) {
+    MICROSECOND_TIMER->SR = ~((uint32_t)TIM_SR_CC1IF);
+    MICROSECOND_TIMER->CCR1 += CAN_PERIODIC_TICK_US;
+    uint32_t now = microsecond_timer_get();
+    can_periodic_tick(now);
+    isotp_tick(now);
+  }
+}
+
 int main(void) {
   // Init interrupt table
   init_interrupts(true);
@@ -303,6 +330,9 @@ int main(void) {
 
   // init early devices
   clock_init();
+#ifdef STM32H7
+  cache_init();
+#endif
   peripherals_init();
   detect_board_type();
   // red+green leds enabled until succesful USB/SPI init, as a debug indicator
@@ -344,6 +374,10 @@ int main(void) {
   REGISTER_INTERRUPT(TICK_TIMER_IRQ, tick_handler, 10U, FAULT_INTERRUPT_RATE_TICK)
   tick_timer_init();
 
+  // 1kHz periodic CAN TX scheduler and ISO-TP pacing
+  REGISTER_INTERRUPT(MICROSECOND_TIMER_IRQ, can_tx_timer_handler, 1100U, FAULT_INTERRUPT_RATE_CAN_PERIODIC)
+  microsecond_timer_compare_init(CAN_PERIODIC_TICK_US);
+
 #ifdef DEBUG
   print("DEBUG ENABLED\n");
 #endif
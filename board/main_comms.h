@@ -4,6 +4,10 @@ extern int _app_start[0xc000]; // Only first 3 sectors of size 0x4000 are used
 void set_safety_mode(uint16_t mode, uint16_t param);
 bool is_car_safety_mode(uint16_t mode);
 
+// bus and address selected by 0xe8, for the per-frame settings in 0xe9, 0xeb and 0xec
+static uint8_t selected_bus = 0U;
+static uint32_t selected_addr = 0U;
+
 static int get_health_pkt(void *dat) {
   COMPILE_TIME_ASSERT(sizeof(struct health_t) <= USBPACKET_MAX_SIZE);
   struct health_t * health = (struct health_t*)dat;
@@ -47,10 +51,38 @@ static int get_health_pkt(void *dat) {
   return sizeof(*health);
 }
 
+static int get_can_health_pkt(uint8_t can_number, void *dat) {
+  update_can_health_pkt(can_number, 0U);
+  can_health[can_number].can_speed = (bus_config[can_number].can_speed / 10U);
+  can_health[can_number].can_data_speed = (bus_config[can_number].can_data_speed / 10U);
+  can_health[can_number].canfd_enabled = bus_config[can_number].canfd_enabled;
+  can_health[can_number].brs_enabled = bus_config[can_number].brs_enabled;
+  can_health[can_number].canfd_non_iso = bus_config[can_number].canfd_non_iso;
+  (void)memcpy(dat, (uint8_t*)(&can_health[can_number]), sizeof(can_health[can_number]));
+  return sizeof(can_health[can_number]);
+}
+
+// inline health records in the CAN read stream, replaces polling 0xd2 and 0xc2
+static void push_health_records(void) {
+  COMPILE_TIME_ASSERT(sizeof(struct health_t) <= CAN_RECORD_DATA_SIZE_MAX);
+  COMPILE_TIME_ASSERT(sizeof(can_health_t) <= CAN_RECORD_DATA_SIZE_MAX);
+  uint8_t dat[CAN_RECORD_DATA_SIZE_MAX];
+
+  int len = get_health_pkt(dat);
+  (void)comms_can_push_record(CAN_RECORD_HEALTH, 0U, dat, (uint32_t)len);
+  for (uint8_t i = 0U; i < 3U; i++) {
+    len = get_can_health_pkt(i, dat);
+    (void)comms_can_push_record(CAN_RECORD_CAN_HEALTH, i, dat, (uint32_t)len);
+  }
+}
+
 // send on serial, first byte to select the ring
+// ISO-TP records use ISOTP_COMMS_ID instead of a ring number
 void comms_endpoint2_write(const uint8_t *data, uint32_t len) {
   uart_ring *ur = get_ring_by_number(data[0]);
-  if ((len != 0U) && (ur != NULL)) {
+  if ((len != 0U) && (data[0] == ISOTP_COMMS_ID)) {
+    isotp_comms_write(data, len);
+  } else if ((len != 0U) && (ur != NULL)) {
     if ((data[0] < 2U) || (data[0] >= 4U)) {
       for (uint32_t i = 1; i < len; i++) {
         while (!put_char(ur, data[i])) {
@@ -108,16 +140,9 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       break;
     // **** 0xc2: CAN health stats
     case 0xc2:
-      COMPILE_TIME_ASSERT(sizeof(can_health_t) <= USBPACKET_MAX_SIZE);
+      COMPILE_TIME_ASSERT(sizeof(can_health_t) <= MAX_CONTROL_RESP_SIZE);
       if (req->param1 < 3U) {
-        update_can_health_pkt(req->param1, 0U);
-        can_health[req->param1].can_speed = (bus_config[req->param1].can_speed / 10U);
-        can_health[req->param1].can_data_speed = (bus_config[req->param1].can_data_speed / 10U);
-        can_health[req->param1].canfd_enabled = bus_config[req->param1].canfd_enabled;
-        can_health[req->param1].brs_enabled = bus_config[req->param1].brs_enabled;
-        can_health[req->param1].canfd_non_iso = bus_config[req->param1].canfd_non_iso;
-        resp_len = sizeof(can_health[req->param1]);
-        (void)memcpy(resp, (uint8_t*)(&can_health[req->param1]), resp_len);
+        resp_len = get_can_health_pkt(req->param1, resp);
       }
       break;
     // **** 0xc3: fetch MCU UID
@@ -125,15 +150,22 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       (void)memcpy(resp, ((uint8_t *)UID_BASE), 12);
       resp_len = 12;
       break;
-    // **** 0xc4: get interrupt call rate
+    // **** 0xc4: get interrupt call rate, or full stats if param2 == 1
     case 0xc4:
       if (req->param1 < NUM_INTERRUPTS) {
-        uint32_t load = interrupts[req->param1].call_rate;
-        resp[0] = (load & 0x000000FFU);
-        resp[1] = ((load & 0x0000FF00U) >> 8U);
-        resp[2] = ((load & 0x00FF0000U) >> 16U);
-        resp[3] = ((load & 0xFF000000U) >> 24U);
-        resp_len = 4U;
+        if (req->param2 == 1U) {
+          interrupt_stats_t stats;
+          get_interrupt_stats(req->param1, &stats);
+          (void)memcpy(resp, &stats, sizeof(interrupt_stats_t));
+          resp_len = sizeof(interrupt_stats_t);
+        } else {
+          uint32_t load = interrupts[req->param1].call_rate;
+          resp[0] = (load & 0x000000FFU);
+          resp[1] = ((load & 0x0000FF00U) >> 8U);
+          resp[2] = ((load & 0x00FF0000U) >> 16U);
+          resp[3] = ((load & 0xFF000000U) >> 24U);
+          resp_len = 4U;
+        }
       }
       break;
     // **** 0xc5: DEBUG: drive relay
@@ -206,10 +238,24 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       (void)memcpy(resp, gitversion, sizeof(gitversion));
       resp_len = sizeof(gitversion) - 1U;
       break;
+    // **** 0xd7: compressed CAN read stream until the next comms reset, param1 enables. returns the dictionary size and history
+    case 0xd7:
+      resp_len = comms_can_set_compression(req->param1 != 0U, resp);
+      break;
     // **** 0xd8: reset ST
     case 0xd8:
       NVIC_SystemReset();
       break;
+    // **** 0xd9: get TX credits per bus, param1 turns credit based flow control on until the next comms reset
+    case 0xd9:
+      resp_len = comms_can_tx_credits(req->param1 != 0U, resp);
+      break;
+    // **** 0xda: inline health records in the CAN read stream every param1 ms, 0 disables
+    case 0xda:
+      comms_can_set_records_period(req->param1);
+      resp[0] = 1U;
+      resp_len = 1U;
+      break;
     // **** 0xdb: set OBD CAN multiplexing mode
     case 0xdb:
       if (current_board->has_obd) {
@@ -317,6 +363,51 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
     case 0xe7:
       set_power_save_state(req->param1);
       break;
+    // **** 0xe8: select bus and address for 0xe9, 0xeb and 0xec
+    // param1: address bits 0-15, param2: address bits 16-28 | (bus << 13)
+    case 0xe8:
+      selected_addr = ((uint32_t)(req->param2 & 0x1FFFU) << 16U) | req->param1;
+      selected_bus = (req->param2 >> 13U) & 0x3U;
+      break;
+    // **** 0xe9: set RX delivery policy for the selected bus and address
+    // param1: CAN_RX_FILTER_* mode, param2: interval in ms
+    case 0xe9:
+      resp[0] = can_rx_filter_set(selected_bus, selected_addr, MIN(req->param1, 0xFFU), req->param2) ? 1U : 0U;
+      resp_len = 1U;
+      break;
+    // **** 0xea: clear all RX delivery policies
+    case 0xea:
+      can_rx_filter_clear();
+      break;
+    // **** 0xeb: set periodic TX for the selected bus and address
+    // param1: period in ms (0 removes), param2: delay of the first send in ms
+    case 0xeb:
+      resp[0] = can_periodic_set(selected_bus, selected_addr, req->param1, req->param2) ? 1U : 0U;
+      resp_len = 1U;
+      break;
+    // **** 0xec: set periodic TX counter and checksum fields for the selected bus and address
+    // param1: counter, param2: checksum, both as start bit (bits 0-8) | length (bits 9-13)
+    case 0xec:
+      resp[0] = can_periodic_set_fields(selected_bus, selected_addr,
+                                        req->param1 & 0x1FFU, (req->param1 >> 9U) & 0x1FU,
+                                        req->param2 & 0x1FFU, (req->param2 >> 9U) & 0x1FU) ? 1U : 0U;
+      resp_len = 1U;
+      break;
+    // **** 0xed: clear all periodic TX frames
+    case 0xed:
+      can_periodic_clear();
+      break;
+    // **** 0xee: ISO-TP channel status
+    case 0xee:
+      if (isotp_get_status(MIN(req->param1, 0xFFU), (isotp_status_t *)resp)) {
+        resp_len = sizeof(isotp_status_t);
+      }
+      break;
+    // **** 0xef: read a received ISO-TP PDU
+    // param1: channel, param2: offset
+    case 0xef:
+      resp_len = isotp_read(MIN(req->param1, 0xFFU), req->param2, resp, MIN(req->length, MAX_CONTROL_RESP_SIZE));
+      break;
     // **** 0xf1: Clear CAN ring buffer.
     case 0xf1:
       if (req->param1 == 0xFFFFU) {
@@ -4,7 +4,7 @@ import time
 import subprocess
 import argparse
 
-from panda import Panda, PandaDFU
+from panda import Panda, PandaDFU, PandaFleet
 
 board_path = os.path.dirname(os.path.realpath(__file__))
 
@@ -15,12 +15,16 @@ if __name__ == "__main__":
 
   subprocess.check_call(f"scons -C {board_path}/.. -j$(nproc) {board_path}", shell=True)
 
-  serials = Panda.list() if args.all else [None]
-  for s in serials:
-    with Panda(serial=s) as p:
-      print(f"putting {p.get_usb_serial()} in DFU mode")
-      p.reset(enter_bootstub=True)
-      p.reset(enter_bootloader=True)
+  if args.all:
+    with PandaFleet() as fleet:
+      print(f"found {len(fleet)} panda(s) - {fleet.serials}, {len(fleet.dfu)} in DFU - {fleet.dfu}")
+      ret = fleet.recover()
+    exit(1 if len(ret) == 0 or any(isinstance(r, Exception) for r in ret.values()) else 0)
+
+  with Panda() as p:
+    print(f"putting {p.get_usb_serial()} in DFU mode")
+    p.reset(enter_bootstub=True)
+    p.reset(enter_bootloader=True)
 
   # wait for reset pandas to come back up
   time.sleep(1)
@@ -111,7 +111,7 @@ uint16_t current_safety_param = 0;
 static const safety_hooks *current_hooks = &nooutput_hooks;
 safety_config current_safety_config;
 
-static bool is_msg_valid(RxCheck addr_list[], int index) {
+ITCM_FUNC static bool is_msg_valid(RxCheck addr_list[], int index) {
   bool valid = true;
   if (index != -1) {
     if (!addr_list[index].status.valid_checksum || !addr_list[index].status.valid_quality_flag || (addr_list[index].status.wrong_counters >= MAX_WRONG_COUNTERS)) {
@@ -122,7 +122,7 @@ static bool is_msg_valid(RxCheck addr_list[], int index) {
   return valid;
 }
 
-static int get_addr_check_index(const CANPacket_t *to_push, RxCheck addr_list[], const int len) {
+ITCM_FUNC static int get_addr_check_index(const CANPacket_t *to_push, RxCheck addr_list[], const int len) {
   int bus = GET_BUS(to_push);
   int addr = GET_ADDR(to_push);
   int length = GET_LEN(to_push);
@@ -153,14 +153,14 @@ static int get_addr_check_index(const CANPacket_t *to_push, RxCheck addr_list[],
   return index;
 }
 
-static void update_addr_timestamp(RxCheck addr_list[], int index) {
+ITCM_FUNC static void update_addr_timestamp(RxCheck addr_list[], int index) {
   if (index != -1) {
     uint32_t ts = microsecond_timer_get();
     addr_list[index].status.last_timestamp = ts;
   }
 }
 
-static void update_counter(RxCheck addr_list[], int index, uint8_t counter) {
+ITCM_FUNC static void update_counter(RxCheck addr_list[], int index, uint8_t counter) {
   if (index != -1) {
     uint8_t expected_counter = (addr_list[index].status.last_counter + 1U) % (addr_list[index].msg[addr_list[index].status.index].max_counter + 1U);
     addr_list[index].status.wrong_counters += (expected_counter == counter) ? -1 : 1;
@@ -169,7 +169,7 @@ static void update_counter(RxCheck addr_list[], int index, uint8_t counter) {
   }
 }
 
-static bool rx_msg_safety_check(const CANPacket_t *to_push,
+ITCM_FUNC static bool rx_msg_safety_check(const CANPacket_t *to_push,
                          const safety_config *cfg,
                          const safety_hooks *safety_hooks) {
 
@@ -204,7 +204,7 @@ static bool rx_msg_safety_check(const CANPacket_t *to_push,
   return is_msg_valid(cfg->rx_checks, index);
 }
 
-bool safety_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC bool safety_rx_hook(const CANPacket_t *to_push) {
   bool controls_allowed_prev = controls_allowed;
 
   bool valid = rx_msg_safety_check(to_push, &current_safety_config, current_hooks);
@@ -245,10 +245,19 @@ bool safety_tx_hook(CANPacket_t *to_send) {
   return !relay_malfunction && whitelisted && safety_allowed;
 }
 
-int safety_fwd_hook(int bus_num, int addr) {
+ITCM_FUNC int safety_fwd_hook(int bus_num, int addr) {
   return (relay_malfunction ? -1 : current_hooks->fwd(bus_num, addr));
 }
 
+// checksum of a firmware generated frame, as the active safety mode would compute it on RX
+bool safety_compute_checksum(const CANPacket_t *to_send, uint32_t *checksum) {
+  bool ret = (current_hooks->compute_checksum != NULL);
+  if (ret) {
+    *checksum = current_hooks->compute_checksum(to_send);
+  }
+  return ret;
+}
+
 bool get_longitudinal_allowed(void) {
   return controls_allowed && !gas_pressed_prev;
 }
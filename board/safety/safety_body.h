@@ -2,7 +2,7 @@
 
 #include "safety_declarations.h"
 
-static void body_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void body_rx_hook(const CANPacket_t *to_push) {
   // body is never at standstill
   vehicle_moving = true;
 
@@ -2,7 +2,7 @@
 
 #include "safety_declarations.h"
 
-void default_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC void default_rx_hook(const CANPacket_t *to_push) {
   UNUSED(to_push);
 }
 
@@ -19,7 +19,7 @@ static GmHardware gm_hw = GM_ASCM;
 static bool gm_cam_long = false;
 static bool gm_pcm_cruise = false;
 
-static void gm_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void gm_rx_hook(const CANPacket_t *to_push) {
 
   const int GM_STANDSTILL_THRSLD = 10;  // 0.311kph
 
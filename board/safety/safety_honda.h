@@ -72,7 +72,7 @@ static uint8_t honda_get_counter(const CANPacket_t *to_push) {
   return (GET_BYTE(to_push, counter_byte) >> 4U) & 0x3U;
 }
 
-static void honda_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void honda_rx_hook(const CANPacket_t *to_push) {
   const bool pcm_cruise = ((honda_hw == HONDA_BOSCH) && !honda_bosch_long) || (honda_hw == HONDA_NIDEC);
   int pt_bus = honda_get_pt_bus();
 
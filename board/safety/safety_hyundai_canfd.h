@@ -45,7 +45,7 @@ static uint32_t hyundai_canfd_get_checksum(const CANPacket_t *to_push) {
   return chksum;
 }
 
-static void hyundai_canfd_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void hyundai_canfd_rx_hook(const CANPacket_t *to_push) {
   int bus = GET_BUS(to_push);
   int addr = GET_ADDR(to_push);
 
@@ -16,7 +16,7 @@
 #define MAZDA_CAM  2
 
 // track msgs coming from OP so that we know what CAM msgs to drop and what to forward
-static void mazda_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void mazda_rx_hook(const CANPacket_t *to_push) {
   if ((int)GET_BUS(to_push) == MAZDA_MAIN) {
     int addr = GET_ADDR(to_push);
 
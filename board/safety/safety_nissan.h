@@ -4,7 +4,7 @@
 
 static bool nissan_alt_eps = false;
 
-static void nissan_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void nissan_rx_hook(const CANPacket_t *to_push) {
   int bus = GET_BUS(to_push);
   int addr = GET_ADDR(to_push);
 
@@ -89,7 +89,7 @@ static uint32_t subaru_compute_checksum(const CANPacket_t *to_push) {
   return checksum;
 }
 
-static void subaru_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void subaru_rx_hook(const CANPacket_t *to_push) {
   const int bus = GET_BUS(to_push);
   const int alt_main_bus = subaru_gen2 ? SUBARU_ALT_BUS : SUBARU_MAIN_BUS;
 
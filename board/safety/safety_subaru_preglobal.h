@@ -19,7 +19,7 @@
 
 static bool subaru_pg_reversed_driver_torque = false;
 
-static void subaru_preglobal_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void subaru_preglobal_rx_hook(const CANPacket_t *to_push) {
   const int bus = GET_BUS(to_push);
 
   if (bus == SUBARU_PG_MAIN_BUS) {
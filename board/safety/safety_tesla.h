@@ -8,7 +8,7 @@ static bool tesla_raven = false;
 
 static bool tesla_stock_aeb = false;
 
-static void tesla_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void tesla_rx_hook(const CANPacket_t *to_push) {
   int bus = GET_BUS(to_push);
   int addr = GET_ADDR(to_push);
 
@@ -50,7 +50,7 @@ static bool toyota_get_quality_flag_valid(const CANPacket_t *to_push) {
   return valid;
 }
 
-static void toyota_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void toyota_rx_hook(const CANPacket_t *to_push) {
   const int TOYOTA_LTA_MAX_ANGLE = 1657;  // EPS only accepts up to 94.9461
 
   if (GET_BUS(to_push) == 0U) {
@@ -79,7 +79,7 @@ static safety_config volkswagen_pq_init(uint16_t param) {
                                    BUILD_SAFETY_CFG(volkswagen_pq_rx_checks, VOLKSWAGEN_PQ_STOCK_TX_MSGS);
 }
 
-static void volkswagen_pq_rx_hook(const CANPacket_t *to_push) {
+ITCM_FUNC static void volkswagen_pq_rx_hook(const CANPacket_t *to_push) {
   if (GET_BUS(to_push) == 0U) {
     int addr = GET_ADDR(to_push);
 
@@ -259,6 +259,7 @@ extern uint16_t current_safety_param;
 extern safety_config current_safety_config;
 
 int safety_fwd_hook(int bus_num, int addr);
+bool safety_compute_checksum(const CANPacket_t *to_send, uint32_t *checksum);
 int set_safety_hooks(uint16_t mode, uint16_t param);
 
 extern const safety_hooks body_hooks;
@@ -7,9 +7,22 @@ void flash_unlock(void) {
   FLASH->KEYR = 0xCDEF89AB;
 }
 
+#define FLASH_SECTOR_CNT 12U
+
+// four 16k sectors, a 64k one, then 128k
+uint32_t flash_sector_address(uint8_t sector) {
+  uint32_t ret;
+  if (sector <= 4U) {
+    ret = 0x8000000U + ((uint32_t)sector * 0x4000U);
+  } else {
+    ret = 0x8020000U + (((uint32_t)sector - 5U) * 0x20000U);
+  }
+  return ret;
+}
+
 bool flash_erase_sector(uint8_t sector, bool unlocked) {
   // don't erase the bootloader(sector 0)
-  if (sector != 0 && sector < 12 && unlocked) {
+  if (sector != 0 && sector < FLASH_SECTOR_CNT && unlocked) {
     FLASH->CR = (sector << 3) | FLASH_CR_SER;
     FLASH->CR |= FLASH_CR_STRT;
     while (FLASH->SR & FLASH_SR_BSY);
@@ -18,11 +31,15 @@ bool flash_erase_sector(uint8_t sector, bool unlocked) {
   return false;
 }
 
-void flash_write_word(void *prog_ptr, uint32_t data) {
-  uint32_t *pp = prog_ptr;
+// no flash words on F4, x32 parallelism is the most without an external VPP
+#define FLASH_PROG_SIZE 16U
+
+void flash_write_block(uint32_t *prog_ptr, const uint32_t *data) {
   FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
-  *pp = data;
-  while (FLASH->SR & FLASH_SR_BSY);
+  for (uint32_t i = 0U; i < (FLASH_PROG_SIZE / 4U); i++) {
+    prog_ptr[i] = data[i];
+    while (FLASH->SR & FLASH_SR_BSY);
+  }
 }
 
 void flush_write_buffer(void) { }
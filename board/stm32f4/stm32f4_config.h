@@ -21,6 +21,7 @@
 #define TICK_TIMER TIM9
 
 #define MICROSECOND_TIMER TIM2
+#define MICROSECOND_TIMER_IRQ TIM2_IRQn
 
 #define INTERRUPT_TIMER_IRQ TIM6_DAC_IRQn
 #define INTERRUPT_TIMER TIM6
@@ -116,3 +116,32 @@ void clock_init(void) {
   //Enable Vdd33usb supply level detector
   register_set_bits(&(PWR->CR3), PWR_CR3_USB33DEN);
 }
+
+/*
+  The M7 D-cache is write-back on all SRAM in the default memory map, so any memory
+  shared with another bus master has to be carved out with the MPU before enabling it:
+  * SRAM1/2 (.sram12): SPI DMA buffers
+  * SRAM4: bootloader magic, which has to land in RAM before NVIC_SystemReset()
+  * FDCAN message RAM: device memory in the default map already, but pinned down explicitly
+  TCMs are never cached, and the CAN queues in AXI SRAM are only touched by the CPU.
+  Only the app calls this, the bootstub keeps running uncached since it writes to flash.
+*/
+void cache_init(void) {
+  ARM_MPU_Disable();
+  // normal memory, shareable, non-cacheable
+  ARM_MPU_SetRegion(ARM_MPU_RBAR(0U, 0x30000000U), ARM_MPU_RASR(1U, ARM_MPU_AP_FULL, 1U, 1U, 0U, 0U, 0U, ARM_MPU_REGION_SIZE_32KB));
+  ARM_MPU_SetRegion(ARM_MPU_RBAR(1U, 0x38000000U), ARM_MPU_RASR(1U, ARM_MPU_AP_FULL, 1U, 1U, 0U, 0U, 0U, ARM_MPU_REGION_SIZE_16KB));
+  // shareable device memory, covers the 10KB of message RAM starting at FDCAN_START_ADDRESS
+  ARM_MPU_SetRegion(ARM_MPU_RBAR(2U, 0x40008000U), ARM_MPU_RASR(1U, ARM_MPU_AP_FULL, 0U, 1U, 0U, 1U, 0U, ARM_MPU_REGION_SIZE_32KB));
+  // default memory map for everything else
+  ARM_MPU_Enable(MPU_CTRL_PRIVDEFENA_Msk);
+
+  SCB_EnableICache();
+  SCB_EnableDCache();
+
+  // free-running cycle counter for ISR profiling
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->LAR = 0xC5ACCE55U; // unlock DWT registers on M7
+  DWT->CYCCNT = 0U;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
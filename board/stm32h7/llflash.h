@@ -7,9 +7,16 @@ void flash_unlock(void) {
   FLASH->KEYR1 = 0xCDEF89AB;
 }
 
+#define FLASH_SECTOR_CNT 8U
+
+// all sectors are 128k
+uint32_t flash_sector_address(uint8_t sector) {
+  return 0x8000000U + ((uint32_t)sector * 0x20000U);
+}
+
 bool flash_erase_sector(uint8_t sector, bool unlocked) {
   // don't erase the bootloader(sector 0)
-  if (sector != 0 && sector < 8 && unlocked) {
+  if (sector != 0 && sector < FLASH_SECTOR_CNT && unlocked) {
     FLASH->CR1 = (sector << 8) | FLASH_CR_SER;
     FLASH->CR1 |= FLASH_CR_START;
     while (FLASH->SR1 & FLASH_SR_QW);
@@ -18,10 +25,14 @@ bool flash_erase_sector(uint8_t sector, bool unlocked) {
   return false;
 }
 
-void flash_write_word(void *prog_ptr, uint32_t data) {
-  uint32_t *pp = prog_ptr;
+// a 256 bit flash word, programmed once the last of its 8 words is written
+#define FLASH_PROG_SIZE 32U
+
+void flash_write_block(uint32_t *prog_ptr, const uint32_t *data) {
   FLASH->CR1 |= FLASH_CR_PG;
-  *pp = data;
+  for (uint32_t i = 0U; i < (FLASH_PROG_SIZE / 4U); i++) {
+    prog_ptr[i] = data[i];
+  }
   while (FLASH->SR1 & FLASH_SR_QW);
 }
 
@@ -34,6 +34,7 @@ separate IRQs for RX and TX.
 #define TICK_TIMER TIM12
 
 #define MICROSECOND_TIMER TIM2
+#define MICROSECOND_TIMER_IRQ TIM2_IRQn
 
 #define INTERRUPT_TIMER_IRQ TIM6_DAC_IRQn
 #define INTERRUPT_TIMER TIM6
@@ -38,6 +38,17 @@
 #define UNUSED(x) ((void)(x))
 #endif
 
+// hot path code, copied to ITCM RAM by the startup on H7 (see .itcm_text in stm32h7x5_flash.ld)
+// calls between flash and ITCM are out of BL range, the linker inserts long branch veneers for those
+// ITCM_DATA puts CPU-only data in what's left of ITCM RAM, it isn't zeroed by the startup
+#ifdef STM32H7
+#define ITCM_FUNC __attribute__((section(".itcm_text")))
+#define ITCM_DATA __attribute__((section(".itcmram")))
+#else
+#define ITCM_FUNC
+#define ITCM_DATA
+#endif
+
 #define COMPILE_TIME_ASSERT(pred) ((void)sizeof(char[1 - (2 * (!(pred) ? 1 : 0))]))
 
 // compute the time elapsed (in microseconds) from 2 counter samples
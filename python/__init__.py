@@ -6,12 +6,17 @@ import usb1
 import struct
 import hashlib
 import binascii
+import concurrent.futures
+from collections import deque
 from functools import wraps, partial
 from itertools import accumulate
 
 from .base import BaseHandle
+from .canreader import CanReader
+from .canrx import CanRxDispatcher
 from .constants import FW_PATH, McuType
 from .dfu import PandaDFU
+from .hotplug import wait_for_usb
 from .isotp import isotp_send, isotp_recv
 from .spi import PandaSpiHandle, PandaSpiException, PandaProtocolMismatch
 from .usb import PandaUsbHandle
@@ -19,9 +24,14 @@ from .utils import logger
 
 __version__ = '0.0.10'
 
-CANPACKET_HEAD_SIZE = 0x6
+CANPACKET_HEAD_SIZE = 0xA
 DLC_TO_LEN = [0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64]
 LEN_TO_DLC = {length: dlc for (dlc, length) in enumerate(DLC_TO_LEN)}
+CAN_RECORD_FLAG = 0x1
+CAN_RECORD_HEALTH = 0
+CAN_RECORD_CAN_HEALTH = 1
+CAN_COMPRESS_LITERAL = 0x0C
+CAN_COMPRESS_RECORD = 0x0D
 PANDA_BUS_CNT = 3
 
 
@@ -46,6 +56,7 @@ def pack_can_buffer(arr):
     header[2] = (word_4b >> 8) & 0xFF
     header[3] = (word_4b >> 16) & 0xFF
     header[4] = (word_4b >> 24) & 0xFF
+    # header[6:10] is the timestamp, filled in by the panda on RX only
     header[5] = calculate_checksum(header[:5] + dat)
 
     snds[-1] += header + dat
@@ -54,10 +65,48 @@ def pack_can_buffer(arr):
 
   return snds
 
-def unpack_can_buffer(dat):
+# ISO-TP offload records, written to endpoint 2 in place of a serial port number
+ISOTP_COMMS_ID = 0xF0
+ISOTP_RECORD_SIZE = 0x40
+ISOTP_DATA_RECORD_MAX = ISOTP_RECORD_SIZE - 6
+
+def pack_isotp_open(channel, bus, tx_addr, rx_addr, ext_addr=None, block_size=0, st_min=0):
+  return struct.pack("<BBBBIIBBBB", ISOTP_COMMS_ID, 0, channel, bus, tx_addr, rx_addr,
+                     int(ext_addr is not None), ext_addr or 0, block_size, st_min)
+
+def pack_isotp_close(channel):
+  return struct.pack("<BBB", ISOTP_COMMS_ID, 3, channel)
+
+def pack_isotp_send(channel, dat):
+  # every record but the last is padded so records stay aligned to USB packets
+  records = []
+  for i in range(0, len(dat), ISOTP_DATA_RECORD_MAX):
+    chunk = dat[i:i + ISOTP_DATA_RECORD_MAX]
+    records.append((struct.pack("<BBBHB", ISOTP_COMMS_ID, 1, channel, i, len(chunk)) + chunk).ljust(ISOTP_RECORD_SIZE, b"\x00"))
+  records.append(struct.pack("<BBBH", ISOTP_COMMS_ID, 2, channel, len(dat)))
+  return b"".join(records)
+
+def unpack_can_buffer(dat, timestamps=False, record_callback=None):
+  """Returns a list of (address, data, bus) tuples and the unparsed remainder.
+  With timestamps=True, each tuple gets a fourth element: the panda's
+  microsecond timer value when the frame was received or transmitted.
+  Inline records (see Panda.set_inline_health) are passed to
+  record_callback(type, index, payload, timestamp), or dropped without one.
+  """
   ret = []
 
   while len(dat) >= CANPACKET_HEAD_SIZE:
+    if dat[0] & CAN_RECORD_FLAG:
+      record_len = CANPACKET_HEAD_SIZE + (dat[3] | dat[4] << 8)
+      if record_len > len(dat):
+        break
+      assert calculate_checksum(dat[:record_len]) == 0, "CAN record checksum incorrect"
+      if record_callback is not None:
+        timestamp = dat[9] << 24 | dat[8] << 16 | dat[7] << 8 | dat[6]
+        record_callback(dat[1], dat[2], bytes(dat[CANPACKET_HEAD_SIZE:record_len]), timestamp)
+      dat = dat[record_len:]
+      continue
+
     data_len = DLC_TO_LEN[(dat[0]>>4)]
 
     header = dat[:CANPACKET_HEAD_SIZE]
@@ -81,11 +130,136 @@ def unpack_can_buffer(dat):
     data = dat[CANPACKET_HEAD_SIZE:(CANPACKET_HEAD_SIZE+data_len)]
     dat = dat[(CANPACKET_HEAD_SIZE+data_len):]
 
-    ret.append((address, data, bus))
+    if timestamps:
+      timestamp = header[9] << 24 | header[8] << 16 | header[7] << 8 | header[6]
+      ret.append((address, data, bus, timestamp))
+    else:
+      ret.append((address, data, bus))
 
   return (ret, dat)
 
 
+class CanDecompressor:
+  """Decoder for the compressed CAN read stream (see Panda.set_can_compression).
+  Keeps the frame dictionary in step with the firmware's and holds on to a
+  partial record until the next read. decode() returns the same tuples as
+  unpack_can_buffer.
+  """
+  def __init__(self, set_bits, history):
+    self.set_bits = set_bits
+    self.history = history  # payload bytes the firmware keeps per entry
+    self.slots = [None] * (2 << set_bits)  # (bus, address, extended, start of the payload)
+    self.mru = [0] * (1 << set_bits)
+    self.last_timestamp = 0
+    self.buf = b""
+
+  def _set(self, bus, address):
+    return (((address ^ (bus << 29)) * 2654435761) & 0xFFFFFFFF) >> (32 - self.set_bits)
+
+  def decode(self, dat, timestamps=False, record_callback=None):
+    dat = self.buf + bytes(dat)
+    ret = []
+    pos = 0
+    while pos < len(dat):
+      try:
+        pos = self._decode_one(dat, pos, ret, timestamps, record_callback)
+      except IndexError:
+        # we need more from the next transfer
+        break
+    self.buf = dat[pos:]
+    return ret
+
+  def _decode_one(self, dat, pos, ret, timestamps, record_callback):
+    head = dat[pos]
+    if head == CAN_COMPRESS_RECORD:
+      record_len = CANPACKET_HEAD_SIZE + (dat[pos + 4] | dat[pos + 5] << 8)
+      record = dat[pos + 1:pos + 1 + record_len]
+      if len(record) < record_len:
+        raise IndexError
+      assert calculate_checksum(record) == 0, "CAN record checksum incorrect"
+      if record_callback is not None:
+        record_callback(record[1], record[2], record[CANPACKET_HEAD_SIZE:], int.from_bytes(record[6:10], "little"))
+      return pos + 1 + record_len
+
+    if head == CAN_COMPRESS_LITERAL:
+      data_len = DLC_TO_LEN[dat[pos + 1] >> 4]
+      pkt = dat[pos + 1:pos + 1 + CANPACKET_HEAD_SIZE + data_len]
+      if len(pkt) < CANPACKET_HEAD_SIZE + data_len:
+        raise IndexError
+      assert calculate_checksum(pkt) == 0, "CAN packet checksum incorrect"
+      bus = (pkt[0] >> 1) & 0x7
+      address = int.from_bytes(pkt[1:5], "little") >> 3
+      extended = (pkt[1] >> 2) & 0x1
+      timestamp = int.from_bytes(pkt[6:10], "little")
+      data = pkt[CANPACKET_HEAD_SIZE:]
+      returned, rejected = (pkt[1] >> 1) & 0x1, pkt[1] & 0x1
+      # replaces the least recently used way
+      set_idx = self._set(bus, address)
+      slot = set_idx * 2 + 1 - self.mru[set_idx]
+      pos += 1 + len(pkt)
+    else:
+      returned, rejected = (head >> 3) & 0x1, (head >> 2) & 0x1
+      assert not (returned and rejected), f"invalid compressed CAN header 0x{head:02x}"
+      slot = (head & 0x3) << 8 | dat[pos + 1]
+      assert self.slots[slot] is not None, "compressed CAN frame for an empty slot"
+      bus, address, extended, prev = self.slots[slot]
+      data_len = DLC_TO_LEN[head >> 4]
+      checksum = dat[pos + 2]
+      pos += 3
+
+      delta, shift = 0, 0
+      while True:
+        b = dat[pos]
+        pos += 1
+        delta |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+          break
+      timestamp = (self.last_timestamp + delta) & 0xFFFFFFFF
+
+      data = bytearray(prev[:data_len].ljust(data_len, b"\x00"))
+      i = 0
+      while i < data_len:
+        ctrl = dat[pos]
+        pos += 1
+        if ctrl >= 0x80:
+          i += ctrl - 0x7F
+        else:
+          lit = dat[pos:pos + ctrl + 1]
+          if len(lit) < ctrl + 1:
+            raise IndexError
+          assert i + len(lit) <= data_len, "compressed CAN payload too long"
+          for b in lit:
+            data[i] ^= b
+            i += 1
+          pos += ctrl + 1
+      data = bytes(data)
+
+      # checksum of the frame as the firmware had it, a dictionary out of step shows up here.
+      # the XOR of all bytes doesn't care where they are, so the header words and payload share
+      # one int, folded down to a byte
+      x = int.from_bytes(data, "little") ^ (address << 3 | extended << 2 | returned << 1 | rejected) ^ timestamp ^ \
+          (head & 0xF0 | bus << 1) ^ checksum
+      if x >> 64:
+        x ^= x >> 256
+        x ^= x >> 128
+        x ^= x >> 64
+      x ^= x >> 32
+      x ^= x >> 16
+      x ^= x >> 8
+      assert (x & 0xFF) == 0, "CAN packet checksum incorrect"
+
+    self.slots[slot] = (bus, address, extended, data[:self.history])
+    self.mru[slot // 2] = slot % 2
+    self.last_timestamp = timestamp
+    if returned:
+      bus += 128
+    if rejected:
+      bus += 192
+    ret.append((address, data, bus, timestamp) if timestamps else (address, data, bus))
+    return pos
+
+
 def ensure_version(desc, lib_field, panda_field, fn):
   @wraps(fn)
   def wrapper(self, *args, **kwargs):
@@ -160,11 +334,14 @@ class Panda:
   HW_TYPE_TRES = b'\x09'
   HW_TYPE_CUATRO = b'\x0a'
 
-  CAN_PACKET_VERSION = 4
+  FLASH_CHUNK_SIZE = 0x4000
+
+  CAN_PACKET_VERSION = 5
   HEALTH_PACKET_VERSION = 16
-  CAN_HEALTH_PACKET_VERSION = 5
+  CAN_HEALTH_PACKET_VERSION = 6
   HEALTH_STRUCT = struct.Struct("<IIIIIIIIBBBBBHBBBHfBBHBHHB")
-  CAN_HEALTH_STRUCT = struct.Struct("<BIBBBBBBBBIIIIIIIHHBBBIIII")
+  CAN_HEALTH_STRUCT = struct.Struct("<BIBBBBBBBBIIIIIIIHHBBBIIIIHH")
+  INTERRUPT_STATS_STRUCT = struct.Struct("<III8I")
 
   F4_DEVICES = [HW_TYPE_WHITE_PANDA, HW_TYPE_GREY_PANDA, HW_TYPE_BLACK_PANDA, HW_TYPE_UNO, HW_TYPE_DOS]
   H7_DEVICES = [HW_TYPE_RED_PANDA, HW_TYPE_RED_PANDA_V2, HW_TYPE_TRES, HW_TYPE_CUATRO]
@@ -231,6 +408,16 @@ class Panda:
     self._handle_open = False
     self.can_rx_overflow_buffer = b''
     self._can_speed_kbps = can_speed_kbps
+    self._inline_health_period_ms = 0
+    self._inline_health_callback = None
+    self._can_compression = False
+    self._can_decompressor = None
+    self._can_tx_credits = False
+    self._tx_credits = None
+    # shared by UDS and ISO-TP clients, see CanRxDispatcher
+    self.can_rx_dispatcher = CanRxDispatcher(self.can_recv)
+    self._can_reader: CanReader | None = None
+    self._can_reader_cursor = None
 
     if cli and serial is None:
         self._connect_serial = self._cli_select_panda()
@@ -241,17 +428,17 @@ class Panda:
     self.connect(claim)
 
   def _cli_select_panda(self):
-    dfu_pandas = PandaDFU.list()
-    if len(dfu_pandas) > 0:
-      print("INFO: some attached pandas are in DFU mode.")
+    with concurrent.futures.ThreadPoolExecutor(1) as ex:
+      dfu_pandas = ex.submit(PandaDFU.list)
+      pandas = self.list()
+      if len(dfu_pandas.result()) > 0:
+        print("INFO: some attached pandas are in DFU mode.")
 
-    pandas = self.list()
     if len(pandas) == 0:
       print("INFO: panda not available")
       return None
     if len(pandas) == 1:
       print(f"INFO: connecting to panda {pandas[0]}")
-      time.sleep(1)
       return pandas[0]
     while True:
       print("Multiple pandas available:")
@@ -271,23 +458,33 @@ class Panda:
     self.close()
 
   def close(self):
+    self.stop_can_reader()
     if self._handle_open:
       self._handle.close()
       self._handle_open = False
       if self._context is not None:
         self._context.close()
 
-  def connect(self, claim=True, wait=False):
+  def connect(self, claim=True, wait=False, timeout=None):
     self.close()
 
-    self._handle = None
-    while self._handle is None:
+    def try_connect():
       # try USB first, then SPI
-      self._context, self._handle, serial, self.bootstub, bcd = self.usb_connect(self._connect_serial, claim=claim, no_error=wait)
-      if self._handle is None:
-        self._context, self._handle, serial, self.bootstub, bcd = self.spi_connect(self._connect_serial)
-      if not wait:
-        break
+      ret = self.usb_connect(self._connect_serial, claim=claim, no_error=wait)
+      if ret[1] is None:
+        ret = self.spi_connect(self._connect_serial)
+      return ret
+
+    # a panda that was on USB comes back on USB, don't keep polling SPI for it
+    usb_only = isinstance(getattr(self, "_handle", None), PandaUsbHandle)
+    conn = try_connect()
+    if conn[1] is None and wait:
+      def check():
+        nonlocal conn
+        conn = try_connect()
+        return conn[1] is not None
+      wait_for_usb(check, (0xbbaa, ), timeout, poll_s=0.01, usb_only=usb_only)
+    self._context, self._handle, serial, self.bootstub, bcd = conn
 
     if self._handle is None:
       raise Exception("failed to connect to panda")
@@ -312,21 +509,35 @@ class Panda:
     self._serial = serial
     self._connect_serial = serial
     self._handle_open = True
-    self._mcu_type = self.get_mcu_type()
-    self.health_version, self.can_version, self.can_health_version = self.get_packets_versions()
+    self._mcu_type = self.get_mcu_type(ret)
+
+    # the rest of the setup goes out as one batch, which saves a round trip per request over SPI
+    reqs = self._connect_requests()
+    resps = self._handle.controlBatch(reqs)
+    self.health_version, self.can_version, self.can_health_version = self._unpack_packets_versions(resps[0])
+    if self._can_tx_credits:
+      self._set_tx_credits(resps[[r[1] for r in reqs].index(0xd9)])
+    if self._can_compression:
+      self._set_can_decompressor(resps[[r[1] for r in reqs].index(0xd7)])
     logger.debug("connected")
 
+  def _connect_requests(self):
+    # packet versions first
+    reqs = [(Panda.REQUEST_IN, 0xdd, 0, 0, 3)]
     # disable openpilot's heartbeat checks
     if self._disable_checks:
-      self.set_heartbeat_disabled()
-      self.set_power_save(0)
-
-    # reset comms
-    self.can_reset_communications()
-
-    # set CAN speed
-    for bus in range(PANDA_BUS_CNT):
-      self.set_can_speed_kbps(bus, self._can_speed_kbps)
+      reqs += [(Panda.REQUEST_OUT, 0xf8, 0, 0, 0), (Panda.REQUEST_OUT, 0xe7, 0, 0, 0)]
+    # reset comms and set CAN speed
+    reqs.append((Panda.REQUEST_OUT, 0xc0, 0, 0, 0))
+    reqs += [(Panda.REQUEST_OUT, 0xde, bus, int(self._can_speed_kbps * 10), 0) for bus in range(PANDA_BUS_CNT)]
+    # the comms reset turns TX credits, inline health and compression off
+    if self._can_tx_credits:
+      reqs.append((Panda.REQUEST_IN, 0xd9, 1, 0, 2 * PANDA_BUS_CNT))
+    if self._inline_health_period_ms:
+      reqs.append((Panda.REQUEST_IN, 0xda, self._inline_health_period_ms, 0, 1))
+    if self._can_compression:
+      reqs.append((Panda.REQUEST_IN, 0xd7, 1, 0, 2))
+    return reqs
 
   @property
   def spi(self) -> bool:
@@ -351,6 +562,8 @@ class Panda:
           raise PandaSpiException("invalid bootstub status")
         bootstub = pid == 0xee
         spi_version = dat[14]
+        if len(dat) >= 17:
+          handle.set_max_data_len(struct.unpack("<H", dat[15:17])[0])
       except PandaSpiException:
         # fallback, we'll raise a protocol mismatch below
         dat = handle.controlRead(Panda.REQUEST_IN, 0xc3, 0, 0, 12, timeout=100)
@@ -483,18 +696,16 @@ class Panda:
     if self._handle_open:
       self.close()
 
-    success = False
-    # wait up to 15 seconds
-    for _ in range(15*10):
+    # wait up to 15 seconds, connecting as soon as the panda enumerates
+    deadline = time.monotonic() + 15
+    while True:
       try:
-        self.connect(claim=False, wait=True)
-        success = True
-        break
+        self.connect(claim=False, wait=True, timeout=max(deadline - time.monotonic(), 0))
+        return
       except Exception:
-        pass
-      time.sleep(0.1)
-    if not success:
-      raise Exception("reconnect failed")
+        if time.monotonic() > deadline:
+          raise Exception("reconnect failed") from None
+      time.sleep(0.01)
 
   @staticmethod
   def flasher_present(handle: BaseHandle) -> bool:
@@ -518,16 +729,36 @@ class Panda:
     logger.warning("flash: unlocking")
     handle.controlWrite(Panda.REQUEST_IN, 0xb1, 0, 0, b'')
 
+    # newer bootstubs hash their sectors, the ones that already match the image are left alone
+    sectors = list(range(1, last_sector + 1))
+    hashes = handle.controlBatch([(Panda.REQUEST_IN, 0xb4, i, 0, 0x40) for i in sectors])
+    delta = all(len(h) == hashlib.sha1().digest_size for h in hashes)
+    if delta:
+      sectors = [i for i, h in zip(sectors, hashes, strict=True) if h != Panda._sector_hash(code, mcu_type, i)]
+
     # erase sectors
-    logger.warning(f"flash: erasing sectors 1 - {last_sector}")
-    for i in range(1, last_sector + 1):
+    logger.warning(f"flash: erasing sectors {sectors}")
+    for i in sectors:
       handle.controlWrite(Panda.REQUEST_IN, 0xb2, i, 0, b'')
 
-    # flash over EP2
-    STEP = 0x10
+    # flash over EP2, the bootstub programs while the next chunk comes in
     logger.warning("flash: flashing")
-    for i in range(0, len(code), STEP):
-      handle.bulkWrite(2, code[i:i + STEP])
+    for i in sectors:
+      start = sum(mcu_type.config.sector_sizes[1:i])
+      end = min(start + mcu_type.config.sector_sizes[i], len(code))
+      # old bootstubs write everything in one go, from the start of the app
+      if delta and (i - 1) not in sectors:
+        handle.controlWrite(Panda.REQUEST_IN, 0xb5, i, 0, b'')
+      for j in range(start, end, Panda.FLASH_CHUNK_SIZE):
+        handle.bulkWrite(2, code[j:min(j + Panda.FLASH_CHUNK_SIZE, end)])
+
+    # verify on the panda. old bootstubs answer with the flasher status instead of a hash
+    logger.warning("flash: verifying")
+    digest = handle.controlRead(Panda.REQUEST_IN, 0xb3, len(code) & 0xFFFF, len(code) >> 16, 0x40)
+    if len(digest) == hashlib.sha1().digest_size:
+      assert bytes(digest) == hashlib.sha1(code).digest(), "flash: verify failed"
+    else:
+      logger.warning("flash: bootstub can't verify, skipping")
 
     # reset
     logger.warning("flash: resetting")
@@ -536,6 +767,13 @@ class Panda:
     except Exception:
       pass
 
+  @staticmethod
+  def _sector_hash(code, mcu_type, sector):
+    # what the sector holds once the image is flashed, the rest of it stays erased
+    start = sum(mcu_type.config.sector_sizes[1:sector])
+    size = mcu_type.config.sector_sizes[sector]
+    return hashlib.sha1(code[start:start + size].ljust(size, b"\xff")).digest()
+
   def flash(self, fn=None, code=None, reconnect=True):
     if self.up_to_date(fn=fn):
       logger.debug("flash: already up to date")
@@ -583,27 +821,19 @@ class Panda:
 
   @staticmethod
   def wait_for_dfu(dfu_serial: str | None, timeout: int | None = None) -> bool:
-    t_start = time.monotonic()
-    dfu_list = PandaDFU.list()
-    while (dfu_serial is None and len(dfu_list) == 0) or (dfu_serial is not None and dfu_serial not in dfu_list):
-      logger.debug("waiting for DFU...")
-      time.sleep(0.1)
-      if timeout is not None and (time.monotonic() - t_start) > timeout:
-        return False
+    def check():
       dfu_list = PandaDFU.list()
-    return True
+      logger.debug("waiting for DFU...")
+      return (dfu_serial is None and len(dfu_list) > 0) or dfu_serial in dfu_list
+    return wait_for_usb(check, (0x0483, ), timeout)
 
   @staticmethod
   def wait_for_panda(serial: str | None, timeout: int) -> bool:
-    t_start = time.monotonic()
-    serials = Panda.list()
-    while (serial is None and len(serials) == 0) or (serial is not None and serial not in serials):
-      logger.debug("waiting for panda...")
-      time.sleep(0.1)
-      if timeout is not None and (time.monotonic() - t_start) > timeout:
-        return False
+    def check():
       serials = Panda.list()
-    return True
+      logger.debug("waiting for panda...")
+      return (serial is None and len(serials) > 0) or serial in serials
+    return wait_for_usb(check, (0xbbaa, ), timeout)
 
   def up_to_date(self, fn=None) -> bool:
     current = self.get_signature()
@@ -620,7 +850,11 @@ class Panda:
   @ensure_health_packet_version
   def health(self):
     dat = self._handle.controlRead(Panda.REQUEST_IN, 0xd2, 0, 0, self.HEALTH_STRUCT.size)
-    a = self.HEALTH_STRUCT.unpack(dat)
+    return self._parse_health(dat)
+
+  @classmethod
+  def _parse_health(cls, dat):
+    a = cls.HEALTH_STRUCT.unpack(dat)
     return {
       "uptime": a[0],
       "voltage": a[1],
@@ -652,6 +886,11 @@ class Panda:
 
   @ensure_can_health_packet_version
   def can_health(self, can_number):
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc2, int(can_number), 0, self.CAN_HEALTH_STRUCT.size)
+    return self._parse_can_health(dat)
+
+  @classmethod
+  def _parse_can_health(cls, dat):
     LEC_ERROR_CODE = {
       0: "No error",
       1: "Stuff error",
@@ -662,8 +901,7 @@ class Panda:
       6: "CRCError",
       7: "NoChange",
     }
-    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc2, int(can_number), 0, self.CAN_HEALTH_STRUCT.size)
-    a = self.CAN_HEALTH_STRUCT.unpack(dat)
+    a = cls.CAN_HEALTH_STRUCT.unpack(dat)
     return {
       "bus_off": a[0],
       "bus_off_cnt": a[1],
@@ -691,8 +929,34 @@ class Panda:
       "irq1_call_rate": a[23],
       "irq2_call_rate": a[24],
       "can_core_reset_count": a[25],
+      "bus_load_1s": a[26] / 100.,
+      "bus_load_10s": a[27] / 100.,
     }
 
+  @ensure_health_packet_version
+  @ensure_can_health_packet_version
+  def set_inline_health(self, period_ms, callback=None):
+    """Have the firmware put health and CAN health records into the CAN read
+    stream every period_ms, instead of polling health() and can_health().
+    The period is rounded up to the firmware's 8Hz tick, 0 turns them off.
+    can_recv() passes them to callback(bus, health), where bus is None for
+    health() and the CAN bus for can_health(). Returns False on firmware
+    without support.
+    """
+    ret = self._handle.controlRead(Panda.REQUEST_IN, 0xda, int(period_ms), 0, 1)
+    supported = ret is not None and len(ret) == 1
+    self._inline_health_period_ms = int(period_ms) if supported else 0
+    self._inline_health_callback = callback
+    return supported
+
+  def _on_can_record(self, record_type, index, payload, timestamp):
+    if self._inline_health_callback is None:
+      return
+    if record_type == CAN_RECORD_HEALTH:
+      self._inline_health_callback(None, self._parse_health(payload))
+    elif record_type == CAN_RECORD_CAN_HEALTH:
+      self._inline_health_callback(index, self._parse_can_health(payload))
+
   # ******************* control *******************
 
   def get_version(self):
@@ -709,8 +973,8 @@ class Panda:
     part_2 = self._handle.controlRead(Panda.REQUEST_IN, 0xd4, 0, 0, 0x40)
     return bytes(part_1 + part_2)
 
-  def get_type(self):
-    ret = self._handle.controlRead(Panda.REQUEST_IN, 0xc1, 0, 0, 0x40)
+  def get_type(self, resp=None):
+    ret = resp if resp is not None else self._handle.controlRead(Panda.REQUEST_IN, 0xc1, 0, 0, 0x40)
 
     # old bootstubs don't implement this endpoint, see comment in Panda.device
     if self._bcd_hw_type is not None and (ret is None or len(ret) != 1):
@@ -720,15 +984,18 @@ class Panda:
 
   # Returns tuple with health packet version and CAN packet/USB packet version
   def get_packets_versions(self):
-    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xdd, 0, 0, 3)
+    return self._unpack_packets_versions(self._handle.controlRead(Panda.REQUEST_IN, 0xdd, 0, 0, 3))
+
+  @staticmethod
+  def _unpack_packets_versions(dat):
     if dat and len(dat) == 3:
       a = struct.unpack("BBB", dat)
       return (a[0], a[1], a[2])
     else:
       return (0, 0, 0)
 
-  def get_mcu_type(self) -> McuType:
-    hw_type = self.get_type()
+  def get_mcu_type(self, hw_type_resp=None) -> McuType:
+    hw_type = self.get_type(hw_type_resp)
     if hw_type in Panda.F4_DEVICES:
       return McuType.F4
     elif hw_type in Panda.H7_DEVICES:
@@ -779,13 +1046,33 @@ class Panda:
     dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc4, int(irqnum), 0, 4)
     return struct.unpack("I", dat)[0]
 
+  def get_interrupt_stats(self, irqnum):
+    """
+      Returns call rate and handler timing for an IRQ. Times are in microseconds,
+      duration_hist[i] counts handler runs shorter than 4^i us, the last bucket
+      counts everything from 4.096ms up
+    """
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc4, int(irqnum), 1, self.INTERRUPT_STATS_STRUCT.size)
+    a = self.INTERRUPT_STATS_STRUCT.unpack(dat)
+    return {
+      "call_rate": a[0],
+      "busy_time": a[1],
+      "load": a[1] / 1e6,
+      "max_duration": a[2],
+      "duration_hist": list(a[3:]),
+    }
+
   # ******************* configuration *******************
 
   def set_power_save(self, power_save_enabled=0):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xe7, int(power_save_enabled), 0, b'')
 
-  def set_safety_mode(self, mode=SAFETY_SILENT, param=0):
-    self._handle.controlWrite(Panda.REQUEST_OUT, 0xdc, mode, param, b'')
+  def set_safety_mode(self, mode=SAFETY_SILENT, param=0, alternative_experience=None):
+    reqs = [(Panda.REQUEST_OUT, 0xdc, mode, param, 0)]
+    # alternative experience can only be changed outside of car safety modes, so it goes first
+    if alternative_experience is not None:
+      reqs.insert(0, (Panda.REQUEST_OUT, 0xdf, int(alternative_experience), 0, 0))
+    self._handle.controlBatch(reqs)
 
   def set_obd(self, obd):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xdb, int(obd), 0, b'')
@@ -824,11 +1111,65 @@ class Panda:
   # Timeout is in ms. If set to 0, the timeout is infinite.
   CAN_SEND_TIMEOUT_MS = 10
 
+  # With set_can_tx_credits, the panda hands out credits for the free TX slots of each
+  # bus instead. Frames for buses without credit wait in can_send_many, which checks
+  # for new credits this often until they're out or the timeout is up.
+  CAN_TX_CREDIT_POLL_S = 0.001
+
   def can_reset_communications(self):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xc0, 0, 0, b'')
+    if self._can_tx_credits:
+      self.set_can_tx_credits(True)
+    if self._can_compression:
+      self.set_can_compression(True)
+
+  def set_can_tx_credits(self, enabled):
+    """Credit based TX flow control: can_send_many sends each bus as many frames
+    as the panda has room for, and waits for credits for the rest, so a stalled
+    bus no longer holds back the others. It's kept across reconnects. Returns
+    False on firmware without support.
+    """
+    ret = self._handle.controlRead(Panda.REQUEST_IN, 0xd9, int(enabled), 0, 2 * PANDA_BUS_CNT)
+    self._can_tx_credits = enabled
+    self._set_tx_credits(ret)
+    return self._unpack_tx_credits(ret) is not None
+
+  def _set_tx_credits(self, resp):
+    credits = self._unpack_tx_credits(resp)
+    self._can_tx_credits = self._can_tx_credits and credits is not None
+    self._tx_credits = credits if self._can_tx_credits else None
+
+  def set_can_compression(self, enabled):
+    """Have the firmware compress the CAN read stream, for links that can't keep
+    up with busy buses, like USB full-speed. Frames are encoded against the last
+    one with the same address, which mostly leaves the counters and changed
+    signals. It's kept across reconnects, set it before reading: a partial frame
+    and data already prefetched for the host are dropped. Returns False on
+    firmware without support.
+    """
+    ret = self._handle.controlRead(Panda.REQUEST_IN, 0xd7, int(enabled), 0, 2)
+    self._can_compression = enabled
+    self._set_can_decompressor(ret)
+    return ret is not None and len(ret) == 2
+
+  def _set_can_decompressor(self, resp):
+    supported = resp is not None and len(resp) == 2
+    self._can_compression = self._can_compression and supported
+    self._can_decompressor = CanDecompressor(resp[0], resp[1]) if self._can_compression else None
+    self.can_rx_overflow_buffer = b''
 
-  @ensure_can_packet_version
-  def can_send_many(self, arr, timeout=CAN_SEND_TIMEOUT_MS):
+  @staticmethod
+  def _unpack_tx_credits(dat):
+    if dat is None or len(dat) != 2 * PANDA_BUS_CNT:
+      return None
+    return list(struct.unpack(f"<{PANDA_BUS_CNT}H", dat))
+
+  def _update_tx_credits(self):
+    credits = self._unpack_tx_credits(self._handle.controlRead(Panda.REQUEST_IN, 0xd9, 1, 0, 2 * PANDA_BUS_CNT))
+    if credits is not None:
+      self._tx_credits = credits
+
+  def _can_write(self, arr, timeout):
     snds = pack_can_buffer(arr)
     while True:
       try:
@@ -843,22 +1184,182 @@ class Panda:
       except (usb1.USBErrorIO, usb1.USBErrorOverflow):
         logger.error("CAN: BAD SEND MANY, RETRYING")
 
+  @ensure_can_packet_version
+  def can_send_many(self, arr, timeout=CAN_SEND_TIMEOUT_MS):
+    if self._tx_credits is None:
+      self._can_write(arr, timeout)
+      return
+
+    tx, waiting = self._can_tx_split(arr)
+    deadline = None if timeout == 0 else time.monotonic() + timeout * 1e-3
+    while True:
+      if self._can_tx_credits_short(waiting):
+        self._update_tx_credits()
+      tx += self._can_tx_take(waiting)
+
+      if len(tx) > 0:
+        self._can_write(tx, timeout)
+        tx = []
+        # SPI write ACKs carry the credits left after the write
+        if self.spi:
+          credits = self._unpack_tx_credits(self._handle.bulk_write_response)
+          if credits is not None:
+            self._tx_credits = credits
+
+      if not any(waiting):
+        return
+      self._can_tx_check_timeout(waiting, deadline)
+      time.sleep(self.CAN_TX_CREDIT_POLL_S)
+
+  @staticmethod
+  def _can_tx_split(arr):
+    # frames for the CAN buses wait for credits, the rest goes out directly
+    tx = []
+    waiting = [deque() for _ in range(PANDA_BUS_CNT)]
+    for msg in arr:
+      if 0 <= msg[2] < PANDA_BUS_CNT:
+        waiting[msg[2]].append(msg)
+      else:
+        tx.append(msg)
+    return tx, waiting
+
+  def _can_tx_credits_short(self, waiting):
+    # our credits only ever run low, since the panda keeps sending. refresh them when they're short
+    return any(len(q) > c for q, c in zip(waiting, self._tx_credits, strict=True))
+
+  def _can_tx_take(self, waiting):
+    tx = []
+    for bus, q in enumerate(waiting):
+      n = min(len(q), self._tx_credits[bus])
+      tx += [q.popleft() for _ in range(n)]
+      self._tx_credits[bus] -= n
+    return tx
+
+  @staticmethod
+  def _can_tx_check_timeout(waiting, deadline):
+    if deadline is not None and time.monotonic() >= deadline:
+      unsent = [len(q) for q in waiting]
+      logger.error(f"CAN: no TX credits, dropping {unsent} frames per bus")
+      raise usb1.USBErrorTimeout()
+
   def can_send(self, addr, dat, bus, timeout=CAN_SEND_TIMEOUT_MS):
     self.can_send_many([[addr, dat, bus]], timeout=timeout)
 
   @ensure_can_packet_version
-  def can_recv(self):
+  def can_recv(self, timestamps=False):
+    if self._can_reader is not None:
+      return self._can_reader_cursor.read(timestamps=timestamps)
+    return self._can_recv_device(timestamps)
+
+  def start_can_reader(self, capacity=1 << 16, health_period_s=1.):
+    """Starts a thread that keeps reading CAN frames from the panda into a ring
+    of capacity frames, see CanReader. Consumers get their own cursor with
+    reader.cursor(), can_recv() then reads from one of its own.
+    """
+    if self._can_reader is None:
+      self._can_reader = CanReader(self, capacity, health_period_s)
+      self._can_reader_cursor = self._can_reader.cursor()
+      self._can_reader.start()
+    return self._can_reader
+
+  def stop_can_reader(self):
+    if self._can_reader is not None:
+      self._can_reader.stop()
+      self._can_reader = None
+      self._can_reader_cursor = None
+
+  @ensure_can_packet_version
+  def _can_recv_device(self, timestamps=False):
     dat = bytearray()
+    retries = self._handle.retry_count if self.spi else 0
+    lost = False
     while True:
       try:
         dat = self._handle.bulkRead(1, 16384) # Max receive batch size + 2 extra reserve frames
         break
       except (usb1.USBErrorIO, usb1.USBErrorOverflow):
         logger.error("CAN: BAD RECV, RETRYING")
+        lost = True
         time.sleep(0.1)
-    msgs, self.can_rx_overflow_buffer = unpack_can_buffer(self.can_rx_overflow_buffer + dat)
+    if self.spi and self._handle.retry_count != retries:
+      lost = True
+
+    if lost and self._can_decompressor is not None:
+      # the failed read may have carried frames that changed the firmware's dictionary,
+      # so don't decode on. Start over with empty dictionaries instead
+      logger.error("CAN: lost compressed data, renegotiating")
+      self.set_can_compression(True)
+      return []
+    return self._parse_can_recv(dat, timestamps)
+
+  def _parse_can_recv(self, dat, timestamps):
+    if self._can_decompressor is not None:
+      try:
+        return self._can_decompressor.decode(dat, timestamps, self._on_can_record)
+      except AssertionError:
+        # out of step with the firmware, start over and let the caller know frames were lost
+        self.set_can_compression(True)
+        raise
+    msgs, self.can_rx_overflow_buffer = unpack_can_buffer(self.can_rx_overflow_buffer + dat, timestamps, self._on_can_record)
     return msgs
 
+  # RX delivery policies, applied per (bus, addr) in firmware before frames are queued for the host
+  CAN_RX_FILTER_ALL = 0         # deliver every frame, removes the policy
+  CAN_RX_FILTER_DROP = 1        # never deliver
+  CAN_RX_FILTER_ON_CHANGE = 2   # deliver on payload change, plus a keyframe every interval_ms (0 = never)
+  CAN_RX_FILTER_RATE_LIMIT = 3  # deliver at most once every interval_ms
+
+  def set_can_rx_filter(self, bus, addr, mode, interval_ms=0):
+    """Sets the delivery policy for frames received on bus with address addr.
+    Safety and forwarding still see every frame. Policies are cleared by a comms
+    reset, so they last until the next connect.
+
+    Returns False if the firmware policy table is full.
+    """
+    assert 0 <= interval_ms <= 0xFFFF
+    self._select_can_addr(bus, addr)
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xe9, int(mode), int(interval_ms), 1)
+    return dat[0] == 1
+
+  def clear_can_rx_filters(self):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xea, 0, 0, b'')
+
+  def set_can_periodic(self, bus, addr, period_ms, phase_ms=0, counter=None, checksum=None):
+    """Registers a frame that the firmware sends every period_ms, starting after phase_ms.
+    Frames sent with can_send for this bus and addr then only update the payload.
+    They have to come at least once every 10 periods, or the firmware stops sending
+    the frame until the next update. Every send goes through the safety mode, and
+    all periodic frames are removed when the safety mode changes. A period of 0
+    removes the frame.
+
+    counter and checksum are optional (start_bit, length) fields that the firmware
+    fills on every send, little endian with bit 0 being the LSB of the first byte.
+    The checksum comes from the active safety mode.
+
+    Returns False if the firmware table is full or a field is invalid.
+    """
+    assert 0 <= period_ms <= 0xFFFF and 0 <= phase_ms <= 0xFFFF
+    self._select_can_addr(bus, addr)
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xeb, int(period_ms), int(phase_ms), 1)
+    ok = dat[0] == 1
+    if ok and period_ms > 0:
+      def encode(field):
+        if field is None:
+          return 0
+        start, length = field
+        assert 0 <= start < 512 and 0 <= length < 32
+        return start | (length << 9)
+      dat = self._handle.controlRead(Panda.REQUEST_IN, 0xec, encode(counter), encode(checksum), 1)
+      ok = dat[0] == 1
+    return ok
+
+  def clear_can_periodic(self):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xed, 0, 0, b'')
+
+  def _select_can_addr(self, bus, addr):
+    assert 0 <= bus < 4 and 0 <= addr < (1 << 29)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe8, addr & 0xFFFF, ((addr >> 16) & 0x1FFF) | (bus << 13), b'')
+
   def can_clear(self, bus):
     """Clears all messages from the specified internal CAN ringbuffer as
     though it were drained.
@@ -878,6 +1379,64 @@ class Panda:
   def isotp_recv(self, addr, bus=0, sendaddr=None, subaddr=None):
     return isotp_recv(self, addr, bus, sendaddr, subaddr)
 
+  # firmware ISO-TP channels, segmentation and flow control are done on the panda
+  ISOTP_CHANNEL_CNT = 4
+  ISOTP_MAX_LEN = 4095
+  ISOTP_STATUS_STRUCT = struct.Struct("<BBBH")
+  ISOTP_TX_IDLE, ISOTP_TX_WAIT_FC, ISOTP_TX_SENDING, ISOTP_TX_DONE, ISOTP_TX_ERROR = range(5)
+  ISOTP_RX_IDLE, ISOTP_RX_RECEIVING, ISOTP_RX_DONE = range(3)
+  ISOTP_ERRORS = {
+    1: "timeout waiting for flow control",
+    2: "timeout waiting for consecutive frame",
+    3: "receiver aborted with overflow",
+    4: "consecutive frame out of sequence",
+    5: "response received before the previous one was read",
+    6: "frame blocked by safety mode",
+    7: "sent before the previous PDU finished sending",
+    8: "command rejected, channel not open or bad arguments",
+  }
+
+  def isotp_channel_open(self, channel, bus, tx_addr, rx_addr, ext_addr=None, block_size=0, separation_time=0):
+    """Opens a firmware ISO-TP channel. Frames on bus with rx_addr (and ext_addr, if set)
+    are then handled by the firmware and no longer returned by can_recv.
+    block_size and separation_time (raw STmin byte) are sent in our flow control frames.
+    Channels are closed when the safety mode changes.
+    """
+    assert 0 <= channel < self.ISOTP_CHANNEL_CNT
+    self._handle.bulkWrite(2, pack_isotp_open(channel, bus, tx_addr, rx_addr, ext_addr, block_size, separation_time))
+
+  def isotp_channel_close(self, channel):
+    self._handle.bulkWrite(2, pack_isotp_close(channel))
+
+  def isotp_channel_status(self, channel):
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xee, int(channel), 0, self.ISOTP_STATUS_STRUCT.size)
+    a = self.ISOTP_STATUS_STRUCT.unpack(dat)
+    return {"tx_state": a[0], "rx_state": a[1], "error": a[2], "rx_len": a[3]}
+
+  def isotp_channel_send(self, channel, dat):
+    """Hands a whole PDU to the firmware, which sends it in the background.
+    Rejected if the previous PDU on the channel is still being sent, the
+    error is raised by the next isotp_channel_recv."""
+    assert 0 < len(dat) <= self.ISOTP_MAX_LEN
+    self._handle.bulkWrite(2, pack_isotp_send(channel, dat))
+
+  def isotp_channel_recv(self, channel, timeout=1.):
+    """Waits for a whole PDU on the channel. Returns None on timeout and
+    raises if the firmware reports a TX or RX error."""
+    end = time.monotonic() + timeout
+    while True:
+      status = self.isotp_channel_status(channel)
+      if status["error"] != 0:
+        raise RuntimeError(f"ISO-TP channel {channel}: {self.ISOTP_ERRORS.get(status['error'], status['error'])}")
+      if status["rx_len"] > 0:
+        dat = b""
+        for offset in range(0, status["rx_len"], 0x80):
+          dat += bytes(self._handle.controlRead(Panda.REQUEST_IN, 0xef, int(channel), offset, min(0x80, status["rx_len"] - offset)))
+        return dat
+      if time.monotonic() > end:
+        return None
+      time.sleep(0.001)
+
   # ******************* serial *******************
 
   def serial_read(self, port_number):
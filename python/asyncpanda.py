@@ -0,0 +1,318 @@
+import asyncio
+import select
+import threading
+import time
+from collections import deque
+
+import usb1
+
+from . import Panda, pack_can_buffer, ensure_can_packet_version
+from .base import TIMEOUT
+from .usb import PandaUsbHandle
+
+
+class AsyncPanda:
+  """
+    asyncio client for a panda on USB. A few bulk IN transfers are always queued
+    with libusb's async API, so the panda has somewhere to put frames while the
+    host is busy with the last batch, and CAN writes are pipelined the same way.
+    Wraps a connected Panda, which can still be used for everything else.
+
+      async with AsyncPanda(Panda()) as p:
+        await p.can_send_many(msgs)
+        async for address, dat, bus in p:
+          ...
+  """
+  READ_SIZE = 16384
+  WRITE_SIZE = 16384
+  IDLE_RESUBMIT_S = 0.001  # empty reads are resubmitted after this, instead of spinning
+  CAN_PACKET_VERSION = Panda.CAN_PACKET_VERSION
+
+  def __init__(self, panda: Panda, read_depth: int = 4, write_depth: int = 4, max_pending: int = 64):
+    assert isinstance(panda._handle, PandaUsbHandle), "AsyncPanda needs a panda on USB"
+    self.panda = panda
+    self.can_version = panda.can_version
+    self._context = panda._context
+    self._usb = panda._handle._libusb_handle
+    self._read_depth = read_depth
+    self._write_depth = write_depth
+    self._max_pending = max_pending
+
+    self._loop: asyncio.AbstractEventLoop | None = None
+    self._rx: deque[bytes] = deque()  # completed reads, not parsed yet
+    self._rx_event: asyncio.Event | None = None
+    self._read_transfers: list = []
+    self._reads_queued = 0
+    self._parked: list = []  # reads held back until the consumer catches up
+    self._idle_handles: dict = {}  # empty reads waiting to be resubmitted
+    self._write_transfers: set = set()
+    self._write_slots: asyncio.Semaphore | None = None
+    self._credit_lock: asyncio.Lock | None = None
+    self._error: Exception | None = None
+    self._closing = False
+
+    self._poll_fds: set[int] = set()
+    self._timeout_handle: asyncio.TimerHandle | None = None
+    self._event_thread: threading.Thread | None = None
+
+    # times all reads were completed and none were queued, the panda had nowhere to send
+    self.read_gaps = 0
+
+  async def __aenter__(self):
+    await self.start()
+    return self
+
+  async def __aexit__(self, *args):
+    await self.close()
+
+  def __aiter__(self):
+    return self.can_frames()
+
+  async def start(self):
+    self._loop = asyncio.get_running_loop()
+    self._rx_event = asyncio.Event()
+    self._write_slots = asyncio.Semaphore(self._write_depth)
+    self._credit_lock = asyncio.Lock()
+    self._start_events()
+
+    for _ in range(self._read_depth):
+      t = self._usb.getTransfer()
+      t.setBulk(usb1.ENDPOINT_IN | 1, self.READ_SIZE, callback=self._on_read, timeout=0)
+      self._read_transfers.append(t)
+      self._submit_read(t)
+
+  async def close(self):
+    self._closing = True
+    for h in self._idle_handles.values():
+      h.cancel()
+    self._idle_handles.clear()
+    for t in self._read_transfers + list(self._write_transfers):
+      if t.isSubmitted():
+        try:
+          t.cancel()
+        except usb1.USBErrorNotFound:
+          pass
+
+    # let libusb deliver the cancellations
+    for _ in range(1000):
+      if not any(t.isSubmitted() for t in self._read_transfers + list(self._write_transfers)):
+        break
+      await asyncio.sleep(0.001)
+
+    self._stop_events()
+    for t in self._read_transfers:
+      t.close()
+    self._read_transfers.clear()
+
+  # ******************* libusb events *******************
+
+  def _start_events(self):
+    try:
+      fds = self._context.getPollFDList()
+    except NotImplementedError:
+      # no poll fds on this platform (Windows), libusb's events get their own thread
+      self._event_thread = threading.Thread(target=self._event_thread_fn, daemon=True)
+      self._event_thread.start()
+      return
+
+    self._context.setPollFDNotifiers(self._on_fd_added, self._on_fd_removed)
+    for fd, events in fds:
+      self._add_fd(fd, events)
+    self._schedule_timeout()
+
+  def _stop_events(self):
+    if self._event_thread is not None:
+      self._event_thread.join()
+      self._event_thread = None
+      return
+
+    self._context.setPollFDNotifiers(None, None)
+    for fd in list(self._poll_fds):
+      self._remove_fd(fd)
+    if self._timeout_handle is not None:
+      self._timeout_handle.cancel()
+      self._timeout_handle = None
+
+  def _event_thread_fn(self):
+    while not self._closing or any(t.isSubmitted() for t in self._read_transfers):
+      self._context.handleEventsTimeout(0.1)
+
+  # libusb can call these from any thread that handles events
+  def _on_fd_added(self, fd, events, user_data=None):
+    self._loop.call_soon_threadsafe(self._add_fd, fd, events)
+
+  def _on_fd_removed(self, fd, user_data=None):
+    self._loop.call_soon_threadsafe(self._remove_fd, fd)
+
+  def _add_fd(self, fd, events):
+    if events & select.POLLIN:
+      self._loop.add_reader(fd, self._handle_events)
+    if events & select.POLLOUT:
+      self._loop.add_writer(fd, self._handle_events)
+    self._poll_fds.add(fd)
+
+  def _remove_fd(self, fd):
+    if fd in self._poll_fds:
+      self._loop.remove_reader(fd)
+      self._loop.remove_writer(fd)
+      self._poll_fds.discard(fd)
+
+  def _handle_events(self):
+    self._context.handleEventsTimeout(0)
+    self._schedule_timeout()
+
+  def _schedule_timeout(self):
+    if self._timeout_handle is not None:
+      self._timeout_handle.cancel()
+      self._timeout_handle = None
+    timeout = self._context.getNextTimeout()
+    if timeout is not None:
+      self._timeout_handle = self._loop.call_later(timeout, self._handle_events)
+
+  # ******************* reads *******************
+
+  def _submit_read(self, t):
+    if self._closing:
+      return
+    try:
+      t.submit()
+      self._reads_queued += 1
+    except usb1.USBError as e:
+      self._fail(e)
+
+  def _on_read(self, t):
+    # copied here, the buffer is reused once the transfer is resubmitted
+    status = t.getStatus()
+    dat = bytes(t.getBuffer()[:t.getActualLength()]) if status == usb1.TRANSFER_COMPLETED else b""
+    self._loop.call_soon_threadsafe(self._read_done, t, status, dat)
+
+  def _read_done(self, t, status, dat):
+    self._reads_queued -= 1
+    if self._closing:
+      return
+    if status != usb1.TRANSFER_COMPLETED:
+      self._fail(usb1.USBError(f"bulk read failed with status {status}"))
+      return
+
+    if len(dat) > 0 and self._reads_queued == 0:
+      self.read_gaps += 1
+
+    if len(dat) == 0:
+      self._idle_handles[t] = self._loop.call_later(self.IDLE_RESUBMIT_S, self._idle_resubmit, t)
+    else:
+      self._rx.append(dat)
+      self._rx_event.set()
+      if len(self._rx) < self._max_pending:
+        self._submit_read(t)
+      else:
+        self._parked.append(t)
+
+  def _idle_resubmit(self, t):
+    del self._idle_handles[t]
+    self._submit_read(t)
+
+  def _fail(self, e):
+    self._error = e
+    self._rx_event.set()
+
+  @ensure_can_packet_version
+  async def can_recv(self, timestamps=False):
+    """Waits for data from the panda, then returns all the frames received since the last call."""
+    while len(self._rx) == 0:
+      if self._error is not None:
+        raise self._error
+      self._rx_event.clear()
+      await self._rx_event.wait()
+
+    dat = b"".join(self._rx)
+    self._rx.clear()
+    for t in self._parked:
+      self._submit_read(t)
+    self._parked.clear()
+    return self.panda._parse_can_recv(dat, timestamps)
+
+  async def can_frames(self, timestamps=False):
+    """Async iterator over the received frames."""
+    while True:
+      for msg in await self.can_recv(timestamps):
+        yield msg
+
+  # ******************* writes *******************
+
+  def _on_write(self, t):
+    self._loop.call_soon_threadsafe(self._write_done, t, t.getUserData(), t.getStatus())
+
+  def _write_done(self, t, fut, status):
+    self._write_slots.release()
+    self._write_transfers.discard(t)
+    t.close()
+    if fut.done():
+      return
+    if status == usb1.TRANSFER_COMPLETED:
+      fut.set_result(None)
+    else:
+      fut.set_exception(usb1.USBError(f"bulk write failed with status {status}"))
+
+  @ensure_can_packet_version
+  async def can_send_many(self, arr, timeout=TIMEOUT):
+    """
+      Writes the frames with up to write_depth transfers in flight, shared by all callers.
+      Returns once they're out, other calls can queue more in the meantime. With TX
+      credits, frames for a bus without credit wait here for up to timeout ms.
+    """
+    p = self.panda
+    futs = []
+    async with self._credit_lock:
+      if p._tx_credits is None:
+        tx, waiting = list(arr), []
+      else:
+        tx, waiting = p._can_tx_split(arr)
+      deadline = None if timeout == 0 else time.monotonic() + timeout * 1e-3
+      while True:
+        if len(waiting) and p._can_tx_credits_short(waiting):
+          # credits read while our writes are in flight would count those slots twice
+          while len(self._write_transfers):
+            await asyncio.sleep(p.CAN_TX_CREDIT_POLL_S)
+          await self._loop.run_in_executor(None, p._update_tx_credits)
+        if len(waiting):
+          tx += p._can_tx_take(waiting)
+        futs += await self._submit_writes(tx, timeout)
+        tx = []
+
+        if not any(waiting):
+          break
+        if deadline is not None and time.monotonic() >= deadline:
+          # let the writes that did go out finish first
+          await asyncio.gather(*futs, return_exceptions=True)
+          p._can_tx_check_timeout(waiting, deadline)
+        await asyncio.sleep(p.CAN_TX_CREDIT_POLL_S)
+
+    await asyncio.gather(*futs)
+
+  async def _submit_writes(self, tx, timeout):
+    # transfers end on frame boundaries, so writes from different calls don't interleave mid-frame
+    transfers = [b""]
+    for chunk in pack_can_buffer(tx):
+      if len(transfers[-1]) + len(chunk) > self.WRITE_SIZE:
+        transfers.append(b"")
+      transfers[-1] += chunk
+
+    futs = []
+    for dat in transfers:
+      if len(dat) == 0:
+        continue
+      await self._write_slots.acquire()
+      fut = self._loop.create_future()
+      t = self._usb.getTransfer()
+      t.setBulk(usb1.ENDPOINT_OUT | 3, dat, callback=self._on_write, user_data=fut, timeout=timeout)
+      try:
+        t.submit()
+      except usb1.USBError:
+        self._write_slots.release()
+        raise
+      self._write_transfers.add(t)
+      futs.append(fut)
+    return futs
+
+  async def can_send(self, addr, dat, bus, timeout=TIMEOUT):
+    await self.can_send_many([[addr, dat, bus]], timeout=timeout)
@@ -30,6 +30,20 @@ class BaseHandle(ABC):
   def bulkRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
     ...
 
+  def controlBatch(self, requests, timeout: int = TIMEOUT) -> list[bytes]:
+    """
+      Runs a list of (request_type, request, value, index, length) control requests,
+      reads for a non-zero length and writes otherwise. Returns the responses in order.
+    """
+    ret = []
+    for request_type, request, value, index, length in requests:
+      if length > 0:
+        ret.append(bytes(self.controlRead(request_type, request, value, index, length, timeout)))
+      else:
+        self.controlWrite(request_type, request, value, index, b'', timeout)
+        ret.append(b'')
+    return ret
+
 
 class BaseSTBootloaderHandle(ABC):
   """
@@ -56,6 +70,11 @@ class BaseSTBootloaderHandle(ABC):
   def erase_sector(self, sector: int) -> None:
     ...
 
+  def erase_sectors(self, sectors: list[int]) -> None:
+    """Erases the sectors, in as few bootloader commands as the handle can."""
+    for sector in sectors:
+      self.erase_sector(sector)
+
   @abstractmethod
   def jump(self, address: int) -> None:
     ...
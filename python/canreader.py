@@ -0,0 +1,178 @@
+import array
+import threading
+import time
+
+from .utils import logger
+
+MAX_DATA_LEN = 64
+
+
+class CanCursor:
+  """A consumer's position in a CanReader. Cursors read independently, a slow one
+  only loses its own frames when the reader laps it, counted in dropped."""
+  def __init__(self, reader: "CanReader", position: int):
+    self._reader = reader
+    self.position = position
+    self.dropped = 0
+
+  def pending(self) -> int:
+    return self._reader._head - self.position
+
+  def wait(self, timeout: float | None = None) -> bool:
+    """Waits for frames that haven't been read, returns False on timeout."""
+    return self._reader._wait(self, timeout)
+
+  def read(self, max_frames: int | None = None, timestamps: bool = False) -> list[tuple]:
+    """Returns the frames since the last read, like Panda.can_recv."""
+    return self._reader._read(self, max_frames, timestamps)
+
+  def close(self) -> None:
+    self._reader._cursors.discard(self)
+
+
+class CanReader:
+  """
+    Background thread that drains the panda's CAN read stream into a ring of
+    capacity preallocated records, so a GC pause or a slow consumer doesn't let
+    the firmware's RX queue overflow. Consumers read through their own CanCursor.
+
+    There's one writer. It claims the slots for a batch, fills them, then
+    publishes the new head. Readers copy without a lock and then drop whatever
+    the writer may have claimed in the meantime, so no lock is held while frames
+    are decoded or copied.
+
+    Firmware RX overflows are read from health() every health_period_s, and
+    reported as a delta since the reader started.
+  """
+  def __init__(self, panda, capacity: int = 1 << 16, health_period_s: float | None = 1.):
+    self._panda = panda
+    self.capacity = capacity
+    self.health_period_s = health_period_s
+
+    self._addr = array.array("I", bytes(4 * capacity))
+    self._bus = array.array("B", bytes(capacity))
+    self._len = array.array("B", bytes(capacity))
+    self._ts = array.array("I", bytes(4 * capacity))
+    self._data = bytearray(MAX_DATA_LEN * capacity)
+
+    self._head = 0   # published, every frame before it is complete
+    self._claim = 0  # being written up to here
+    self._cond = threading.Condition()
+    self._cursors: set[CanCursor] = set()
+
+    self.reads = 0
+    self.max_batch = 0
+    self.fw_rx_overflow = 0
+    self._fw_rx_overflow_start: int | None = None
+    self._next_health = 0.
+
+    self._running = False
+    self._thread: threading.Thread | None = None
+
+  def cursor(self, from_oldest: bool = False) -> CanCursor:
+    """A new cursor at the newest frame, or at the oldest one still held."""
+    c = CanCursor(self, max(self._head - self.capacity, 0) if from_oldest else self._head)
+    self._cursors.add(c)
+    return c
+
+  def start(self) -> None:
+    assert self._thread is None
+    self._running = True
+    self._thread = threading.Thread(target=self._run, daemon=True)
+    self._thread.start()
+
+  def stop(self) -> None:
+    self._running = False
+    if self._thread is not None:
+      self._thread.join()
+      self._thread = None
+
+  @property
+  def frames(self) -> int:
+    return self._head
+
+  @property
+  def host_dropped(self) -> int:
+    return sum(c.dropped for c in list(self._cursors))
+
+  def stats(self) -> dict:
+    return {
+      "frames": self._head,
+      "reads": self.reads,
+      "max_batch": self.max_batch,
+      "host_dropped": self.host_dropped,
+      "fw_rx_overflow": self.fw_rx_overflow,
+    }
+
+  def _run(self) -> None:
+    while self._running:
+      try:
+        msgs = self._panda._can_recv_device(timestamps=True)
+      except Exception:
+        logger.exception("CAN reader: read failed")
+        time.sleep(0.1)
+        continue
+      self.reads += 1
+      if len(msgs):
+        self._push(msgs)
+      self._check_health()
+
+  def _push(self, msgs: list[tuple]) -> None:
+    n = len(msgs)
+    self.max_batch = max(self.max_batch, n)
+    head = self._head
+    self._claim = head + n
+    cap = self.capacity
+    # only the last capacity frames of a huge batch would survive anyway
+    for i in range(max(n - cap, 0), n):
+      addr, dat, bus, ts = msgs[i]
+      slot = (head + i) % cap
+      self._addr[slot] = addr
+      self._bus[slot] = bus
+      self._ts[slot] = ts
+      self._len[slot] = len(dat)
+      self._data[slot * MAX_DATA_LEN:slot * MAX_DATA_LEN + len(dat)] = dat
+    self._head = head + n
+    with self._cond:
+      self._cond.notify_all()
+
+  def _check_health(self) -> None:
+    if self.health_period_s is None or time.monotonic() < self._next_health:
+      return
+    self._next_health = time.monotonic() + self.health_period_s
+    try:
+      overflow = self._panda.health()["rx_buffer_overflow"]
+    except Exception:
+      logger.exception("CAN reader: health failed")
+      return
+    if self._fw_rx_overflow_start is None:
+      self._fw_rx_overflow_start = overflow
+    self.fw_rx_overflow = overflow - self._fw_rx_overflow_start
+
+  def _wait(self, cursor: CanCursor, timeout: float | None) -> bool:
+    with self._cond:
+      return self._cond.wait_for(lambda: self._head > cursor.position or not self._running, timeout) and self._head > cursor.position
+
+  def _read(self, cursor: CanCursor, max_frames: int | None, timestamps: bool) -> list[tuple]:
+    head = self._head
+    start = max(cursor.position, head - self.capacity)
+    end = head if max_frames is None else min(head, start + max_frames)
+
+    cap = self.capacity
+    ret = []
+    for i in range(start, end):
+      slot = i % cap
+      dat = bytes(self._data[slot * MAX_DATA_LEN:slot * MAX_DATA_LEN + self._len[slot]])
+      if timestamps:
+        ret.append((self._addr[slot], dat, self._bus[slot], self._ts[slot]))
+      else:
+        ret.append((self._addr[slot], dat, self._bus[slot]))
+
+    # frames the writer has claimed since may have been overwritten while copying
+    valid = self._claim - cap
+    if valid > start:
+      ret = ret[valid - start:]
+      start = valid
+    cursor.dropped += start - cursor.position
+    cursor.position = max(end, start)
+    return ret
@@ -0,0 +1,92 @@
+import threading
+import weakref
+from collections import deque
+from collections.abc import Callable, Iterable
+
+
+class CanRxDispatcher:
+  """
+    Routes received CAN frames to per (bus, addr) queues, so several clients can
+    share one panda. Each can_recv batch is read once and every frame is looked up
+    by its (bus, addr) instead of being filtered by every client. The last frames
+    nobody was subscribed to are kept for shared queues, like the legacy isotp
+    helpers expect. Queues that are no longer referenced are dropped.
+
+      q = panda.can_rx_dispatcher.subscribe(0, [0x7E8])
+      panda.can_rx_dispatcher.poll()
+      for addr, dat in q:
+        ...
+
+    Frames read by calling can_recv directly bypass the dispatcher. Clients on
+    different threads can share it, reads and route changes hold lock. A client
+    that sorts its queue from more than one thread can hold lock around poll()
+    and draining the queue, to keep the frames in order.
+  """
+  QUEUE_LEN = 1024  # per subscription, the oldest frames are dropped past this
+  UNROUTED_LEN = 256
+  FULL_BATCH = 254  # a batch this long may have left frames on the panda
+
+  def __init__(self, can_recv: Callable[[], list[tuple[int, bytes, int]]]):
+    self._can_recv = can_recv
+    self._routes: dict[tuple[int, int], list[weakref.ref]] = {}
+    self._shared: dict[tuple[int, int], deque] = {}
+    self._unrouted: deque = deque(maxlen=self.UNROUTED_LEN)
+    self.lock = threading.RLock()
+
+  def subscribe(self, bus: int, addrs: Iterable[int], maxlen: int = QUEUE_LEN) -> deque:
+    """Returns a new queue of (addr, data) for frames on bus with any of addrs.
+    Every subscription gets its own copy of a frame."""
+    q: deque = deque(maxlen=maxlen)
+    self.route(q, bus, addrs)
+    return q
+
+  def route(self, q: deque, bus: int, addrs: Iterable[int]) -> None:
+    with self.lock:
+      for addr in addrs:
+        self._routes.setdefault((bus, addr), []).append(weakref.ref(q))
+
+  def unsubscribe(self, q: deque | None, bus: int | None = None, addrs: Iterable[int] | None = None) -> None:
+    """Stops routing to q, for the given addrs on bus, or everywhere."""
+    with self.lock:
+      keys = list(self._routes) if addrs is None else [(bus, addr) for addr in addrs]
+      for key in keys:
+        if bus is not None and key[0] != bus:
+          continue
+        refs = [r for r in self._routes.get(key, []) if r() is not q]
+        if refs:
+          self._routes[key] = refs
+        else:
+          self._routes.pop(key, None)
+
+  def shared(self, bus: int, addr: int) -> deque:
+    """A queue for (bus, addr) that stays subscribed and is shared by every caller,
+    for consumers that compete for the same frames."""
+    key = (bus, addr)
+    with self.lock:
+      if key not in self._shared:
+        q = self.subscribe(bus, [addr])
+        q.extend((a, bytes(d)) for a, d, b in self._unrouted if (b, a) == key)
+        self._unrouted = deque((m for m in self._unrouted if (m[2], m[0]) != key), maxlen=self.UNROUTED_LEN)
+        self._shared[key] = q
+      return self._shared[key]
+
+  def poll(self) -> int:
+    """Reads until the panda has nothing left, returns the number of frames routed."""
+    routed = 0
+    with self.lock:
+      while True:
+        msgs = self._can_recv()
+        for addr, dat, bus in msgs or []:
+          refs = self._routes.get((bus, addr))
+          if refs is None:
+            self._unrouted.append((addr, dat, bus))
+          else:
+            dat = bytes(dat)
+            qs = [q for q in (r() for r in refs) if q is not None]
+            if len(qs) < len(refs):
+              self.unsubscribe(None, bus, [addr])  # drops the dead references
+            for q in qs:
+              q.append((addr, dat))
+            routed += 1
+        if len(msgs or []) < self.FULL_BATCH:
+          return routed
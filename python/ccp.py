@@ -1,10 +1,14 @@
-import sys
 import time
+import array
 import struct
+import threading
+from collections import deque
 from enum import IntEnum, Enum
 from dataclasses import dataclass
 from typing import Optional
 
+from .canrx import CanRxDispatcher
+
 @dataclass
 class ExchangeStationIdsReturn:
   id_length: int
@@ -103,15 +107,43 @@ class CommandResponseError(Exception):
     return self.message
 
 class CcpClient():
-  def __init__(self, panda, tx_addr: int, rx_addr: int, bus: int=0, byte_order: BYTE_ORDER=BYTE_ORDER.BIG_ENDIAN, debug=False):
+  DTO_QUEUE_LEN = 4096
+
+  def __init__(self, panda, tx_addr: int, rx_addr: int, bus: int=0, byte_order: BYTE_ORDER=BYTE_ORDER.BIG_ENDIAN, debug=False,
+               daq_rx_addr: int | None = None):
     self.tx_addr = tx_addr
     self.rx_addr = rx_addr
+    self.daq_rx_addr = daq_rx_addr if daq_rx_addr is not None else rx_addr
     self.can_bus = bus
     self.byte_order = byte_order
     self.debug = debug
     self._panda = panda
     self._command_counter = -1
 
+    # CRMs and DAQ DTOs are told apart by their PID, DTOs are kept for CcpDaqSession
+    dispatcher = getattr(panda, "can_rx_dispatcher", None)
+    self._dispatcher = dispatcher if dispatcher is not None else CanRxDispatcher(panda.can_recv)
+    self._rx_queue = self._dispatcher.subscribe(bus, {self.rx_addr, self.daq_rx_addr})
+    self._crm: deque[bytes] = deque()
+    self._dto: deque[tuple[float, bytes]] = deque(maxlen=self.DTO_QUEUE_LEN)
+    self._timed_out = False
+
+  def _rx(self) -> bool:
+    # the DAQ session's thread calls this too, the dispatcher's lock keeps the frames in order
+    with self._dispatcher.lock:
+      self._dispatcher.poll()
+      t = time.monotonic()
+      received = len(self._rx_queue) > 0
+      while self._rx_queue:
+        rx_addr, rx_data = self._rx_queue.popleft()
+        if self.debug:
+          print(f"CAN-RX: {hex(rx_addr)} - 0x{bytes.hex(rx_data)}")
+        if rx_addr == self.rx_addr and rx_data[0] >= 0xFE:
+          self._crm.append(rx_data)
+        elif rx_addr == self.daq_rx_addr and rx_data[0] < 0xFE:
+          self._dto.append((t, rx_data))
+    return received
+
   def _send_cro(self, cmd: int, dat: bytes = b"") -> None:
     self._command_counter = (self._command_counter + 1) & 0xFF
     tx_data = (bytes([cmd, self._command_counter]) + dat).ljust(8, b"\x00")
@@ -119,46 +151,42 @@ class CcpClient():
       print(f"CAN-TX: {hex(self.tx_addr)} - 0x{bytes.hex(tx_data)}")
     assert len(tx_data) == 8, "data is not 8 bytes"
     self._panda.can_clear(self.can_bus)
-    self._panda.can_clear(0xFFFF)
+    # drop stale responses, DTOs are kept. a late response can only be on the panda after a timeout
+    if self._timed_out:
+      self._rx()
+      self._timed_out = False
+    self._crm.clear()
     self._panda.can_send(self.tx_addr, tx_data, self.can_bus)
 
   def _recv_dto(self, timeout: float) -> bytes:
     start_time = time.time()
     while time.time() - start_time < timeout:
-      msgs = self._panda.can_recv() or []
-      if len(msgs) >= 256:
-        print("CAN RX buffer overflow!!!", file=sys.stderr)
-      for rx_addr, rx_data_bytearray, rx_bus in msgs:
-        if rx_bus == self.can_bus and rx_addr == self.rx_addr:
-          rx_data = bytes(rx_data_bytearray)
+      while self._crm:
+        rx_data = bytes(self._crm.popleft())
+        assert len(rx_data) == 8, f"message length not 8: {len(rx_data)}"
+        pid = rx_data[0]
+        err = rx_data[1]
+        err_desc = COMMAND_RETURN_CODES.get(err, "unknown error")
+        ctr = rx_data[2]
+        dat = rx_data[3:]
+
+        if pid == 0xFF and self._command_counter != ctr:
+          raise CommandCounterError(f"counter invalid: {ctr} != {self._command_counter}")
+
+        if err >= 0x10 and err <= 0x12:
           if self.debug:
-            print(f"CAN-RX: {hex(rx_addr)} - 0x{bytes.hex(rx_data)}")
-          assert len(rx_data) == 8, f"message length not 8: {len(rx_data)}"
-
-          pid = rx_data[0]
-          if pid == 0xFF or pid == 0xFE:
-            err = rx_data[1]
-            err_desc = COMMAND_RETURN_CODES.get(err, "unknown error")
-            ctr = rx_data[2]
-            dat = rx_data[3:]
-
-            if pid == 0xFF and self._command_counter != ctr:
-              raise CommandCounterError(f"counter invalid: {ctr} != {self._command_counter}")
+            print(f"CCP-WAIT: {hex(err)} - {err_desc}")
+          start_time = time.time()
+          continue
 
-            if err >= 0x10 and err <= 0x12:
-              if self.debug:
-                print(f"CCP-WAIT: {hex(err)} - {err_desc}")
-              start_time = time.time()
-              continue
+        if err >= 0x30:
+          raise CommandResponseError(f"{hex(err)} - {err_desc}", err)
 
-            if err >= 0x30:
-              raise CommandResponseError(f"{hex(err)} - {err_desc}", err)
-          else:
-            dat = rx_data[1:]
-
-          return dat
-      time.sleep(0.001)
+        return dat
+      if not self._rx():
+        time.sleep(0.001)
 
+    self._timed_out = True
     raise CommandTimeoutError("timeout waiting for response")
 
   # commands
@@ -372,3 +400,147 @@ class CcpClient():
     self._send_cro(COMMAND_CODE.GET_CCP_VERSION, bytes([major, minor]))
     resp = self._recv_dto(0.025)
     return float(f"{resp[0]}.{resp[1]}")
+
+
+@dataclass
+class DaqSignal:
+  name: str
+  addr: int
+  size: int  # 1, 2 or 4 bytes
+  signed: bool = False
+  is_float: bool = False
+  addr_ext: int = 0
+  scale: float = 1.
+  offset: float = 0.
+
+
+class CcpDaqSession():
+  """
+    Samples signals with a CCP DAQ list. The signals are packed into ODTs, and a
+    background thread decodes the DTOs into a timestamp array and one value array
+    per signal, scaled. Timestamps are the host's time.monotonic() when the last
+    ODT of a sample was read. Gaps in the PID sequence are counted in odts_lost,
+    and the samples they belong to are dropped.
+
+      with CcpDaqSession(client, [DaqSignal("rpm", 0x1000, 2)], event_channel=1) as daq:
+        time.sleep(1)
+        t, values = daq.read()
+  """
+  ODT_SIZE = 7
+  SIZE_CODES = {1: "b", 2: "h", 4: "i"}
+
+  def __init__(self, client: CcpClient, signals: list[DaqSignal], list_num: int = 0, event_channel: int = 0,
+               prescaler: int = 1, can_id: int = 0):
+    self.client = client
+    self.signals = signals
+    self.list_num = list_num
+    self.event_channel = event_channel
+    self.prescaler = prescaler
+    self.can_id = can_id
+
+    self.odts: list[list[DaqSignal]] = [[]]
+    for sig in signals:
+      if sig.size not in self.SIZE_CODES or (sig.is_float and sig.size != 4):
+        raise ValueError(f"invalid size for {sig.name}: {sig.size}")
+      if sum(s.size for s in self.odts[-1]) + sig.size > self.ODT_SIZE:
+        self.odts.append([])
+      self.odts[-1].append(sig)
+    self._structs = [struct.Struct(client.byte_order.value + "".join(self._code(s) for s in odt) + f"{self.ODT_SIZE - sum(s.size for s in odt)}x")
+                     for odt in self.odts]
+
+    self.first_pid = 0
+    self.odts_lost = 0
+    self.samples_dropped = 0
+    self._lock = threading.Lock()
+    self._stop = threading.Event()
+    self._thread: threading.Thread | None = None
+    self._reset_buffers()
+
+  def _code(self, sig: DaqSignal) -> str:
+    code = "f" if sig.is_float else self.SIZE_CODES[sig.size]
+    return code if sig.signed or sig.is_float else code.upper()
+
+  def _reset_buffers(self) -> None:
+    self._t = array.array("d")
+    self._values = {s.name: array.array("d") for s in self.signals}
+    self._sample: list[int | float] | None = None
+    self._next_odt = 0
+
+  def __enter__(self):
+    self.configure()
+    self.start()
+    return self
+
+  def __exit__(self, *args):
+    self.stop()
+
+  def configure(self) -> None:
+    size = self.client.get_daq_list_size(self.list_num, self.can_id)
+    if len(self.odts) > size.list_size:
+      raise ValueError(f"{len(self.odts)} ODTs needed, DAQ list {self.list_num} has {size.list_size}")
+    self.first_pid = size.first_pid
+    for i, odt in enumerate(self.odts):
+      for j, sig in enumerate(odt):
+        self.client.set_daq_list_pointer(self.list_num, i, j)
+        self.client.write_daq_list_entry(sig.size, sig.addr_ext, sig.addr)
+
+  def start(self) -> None:
+    with self._lock:
+      self._reset_buffers()
+    self.client._dto.clear()
+    self.client.start_stop_transmission(1, self.list_num, len(self.odts) - 1, self.event_channel, self.prescaler)
+    self._stop.clear()
+    self._thread = threading.Thread(target=self._run, daemon=True)
+    self._thread.start()
+
+  def stop(self) -> None:
+    try:
+      self.client.start_stop_transmission(0, self.list_num, len(self.odts) - 1, self.event_channel, self.prescaler)
+    finally:
+      self._stop.set()
+      if self._thread is not None:
+        self._thread.join()
+        self._thread = None
+
+  def read(self) -> tuple[array.array, dict[str, array.array]]:
+    """Returns the samples decoded since the last read."""
+    with self._lock:
+      ret = self._t, self._values
+      self._t = array.array("d")
+      self._values = {s.name: array.array("d") for s in self.signals}
+    return ret
+
+  def _run(self) -> None:
+    while not self._stop.is_set():
+      if not self.client._rx() and not self.client._dto:
+        time.sleep(0.001)
+      with self._lock:
+        while self.client._dto:
+          self._decode(*self.client._dto.popleft())
+
+  def _decode(self, t: float, dat: bytes) -> None:
+    odt = dat[0] - self.first_pid
+    n = len(self.odts)
+    if not 0 <= odt < n:
+      return  # another DAQ list
+
+    if odt != self._next_odt:
+      self.odts_lost += (odt - self._next_odt) % n
+      if self._sample is not None and odt == 0:
+        self.samples_dropped += 1
+      self._sample = None
+    self._next_odt = (odt + 1) % n
+
+    if odt == 0:
+      self._sample = []
+    if self._sample is None:
+      if odt == n - 1:
+        self.samples_dropped += 1
+      return
+    self._sample += self._structs[odt].unpack(dat[1:1 + self.ODT_SIZE].ljust(self.ODT_SIZE, b"\x00"))
+
+    if odt == n - 1:
+      self._t.append(t)
+      for sig, v in zip(self.signals, self._sample, strict=True):
+        self._values[sig.name].append(v * sig.scale + sig.offset)
+      self._sample = None
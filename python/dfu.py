@@ -1,4 +1,5 @@
 import os
+import time
 import usb1
 import struct
 import binascii
@@ -7,6 +8,7 @@ from .base import BaseSTBootloaderHandle
 from .spi import STBootloaderSPIHandle, PandaSpiException
 from .usb import STBootloaderUSBHandle
 from .constants import FW_PATH, McuType
+from .utils import logger
 
 
 class PandaDFU:
@@ -112,14 +114,22 @@ class PandaDFU:
   def reset(self):
     self._handle.jump(self._mcu_type.config.bootstub_address)
 
-  def program_bootstub(self, code_bootstub):
+  def program_bootstub(self, code_bootstub) -> dict[str, float]:
+    """Programs the bootstub, returns the time each phase took in seconds."""
+    times = {}
+    t = time.monotonic()
     self._handle.clear_status()
+    times["clear"], t = time.monotonic() - t, time.monotonic()
 
     # erase all sectors
-    for i in range(len(self._mcu_type.config.sector_sizes)):
-      self._handle.erase_sector(i)
+    self._handle.erase_sectors(list(range(len(self._mcu_type.config.sector_sizes))))
+    times["erase"], t = time.monotonic() - t, time.monotonic()
 
     self._handle.program(self._mcu_type.config.bootstub_address, code_bootstub)
+    times["program"] = time.monotonic() - t
+
+    logger.info("DFU: " + ", ".join(f"{k} {v:.2f}s" for k, v in times.items()))
+    return times
 
   def recover(self):
     fn = os.path.join(FW_PATH, self._mcu_type.config.bootstub_fn)
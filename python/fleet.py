@@ -0,0 +1,169 @@
+import concurrent.futures
+import threading
+import time
+from collections.abc import Callable
+from typing import Any, NamedTuple
+
+from . import Panda, PandaDFU
+from .utils import logger
+
+
+class FleetDevices(NamedTuple):
+  pandas: list[str]
+  dfu: list[str]
+
+
+def discover() -> FleetDevices:
+  """Lists USB and SPI pandas, and the ones in DFU, all at once instead of one after the other."""
+  with concurrent.futures.ThreadPoolExecutor(4) as ex:
+    futs = [ex.submit(f) for f in (Panda.usb_list, Panda.spi_list, PandaDFU.usb_list, PandaDFU.spi_list)]
+    usb, spi, dfu_usb, dfu_spi = (f.result() for f in futs)
+  return FleetDevices(sorted(set(usb + spi)), sorted(set(dfu_usb + dfu_spi)))
+
+
+def _log_progress(serial: str, stage: str) -> None:
+  logger.info(f"{serial}: {stage}")
+
+
+class PandaFleet:
+  """
+    A set of pandas that are connected, configured, flashed and recovered in
+    parallel, one worker per device. Per device work returns a dict of
+    serial -> result, with the exception in place of the result when that
+    device failed, so one bad panda doesn't stop the others.
+
+      with PandaFleet() as fleet:
+        fleet.flash()
+        fleet.map(lambda p: p.set_safety_mode(Panda.SAFETY_ALLOUTPUT))
+
+    progress(serial, stage) is called from the workers as each device moves on.
+  """
+  def __init__(self, serials: list[str] | None = None, claim: bool = True, max_workers: int | None = None,
+               progress: Callable[[str, str], None] | None = _log_progress):
+    self.progress = progress
+    self.max_workers = max_workers
+    self.pandas: dict[str, Panda] = {}
+    self.errors: dict[str, Exception] = {}
+    self.dfu: list[str] = []
+    self._lock = threading.Lock()
+
+    if serials is None:
+      devices = discover()
+      serials, self.dfu = devices.pandas, devices.dfu
+      if len(self.dfu):
+        logger.warning(f"fleet: pandas in DFU mode, recover() brings them back: {self.dfu}")
+
+    for serial, ret in self._run(serials, lambda s: self._connect(s, claim)).items():
+      if isinstance(ret, Exception):
+        self.errors[serial] = ret
+      else:
+        self.pandas[serial] = ret
+
+  def __enter__(self):
+    return self
+
+  def __exit__(self, *args):
+    self.close()
+
+  def __len__(self):
+    return len(self.pandas)
+
+  def __iter__(self):
+    return iter(self.pandas.values())
+
+  @property
+  def serials(self) -> list[str]:
+    return sorted(self.pandas)
+
+  def close(self) -> None:
+    for p in self.pandas.values():
+      p.close()
+
+  def _stage(self, serial: str, stage: str) -> None:
+    if self.progress is not None:
+      with self._lock:
+        self.progress(serial, stage)
+
+  def _run(self, serials: list[str], fn: Callable[[str], Any]) -> dict[str, Any]:
+    def work(serial):
+      t = time.monotonic()
+      try:
+        ret = fn(serial)
+      except Exception as e:
+        logger.exception(f"fleet: {serial} failed")
+        self._stage(serial, f"failed: {e}")
+        return e
+      self._stage(serial, f"done in {time.monotonic() - t:.1f}s")
+      return ret
+
+    if len(serials) == 0:
+      return {}
+    with concurrent.futures.ThreadPoolExecutor(self.max_workers or len(serials)) as ex:
+      return dict(zip(serials, ex.map(work, serials), strict=True))
+
+  def _connect(self, serial: str, claim: bool) -> Panda:
+    self._stage(serial, "connecting")
+    return Panda(serial, claim=claim, cli=False)
+
+  def map(self, fn: Callable[[Panda], Any], serials: list[str] | None = None) -> dict[str, Any]:
+    """Calls fn(panda) on every panda at once."""
+    return self._run(self.serials if serials is None else serials, lambda s: fn(self.pandas[s]))
+
+  def reset(self, **kwargs) -> dict[str, Any]:
+    return self.map(lambda p: p.reset(**kwargs))
+
+  def flash(self, fn: str | None = None, code: bytes | None = None) -> dict[str, Any]:
+    return self._run(self.serials, lambda s: self._flash(s, fn, code))
+
+  def _flash(self, serial: str, fn: str | None, code: bytes | None) -> None:
+    p = self.pandas[serial]
+    if not p.bootstub and p.up_to_date(fn=fn):
+      self._stage(serial, "up to date")
+      return
+    self._stage(serial, "flashing")
+    p.flash(fn=fn, code=code, reconnect=False)
+    self._stage(serial, "reconnecting")
+    p.reconnect()
+
+  def recover(self, timeout: int | None = 60) -> dict[str, Any]:
+    """Reprograms the bootstub over DFU and then flashes the app. Pandas found
+    already in DFU are recovered too, and join the fleet once they're back."""
+    def recover(serial):
+      p = self.pandas[serial]
+      dfu_serial = p.get_dfu_serial()
+      self._stage(serial, "entering DFU")
+      p.reset(enter_bootstub=True)
+      p.reset(enter_bootloader=True)
+      if not Panda.wait_for_dfu(dfu_serial, timeout=timeout):
+        raise Exception("failed to enter DFU")
+      self._recover_dfu(serial, dfu_serial)
+      p.connect(True, True)
+      self._stage(serial, "flashing")
+      p.flash()
+
+    ret = self._run(self.serials, recover)
+    if len(self.dfu):
+      known = set(self.pandas) | set(self.errors)
+      dfu_ret = self._run(self.dfu, lambda s: self._recover_dfu(s, s))
+      ret.update(dfu_ret)
+      self.dfu = []
+      expected = sum(not isinstance(r, Exception) for r in dfu_ret.values())
+
+      # they come back in the bootstub with a serial we haven't seen
+      new: list[str] = []
+      t_start = time.monotonic()
+      while len(new) < expected and (timeout is None or time.monotonic() - t_start < timeout):
+        time.sleep(0.1)
+        new = [s for s in discover().pandas if s not in known]
+      for serial, r in self._run(new, lambda s: self._connect(s, True)).items():
+        if isinstance(r, Exception):
+          self.errors[serial] = r
+        else:
+          self.pandas[serial] = r
+      ret.update(self._run([s for s in new if s in self.pandas], lambda s: self._flash(s, None, None)))
+    return ret
+
+  def _recover_dfu(self, serial: str, dfu_serial: str) -> None:
+    self._stage(serial, "recovering")
+    with PandaDFU(dfu_serial) as dfu:
+      dfu.recover()
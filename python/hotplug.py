@@ -0,0 +1,54 @@
+import time
+from collections.abc import Callable, Iterable
+
+import usb1
+
+# turned off to compare against polling, see tests/benchmark.py
+ENABLED = True
+# after a device arrives it can take a moment before it opens, retry quickly until then
+SETTLE_S = 0.5
+SETTLE_POLL_S = 0.01
+# with hotplug, USB-only waits still check this often in case an event was missed
+RECHECK_S = 1.
+
+
+def wait_for_usb(check: Callable[[], bool], vendor_ids: Iterable[int], timeout: float | None,
+                 poll_s: float = 0.1, usb_only: bool = False) -> bool:
+  """
+    Waits until check() returns True, or timeout seconds. Where libusb supports
+    hotplug, check() runs as soon as a device from one of vendor_ids arrives,
+    instead of on the next poll. Without hotplug it's polled every poll_s, and
+    so is anything that could also show up over SPI (usb_only=False).
+  """
+  deadline = None if timeout is None else time.monotonic() + timeout
+  with usb1.USBContext() as context:
+    hotplug = ENABLED and context.hasCapability(usb1.CAP_HAS_HOTPLUG)
+    arrived_at: float | None = None
+
+    def on_arrival(context, device, event):
+      nonlocal arrived_at
+      arrived_at = time.monotonic()
+      return False
+
+    if hotplug:
+      for vid in vendor_ids:
+        context.hotplugRegisterCallback(on_arrival, events=usb1.HOTPLUG_EVENT_DEVICE_ARRIVED, flags=0, vendor_id=vid)
+    period = RECHECK_S if hotplug and usb_only else poll_s
+
+    while not check():
+      now = time.monotonic()
+      if deadline is not None and now >= deadline:
+        return False
+
+      wait = period
+      if arrived_at is not None and now - arrived_at < SETTLE_S:
+        wait = SETTLE_POLL_S
+      if deadline is not None:
+        wait = min(wait, deadline - now)
+
+      if hotplug:
+        # returns early when a device arrives
+        context.handleEventsTimeout(wait)
+      else:
+        time.sleep(wait)
+  return True
@@ -15,6 +15,16 @@ def recv(panda, cnt, addr, nbus):
   global kmsgs
   ret = []
 
+  dispatcher = getattr(panda, "can_rx_dispatcher", None)
+  if dispatcher is not None:
+    q = dispatcher.shared(nbus, addr)
+    while len(ret) < cnt:
+      if not q:
+        dispatcher.poll()
+      while q and len(ret) < cnt:
+        ret.append(q.popleft()[1])
+    return ret
+
   while len(ret) < cnt:
     kmsgs += panda.can_recv()
     nmsgs = []
@@ -29,9 +29,15 @@ CHECKSUM_START = 0xAB
 MIN_ACK_TIMEOUT_MS = 100
 MAX_XFER_RETRY_COUNT = 5
 
+# used until the panda reports its max transfer size, see PandaSpiHandle.set_max_data_len
 XFER_SIZE = 0x40*31
 
+CONTROL_BATCH = 0xf0
+CONTROL_BATCH_MAX_RX = 1000
+CONTROL_BATCH_MIN_PROTOCOL = 3  # first SPI protocol version that answers batches
+
 DEV_PATH = "/dev/spidev0.0"
+SPIDEV_BUFSIZ_PATH = "/sys/module/spidev/parameters/bufsiz"
 
 
 def crc8(data):
@@ -104,6 +110,13 @@ class SpiDevice:
     self._spidev.open(0, 0)
     self._spidev.max_speed_hz = speed
 
+    # spidev rejects single transfers larger than its buffer
+    try:
+      with open(SPIDEV_BUFSIZ_PATH) as f:
+        self.max_xfer_len = int(f.read())
+    except (OSError, ValueError):
+      self.max_xfer_len = 4096
+
   @contextmanager
   def acquire(self):
     try:
@@ -124,10 +137,15 @@ class PandaSpiHandle(BaseHandle):
   A class that mimics a libusb1 handle for panda SPI communications.
   """
 
-  PROTOCOL_VERSION = 2
+  PROTOCOL_VERSION = 4
 
   def __init__(self) -> None:
     self.dev = SpiDevice()
+    self._batch_supported = True
+    self._protocol_version: int | None = None
+    self.bulk_write_response = b""
+    self.retry_count = 0  # transfers that failed and were sent again
+    self.xfer_size = XFER_SIZE
 
     self._transfer_raw: Callable[[SpiDevice, int, bytes, int, int, bool], bytes] = self._transfer_spidev
 
@@ -144,6 +162,13 @@ class PandaSpiHandle(BaseHandle):
       self.ioctl_data.rx_buf = ctypes.addressof(rx_buf_raw)
       self.fileno = self.dev._spidev.fileno()
 
+  def set_max_data_len(self, max_len: int) -> None:
+    """Use the largest transfers both the panda and spidev take, in whole USB packets."""
+    if "KERN" in os.environ:
+      return
+    n = min(max_len, self.dev.max_xfer_len - 1)
+    self.xfer_size = max(USBPACKET_MAX_SIZE, n - (n % USBPACKET_MAX_SIZE))
+
   # helpers
   def _calc_checksum(self, data: bytes) -> int:
     cksum = CHECKSUM_START
@@ -236,6 +261,7 @@ class PandaSpiHandle(BaseHandle):
           return self._transfer_raw(spi, endpoint, data, timeout, max_rx_len, expect_disconnect)
         except PandaSpiException as e:
           exc = e
+          self.retry_count += 1
           logger.debug("SPI transfer failed, retrying", exc_info=True)
 
     raise exc
@@ -264,6 +290,8 @@ class PandaSpiHandle(BaseHandle):
       calculated_crc = crc8(bytes(version_bytes + resp))
       if calculated_crc != dat[-1]:
         raise PandaSpiBadChecksum
+      if len(resp) > 14:
+        self._protocol_version = resp[14]
       return bytes(resp)
 
     exc = PandaSpiException()
@@ -286,17 +314,41 @@ class PandaSpiHandle(BaseHandle):
   def controlRead(self, request_type: int, request: int, value: int, index: int, length: int, timeout: int = TIMEOUT):
     return self._transfer(0, struct.pack("<BHHH", request, value, index, length), timeout, max_rx_len=length)
 
+  def controlBatch(self, requests, timeout: int = TIMEOUT) -> list[bytes]:
+    # all requests go in one transfer, the panda answers as many as fit and we send the rest again
+    ret: list[bytes] = []
+    while self._batch_supported and len(ret) < len(requests):
+      todo = requests[len(ret):]
+      data = struct.pack("<BHHH", CONTROL_BATCH, len(todo), 0, 0)
+      data += b"".join(struct.pack("<BHHH", request, value, index, length) for _, request, value, index, length in todo)
+      dat = self._transfer(0, data, timeout, max_rx_len=CONTROL_BATCH_MAX_RX)
+
+      # firmware without batch support answers with an empty response, so does
+      # newer firmware when the next response might not fit. only the version
+      # packet tells them apart, otherwise just this batch goes one by one
+      if len(dat) == 0:
+        if self._protocol_version is not None and self._protocol_version < CONTROL_BATCH_MIN_PROTOCOL:
+          self._batch_supported = False
+        break
+
+      pos = 0
+      while pos + 2 <= len(dat):
+        n = struct.unpack("<H", dat[pos:pos + 2])[0]
+        ret.append(dat[pos + 2:pos + 2 + n])
+        pos += 2 + n
+    return ret + super().controlBatch(requests[len(ret):], timeout)
+
   def bulkWrite(self, endpoint: int, data: bytes, timeout: int = TIMEOUT) -> int:
-    for x in range(math.ceil(len(data) / XFER_SIZE)):
-      self._transfer(endpoint, data[XFER_SIZE*x:XFER_SIZE*(x+1)], timeout)
+    for x in range(math.ceil(len(data) / self.xfer_size)):
+      self.bulk_write_response = self._transfer(endpoint, data[self.xfer_size*x:self.xfer_size*(x+1)], timeout)
     return len(data)
 
   def bulkRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
     ret = b""
-    for _ in range(math.ceil(length / XFER_SIZE)):
-      d = self._transfer(endpoint, [], timeout, max_rx_len=XFER_SIZE)
+    for _ in range(math.ceil(length / self.xfer_size)):
+      d = self._transfer(endpoint, [], timeout, max_rx_len=self.xfer_size)
       ret += d
-      if len(d) < XFER_SIZE:
+      if len(d) < self.xfer_size:
         break
     return ret
 
@@ -341,7 +393,7 @@ class STBootloaderSPIHandle(BaseSTBootloaderHandle):
     elif data != self.ACK:
       raise PandaSpiMissingAck
 
-  def _cmd_no_retry(self, cmd: int, data: list[bytes] | None = None, read_bytes: int = 0, predata=None) -> bytes:
+  def _cmd_no_retry(self, cmd: int, data: list[bytes] | None = None, read_bytes: int = 0, predata=None, ack_timeout: float = 20) -> bytes:
     ret = b""
     with self.dev.acquire() as spi:
       # sync + command
@@ -361,7 +413,7 @@ class STBootloaderSPIHandle(BaseSTBootloaderHandle):
             spi.xfer(d + self._checksum(predata + d))
           else:
             spi.xfer(d + self._checksum(d))
-          self._get_ack(spi, timeout=20)
+          self._get_ack(spi, timeout=ack_timeout)
 
       # receive
       if read_bytes > 0:
@@ -371,11 +423,11 @@ class STBootloaderSPIHandle(BaseSTBootloaderHandle):
 
     return bytes(ret)
 
-  def _cmd(self, cmd: int, data: list[bytes] | None = None, read_bytes: int = 0, predata=None) -> bytes:
+  def _cmd(self, cmd: int, data: list[bytes] | None = None, read_bytes: int = 0, predata=None, ack_timeout: float = 20) -> bytes:
     exc = PandaSpiException()
     for n in range(MAX_XFER_RETRY_COUNT):
       try:
-        return self._cmd_no_retry(cmd, data, read_bytes, predata)
+        return self._cmd_no_retry(cmd, data, read_bytes, predata, ack_timeout)
       except PandaSpiException as e:
         exc = e
         logger.debug("SPI transfer failed, %d retries left", MAX_XFER_RETRY_COUNT - n - 1, exc_info=True)
@@ -409,9 +461,13 @@ class STBootloaderSPIHandle(BaseSTBootloaderHandle):
     return binascii.hexlify(dat).decode()
 
   def erase_sector(self, sector: int):
-    p = struct.pack('>H', 0)  # number of sectors to erase
-    d = struct.pack('>H', sector)
-    self._cmd(0x44, data=[d, ], predata=p)
+    self.erase_sectors([sector, ])
+
+  def erase_sectors(self, sectors: list[int]):
+    # extended erase takes a list of sectors, one command for all of them
+    p = struct.pack('>H', len(sectors) - 1)  # number of sectors to erase
+    d = b"".join(struct.pack('>H', s) for s in sectors)
+    self._cmd(0x44, data=[d, ], predata=p, ack_timeout=20 * len(sectors))
 
   # *** PandaDFU API ***
 
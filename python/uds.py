@@ -6,6 +6,8 @@ from collections.abc import Callable, Generator
 from enum import IntEnum
 from functools import partial
 
+from .canrx import CanRxDispatcher
+
 class SERVICE_TYPE(IntEnum):
   DIAGNOSTIC_SESSION_CONTROL = 0x10
   ECU_RESET = 0x11
@@ -302,7 +304,8 @@ def get_dtc_status_names(status):
 
 class CanClient():
   def __init__(self, can_send: Callable[[int, bytes, int], None], can_recv: Callable[[], list[tuple[int, bytes, int]]],
-               tx_addr: int, rx_addr: int, bus: int, sub_addr: int | None = None, debug: bool = False):
+               tx_addr: int, rx_addr: int, bus: int, sub_addr: int | None = None, debug: bool = False,
+               dispatcher: CanRxDispatcher | None = None, poll: bool = True):
     self.tx = can_send
     self.rx = can_recv
     self.tx_addr = tx_addr
@@ -312,6 +315,30 @@ class CanClient():
     self.bus = bus
     self.debug = debug
 
+    # with a dispatcher, frames come from its queue instead of can_recv.
+    # without poll, recv only returns what someone else already polled
+    self._dispatcher = dispatcher
+    self._poll = poll
+    self._rx_queue: Deque[tuple[int, bytes]] | None = None
+    if dispatcher is not None:
+      self._rx_queue = dispatcher.subscribe(bus, self._rx_addrs())
+
+  def _rx_addrs(self) -> range:
+    if self.tx_addr == 0x7DF:
+      return range(0x7E8, 0x7F0)
+    if self.tx_addr == 0x18DB33F1:
+      return range(0x18DAF100, 0x18DAF200)
+    return range(self.rx_addr, self.rx_addr + 1)
+
+  def close(self) -> None:
+    if self._dispatcher is not None and self._rx_queue is not None:
+      self._dispatcher.unsubscribe(self._rx_queue)
+      self._rx_queue = None
+
+  def rx_pending(self) -> bool:
+    """Whether frames are buffered that recv hasn't returned yet."""
+    return bool(self.rx_buff) or bool(self._rx_queue)
+
   def _recv_filter(self, bus: int, addr: int) -> bool:
     # handle functional addresses (switch to first addr to respond)
     if self.tx_addr == 0x7DF:
@@ -331,7 +358,26 @@ class CanClient():
         self.rx_addr = addr
     return bus == self.bus and addr == self.rx_addr
 
+  def _recv_frame(self, rx_addr: int, rx_data: bytes, rx_bus: int) -> None:
+    if self._recv_filter(rx_bus, rx_addr) and len(rx_data) > 0:
+      rx_data = bytes(rx_data)  # convert bytearray to bytes
+
+      if self.debug:
+        print(f"CAN-RX: {hex(rx_addr)} - 0x{bytes.hex(rx_data)}")
+
+      # Cut off sub addr in first byte
+      if self.sub_addr is not None:
+        if rx_data[0] != self.sub_addr:
+          raise InvalidSubAddressError(f"isotp - rx: invalid sub-address: {rx_data[0]}, expected: {self.sub_addr}")
+        rx_data = rx_data[1:]
+
+      self.rx_buff.append(rx_data)
+
   def _recv_buffer(self, drain: bool = False) -> None:
+    if self._dispatcher is not None:
+      self._recv_dispatched(drain)
+      return
+
     while True:
       msgs = self.rx()
       if drain:
@@ -340,23 +386,32 @@ class CanClient():
         self.rx_buff.clear()
       else:
         for rx_addr, rx_data, rx_bus in msgs or []:
-          if self._recv_filter(rx_bus, rx_addr) and len(rx_data) > 0:
-            rx_data = bytes(rx_data)  # convert bytearray to bytes
-
-            if self.debug:
-              print(f"CAN-RX: {hex(rx_addr)} - 0x{bytes.hex(rx_data)}")
-
-            # Cut off sub addr in first byte
-            if self.sub_addr is not None:
-              if rx_data[0] != self.sub_addr:
-                raise InvalidSubAddressError(f"isotp - rx: invalid sub-address: {rx_data[0]}, expected: {self.sub_addr}")
-              rx_data = rx_data[1:]
-
-            self.rx_buff.append(rx_data)
+          self._recv_frame(rx_addr, rx_data, rx_bus)
       # break when non-full buffer is processed
       if len(msgs) < 254:
         return
 
+  def _recv_dispatched(self, drain: bool) -> None:
+    assert self._dispatcher is not None and self._rx_queue is not None, "CanClient is closed"
+    if self._poll:
+      self._dispatcher.poll()
+    if drain:
+      if self.debug:
+        print(f"CAN-RX: drain - {len(self._rx_queue)}")
+      self._rx_queue.clear()
+      self.rx_buff.clear()
+      return
+
+    functional = self.tx_addr in (0x7DF, 0x18DB33F1)
+    while self._rx_queue:
+      rx_addr, rx_data = self._rx_queue.popleft()
+      self._recv_frame(rx_addr, rx_data, self.bus)
+
+    # only listen to the ECU that answered a functional request
+    if functional and self.tx_addr not in (0x7DF, 0x18DB33F1):
+      self._dispatcher.unsubscribe(self._rx_queue)
+      self._dispatcher.route(self._rx_queue, self.bus, self._rx_addrs())
+
   def recv(self, drain: bool = False) -> Generator[bytes, None, None]:
     # buffer rx messages in case two response messages are received at once
     # (e.g. response pending and success/failure response)
@@ -575,6 +630,51 @@ def get_rx_addr_for_tx_addr(tx_addr, rx_offset=0x8):
   raise ValueError(f"invalid tx_addr: {tx_addr}")
 
 
+def uds_request(service_type: SERVICE_TYPE, subfunction: int | None = None, data: bytes | None = None) -> bytes:
+  req = bytes([service_type])
+  if subfunction is not None:
+    req += bytes([subfunction])
+  if data is not None:
+    req += data
+  return req
+
+
+def uds_response(service_type: SERVICE_TYPE, subfunction: int | None, resp: bytes) -> bytes | None:
+  """Checks the response to a request and returns its data, or None while the ECU reports the response pending."""
+  resp_sid = resp[0] if len(resp) > 0 else None
+
+  # negative response
+  if resp_sid == 0x7F:
+    service_id = resp[1] if len(resp) > 1 else -1
+    try:
+      service_desc = SERVICE_TYPE(service_id).name
+    except BaseException:
+      service_desc = 'NON_STANDARD_SERVICE'
+    error_code = resp[2] if len(resp) > 2 else -1
+    try:
+      error_desc = _negative_response_codes[error_code]
+    except BaseException:
+      error_desc = resp[3:].hex()
+    # wait for another message if response pending
+    if error_code == 0x78:
+      return None
+    raise NegativeResponseError(f'{service_desc} - {error_desc}', service_id, error_code)
+
+  # positive response
+  if service_type + 0x40 != resp_sid:
+    resp_sid_hex = hex(resp_sid) if resp_sid is not None else None
+    raise InvalidServiceIdError(f'invalid response service id: {resp_sid_hex}')
+
+  if subfunction is not None:
+    resp_sfn = resp[1] if len(resp) > 1 else None
+    if subfunction != resp_sfn:
+      resp_sfn_hex = hex(resp_sfn) if resp_sfn is not None else None
+      raise InvalidSubFunctionError(f'invalid response subfunction: {resp_sfn_hex}')
+
+  # return data (exclude service id and sub-function id)
+  return resp[(1 if subfunction is None else 2):]
+
+
 class UdsClient():
   def __init__(self, panda, tx_addr: int, rx_addr: int | None = None, bus: int = 0, sub_addr: int | None = None, timeout: float = 1,
                debug: bool = False, tx_timeout: float = 1, response_pending_timeout: float = 10):
@@ -585,21 +685,16 @@ class UdsClient():
     self.timeout = timeout
     self.debug = debug
     can_send_with_timeout = partial(panda.can_send, timeout=int(tx_timeout*1000))
-    self._can_client = CanClient(can_send_with_timeout, panda.can_recv, self.tx_addr, self.rx_addr, self.bus, self.sub_addr, debug=self.debug)
+    self._can_client = CanClient(can_send_with_timeout, panda.can_recv, self.tx_addr, self.rx_addr, self.bus, self.sub_addr, debug=self.debug,
+                                 dispatcher=getattr(panda, "can_rx_dispatcher", None))
     self.response_pending_timeout = response_pending_timeout
 
   # generic uds request
   def _uds_request(self, service_type: SERVICE_TYPE, subfunction: int | None = None, data: bytes | None = None) -> bytes:
-    req = bytes([service_type])
-    if subfunction is not None:
-      req += bytes([subfunction])
-    if data is not None:
-      req += data
-
     # send request, wait for response
     max_len = 8 if self.sub_addr is None else 7
     isotp_msg = IsoTpMessage(self._can_client, timeout=self.timeout, debug=self.debug, max_len=max_len)
-    isotp_msg.send(req)
+    isotp_msg.send(uds_request(service_type, subfunction, data))
     response_pending = False
     while True:
       timeout = self.response_pending_timeout if response_pending else self.timeout
@@ -608,42 +703,13 @@ class UdsClient():
       if resp is None:
         continue
 
-      response_pending = False
-      resp_sid = resp[0] if len(resp) > 0 else None
-
-      # negative response
-      if resp_sid == 0x7F:
-        service_id = resp[1] if len(resp) > 1 else -1
-        try:
-          service_desc = SERVICE_TYPE(service_id).name
-        except BaseException:
-          service_desc = 'NON_STANDARD_SERVICE'
-        error_code = resp[2] if len(resp) > 2 else -1
-        try:
-          error_desc = _negative_response_codes[error_code]
-        except BaseException:
-          error_desc = resp[3:].hex()
-        # wait for another message if response pending
-        if error_code == 0x78:
-          response_pending = True
-          if self.debug:
-            print("UDS-RX: response pending")
-          continue
-        raise NegativeResponseError(f'{service_desc} - {error_desc}', service_id, error_code)
-
-      # positive response
-      if service_type + 0x40 != resp_sid:
-        resp_sid_hex = hex(resp_sid) if resp_sid is not None else None
-        raise InvalidServiceIdError(f'invalid response service id: {resp_sid_hex}')
-
-      if subfunction is not None:
-        resp_sfn = resp[1] if len(resp) > 1 else None
-        if subfunction != resp_sfn:
-          resp_sfn_hex = hex(resp_sfn) if resp_sfn is not None else None
-          raise InvalidSubFunctionError(f'invalid response subfunction: {resp_sfn_hex}')
-
-      # return data (exclude service id and sub-function id)
-      return resp[(1 if subfunction is None else 2):]
+      ret = uds_response(service_type, subfunction, resp)
+      response_pending = ret is None
+      if response_pending:
+        if self.debug:
+          print("UDS-RX: response pending")
+        continue
+      return ret
 
   # services
   def diagnostic_session_control(self, session_type: SESSION_TYPE):
@@ -941,3 +1007,80 @@ class UdsClient():
 
   def request_transfer_exit(self):
     self._uds_request(SERVICE_TYPE.REQUEST_TRANSFER_EXIT, subfunction=None)
+
+
+class UdsTarget(NamedTuple):
+  tx_addr: int
+  rx_addr: int
+  bus: int = 0
+  sub_addr: int | None = None
+
+
+class UdsParallelQuery():
+  """
+    Sends one request to many ECUs at once and drives all of their ISO-TP sessions
+    from one receive loop, instead of waiting on each ECU in turn. Results are
+    yielded as they complete, with the exception in place of the response for
+    ECUs that fail or time out.
+
+      query = UdsParallelQuery(panda, [UdsTarget(0x7E0, 0x7E8), UdsTarget(0x7E1, 0x7E9)])
+      for target, resp in query.request(SERVICE_TYPE.READ_DATA_BY_IDENTIFIER, data=b"\xf1\x90"):
+        ...
+  """
+  def __init__(self, panda, targets: list[UdsTarget], timeout: float = 1, debug: bool = False, tx_timeout: float = 1,
+               response_pending_timeout: float = 10):
+    self.targets = [UdsTarget(*t) for t in targets]
+    self.timeout = timeout
+    self.response_pending_timeout = response_pending_timeout
+    self.debug = debug
+    self._dispatcher = panda.can_rx_dispatcher
+    can_send_with_timeout = partial(panda.can_send, timeout=int(tx_timeout*1000))
+    self._can_clients = {t: CanClient(can_send_with_timeout, panda.can_recv, t.tx_addr, t.rx_addr, t.bus, t.sub_addr, debug=debug,
+                                      dispatcher=self._dispatcher, poll=False) for t in self.targets}
+
+  def close(self) -> None:
+    for can_client in self._can_clients.values():
+      can_client.close()
+
+  def request(self, service_type: SERVICE_TYPE, subfunction: int | None = None,
+              data: bytes | None = None) -> Generator[tuple[UdsTarget, bytes | Exception], None, None]:
+    req = uds_request(service_type, subfunction, data)
+
+    # drop anything stale, then send every request before waiting on any of them
+    self._dispatcher.poll()
+    msgs: dict[UdsTarget, IsoTpMessage] = {}
+    deadlines: dict[UdsTarget, float] = {}
+    for t, can_client in self._can_clients.items():
+      msgs[t] = IsoTpMessage(can_client, timeout=0, debug=self.debug, max_len=8 if t.sub_addr is None else 7)
+      msgs[t].send(req)
+      deadlines[t] = time.monotonic() + self.timeout
+
+    while msgs:
+      self._dispatcher.poll()
+      now = time.monotonic()
+      for t in list(msgs):
+        msg = msgs[t]
+        try:
+          if self._can_clients[t].rx_pending():
+            deadlines[t] = now + self.timeout
+          resp, _ = msg.recv(0)
+          if resp is None:
+            if now > deadlines[t]:
+              raise MessageTimeoutError("timeout waiting for response")
+            continue
+
+          ret = uds_response(service_type, subfunction, resp)
+          if ret is None:
+            if self.debug:
+              print(f"UDS-RX: response pending - {hex(t.rx_addr)}")
+            deadlines[t] = now + self.response_pending_timeout
+            continue
+          del msgs[t]
+          yield t, ret
+        except Exception as e:
+          del msgs[t]
+          yield t, e
+
+  def request_all(self, service_type: SERVICE_TYPE, subfunction: int | None = None,
+                  data: bytes | None = None) -> dict[UdsTarget, bytes | Exception]:
+    return dict(self.request(service_type, subfunction, data))
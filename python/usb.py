@@ -1,7 +1,10 @@
 import struct
+import time
+from functools import partial
 
 from .base import BaseHandle, BaseSTBootloaderHandle, TIMEOUT
 from .constants import McuType
+from .utils import logger
 
 class PandaUsbHandle(BaseHandle):
   def __init__(self, libusb_handle):
@@ -31,6 +34,9 @@ class STBootloaderUSBHandle(BaseSTBootloaderHandle):
   DFU_CLRSTATUS = 4
   DFU_ABORT = 6
 
+  DFU_STATE_DNLOAD_SYNC = 3
+  DFU_STATE_DNBUSY = 4
+
   def __init__(self, libusb_device, libusb_handle):
     self._libusb_handle = libusb_handle
 
@@ -45,22 +51,49 @@ class STBootloaderUSBHandle(BaseSTBootloaderHandle):
     assert sector_count in mcu_by_sector_count, f"Unkown MCU: {sector_count=}"
     self._mcu_type = mcu_by_sector_count[sector_count]
 
-  def _status(self) -> None:
+  def _status(self, work=None):
+    # the bootloader says how long it's busy for, ask again once that's up instead of spinning.
+    # work runs in the meantime, its result is returned
+    ret = None
     while 1:
       dat = self._libusb_handle.controlRead(0x21, self.DFU_GETSTATUS, 0, 0, 6)
-      if dat[1] == 0:
+      assert dat[0] == 0, f"DFU error: status {dat[0]:#x}, state {dat[4]}"
+      if dat[4] not in (self.DFU_STATE_DNLOAD_SYNC, self.DFU_STATE_DNBUSY):
         break
 
+      start = time.monotonic()
+      if work is not None:
+        ret, work = work(), None
+      poll_timeout = (dat[1] | (dat[2] << 8) | (dat[3] << 16)) / 1000
+      time.sleep(max(0., poll_timeout - (time.monotonic() - start)))
+
+    if work is not None:
+      ret = work()
+    return ret
+
   def _erase_page_address(self, address: int) -> None:
     self._libusb_handle.controlWrite(0x21, self.DFU_DNLOAD, 0, 0, b"\x41" + struct.pack("I", address))
     self._status()
 
+  def _mass_erase(self) -> None:
+    self._libusb_handle.controlWrite(0x21, self.DFU_DNLOAD, 0, 0, b"\x41")
+    self._status()
+
   def get_mcu_type(self):
     return self._mcu_type
 
   def erase_sector(self, sector: int):
     self._erase_page_address(self._mcu_type.config.sector_address(sector))
 
+  def erase_sectors(self, sectors: list[int]):
+    # a mass erase is one command instead of one per sector, only when it's all of them.
+    # the H7's provisioning sector isn't in sector_sizes, so it's never mass erased
+    config = self._mcu_type.config
+    if len(config.sector_sizes) == config.sector_count and sorted(sectors) == list(range(config.sector_count)):
+      self._mass_erase()
+    else:
+      super().erase_sectors(sectors)
+
   def clear_status(self):
     # Clear status
     stat = self._libusb_handle.controlRead(0x21, self.DFU_GETSTATUS, 0, 0, 6)
@@ -79,14 +112,15 @@ class STBootloaderUSBHandle(BaseSTBootloaderHandle):
     self._libusb_handle.controlWrite(0x21, self.DFU_DNLOAD, 0, 0, b"\x21" + struct.pack("I", address))
     self._status()
 
-    # Program
+    # Program, the next block is prepared while the bootloader writes the last one
     bs = min(len(dat), self._mcu_type.config.block_size)
-    dat += b"\xFF" * ((bs - len(dat)) % bs)
-    for i in range(len(dat) // bs):
-      ldat = dat[i * bs:(i + 1) * bs]
-      print("programming %d with length %d" % (i, len(ldat)))
-      self._libusb_handle.controlWrite(0x21, self.DFU_DNLOAD, 2 + i, 0, ldat)
-      self._status()
+    n = (len(dat) + bs - 1) // bs
+    blocks = (dat[i * bs:(i + 1) * bs].ljust(bs, b"\xFF") for i in range(n))
+    block = next(blocks)
+    for i in range(n):
+      logger.debug("programming %d with length %d", i, len(block))
+      self._libusb_handle.controlWrite(0x21, self.DFU_DNLOAD, 2 + i, 0, block)
+      block = self._status(work=partial(next, blocks, None))
 
   def jump(self, address):
     self._libusb_handle.controlWrite(0x21, self.DFU_DNLOAD, 0, 0, b"\x21" + struct.pack("I", address))
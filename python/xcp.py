@@ -1,7 +1,10 @@
-import sys
 import time
 import struct
+from collections import deque
 from enum import IntEnum
+from typing import NamedTuple
+
+from .canrx import CanRxDispatcher
 
 class COMMAND_CODE(IntEnum):
   CONNECT = 0xFF
@@ -94,6 +97,21 @@ class GET_ID_REQUEST_TYPE(IntEnum):
   ASAM_MC2_UPLOAD = 0x04,
   # 128-255 user defined
 
+class DAQ_START_STOP_MODE(IntEnum):
+  STOP = 0x00
+  START = 0x01
+  SELECT = 0x02
+
+class DAQ_SYNCH_MODE(IntEnum):
+  STOP_ALL = 0x00
+  START_SELECTED = 0x01
+  STOP_SELECTED = 0x02
+
+class DaqList(NamedTuple):
+  daq: int
+  first_pid: int
+  odts: list[list[int]]  # entry sizes in each ODT
+
 class CommandTimeoutError(Exception):
   pass
 
@@ -110,9 +128,13 @@ class CommandResponseError(Exception):
     return self.message
 
 class XcpClient():
-  def __init__(self, panda, tx_addr: int, rx_addr: int, bus: int=0, timeout: float=0.1, debug=False, pad=True):
+  DTO_QUEUE_LEN = 4096
+
+  def __init__(self, panda, tx_addr: int, rx_addr: int, bus: int=0, timeout: float=0.1, debug=False, pad=True,
+               daq_rx_addr: int | None = None):
     self.tx_addr = tx_addr
     self.rx_addr = rx_addr
+    self.daq_rx_addr = daq_rx_addr if daq_rx_addr is not None else rx_addr
     self.can_bus = bus
     self.timeout = timeout
     self.debug = debug
@@ -120,21 +142,51 @@ class XcpClient():
     self._byte_order = ">"
     self._max_cto = 8
     self._max_dto = 8
+    self._slave_block_mode = False
+    self._master_block_mode = False
+    self._max_bs = 1
+    self._min_st = 0.
     self.pad = pad
 
-  def _send_cto(self, cmd: int, dat: bytes = b"") -> None:
+    # responses and DTOs are told apart by their PID, DTOs are kept for daq_recv
+    dispatcher = getattr(panda, "can_rx_dispatcher", None)
+    self._dispatcher = dispatcher if dispatcher is not None else CanRxDispatcher(panda.can_recv)
+    self._rx_queue = self._dispatcher.subscribe(bus, {self.rx_addr, self.daq_rx_addr})
+    self._cto: deque[bytes] = deque()
+    self._dto: deque[bytes] = deque(maxlen=self.DTO_QUEUE_LEN)
+    self._daq: DaqList | None = None
+    self._daq_sample: list[bytes] = []
+    self._timed_out = False
+
+  def _rx(self) -> bool:
+    self._dispatcher.poll()
+    received = len(self._rx_queue) > 0
+    while self._rx_queue:
+      rx_addr, rx_data = self._rx_queue.popleft()
+      if self.debug:
+        print(f"CAN-RX: {hex(rx_addr)} - 0x{bytes.hex(rx_data)}")
+      if rx_addr == self.rx_addr and rx_data[0] >= 0xFC:
+        self._cto.append(rx_data)
+      elif rx_addr == self.daq_rx_addr and rx_data[0] < 0xFC:
+        self._dto.append(rx_data)
+    return received
+
+  def _send_cto(self, cmd: int, dat: bytes = b"", clear: bool = True) -> None:
     tx_data = (bytes([cmd]) + dat)
 
     # Some ECUs don't respond if the packets are not padded to 8 bytes
     if self.pad:
       tx_data = tx_data.ljust(8, b"\x00")
 
-    if self.debug:
-      print("CAN-CLEAR: TX")
-    self._panda.can_clear(self.can_bus)
-    if self.debug:
-      print("CAN-CLEAR: RX")
-    self._panda.can_clear(0xFFFF)
+    if clear:
+      if self.debug:
+        print("CAN-CLEAR: TX")
+      self._panda.can_clear(self.can_bus)
+      # drop stale responses, DTOs are kept. a late response can only be on the panda after a timeout
+      if self._timed_out:
+        self._rx()
+        self._timed_out = False
+      self._cto.clear()
     if self.debug:
       print(f"CAN-TX: {hex(self.tx_addr)} - 0x{bytes.hex(tx_data)}")
     self._panda.can_send(self.tx_addr, tx_data, self.can_bus)
@@ -142,25 +194,24 @@ class XcpClient():
   def _recv_dto(self, timeout: float) -> bytes:
     start_time = time.time()
     while time.time() - start_time < timeout:
-      msgs = self._panda.can_recv() or []
-      if len(msgs) >= 256:
-        print("CAN RX buffer overflow!!!", file=sys.stderr)
-      for rx_addr, rx_data, rx_bus in msgs:
-        if rx_bus == self.can_bus and rx_addr == self.rx_addr:
-          rx_data = bytes(rx_data)  # convert bytearray to bytes
-          if self.debug:
-            print(f"CAN-RX: {hex(rx_addr)} - 0x{bytes.hex(rx_data)}")
-
-          pid = rx_data[0]
-          if pid == 0xFE:
-            err = rx_data[1]
-            err_desc = ERROR_CODES.get(err, "unknown error")
-            dat = rx_data[2:]
-            raise CommandResponseError(f"{hex(err)} - {err_desc} {dat}", err)
-
+      while self._cto:
+        rx_data = self._cto.popleft()
+        pid = rx_data[0]
+        if pid == 0xFE:
+          err = rx_data[1]
+          err_desc = ERROR_CODES.get(err, "unknown error")
+          dat = rx_data[2:]
+          raise CommandResponseError(f"{hex(err)} - {err_desc} {dat}", err)
+        if pid == 0xFF:
           return bytes(rx_data[1:])
-      time.sleep(0.001)
+        # events and service requests
+        if self.debug:
+          print(f"XCP: ignoring packet with PID {hex(pid)}")
+
+      if not self._rx():
+        time.sleep(0.001)
 
+    self._timed_out = True
     raise CommandTimeoutError("timeout waiting for response")
 
   # commands
@@ -187,6 +238,22 @@ class XcpClient():
       "transport_version": resp[6],
     }
 
+  def get_comm_mode_info(self) -> dict:
+    self._send_cto(COMMAND_CODE.GET_COMM_MODE_INFO)
+    resp = self._recv_dto(self.timeout)
+    assert len(resp) >= 6, f"incorrect data length: {len(resp)}"
+    self._master_block_mode = resp[1] & 0x01 != 0
+    self._max_bs = max(resp[3], 1)
+    self._min_st = resp[4] * 100e-6
+    return {
+      "master_block_mode": self._master_block_mode,
+      "interleaved_mode": resp[1] & 0x02 != 0,
+      "max_bs": resp[3],
+      "min_st": self._min_st,
+      "queue_size": resp[5],
+      "driver_version": resp[6] if len(resp) > 6 else None,
+    }
+
   def disconnect(self) -> None:
     self._send_cto(COMMAND_CODE.DISCONNECT)
     resp = self._recv_dto(self.timeout)
@@ -230,14 +297,24 @@ class XcpClient():
   def upload(self, size: int) -> bytes:
     if size > 255:
       raise ValueError("size must be less than 256")
-    if not self._slave_block_mode and size > self._max_dto - 1:
+    if not self._slave_block_mode and size > self._max_cto - 1:
       raise ValueError("block mode not supported")
 
+    # in slave block mode, the data comes in as many responses as it takes
     self._send_cto(COMMAND_CODE.UPLOAD, bytes([size]))
     resp = b""
     while len(resp) < size:
-      resp += self._recv_dto(self.timeout)[:size - len(resp) + 1]
-    return resp[:size] # trim off bytes with undefined values
+      resp += self._recv_dto(self.timeout)[:size - len(resp)]
+    return resp
+
+  def upload_memory(self, addr: int, size: int, addr_ext: int = 0) -> bytes:
+    """Reads size bytes from addr, in blocks when the slave supports it."""
+    self.set_mta(addr, addr_ext)
+    chunk = 255 if self._slave_block_mode else self._max_cto - 1
+    resp = b""
+    while len(resp) < size:
+      resp += self.upload(min(chunk, size - len(resp)))
+    return resp
 
   def short_upload(self, size: int, addr_ext: int, addr: int) -> bytes:
     if size > 6:
@@ -249,10 +326,133 @@ class XcpClient():
 
   def download(self, data: bytes) -> bytes:
     size = len(data)
+    per_frame = self._max_cto - 2
     if size > 255:
       raise ValueError("size must be less than 256")
-    if not self._slave_block_mode and size > self._max_dto - 2:
+    if size > per_frame and not self._master_block_mode:
       raise ValueError("block mode not supported")
+    if size > self._max_bs * per_frame:
+      raise ValueError(f"size must be at most {self._max_bs * per_frame} in a block")
 
-    self._send_cto(COMMAND_CODE.DOWNLOAD, bytes([size]) + data)
-    return self._recv_dto(self.timeout)[:size]
+    # in master block mode, the rest follows in DOWNLOAD_NEXT packets, the slave only responds to the last one
+    self._send_cto(COMMAND_CODE.DOWNLOAD, bytes([size]) + data[:per_frame])
+    for i in range(per_frame, size, per_frame):
+      if self._min_st > 0:
+        time.sleep(self._min_st)
+      self._send_cto(COMMAND_CODE.DOWNLOAD_NEXT, bytes([size - i]) + data[i:i + per_frame], clear=False)
+    return self._recv_dto(self.timeout)
+
+  def download_memory(self, addr: int, data: bytes, addr_ext: int = 0) -> None:
+    """Writes data to addr, in blocks when the slave supports it."""
+    self.set_mta(addr, addr_ext)
+    per_frame = self._max_cto - 2
+    chunk = min(255, self._max_bs * per_frame) if self._master_block_mode else per_frame
+    for i in range(0, len(data), chunk):
+      self.download(data[i:i + chunk])
+
+  # synchronous data acquisition
+  def free_daq(self) -> None:
+    self._send_cto(COMMAND_CODE.FREE_DAQ)
+    self._recv_dto(self.timeout)
+    self._daq = None
+
+  def alloc_daq(self, daq_count: int) -> None:
+    self._send_cto(COMMAND_CODE.ALLOC_DAQ, b"\x00" + struct.pack(f"{self._byte_order}H", daq_count))
+    self._recv_dto(self.timeout)
+
+  def alloc_odt(self, daq: int, odt_count: int) -> None:
+    self._send_cto(COMMAND_CODE.ALLOC_ODT, b"\x00" + struct.pack(f"{self._byte_order}HB", daq, odt_count))
+    self._recv_dto(self.timeout)
+
+  def alloc_odt_entry(self, daq: int, odt: int, entry_count: int) -> None:
+    self._send_cto(COMMAND_CODE.ALLOC_ODT_ENTRY, b"\x00" + struct.pack(f"{self._byte_order}HBB", daq, odt, entry_count))
+    self._recv_dto(self.timeout)
+
+  def set_daq_ptr(self, daq: int, odt: int, entry: int) -> None:
+    self._send_cto(COMMAND_CODE.SET_DAQ_PTR, b"\x00" + struct.pack(f"{self._byte_order}HBB", daq, odt, entry))
+    self._recv_dto(self.timeout)
+
+  def write_daq(self, size: int, addr: int, addr_ext: int = 0, bit_offset: int = 0xFF) -> None:
+    # the DAQ pointer moves to the next entry
+    self._send_cto(COMMAND_CODE.WRITE_DAQ, bytes([bit_offset, size, addr_ext]) + struct.pack(f"{self._byte_order}I", addr))
+    self._recv_dto(self.timeout)
+
+  def set_daq_list_mode(self, daq: int, event: int, prescaler: int = 1, priority: int = 0, mode: int = 0) -> None:
+    self._send_cto(COMMAND_CODE.SET_DAQ_LIST_MODE, bytes([mode]) + struct.pack(f"{self._byte_order}HHBB", daq, event, prescaler, priority))
+    self._recv_dto(self.timeout)
+
+  def start_stop_daq_list(self, mode: DAQ_START_STOP_MODE, daq: int) -> int:
+    self._send_cto(COMMAND_CODE.START_STOP_DAQ_LIST, bytes([mode]) + struct.pack(f"{self._byte_order}H", daq))
+    resp = self._recv_dto(self.timeout)
+    return resp[0]  # first PID
+
+  def start_stop_synch(self, mode: DAQ_SYNCH_MODE) -> None:
+    self._send_cto(COMMAND_CODE.START_STOP_SYNCH, bytes([mode]))
+    self._recv_dto(self.timeout)
+
+  def configure_daq(self, entries: list[tuple[int, int]], event: int = 0, prescaler: int = 1, addr_ext: int = 0) -> DaqList:
+    """Sets up DAQ list 0 to sample the (addr, size) entries on event, packed into as few ODTs as fit.
+    Dynamic DAQ configuration with absolute ODT numbers is assumed. Start it with start_daq."""
+    odt_len = self._max_dto - 1
+    odts: list[list[tuple[int, int]]] = [[]]
+    for addr, size in entries:
+      if size > odt_len:
+        raise ValueError(f"entry size must be at most {odt_len}")
+      if sum(e[1] for e in odts[-1]) + size > odt_len:
+        odts.append([])
+      odts[-1].append((addr, size))
+
+    self.free_daq()
+    self.alloc_daq(1)
+    self.alloc_odt(0, len(odts))
+    for i, odt in enumerate(odts):
+      self.alloc_odt_entry(0, i, len(odt))
+    for i, odt in enumerate(odts):
+      self.set_daq_ptr(0, i, 0)
+      for addr, size in odt:
+        self.write_daq(size, addr, addr_ext)
+    self.set_daq_list_mode(0, event, prescaler)
+    first_pid = self.start_stop_daq_list(DAQ_START_STOP_MODE.SELECT, 0)
+    self._daq = DaqList(0, first_pid, [[size for _, size in odt] for odt in odts])
+    return self._daq
+
+  def start_daq(self) -> None:
+    self._dto.clear()
+    self._daq_sample = []
+    self.start_stop_synch(DAQ_SYNCH_MODE.START_SELECTED)
+
+  def stop_daq(self) -> None:
+    self.start_stop_synch(DAQ_SYNCH_MODE.STOP_ALL)
+
+  def daq_recv(self, timeout: float = 0) -> list[list[bytes]]:
+    """Returns the samples received so far, each a list with the value of every entry.
+    Waits up to timeout for at least one. Samples with a missing ODT are dropped."""
+    assert self._daq is not None, "DAQ not configured"
+    first_pid, odts = self._daq.first_pid, self._daq.odts
+    samples: list[list[bytes]] = []
+    start_time = time.time()
+    while True:
+      self._rx()
+      while self._dto:
+        dat = self._dto.popleft()
+        odt = dat[0] - first_pid
+        if not 0 <= odt < len(odts):
+          continue
+        if odt != len(self._daq_sample):
+          # out of sequence, wait for the next sample
+          self._daq_sample = []
+          if odt != 0:
+            continue
+        self._daq_sample.append(dat[1:])
+        if len(self._daq_sample) == len(odts):
+          sample = []
+          for odt_dat, sizes in zip(self._daq_sample, odts, strict=True):
+            pos = 0
+            for size in sizes:
+              sample.append(odt_dat[pos:pos + size])
+              pos += size
+          samples.append(sample)
+          self._daq_sample = []
+      if samples or time.time() - start_time >= timeout:
+        return samples
+      time.sleep(0.001)
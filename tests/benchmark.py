@@ -3,6 +3,8 @@ import time
 from contextlib import contextmanager
 
 from panda import Panda, PandaDFU
+from panda.python import hotplug
+from panda.python.base import BaseHandle
 from panda.tests.hitl.helpers import get_random_can_messages
 
 
@@ -32,6 +34,28 @@ if __name__ == "__main__":
     with print_time(f"Panda.{f}()"):
       getattr(p, f)()
 
+  with print_time("Panda.connect()"):
+    p.connect()
+
+  # reset and reconnect, polling for the panda to come back against hotplug events
+  for enabled in (False, True):
+    hotplug.ENABLED = enabled
+    desc = "hotplug" if enabled else "polling"
+    with print_time(f"Panda.reset() - {desc}"):
+      p.reset()
+    p.reset(reconnect=False)
+    with print_time(f"Panda.reconnect() - {desc}"):
+      p.reconnect()
+
+  # the connect setup requests, one by one and as a single batch
+  reqs = p._connect_requests()
+  with print_time(f"connect requests - {len(reqs)} sequential"):
+    for _ in range(100):
+      BaseHandle.controlBatch(p._handle, reqs)
+  with print_time(f"connect requests - {len(reqs)} batched"):
+    for _ in range(100):
+      p._handle.controlBatch(reqs)
+
   p.set_can_loopback(True)
 
   for n in range(6):
@@ -1,10 +1,11 @@
 import binascii
+import math
 import pytest
 import random
 from unittest.mock import patch
 
 from panda import Panda, PandaDFU
-from panda.python.spi import SpiDevice, PandaProtocolMismatch, PandaSpiNackResponse
+from panda.python.spi import CONTROL_BATCH_MAX_RX, SpiDevice, PandaProtocolMismatch, PandaSpiNackResponse
 
 pytestmark = [
   pytest.mark.test_panda_types((Panda.HW_TYPE_TRES, ))
@@ -75,6 +76,28 @@ class TestSpi:
     p.can_send(0x123, b"somedata", 0)
     assert spy.call_count == 2*4
 
+  def test_control_batch(self, mocker, p):
+    reqs = [
+      (Panda.REQUEST_IN, 0xdd, 0, 0, 3),
+      (Panda.REQUEST_IN, 0xc1, 0, 0, 0x40),
+      (Panda.REQUEST_OUT, 0xc0, 0, 0, 0),
+      (Panda.REQUEST_IN, 0xd2, 0, 0, p.HEALTH_STRUCT.size),
+    ]
+    expected = [bytes(p._handle.controlRead(*r)) if r[4] else b'' for r in reqs]
+
+    spy = mocker.spy(p._handle, '_wait_for_ack')
+    resps = p._handle.controlBatch(reqs)
+    assert spy.call_count == 2
+    assert resps[:3] == expected[:3]
+    assert len(resps[3]) == p.HEALTH_STRUCT.size
+
+    # the panda answers as many as fit in CONTROL_BATCH_MAX_RX, the rest go in the next transfer
+    n = 40
+    per_transfer = CONTROL_BATCH_MAX_RX // (2 + p.HEALTH_STRUCT.size)
+    resps = p._handle.controlBatch([reqs[3], ] * n)
+    assert [len(r) for r in resps] == [p.HEALTH_STRUCT.size, ] * n
+    assert spy.call_count == 2 + 2 * math.ceil(n / per_transfer)
+
   def test_bad_header(self, mocker, p):
     with patch('panda.python.spi.SYNC', return_value=0):
       with pytest.raises(PandaSpiNackResponse):
@@ -2,7 +2,7 @@ import os
 import pytest
 import concurrent.futures
 
-from panda import Panda, PandaDFU, PandaJungle
+from panda import Panda, PandaDFU, PandaFleet, PandaJungle, discover
 from panda.tests.hitl.helpers import clear_can_buffers
 
 # needed to get output when using xdist
@@ -42,12 +42,12 @@ def init_all_pandas():
     _panda_jungle = PandaJungle(JUNGLE_SERIAL)
     _panda_jungle.set_panda_power(True)
 
-  for serial in Panda.list():
-    if serial not in PANDAS_EXCLUDE:
-      with Panda(serial=serial, claim=False) as p:
-        ptype = bytes(p.get_type())
-        if ptype in PandaGroup.TESTED:
-          _all_pandas[serial] = ptype
+  serials = [s for s in discover().pandas if s not in PANDAS_EXCLUDE]
+  with PandaFleet(serials, claim=False, progress=None) as fleet:
+    assert len(fleet.errors) == 0, f"Failed to connect: {fleet.errors}"
+    for serial, ptype in fleet.map(lambda p: bytes(p.get_type())).items():
+      if ptype in PandaGroup.TESTED:
+        _all_pandas[serial] = ptype
 
   # ensure we have all tested panda types
   missing_types = set(PandaGroup.TESTED) - set(_all_pandas.values())
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""
+Sync Panda against AsyncPanda on the USB emulator, with the host busy for a
+while after every batch like a real consumer. Reports the frames received,
+the frames the panda dropped and the latency from RX queue to the host.
+
+  ./benchmark_async.py [frames per ms] [host work per batch, ms]
+"""
+import asyncio
+import sys
+import time
+
+from panda import AsyncPanda
+from panda.tests.libpanda import libpanda_py
+from panda.tests.libpanda.usb_emulator import UsbEmulator
+
+DURATION_S = 3.
+
+
+class Traffic:
+  def __init__(self, per_ms):
+    self.per_ms = per_ms
+    self.sent = 0
+
+  def __call__(self):
+    out = [libpanda_py.make_CANPacket(0x100 + (self.sent + i) % 0x600, 0, bytes(8)) for i in range(self.per_ms)]
+    self.sent += self.per_ms
+    return out
+
+
+def run_sync(emu, work_s):
+  latencies = []
+  with emu.panda() as p:
+    end = time.monotonic() + DURATION_S
+    while time.monotonic() < end:
+      msgs = p.can_recv(timestamps=True)
+      now = emu.now_us()
+      latencies += [(now - m[3]) & 0xFFFFFFFF for m in msgs]
+      time.sleep(work_s)
+  return latencies
+
+
+def run_async(emu, work_s):
+  latencies = []
+  with emu.panda() as p:
+    async def run():
+      async with AsyncPanda(p) as ap:
+        end = time.monotonic() + DURATION_S
+        while time.monotonic() < end:
+          msgs = await ap.can_recv(timestamps=True)
+          now = emu.now_us()
+          latencies.extend((now - m[3]) & 0xFFFFFFFF for m in msgs)
+          time.sleep(work_s)  # blocking, like real processing
+        return ap.read_gaps
+    gaps = asyncio.run(run())
+  return latencies, gaps
+
+
+def percentile(v, p):
+  v = sorted(v)
+  return v[min(len(v) - 1, int(len(v) * p))] / 1000 if len(v) else float("nan")
+
+
+if __name__ == "__main__":
+  per_ms = int(sys.argv[1]) if len(sys.argv) > 1 else 20
+  work_s = (float(sys.argv[2]) if len(sys.argv) > 2 else 2.) / 1000
+
+  for name in ("sync", "async"):
+    traffic = Traffic(per_ms)
+    emu = UsbEmulator(traffic)
+    if name == "sync":
+      latencies, gaps = run_sync(emu, work_s), None
+    else:
+      latencies, gaps = run_async(emu, work_s)
+    emu.stop()
+
+    print(f"{name}: {len(latencies) / DURATION_S:.0f} frames/s received, {emu.rx_overflow} dropped of {traffic.sent}")
+    print(f"  latency p50 {percentile(latencies, 0.5):.1f} ms, p99 {percentile(latencies, 0.99):.1f} ms" +
+          (f", {gaps} reads with none queued" if gaps is not None else ""))
@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+import random
+import statistics
+import time
+
+from panda import Panda, DLC_TO_LEN, pack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+ROUNDS = 2000
+CHUNK_SIZES = (64, 512, 4032)
+
+
+def drain():
+  # TX queues are emptied outside the timed section
+  for q in (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q):
+    lpp.can_clear(q)
+
+
+def bench_write(data_len, chunk_size):
+  frames = lpp.can_slots_empty(lpp.tx1_q) - 1
+  msgs = [(random.randint(1, 0x7ff), bytes(random.getrandbits(8) for _ in range(data_len)), 0) for _ in range(frames)]
+  buf = b"".join(pack_can_buffer(msgs))
+  chunks = [libpanda_py.ffi.from_buffer(buf[i:i+chunk_size]) for i in range(0, len(buf), chunk_size)]
+
+  # median round, the host is noisy
+  times = []
+  for _ in range(ROUNDS):
+    lpp.comms_can_reset()
+    start = time.perf_counter()
+    for c in chunks:
+      lpp.comms_can_write(c, len(c))
+    times.append(time.perf_counter() - start)
+    drain()
+  elapsed = statistics.median(times)
+  return frames / elapsed, len(buf) / elapsed
+
+
+if __name__ == "__main__":
+  lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+  for data_len in (8, 64):
+    assert data_len in DLC_TO_LEN
+    for chunk_size in CHUNK_SIZES:
+      fps, bps = bench_write(data_len, chunk_size)
+      print(f"comms_can_write {data_len:2d}B frames, {chunk_size:4d}B chunks: {fps / 1e6:6.2f} Mframes/s, {bps / 1e6:7.1f} MB/s")
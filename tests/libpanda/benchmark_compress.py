@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+Compression ratio and CPU cost of the compressed CAN read stream.
+Takes CSV logs from examples/can_logger.py, or makes up a drive without one.
+
+  ./benchmark_compress.py [output.csv ...]
+"""
+import csv
+import random
+import sys
+import time
+
+from panda import DLC_TO_LEN, CanDecompressor, unpack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+READ_SIZE = 16384
+BATCH = 4000  # fits the RX queue
+
+
+def load_csv(fn):
+  frames = []
+  with open(fn) as f:
+    for row in csv.DictReader(f):
+      dat = bytes.fromhex(row['Message'][2:])
+      frames.append((int(row['MessageID'], 16), int(row['Bus']) % 128, dat, int(float(row['Time']) * 1e6) & 0xFFFFFFFF))
+  return frames
+
+
+def synthetic_drive(seconds=10):
+  # three buses of periodic messages, counters and checksums, slowly changing
+  # signals and zero padding on the CAN-FD bus
+  msgs = []
+  for bus in range(3):
+    for _ in range(80):
+      length = random.choice([8, 8, 8, 8, 32, 64]) if bus == 0 else 8
+      msgs.append({"addr": random.randint(0x10, 0x7ff), "bus": bus, "period_us": random.choice([10000, 20000, 50000, 100000]),
+                   "dat": bytearray(length), "used": random.randint(2, min(length, 16))})
+
+  events = []
+  for m in msgs:
+    phase = random.randrange(m["period_us"])
+    events += [(t, id(m), m) for t in range(phase, seconds * 1_000_000, m["period_us"])]
+  events.sort(key=lambda e: e[:2])
+
+  frames = []
+  for t, _, m in events:
+    dat = m["dat"]
+    dat[0] = (dat[0] + 1) & 0xF
+    for i in range(2, m["used"]):
+      if random.random() < 0.05:
+        dat[i] = (dat[i] + random.choice([-1, 1])) & 0xFF
+    dat[1] = sum(dat[2:]) & 0xFF
+    frames.append((m["addr"], m["bus"], bytes(dat), (t + random.randint(0, 50)) & 0xFFFFFFFF))
+  return frames
+
+
+def read_all(buf):
+  out, elapsed = [], 0.
+  while True:
+    start = time.perf_counter()
+    rx_len = lpp.comms_can_read(buf, READ_SIZE)
+    elapsed += time.perf_counter() - start
+    out.append(bytes(buf[0:rx_len]))
+    if rx_len < READ_SIZE:
+      return b"".join(out), elapsed
+
+
+def run(frames, compressed):
+  lpp.comms_can_reset()
+  resp = libpanda_py.ffi.new("uint8_t[2]")
+  lpp.comms_can_set_compression(compressed, resp)
+  dec = CanDecompressor(resp[0], resp[1])
+  buf = libpanda_py.ffi.new(f"uint8_t[{READ_SIZE}]")
+  pkts = []
+  for addr, bus, dat, ts in frames:
+    pkt = libpanda_py.make_CANPacket(addr, bus, dat)
+    pkt[0].timestamp = ts
+    lpp.can_set_checksum(pkt)
+    pkts.append(pkt)
+
+  size, fw_time, host_time, rx = 0, 0., 0., []
+  for i in range(0, len(pkts), BATCH):
+    for p in pkts[i:i+BATCH]:
+      assert lpp.can_push(lpp.rx_q, p)
+    dat, elapsed = read_all(buf)
+    size += len(dat)
+    fw_time += elapsed
+
+    start = time.perf_counter()
+    rx += dec.decode(dat, timestamps=True) if compressed else unpack_can_buffer(dat, timestamps=True)[0]
+    host_time += time.perf_counter() - start
+
+  assert rx == [(a, d, b, t) for a, b, d, t in frames]
+  return size, fw_time, host_time
+
+
+if __name__ == "__main__":
+  logs = [(fn, load_csv(fn)) for fn in sys.argv[1:]] or [("synthetic drive", synthetic_drive())]
+  for name, frames in logs:
+    raw, raw_fw, raw_host = run(frames, False)
+    comp, comp_fw, comp_host = run(frames, True)
+    n = len(frames)
+    print(f"{name}: {n} frames, {sum(len(f[2]) for f in frames) / n:.1f} B avg payload")
+    print(f"  stream: {raw / n:.1f} -> {comp / n:.1f} B/frame, ratio {raw / comp:.2f}")
+    print(f"  comms_can_read (libpanda -O0): {raw_fw / n * 1e6:.2f} -> {comp_fw / n * 1e6:.2f} us/frame")
+    print(f"  host decode: {raw_host / n * 1e6:.2f} -> {comp_host / n * 1e6:.2f} us/frame")
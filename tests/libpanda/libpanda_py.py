@@ -20,6 +20,7 @@ typedef struct {
   unsigned char extended : 1;
   unsigned int addr : 29;
   unsigned char checksum;
+  unsigned int timestamp;
   unsigned char data[64];
 } CANPacket_t;
 """, packed=True)
@@ -50,7 +51,132 @@ void can_set_checksum(CANPacket_t *packet);
 int comms_can_read(uint8_t *data, uint32_t max_len);
 void comms_can_write(uint8_t *data, uint32_t len);
 void comms_can_reset(void);
+int comms_can_tx_credits(bool enabled, uint8_t *data);
+bool comms_can_tx_credits_enabled(void);
+extern uint32_t can_tx_comms_resume_usb_cnt;
+void comms_can_set_records_period(uint16_t period_ms);
+bool comms_can_records_due(uint32_t now);
+bool comms_can_push_record(uint8_t type, uint8_t index, const uint8_t *payload, uint32_t len);
+int comms_can_set_compression(bool enabled, uint8_t *resp);
 uint32_t can_slots_empty(can_ring *q);
+void can_clear(can_ring *q);
+void refresh_can_tx_slots_available(void);
+
+extern uint8_t *spi_mosi_addr;
+extern int spi_mosi_len;
+extern uint32_t spi_mosi_cnt;
+extern uint8_t *spi_miso_addr;
+extern int spi_miso_len;
+extern uint32_t spi_miso_cnt;
+extern uint32_t spi_miso_rx_q_free;
+void spi_init(void);
+void spi_rx_done(void);
+void spi_tx_done(bool reset);
+
+extern uint8_t fake_app_flash[0xE0000];
+extern uint32_t flash_blocks_programmed;
+void flash_stream_reset(void);
+void flash_stream_seek(uint32_t offset);
+void flash_stream_write(const uint8_t *data, uint32_t len);
+bool flash_stream_program(bool flush);
+void flash_stream_flush(void);
+uint32_t flash_stream_offset(void);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint8_t bus_off;
+  uint32_t bus_off_cnt;
+  uint8_t error_warning;
+  uint8_t error_passive;
+  uint8_t last_error;
+  uint8_t last_stored_error;
+  uint8_t last_data_error;
+  uint8_t last_data_stored_error;
+  uint8_t receive_error_cnt;
+  uint8_t transmit_error_cnt;
+  uint32_t total_error_cnt;
+  uint32_t total_tx_lost_cnt;
+  uint32_t total_rx_lost_cnt;
+  uint32_t total_tx_cnt;
+  uint32_t total_rx_cnt;
+  uint32_t total_fwd_cnt;
+  uint32_t total_tx_checksum_error_cnt;
+  uint16_t can_speed;
+  uint16_t can_data_speed;
+  uint8_t canfd_enabled;
+  uint8_t brs_enabled;
+  uint8_t canfd_non_iso;
+  uint32_t irq0_call_rate;
+  uint32_t irq1_call_rate;
+  uint32_t irq2_call_rate;
+  uint32_t can_core_reset_cnt;
+  uint16_t bus_load_1s;
+  uint16_t bus_load_10s;
+} can_health_t;
+""", packed=True)
+
+ffi.cdef("""
+extern can_health_t can_health[3];
+
+void can_bus_load_add(uint8_t can_number, const CANPacket_t *pkt, bool canfd, bool brs);
+void can_bus_load_tick(void);
+
+bool can_rx_filter_check(const CANPacket_t *pkt);
+bool can_rx_filter_set(uint8_t bus, uint32_t addr, uint8_t mode, uint16_t interval);
+void can_rx_filter_clear(void);
+extern uint32_t can_rx_filtered_cnt;
+
+bool can_periodic_set(uint8_t bus, uint32_t addr, uint16_t period, uint16_t phase);
+bool can_periodic_set_fields(uint8_t bus, uint32_t addr, uint16_t counter_start, uint8_t counter_len, uint16_t checksum_start, uint8_t checksum_len);
+void can_periodic_tick(uint32_t now);
+void can_periodic_clear(void);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint8_t tx_state;
+  uint8_t rx_state;
+  uint8_t error;
+  uint16_t rx_len;
+} isotp_status_t;
+""", packed=True)
+
+ffi.cdef("""
+bool isotp_open(uint8_t channel, uint8_t bus, uint32_t tx_addr, uint32_t rx_addr, bool ext_addr_en, uint8_t ext_addr, uint8_t block_size, uint8_t st_min);
+void isotp_close(uint8_t channel);
+bool isotp_send(uint8_t channel, uint16_t len);
+bool isotp_rx_hook(const CANPacket_t *msg);
+void isotp_tick(uint32_t now);
+bool isotp_get_status(uint8_t channel, isotp_status_t *status);
+uint16_t isotp_read(uint8_t channel, uint16_t offset, uint8_t *data, uint16_t len);
+void isotp_comms_write(const uint8_t *data, uint32_t len);
+void isotp_clear(void);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint32_t call_rate;
+  uint32_t busy_time;
+  uint32_t max_duration;
+  uint32_t duration_hist[8];
+} interrupt_stats_t;
+""", packed=True)
+
+ffi.cdef("""
+typedef struct {
+  uint32_t CNT;
+  uint32_t SR;
+} TIM_TypeDef;
+
+extern TIM_TypeDef *INTERRUPT_TIMER;
+extern uint32_t fake_irq_duration;
+extern uint32_t interrupt_stats_size;
+void fake_irq_register(uint8_t irq);
+void init_interrupts(bool check_rate_limit);
+void handle_interrupt(uint8_t irq_type);
+void interrupt_timer_handler(void);
+void get_interrupt_stats(uint16_t irq_num, interrupt_stats_t *stats);
 """)
 
 setup_safety_helpers(ffi)
@@ -63,6 +189,7 @@ class CANPacket:
   returned: int
   extended: int
   addr: int
+  timestamp: int
   data: list[int]
 
 class Panda(PandaSafety, Protocol):
@@ -70,7 +197,39 @@ class Panda(PandaSafety, Protocol):
   tx1_q: Any
   tx2_q: Any
   tx3_q: Any
+  can_health: Any
   def can_set_checksum(self, p: CANPacket) -> None: ...
+  def can_bus_load_add(self, can_number: int, pkt: CANPacket, canfd: bool, brs: bool) -> None: ...
+  def can_bus_load_tick(self) -> None: ...
+  can_rx_filtered_cnt: int
+  def can_rx_filter_check(self, pkt: CANPacket) -> bool: ...
+  def can_rx_filter_set(self, bus: int, addr: int, mode: int, interval: int) -> bool: ...
+  def can_rx_filter_clear(self) -> None: ...
+  def can_periodic_set(self, bus: int, addr: int, period: int, phase: int) -> bool: ...
+  def can_periodic_set_fields(self, bus: int, addr: int, counter_start: int, counter_len: int,
+                              checksum_start: int, checksum_len: int) -> bool: ...
+  def can_periodic_tick(self, now: int) -> None: ...
+  def can_periodic_clear(self) -> None: ...
+  def isotp_open(self, channel: int, bus: int, tx_addr: int, rx_addr: int, ext_addr_en: bool, ext_addr: int,
+                 block_size: int, st_min: int) -> bool: ...
+  def isotp_close(self, channel: int) -> None: ...
+  def isotp_send(self, channel: int, len: int) -> bool: ...
+  def isotp_rx_hook(self, msg: CANPacket) -> bool: ...
+  def isotp_tick(self, now: int) -> None: ...
+  def isotp_get_status(self, channel: int, status: Any) -> bool: ...
+  def isotp_read(self, channel: int, offset: int, data: Any, len: int) -> int: ...
+  def isotp_comms_write(self, data: Any, len: int) -> None: ...
+  def isotp_clear(self) -> None: ...
+
+  # interrupts
+  INTERRUPT_TIMER: Any
+  fake_irq_duration: int
+  interrupt_stats_size: int
+  def fake_irq_register(self, irq: int) -> None: ...
+  def init_interrupts(self, check_rate_limit: bool) -> None: ...
+  def handle_interrupt(self, irq_type: int) -> None: ...
+  def interrupt_timer_handler(self) -> None: ...
+  def get_interrupt_stats(self, irq_num: int, stats: Any) -> None: ...
 
   # safety
   def safety_rx_hook(self, to_send: CANPacket) -> int: ...
@@ -8,8 +8,9 @@ void process_can(uint8_t can_number) { }
 
 typedef struct harness_configuration harness_configuration;
 void refresh_can_tx_slots_available(void);
-void can_tx_comms_resume_usb(void) { };
-void can_tx_comms_resume_spi(void) { };
+uint32_t can_tx_comms_resume_usb_cnt = 0U;
+void can_tx_comms_resume_usb(void) { can_tx_comms_resume_usb_cnt++; };
+void can_tx_comms_resume_spi(void);
 
 #include "health.h"
 #include "faults.h"
@@ -18,6 +19,8 @@ void can_tx_comms_resume_spi(void) { };
 #include "safety.h"
 #include "main_definitions.h"
 #include "drivers/can_common.h"
+#include "drivers/can_periodic.h"
+#include "drivers/isotp.h"
 
 can_ring *rx_q = &can_rx_q;
 can_ring *tx1_q = &can_tx1_q;
@@ -27,5 +30,73 @@ can_ring *tx3_q = &can_tx3_q;
 #include "comms_definitions.h"
 #include "can_comms.h"
 
+// SPI protocol emulator with the H7 buffer sizes, python plays the host and the DMA
+#define ENABLE_SPI
+#define STM32H7
+uint8_t fake_uid[12] = {0};
+#define UID_BASE fake_uid
+void puth4(unsigned int i) { printf("%08x", i); }
+void hexdump(const void *a, int l) { (void)a; (void)l; }
+
+int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
+  int resp_len = 0;
+  if (req->request == 0xc0U) {
+    comms_can_reset();
+  } else if (req->request == 0xc1U) {
+    resp[0] = hw_type;
+    resp_len = 1;
+  } else {
+  }
+  return resp_len;
+}
+void comms_endpoint2_write(const uint8_t *data, uint32_t len) { (void)data; (void)len; }
+
+uint8_t *spi_mosi_addr = NULL;
+int spi_mosi_len = 0;
+uint32_t spi_mosi_cnt = 0U;
+uint8_t *spi_miso_addr = NULL;
+int spi_miso_len = 0;
+uint32_t spi_miso_cnt = 0U;
+uint32_t spi_miso_rx_q_free = 0U;  // free slots in can_rx_q when the response started clocking out
+void llspi_init(void) { }
+void llspi_mosi_dma(uint8_t *addr, int len) {
+  spi_mosi_addr = addr;
+  spi_mosi_len = len;
+  spi_mosi_cnt++;
+}
+void llspi_miso_dma(uint8_t *addr, int len) {
+  spi_miso_addr = addr;
+  spi_miso_len = len;
+  spi_miso_cnt++;
+  spi_miso_rx_q_free = can_slots_empty(&can_rx_q);
+}
+
+#include "drivers/spi.h"
+#undef STM32H7
+
+// bootstub flash writes, H7 flash words into a fake app region
+#define FLASH_PROG_SIZE 32U
+uint8_t fake_app_flash[0xE0000];
+#define APP_START_ADDRESS ((uintptr_t)fake_app_flash)
+uint32_t flash_blocks_programmed = 0U;
+void flash_write_block(uint32_t *prog_ptr, const uint32_t *data) {
+  (void)memcpy(prog_ptr, data, FLASH_PROG_SIZE);
+  flash_blocks_programmed++;
+}
+void flush_write_buffer(void) { }
+#include "drivers/flash_stream.h"
+
+// interrupt accounting, the fake IRQ handler keeps the microsecond timer running for fake_irq_duration
+typedef uint8_t IRQn_Type;
+#define NUM_INTERRUPTS 4U
+TIM_TypeDef interrupt_timer;
+TIM_TypeDef *INTERRUPT_TIMER = &interrupt_timer;
+void interrupt_timer_init(void) { }
+uint32_t fake_irq_duration = 0U;
+static void fake_irq_handler(void) { timer.CNT += fake_irq_duration; }
+#include "drivers/interrupts.h"
+uint32_t interrupt_stats_size = sizeof(interrupt_stats_t);
+void fake_irq_register(uint8_t irq) { REGISTER_INTERRUPT(irq, fake_irq_handler, 1000U, FAULT_INTERRUPT_RATE_TICK) }
+
 // libpanda stuff
 #include "safety_helpers.h"
@@ -0,0 +1,275 @@
+import os
+import select
+import struct
+import threading
+import time
+from collections import deque
+from contextlib import contextmanager
+from unittest.mock import patch
+
+import usb1
+
+from panda import Panda, DLC_TO_LEN
+from panda.python.usb import PandaUsbHandle
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+USB_PACKET_SIZE = 64
+
+
+class FakeTransfer:
+  def __init__(self, emu):
+    self._emu = emu
+    self._submitted = False
+    self._status = None
+    self._buffer = bytearray()
+    self._actual_length = 0
+
+  def setBulk(self, endpoint, buffer_or_len, callback=None, user_data=None, timeout=0):
+    self.endpoint = endpoint
+    self._length = buffer_or_len if isinstance(buffer_or_len, int) else len(buffer_or_len)
+    self._buffer = bytearray(self._length) if isinstance(buffer_or_len, int) else bytearray(buffer_or_len)
+    self._callback = callback
+    self._user_data = user_data
+
+  def submit(self):
+    assert not self._submitted
+    self._submitted = True
+    self._status = None
+    self._actual_length = 0
+    self._emu._submit(self)
+
+  def cancel(self):
+    if not self._submitted:
+      raise usb1.USBErrorNotFound()
+    self._emu._cancel(self)
+
+  def isSubmitted(self):
+    return self._submitted
+
+  def getStatus(self):
+    return self._status
+
+  def getActualLength(self):
+    return self._actual_length
+
+  def getBuffer(self):
+    return self._buffer
+
+  def getUserData(self):
+    return self._user_data
+
+  def close(self):
+    assert not self._submitted
+
+
+class FakeContext:
+  """The libusb context: completions are delivered from handleEventsTimeout, signalled on a poll fd."""
+  def __init__(self, emu):
+    self._emu = emu
+
+  def getPollFDList(self):
+    return [(self._emu._rfd, select.POLLIN)]
+
+  def setPollFDNotifiers(self, added_cb=None, removed_cb=None, user_data=None):
+    pass
+
+  def getNextTimeout(self):
+    return None
+
+  def handleEventsTimeout(self, tv=0):
+    select.select([self._emu._rfd], [], [], tv)
+    try:
+      os.read(self._emu._rfd, 4096)
+    except BlockingIOError:
+      pass
+    while True:
+      with self._emu.lock:
+        if len(self._emu._completed) == 0:
+          break
+        t = self._emu._completed.popleft()
+      t._callback(t)
+
+  def close(self):
+    pass
+
+
+class FakeUsbHandle:
+  """The libusb device handle. Sync bulk calls wait for the bus like libusb's do."""
+  def __init__(self, emu):
+    self._emu = emu
+
+  def getTransfer(self):
+    return FakeTransfer(self._emu)
+
+  def _sync(self, endpoint, buffer_or_len, timeout):
+    done = threading.Event()
+    t = FakeTransfer(self._emu)
+    t.setBulk(endpoint, buffer_or_len, callback=None)
+    t._done = done
+    t.submit()
+    if not done.wait(timeout / 1000 if timeout else None):
+      self._emu._cancel(t)
+      raise usb1.USBErrorTimeout()
+    return t
+
+  def bulkRead(self, endpoint, length, timeout=0):
+    t = self._sync(usb1.ENDPOINT_IN | endpoint, length, timeout)
+    return bytes(t.getBuffer()[:t.getActualLength()])
+
+  def bulkWrite(self, endpoint, data, timeout=0):
+    return self._sync(endpoint, data, timeout).getActualLength()
+
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    with self._emu.lock:
+      if request == 0xc1:
+        return Panda.HW_TYPE_RED_PANDA
+      if request == 0xdd:
+        return struct.pack("BBB", Panda.HEALTH_PACKET_VERSION, Panda.CAN_PACKET_VERSION, Panda.CAN_HEALTH_PACKET_VERSION)
+      if request == 0xd2:
+        health = [0] * len(Panda.HEALTH_STRUCT.format.strip("<"))
+        health[6] = self._emu.rx_overflow
+        return Panda.HEALTH_STRUCT.pack(*health)
+      if request == 0xc4 and index == 1:
+        stats = libpanda_py.ffi.new("interrupt_stats_t *")
+        lpp.get_interrupt_stats(value, stats)
+        return bytes(libpanda_py.ffi.buffer(stats))
+      if request == 0xd9:
+        dat = libpanda_py.ffi.new(f"uint8_t[{length}]")
+        return bytes(dat[0:lpp.comms_can_tx_credits(value != 0, dat)])
+      return bytes(length)
+
+  def controlWrite(self, request_type, request, value, index, data, timeout=0):
+    with self._emu.lock:
+      if request == 0xc0:
+        lpp.comms_can_reset()
+    return len(data)
+
+  def close(self):
+    pass
+
+
+class UsbEmulator:
+  """
+    libpanda behind a fake libusb device. A thread plays the USB bus: every
+    frame it moves up to BYTES_PER_FRAME between the queued transfers and
+    libpanda, in USB packets, and pushes the frames from traffic() into the
+    RX queue first. Frames sent by the panda are collected in sent.
+  """
+  FRAME_S = 0.001
+  BYTES_PER_FRAME = 19 * USB_PACKET_SIZE  # full-speed bulk
+
+  def __init__(self, traffic=None):
+    self.lock = threading.RLock()  # all libpanda access
+    self.traffic = traffic
+    self.sent = []
+    self.rx_overflow = 0
+    self.max_in_queued = 0
+    self.max_out_queued = 0
+
+    self._in = deque()
+    self._out = deque()
+    self._completed = deque()
+    self._rfd, self._wfd = os.pipe()
+    os.set_blocking(self._rfd, False)
+    self.context = FakeContext(self)
+    self.handle = FakeUsbHandle(self)
+
+    with self.lock:
+      lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+      lpp.comms_can_reset()
+      pkt = libpanda_py.ffi.new('CANPacket_t *')
+      for q in (lpp.rx_q, lpp.tx1_q, lpp.tx2_q, lpp.tx3_q):
+        while lpp.can_pop(q, pkt):
+          pass
+
+    self._start = time.monotonic()
+    self._running = True
+    self._thread = threading.Thread(target=self._bus_thread, daemon=True)
+    self._thread.start()
+
+  def now_us(self):
+    return int((time.monotonic() - self._start) * 1e6) & 0xFFFFFFFF
+
+  def stop(self):
+    self._running = False
+    self._thread.join()
+    os.close(self._rfd)
+    os.close(self._wfd)
+
+  @contextmanager
+  def panda(self):
+    with patch.object(Panda, "usb_connect", lambda *args, **kwargs: (self.context, PandaUsbHandle(self.handle), "EMULATOR", False, None)):
+      p = Panda("EMULATOR", cli=False)
+    try:
+      yield p
+    finally:
+      p.close()
+
+  def _submit(self, t):
+    with self.lock:
+      q = self._in if t.endpoint & usb1.ENDPOINT_IN else self._out
+      q.append(t)
+      self.max_in_queued = max(self.max_in_queued, len(self._in))
+      self.max_out_queued = max(self.max_out_queued, len(self._out))
+
+  def _cancel(self, t):
+    with self.lock:
+      for q in (self._in, self._out):
+        if t in q:
+          q.remove(t)
+          self._complete(t, usb1.TRANSFER_CANCELLED)
+
+  def _complete(self, t, status):
+    t._status = status
+    t._submitted = False
+    if getattr(t, "_done", None) is not None:
+      t._done.set()
+    else:
+      self._completed.append(t)
+      os.write(self._wfd, b"\x00")
+
+  def _bus_thread(self):
+    buf = libpanda_py.ffi.new(f"uint8_t[{USB_PACKET_SIZE}]")
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    next_frame = time.monotonic()
+    while self._running:
+      next_frame += self.FRAME_S
+      time.sleep(max(0., next_frame - time.monotonic()))
+
+      with self.lock:
+        if self.traffic is not None:
+          now = self.now_us()
+          for p in self.traffic():
+            p[0].timestamp = now
+            lpp.can_set_checksum(p)
+            if not lpp.can_push(lpp.rx_q, p):
+              self.rx_overflow += 1
+
+        budget = self.BYTES_PER_FRAME
+        while budget > 0 and (len(self._in) or len(self._out)):
+          if len(self._out):
+            t = self._out[0]
+            n = min(USB_PACKET_SIZE, t._length - t._actual_length)
+            chunk = bytes(t._buffer[t._actual_length:t._actual_length + n])
+            lpp.comms_can_write(chunk, n)
+            t._actual_length += n
+            budget -= max(n, 1)
+            if t._actual_length == t._length:
+              self._complete(self._out.popleft(), usb1.TRANSFER_COMPLETED)
+
+          if len(self._in) and budget > 0:
+            t = self._in[0]
+            n = lpp.comms_can_read(buf, min(USB_PACKET_SIZE, t._length - t._actual_length))
+            t._buffer[t._actual_length:t._actual_length + n] = bytes(buf[0:n])
+            t._actual_length += n
+            budget -= max(n, 1)
+            # a short packet ends the transfer
+            if n < USB_PACKET_SIZE or t._actual_length == t._length:
+              self._complete(self._in.popleft(), usb1.TRANSFER_COMPLETED)
+
+        # the CAN buses take everything queued
+        for bus, q in enumerate((lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)):
+          while lpp.can_pop(q, pkt):
+            self.sent.append((pkt[0].addr, bytes(pkt[0].data[0:DLC_TO_LEN[pkt[0].data_len_code]]), bus))
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+import asyncio
+import random
+import time
+import unittest
+
+from panda import AsyncPanda, DLC_TO_LEN
+from panda.tests.libpanda import libpanda_py
+from panda.tests.libpanda.usb_emulator import UsbEmulator
+
+
+def random_can_messages(n, bus=None):
+  msgs = []
+  for _ in range(n):
+    data = bytes(random.getrandbits(8) for _ in range(DLC_TO_LEN[random.randrange(0, 9)]))
+    msgs.append((random.randint(1, 0x7ff), data, random.randint(0, 2) if bus is None else bus))
+  return msgs
+
+
+class Traffic:
+  """Frames for the emulator to receive, a few per USB frame."""
+  def __init__(self, msgs, per_frame):
+    self.msgs = list(msgs)
+    self.per_frame = per_frame
+
+  def __call__(self):
+    out = self.msgs[:self.per_frame]
+    del self.msgs[:self.per_frame]
+    return [libpanda_py.make_CANPacket(m[0], m[2], m[1]) for m in out]
+
+
+class TestAsyncPanda(unittest.TestCase):
+  def setUp(self):
+    self.emu = None
+
+  def tearDown(self):
+    if self.emu is not None:
+      self.emu.stop()
+
+  def _run(self, coro, timeout=30):
+    return asyncio.run(asyncio.wait_for(coro, timeout))
+
+  async def _recv(self, ap, n):
+    rx = []
+    while len(rx) < n:
+      rx += [(addr, dat, bus) for addr, dat, bus in await ap.can_recv()]
+    return rx
+
+  def test_recv(self):
+    msgs = random_can_messages(3000)
+    self.emu = UsbEmulator(Traffic(msgs, 20))
+    with self.emu.panda() as p:
+      async def run():
+        async with AsyncPanda(p) as ap:
+          self.assertEqual(await self._recv(ap, len(msgs)), msgs)
+      self._run(run())
+    self.assertEqual(self.emu.rx_overflow, 0)
+    self.assertGreaterEqual(self.emu.max_in_queued, 2)
+
+  def test_async_iterator(self):
+    msgs = random_can_messages(200)
+    self.emu = UsbEmulator(Traffic(msgs, 5))
+    with self.emu.panda() as p:
+      async def run():
+        rx = []
+        async with AsyncPanda(p) as ap:
+          async for addr, dat, bus in ap:
+            rx.append((addr, dat, bus))
+            if len(rx) == len(msgs):
+              break
+        return rx
+      self.assertEqual(self._run(run()), msgs)
+
+  def test_send_concurrent(self):
+    self.emu = UsbEmulator()
+    # each caller's frames stay in order on its bus
+    sends = {bus: [random_can_messages(300, bus) for _ in range(3)] for bus in range(3)}
+    with self.emu.panda() as p:
+      async def run():
+        async with AsyncPanda(p, write_depth=2) as ap:
+          ap.WRITE_SIZE = 1024
+          await asyncio.gather(*[ap.can_send_many(b) for batches in sends.values() for b in batches])
+      self._run(run())
+
+    for _ in range(100):
+      if len(self.emu.sent) == 2700:
+        break
+      time.sleep(0.01)
+    for bus, batches in sends.items():
+      sent = [m for m in self.emu.sent if m[2] == bus]
+      self.assertEqual(sent, [m for b in batches for m in b])
+    self.assertLessEqual(self.emu.max_out_queued, 2)
+
+  def test_backpressure(self):
+    msgs = random_can_messages(2000)
+    self.emu = UsbEmulator(Traffic(msgs, 40))
+    with self.emu.panda() as p:
+      async def run():
+        async with AsyncPanda(p, max_pending=2) as ap:
+          # a slow consumer stops the reads once max_pending are waiting, the rest stays in the panda
+          await asyncio.sleep(0.2)
+          self.assertLess(len(ap._rx), 2 + ap._read_depth)
+          self.assertEqual(len(self.emu._in), 0)
+          self.assertEqual(await self._recv(ap, len(msgs)), msgs)
+      self._run(run())
+
+  def test_close(self):
+    msgs = random_can_messages(100)
+    self.emu = UsbEmulator(Traffic(msgs, 1))
+    with self.emu.panda() as p:
+      async def run():
+        ap = AsyncPanda(p)
+        await ap.start()
+        await self._recv(ap, 10)
+        await ap.close()
+        return ap
+      ap = self._run(run())
+      self.assertEqual(len(self.emu._in), 0)
+      self.assertEqual(len(ap._read_transfers), 0)
+
+      # the sync client keeps working on the same handle
+      p.can_send(0x123, b"\x01\x02", 1)
+      for _ in range(100):
+        if len(self.emu.sent):
+          break
+        time.sleep(0.01)
+      self.assertEqual(self.emu.sent, [(0x123, b"\x01\x02", 1)])
+
+
+if __name__ == "__main__":
+  unittest.main()
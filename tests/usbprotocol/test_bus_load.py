@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+import unittest
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+
+class TestCanBusLoad(unittest.TestCase):
+  def setUp(self):
+    # flush any bits and history left over from previous tests
+    for _ in range(10):
+      lpp.can_bus_load_tick()
+
+  def test_classic_frames(self):
+    # 8 byte standard frame: 98 stuffed bits + 18 estimated stuff bits + 13 = 129 bits
+    pkt = libpanda_py.make_CANPacket(0x100, 0, b"\x00" * 8)
+    for _ in range(1000):
+      lpp.can_bus_load_add(0, pkt, False, False)
+    lpp.can_bus_load_tick()
+
+    # 129000 bits at 500 kbps
+    self.assertEqual(lpp.can_health[0].bus_load_1s, 2580)
+    self.assertEqual(lpp.can_health[0].bus_load_10s, 258)
+
+    lpp.can_bus_load_tick()
+    self.assertEqual(lpp.can_health[0].bus_load_1s, 0)
+    self.assertEqual(lpp.can_health[0].bus_load_10s, 258)
+
+  def test_extended_longer_than_standard(self):
+    std = libpanda_py.make_CANPacket(0x100, 0, b"\x00" * 8)
+    ext = libpanda_py.make_CANPacket(0x18DAF110, 0, b"\x00" * 8)
+    lpp.can_bus_load_add(1, std, False, False)
+    lpp.can_bus_load_tick()
+    std_load = lpp.can_health[1].bus_load_1s
+    lpp.can_bus_load_add(1, ext, False, False)
+    lpp.can_bus_load_tick()
+    self.assertGreater(lpp.can_health[1].bus_load_1s, std_load)
+
+  def test_canfd_brs(self):
+    pkt = libpanda_py.make_CANPacket(0x100, 0, b"\x00" * 64)
+    for _ in range(100):
+      lpp.can_bus_load_add(2, pkt, True, False)
+    lpp.can_bus_load_tick()
+    no_brs_load = lpp.can_health[2].bus_load_1s
+
+    # data phase at 2 Mbps takes a quarter of the time compared to 500 kbps
+    for _ in range(100):
+      lpp.can_bus_load_add(2, pkt, True, True)
+    lpp.can_bus_load_tick()
+    brs_load = lpp.can_health[2].bus_load_1s
+    self.assertLess(brs_load, no_brs_load / 2)
+    self.assertGreater(brs_load, no_brs_load / 4)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+import random
+import unittest
+
+import usb1
+
+from panda import Panda, DLC_TO_LEN, CAN_RECORD_HEALTH, CanDecompressor, unpack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+SET_BITS = 9
+HISTORY = 8
+
+
+def make_frame(addr, bus, dat, ts, returned=False, rejected=False):
+  pkt = libpanda_py.make_CANPacket(addr, bus, dat)
+  pkt[0].timestamp = ts
+  pkt[0].returned = returned
+  pkt[0].rejected = rejected
+  lpp.can_set_checksum(pkt)
+  return pkt
+
+
+def expected(addr, bus, dat, ts, returned=False, rejected=False):
+  return (addr, bytes(dat), bus + (128 if returned else 0) + (192 if rejected else 0), ts)
+
+
+def drive_frames(n):
+  # a few periodic messages with a counter, a checksum and slowly changing signals
+  ids = [(random.randint(0x100, 0x7ff), random.randint(0, 2), random.choice([8, 8, 8, 32, 64])) for _ in range(40)]
+  state = {k: bytearray(k[2]) for k in ids}
+  frames, ts = [], 0
+  for i in range(n):
+    k = ids[i % len(ids)]
+    dat = state[k]
+    dat[0] = (dat[0] + 1) & 0xF
+    if random.random() < 0.2:
+      dat[random.randrange(2, len(dat) // 2)] ^= 1 << random.randrange(8)
+    dat[1] = sum(dat[2:]) & 0xFF
+    ts += random.randint(50, 300)
+    frames.append((k[0], k[1], bytes(dat), ts & 0xFFFFFFFF))
+  return frames
+
+
+class LibpandaHandle:
+  """Just enough of a handle to run Panda.can_recv against libpanda, with reads that get lost."""
+  def __init__(self):
+    self.lost_reads = 0
+
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    assert request == 0xd7
+    resp = libpanda_py.ffi.new("uint8_t[2]")
+    return bytes(resp[0:lpp.comms_can_set_compression(value != 0, resp)])
+
+  def bulkRead(self, endpoint, length, timeout=0):
+    dat = libpanda_py.ffi.new(f"uint8_t[{length}]")
+    ret = bytes(dat[0:lpp.comms_can_read(dat, length)])
+    if self.lost_reads > 0:
+      self.lost_reads -= 1
+      raise usb1.USBErrorIO()
+    return ret
+
+
+class TestCanCompression(unittest.TestCase):
+  def setUp(self):
+    lpp.comms_can_reset()
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    while lpp.can_pop(lpp.rx_q, pkt):
+      pass
+
+  def tearDown(self):
+    lpp.comms_can_reset()
+
+  def _enable(self):
+    resp = libpanda_py.ffi.new("uint8_t[2]")
+    self.assertEqual(lpp.comms_can_set_compression(True, resp), 2)
+    self.assertEqual(list(resp), [SET_BITS, HISTORY])
+
+  def _read(self, chunk_sizes=(64,)):
+    dat = libpanda_py.ffi.new("uint8_t[16384]")
+    out = b""
+    while True:
+      max_len = random.choice(chunk_sizes)
+      rx_len = lpp.comms_can_read(dat, max_len)
+      out += bytes(dat[0:rx_len])
+      if rx_len < max_len:
+        return out
+
+  def _roundtrip(self, frames, chunk_sizes=(64,)):
+    self._enable()
+    dec = CanDecompressor(SET_BITS, HISTORY)
+    rx = []
+    for i in range(0, len(frames), 1000):
+      for f in frames[i:i+1000]:
+        self.assertTrue(lpp.can_push(lpp.rx_q, make_frame(*f)))
+      dat = self._read(chunk_sizes)
+      # decode in pieces as they come in over USB
+      for j in range(0, len(dat), 64):
+        rx += dec.decode(dat[j:j+64], timestamps=True)
+    self.assertEqual(dec.buf, b"")
+    self.assertEqual(rx, [expected(*f) for f in frames])
+    return dat
+
+  def test_random_frames(self):
+    frames = []
+    for _ in range(5000):
+      addr = random.choice([random.randint(1, 0x7ff), random.randint(0x800, (1 << 29) - 1), 0x123, 0x456])
+      dat = bytes(random.getrandbits(8) for _ in range(random.choice(DLC_TO_LEN)))
+      frames.append((addr, random.randint(0, 2), dat, random.getrandbits(32), random.random() < 0.1, random.random() < 0.1))
+    self._roundtrip(frames, chunk_sizes=(1, 7, 64, 500))
+
+  def test_drive(self):
+    frames = drive_frames(5000)
+    self._roundtrip(frames, chunk_sizes=(64, 3, 1000))
+
+  def test_ratio(self):
+    frames = drive_frames(2000)
+    raw = sum(10 + len(f[2]) for f in frames)
+    self._enable()
+    for f in frames:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    compressed = len(self._read((16384,)))
+    self.assertLess(compressed * 2.2, raw)
+
+  def test_slot_collision(self):
+    # same slot, different frames replace each other
+    dec = CanDecompressor(SET_BITS, HISTORY)
+    a = 0x100
+    b, c = [x for x in range(a + 1, 0x800) if dec._set(0, x) == dec._set(0, a)][:2]
+    frames = [((a, b, c, a)[i % 4], 0, bytes([i & 0xFF] * 8), i * 100) for i in range(300)]
+    frames += [(a | (1 << 12), 0, b"\x01", 40000), (a, 1, b"\x02", 40001), (a, 0, b"\x03", 40002)]
+    self._roundtrip(frames)
+
+  def test_corrupted_hit(self):
+    self._enable()
+    lpp.can_push(lpp.rx_q, make_frame(0x200, 0, b"\x01" * 8, 100))
+    lpp.can_push(lpp.rx_q, make_frame(0x200, 0, b"\x02" * 8, 200))
+    dat = self._read()
+    self.assertEqual(len(CanDecompressor(SET_BITS, HISTORY).decode(dat)), 2)
+
+    # the checksum, the timestamp delta and the payload of the hit after the literal
+    hit = 1 + 10 + 8
+    for i in (hit + 2, hit + 3, len(dat) - 1):
+      bad = bytearray(dat)
+      bad[i] ^= 0x10
+      with self.assertRaises(AssertionError):
+        CanDecompressor(SET_BITS, HISTORY).decode(bad)
+
+  def test_renegotiate_after_lost_read(self):
+    handle = LibpandaHandle()
+    p = Panda.__new__(Panda)
+    p._handle = handle
+    p.can_version = Panda.CAN_PACKET_VERSION
+    p.can_rx_overflow_buffer = b""
+    p._inline_health_callback = None
+    p._can_reader = None
+    p._can_compression = False
+    self.assertTrue(p.set_can_compression(True))
+
+    frames = drive_frames(300)
+    for f in frames[:100]:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    self.assertEqual(p.can_recv(timestamps=True), [expected(*f) for f in frames[:100]])
+
+    # the frames in the lost read moved the firmware's dictionary on, both sides start over
+    for f in frames[100:200]:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    handle.lost_reads = 1
+    self.assertEqual(p.can_recv(timestamps=True), [])
+    self.assertTrue(p._can_compression)
+
+    for f in frames[200:]:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    self.assertEqual(p.can_recv(timestamps=True), [expected(*f) for f in frames[200:]])
+
+  def test_length_change(self):
+    frames = [(0x200, 0, bytes(range(DLC_TO_LEN[dlc])), dlc) for dlc in (8, 15, 4, 0, 15, 12, 8)]
+    self._roundtrip(frames)
+
+  def test_records(self):
+    self._enable()
+    lpp.comms_can_set_records_period(100)
+    health = bytes(random.getrandbits(8) for _ in range(Panda.HEALTH_STRUCT.size))
+    frames = drive_frames(100)
+    for f in frames[:50]:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    self.assertTrue(lpp.comms_can_push_record(CAN_RECORD_HEALTH, 0, health, len(health)))
+    dat = self._read((5,))
+    for f in frames[50:]:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    dat += self._read((64,))
+
+    records = []
+    dec = CanDecompressor(SET_BITS, HISTORY)
+    rx = dec.decode(dat, timestamps=True, record_callback=lambda *r: records.append(r))
+    self.assertEqual(rx, [expected(*f) for f in frames])
+    self.assertEqual([r[:3] for r in records], [(CAN_RECORD_HEALTH, 0, health)])
+
+  def test_reset_disables(self):
+    self._enable()
+    lpp.comms_can_reset()
+    frames = drive_frames(10)
+    for f in frames:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    msgs, rest = unpack_can_buffer(self._read(), timestamps=True)
+    self.assertEqual(rest, b"")
+    self.assertEqual(msgs, [expected(*f) for f in frames])
+
+  def test_enable_drops_partial_frame(self):
+    frames = drive_frames(20)
+    for f in frames:
+      lpp.can_push(lpp.rx_q, make_frame(*f))
+    dat = libpanda_py.ffi.new("uint8_t[16]")
+    lpp.comms_can_read(dat, 5)
+
+    # the rest of the first frame is dropped, everything after it is compressed
+    self._enable()
+    rx = CanDecompressor(SET_BITS, HISTORY).decode(self._read(), timestamps=True)
+    self.assertEqual(rx, [expected(*f) for f in frames[1:]])
+
+
+if __name__ == "__main__":
+  unittest.main()
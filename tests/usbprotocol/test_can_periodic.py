@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+import unittest
+
+from panda import Panda, DLC_TO_LEN, pack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+TICK_US = 1000
+
+
+def drain(q):
+  msgs = []
+  pkt = libpanda_py.ffi.new('CANPacket_t *')
+  while lpp.can_pop(q, pkt):
+    msgs.append((pkt[0].addr, bytes(pkt[0].data[0:DLC_TO_LEN[pkt[0].data_len_code]]), pkt[0].bus))
+  return msgs
+
+
+def host_write(msgs):
+  for buf in pack_can_buffer(msgs):
+    dat = libpanda_py.ffi.from_buffer(buf)
+    lpp.comms_can_write(dat, len(buf))
+
+
+class TestCanPeriodic(unittest.TestCase):
+  def setUp(self):
+    lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+    lpp.comms_can_reset()
+    lpp.can_periodic_clear()
+    lpp.set_timer(0)
+    for q in (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q, lpp.rx_q):
+      drain(q)
+
+  def tearDown(self):
+    lpp.can_periodic_clear()
+    lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+
+  def _run(self, start_ms, end_ms, update=None):
+    # simulated 1kHz tick, returns the ms timestamps of every frame sent on each tick.
+    # the host writes update before every tick
+    sent = []
+    for t in range(start_ms, end_ms):
+      lpp.set_timer(t * 1000)
+      if update is not None:
+        host_write(update)
+      lpp.can_periodic_tick(t * TICK_US)
+      sent += [(t, m) for m in drain(lpp.tx1_q) + drain(lpp.tx2_q) + drain(lpp.tx3_q)]
+    return sent
+
+  def test_period_and_phase(self):
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    self.assertTrue(lpp.can_periodic_set(1, 0x200, 20, 5))
+
+    # nothing is sent until the host provides a payload, which isn't sent directly
+    self.assertEqual(self._run(0, 50), [])
+    lpp.set_timer(50 * 1000)
+    host_write([(0x100, b"\x01\x02", 0), (0x200, b"\x03", 1)])
+    self.assertEqual(drain(lpp.tx1_q) + drain(lpp.tx2_q), [])
+
+    sent = self._run(50, 150)
+    self.assertEqual([t for t, m in sent if m[2] == 0], list(range(50, 150, 10)))
+    self.assertEqual([t for t, m in sent if m[2] == 1], list(range(50, 150, 20)))
+    self.assertTrue(all(m == (0x100, b"\x01\x02", 0) for t, m in sent if m[2] == 0))
+
+  def test_phase_delays_first_send(self):
+    lpp.set_timer(0)
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 5))
+    host_write([(0x100, b"\x00", 0)])
+    sent = self._run(0, 30)
+    self.assertEqual([t for t, _ in sent], [5, 15, 25])
+
+  def test_payload_update(self):
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    host_write([(0x100, b"\xaa", 0)])
+    sent = self._run(0, 20)
+    host_write([(0x100, b"\xbb\xcc", 0)])
+    sent += self._run(20, 40)
+    self.assertEqual([m[1] for _, m in sent], [b"\xaa", b"\xaa", b"\xbb\xcc", b"\xbb\xcc"])
+
+  def test_bad_checksum_update(self):
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    host_write([(0x100, b"\xaa", 0)])
+    sent = self._run(0, 20)
+
+    # a corrupted update is counted and dropped, the last good payload keeps going
+    errors = lpp.can_health[0].total_tx_checksum_error_cnt
+    buf = bytearray(pack_can_buffer([(0x100, b"\xbb", 0)])[0])
+    buf[-1] ^= 0x01
+    lpp.comms_can_write(libpanda_py.ffi.from_buffer(buf), len(buf))
+    self.assertEqual(lpp.can_health[0].total_tx_checksum_error_cnt, errors + 1)
+    sent += self._run(20, 40)
+    self.assertEqual([m[1] for _, m in sent], [b"\xaa"] * 4)
+
+  def test_other_frames_pass_through(self):
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    host_write([(0x101, b"\x01", 0), (0x100, b"\x01", 1)])
+    self.assertEqual(drain(lpp.tx1_q), [(0x101, b"\x01", 0)])
+    self.assertEqual(drain(lpp.tx2_q), [(0x100, b"\x01", 1)])
+
+  def test_counter(self):
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 1, 0))
+    # 4 bit counter in the high nibble of byte 1
+    self.assertTrue(lpp.can_periodic_set_fields(0, 0x100, 12, 4, 0, 0))
+    sent = self._run(0, 20, update=[(0x100, b"\xff\x0f", 0)])
+    self.assertEqual([m[1] for _, m in sent], [bytes([0xff, ((i % 16) << 4) | 0xf]) for i in range(20)])
+
+  def test_checksum_from_safety_mode(self):
+    lpp.set_safety_hooks(Panda.SAFETY_TOYOTA, 0)
+    self.assertTrue(lpp.can_periodic_set(0, 0x412, 10, 0))
+    # toyota: 8 bit sum over addr, len and payload in the last byte
+    self.assertTrue(lpp.can_periodic_set_fields(0, 0x412, 48, 8, 56, 8))
+    host_write([(0x412, b"\x00" * 8, 0)])
+    sent = self._run(0, 30)
+    self.assertEqual(len(sent), 3)
+    for i, (_, (_, dat, _)) in enumerate(sent):
+      self.assertEqual(dat[6], i)
+      self.assertEqual(dat[7], (0x12 + 0x04 + 8 + i) & 0xFF)
+
+  def test_safety_blocks(self):
+    lpp.set_safety_hooks(Panda.SAFETY_NOOUTPUT, 0)
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    host_write([(0x100, b"\x01", 0)])
+    self.assertEqual(self._run(0, 30), [])
+    # blocked frames come back as rejected
+    self.assertEqual(len(drain(lpp.rx_q)), 3)
+
+  def test_stale_host(self):
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    host_write([(0x100, b"\x01", 0)])
+    # the host stops updating, the frame stops after CAN_PERIODIC_STALE_MAX periods
+    self.assertEqual([t for t, _ in self._run(0, 300)], list(range(0, 100, 10)))
+
+    # and picks up again with the next update
+    lpp.set_timer(300 * 1000)
+    host_write([(0x100, b"\x02", 0)])
+    sent = self._run(300, 330)
+    self.assertEqual([m[1] for _, m in sent], [b"\x02"] * 3)
+
+    # a host that keeps updating is never cut off
+    sent = self._run(330, 630, update=[(0x100, b"\x03", 0)])
+    self.assertEqual(len(sent), 30)
+
+  def test_missed_ticks_dont_burst(self):
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    host_write([(0x100, b"\x01", 0)])
+    self.assertEqual(len(self._run(0, 1)), 1)
+    # tick stalls for 100ms
+    self.assertEqual(len(self._run(100, 101)), 1)
+    self.assertEqual([t for t, _ in self._run(101, 125)], [110, 120])
+
+  def test_timer_wraparound(self):
+    start = 2**32 // TICK_US - 15
+    lpp.set_timer(start * TICK_US)
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    host_write([(0x100, b"\x01", 0)])
+    sent = []
+    for t in range(start, start + 30):
+      lpp.can_periodic_tick((t * TICK_US) & 0xFFFFFFFF)
+      sent += [t - start for _ in drain(lpp.tx1_q)]
+    self.assertEqual(sent, [0, 10, 20])
+
+  def test_remove_and_table_full(self):
+    for addr in range(16):
+      self.assertTrue(lpp.can_periodic_set(0, addr, 10, 0))
+    self.assertFalse(lpp.can_periodic_set(0, 16, 10, 0))
+    self.assertTrue(lpp.can_periodic_set(0, 3, 0, 0))
+    self.assertTrue(lpp.can_periodic_set(0, 16, 10, 0))
+
+    # removed frames are sent directly again
+    host_write([(0x3, b"\x01", 0)])
+    self.assertEqual(drain(lpp.tx1_q), [(0x3, b"\x01", 0)])
+
+  def test_invalid_fields(self):
+    self.assertFalse(lpp.can_periodic_set_fields(0, 0x100, 0, 4, 0, 0))
+    self.assertTrue(lpp.can_periodic_set(0, 0x100, 10, 0))
+    self.assertFalse(lpp.can_periodic_set_fields(0, 0x100, 0, 9, 0, 0))
+    self.assertFalse(lpp.can_periodic_set_fields(0, 0x100, 0, 0, 0, 17))
+    self.assertTrue(lpp.can_periodic_set_fields(0, 0x100, 0, 8, 8, 16))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+import struct
+import threading
+import time
+import unittest
+
+from panda.tests.libpanda import libpanda_py
+from panda.tests.libpanda.usb_emulator import UsbEmulator
+
+PER_MS = 20       # frames received every USB frame, 20k frames/s
+DURATION_S = 2.
+PAUSE_S = 0.3     # long enough to overflow the firmware's 4096 frame RX queue
+
+
+class CountingTraffic:
+  """Frames numbered in their payload, for DURATION_S."""
+  def __init__(self):
+    self.sent = 0
+    self.end = time.monotonic() + DURATION_S
+
+  def __call__(self):
+    if time.monotonic() > self.end:
+      return []
+    out = [libpanda_py.make_CANPacket(0x100, 0, struct.pack("<Q", self.sent + i)) for i in range(PER_MS)]
+    self.sent += PER_MS
+    return out
+
+
+def counters(msgs):
+  return [struct.unpack("<Q", m[1])[0] for m in msgs]
+
+
+class TestCanReader(unittest.TestCase):
+  def setUp(self):
+    self.traffic = CountingTraffic()
+    self.emu = UsbEmulator(self.traffic)
+    self.addCleanup(self.emu.stop)
+
+  def _consume(self, read, pause_every_s=None):
+    """Reads until the traffic is over, with a PAUSE_S stall (a GC pause, a slow consumer) every pause_every_s."""
+    msgs = []
+    next_pause = time.monotonic() + (pause_every_s or 0)
+    idle = 0
+    while idle < 20:
+      new = read()
+      msgs += new
+      idle = idle + 1 if len(new) == 0 and time.monotonic() > self.traffic.end else 0
+      if pause_every_s is not None and time.monotonic() > next_pause:
+        time.sleep(PAUSE_S)
+        next_pause = time.monotonic() + pause_every_s
+      time.sleep(0.001)
+    return msgs
+
+  def test_without_reader(self):
+    with self.emu.panda() as p:
+      msgs = self._consume(p.can_recv, pause_every_s=0.5)
+    # the firmware queue overflowed during the stalls
+    self.assertGreater(self.emu.rx_overflow, 0)
+    self.assertLess(len(msgs), self.traffic.sent)
+
+  def test_sustained_load(self):
+    with self.emu.panda() as p:
+      reader = p.start_can_reader(health_period_s=0.1)
+      fast, slow = reader.cursor(from_oldest=True), reader.cursor(from_oldest=True)
+
+      results = {}
+      t = threading.Thread(target=lambda: results.setdefault("fast", self._consume(fast.read)))
+      t.start()
+      results["slow"] = self._consume(slow.read, pause_every_s=0.5)
+      t.join()
+
+      # the default cursor behind can_recv saw everything too
+      self.assertEqual(counters(p.can_recv()), list(range(self.traffic.sent)))
+      stats = reader.stats()
+      p.stop_can_reader()
+
+    self.assertEqual(self.emu.rx_overflow, 0)
+    self.assertEqual(stats["fw_rx_overflow"], 0)
+    self.assertEqual(stats["host_dropped"], 0)
+    self.assertEqual(stats["frames"], self.traffic.sent)
+    for name in ("fast", "slow"):
+      self.assertEqual(counters(results[name]), list(range(self.traffic.sent)), name)
+
+  def test_host_drops(self):
+    with self.emu.panda() as p:
+      # smaller than what arrives during a stall
+      reader = p.start_can_reader(capacity=4096, health_period_s=0.1)
+      fast, slow = reader.cursor(from_oldest=True), reader.cursor(from_oldest=True)
+
+      results = {}
+      t = threading.Thread(target=lambda: results.setdefault("fast", self._consume(fast.read)))
+      t.start()
+      results["slow"] = self._consume(slow.read, pause_every_s=0.5)
+      t.join()
+      p.stop_can_reader()
+
+    self.assertEqual(self.emu.rx_overflow, 0)
+    self.assertEqual(counters(results["fast"]), list(range(self.traffic.sent)))
+    self.assertEqual(fast.dropped, 0)
+
+    # the slow cursor lost the oldest frames of each stall, and counted them
+    got = counters(results["slow"])
+    self.assertGreater(slow.dropped, 0)
+    self.assertEqual(len(got) + slow.dropped, self.traffic.sent)
+    self.assertEqual(got, sorted(got))
+    self.assertEqual(len(got), len(set(got)))
+    self.assertEqual(reader.host_dropped, slow.dropped)
+
+  def test_wait(self):
+    with self.emu.panda() as p:
+      reader = p.start_can_reader(health_period_s=None)
+      c = reader.cursor()
+      self.assertTrue(c.wait(1.))
+      self.assertGreater(c.pending(), 0)
+      self.assertLessEqual(len(c.read(max_frames=5)), 5)
+      p.stop_can_reader()
+
+
+if __name__ == "__main__":
+  unittest.main()
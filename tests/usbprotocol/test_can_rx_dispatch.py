@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+import gc
+import threading
+import time
+import unittest
+
+from panda import CanRxDispatcher
+from panda.python.isotp import isotp_recv
+from panda.python.uds import CanClient, UdsClient, SERVICE_TYPE
+
+
+class FakePanda:
+  """can_send/can_recv on a fake bus, with an optional responder for sent frames."""
+  BATCH = 254
+
+  def __init__(self, responder=None):
+    self.pending = []
+    self.sent = []
+    self.recv_calls = 0
+    self.responder = responder
+    self.can_rx_dispatcher = CanRxDispatcher(self.can_recv)
+
+  def can_send(self, addr, dat, bus, timeout=0):
+    self.sent.append((addr, bytes(dat), bus))
+    if self.responder is not None:
+      self.pending += self.responder(addr, bytes(dat), bus)
+
+  def can_recv(self):
+    self.recv_calls += 1
+    ret, self.pending = self.pending[:self.BATCH], self.pending[self.BATCH:]
+    return ret
+
+
+def single(dat):
+  return (bytes([len(dat)]) + dat).ljust(8, b"\x00")
+
+
+class TestCanRxDispatch(unittest.TestCase):
+  def test_clients_keep_their_frames(self):
+    p = FakePanda()
+    a = CanClient(p.can_send, p.can_recv, 0x7E0, 0x7E8, 0, dispatcher=p.can_rx_dispatcher)
+    b = CanClient(p.can_send, p.can_recv, 0x7E1, 0x7E9, 0, dispatcher=p.can_rx_dispatcher)
+    for i in range(600):
+      p.pending.append((0x7E8 + i % 2, bytes([i % 256]), 0))
+      p.pending.append((0x100, b"\x00", 0))
+      p.pending.append((0x7E8, b"\x01", 1))
+
+    self.assertEqual(list(a.recv()), [bytes([i % 256]) for i in range(0, 600, 2)])
+    self.assertEqual(list(b.recv()), [bytes([i % 256]) for i in range(1, 600, 2)])
+    # read once, the second client didn't need the bus
+    self.assertEqual(p.recv_calls, 9)
+
+  def test_without_dispatcher_frames_are_lost(self):
+    p = FakePanda()
+    a = CanClient(p.can_send, p.can_recv, 0x7E0, 0x7E8, 0)
+    b = CanClient(p.can_send, p.can_recv, 0x7E1, 0x7E9, 0)
+    p.pending += [(0x7E8, b"\x01", 0), (0x7E9, b"\x02", 0)]
+    self.assertEqual(list(a.recv()), [b"\x01"])
+    self.assertEqual(list(b.recv()), [])
+
+  def test_drain(self):
+    p = FakePanda()
+    a = CanClient(p.can_send, p.can_recv, 0x7E0, 0x7E8, 0, dispatcher=p.can_rx_dispatcher)
+    p.pending += [(0x7E8, b"\x01", 0)]
+    self.assertEqual(list(a.recv(drain=True)), [])
+    p.pending += [(0x7E8, b"\x02", 0)]
+    self.assertEqual(list(a.recv()), [b"\x02"])
+
+  def test_functional_addressing(self):
+    p = FakePanda()
+    d = p.can_rx_dispatcher
+    c = CanClient(p.can_send, p.can_recv, 0x7DF, None, 0, dispatcher=d)
+    self.assertEqual(len(d._routes), 8)
+
+    p.pending += [(0x7EA, b"\x01", 0), (0x7EB, b"\x02", 0)]
+    self.assertEqual(list(c.recv()), [b"\x01"])
+    self.assertEqual((c.tx_addr, c.rx_addr), (0x7E2, 0x7EA))
+    self.assertEqual(list(d._routes), [(0, 0x7EA)])
+
+    p.pending += [(0x7EB, b"\x03", 0), (0x7EA, b"\x04", 0)]
+    self.assertEqual(list(c.recv()), [b"\x04"])
+
+  def test_unreferenced_queue(self):
+    p = FakePanda()
+    d = p.can_rx_dispatcher
+    c = CanClient(p.can_send, p.can_recv, 0x7E0, 0x7E8, 0, dispatcher=d)
+    q = d.subscribe(0, [0x7E8])
+    del c
+    gc.collect()
+    p.pending += [(0x7E8, b"\x01", 0)]
+    self.assertEqual(d.poll(), 1)
+    self.assertEqual(list(q), [(0x7E8, b"\x01")])
+    self.assertEqual(len(d._routes[(0, 0x7E8)]), 1)
+
+    d.unsubscribe(q)
+    self.assertEqual(d._routes, {})
+
+  def test_uds_clients(self):
+    # every ECU answers tester present, the answers all arrive in one batch
+    def responder(addr, dat, bus):
+      if addr == 0x7E0:
+        return [(0x7E8 + i, single(bytes([0x7E, 0x00])), bus) for i in range(4)]
+      return []
+
+    p = FakePanda(responder)
+    clients = [UdsClient(p, 0x7E0 + i, bus=0) for i in range(4)]
+    clients[0].tester_present()
+    for c in clients[1:]:
+      # the other ECUs' answers are still queued for their clients
+      self.assertEqual(list(c._can_client.recv()), [single(bytes([SERVICE_TYPE.TESTER_PRESENT + 0x40, 0x00]))])
+
+  def test_legacy_isotp_recv(self):
+    p = FakePanda()
+    p.pending += [(0x7E9, single(b"\x02"), 0), (0x7E8, single(b"\x01"), 0), (0x7E9, single(b"\x03"), 0)]
+    self.assertEqual(isotp_recv(p, 0x7E8), b"\x01")
+    # read before anyone asked for them
+    self.assertEqual(isotp_recv(p, 0x7E9), b"\x02")
+    self.assertEqual(isotp_recv(p, 0x7E9), b"\x03")
+
+  def test_threads(self):
+    # clients polling from their own threads, while others subscribe and leave
+    p = FakePanda()
+    inside = []
+    can_recv = p.can_recv
+
+    def slow_recv():
+      inside.append(1)
+      assert len(inside) == 1, "can_recv called concurrently"
+      time.sleep(0.0001)
+      ret = can_recv()
+      inside.pop()
+      return ret
+
+    p.can_rx_dispatcher._can_recv = slow_recv
+    d = p.can_rx_dispatcher
+    queues = [d.subscribe(0, [0x100 + i]) for i in range(4)]
+    p.pending += [(0x100 + i % 4, bytes([i % 256]), 0) for i in range(4000)]
+
+    errors = []
+    def run(i):
+      try:
+        for _ in range(200):
+          d.poll()
+          tmp = d.subscribe(1, [0x200 + i])
+          d.unsubscribe(tmp)
+      except Exception as e:
+        errors.append(e)
+
+    threads = [threading.Thread(target=run, args=(i, )) for i in range(4)]
+    for t in threads:
+      t.start()
+    for t in threads:
+      t.join()
+    self.assertEqual(errors, [])
+    for i, q in enumerate(queues):
+      self.assertEqual([d for _, d in q], [bytes([j % 256]) for j in range(i, 4000, 4)])
+    self.assertEqual(d._routes.keys(), {(0, 0x100 + i) for i in range(4)})
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+import struct
+import threading
+import time
+import unittest
+
+from panda import CanRxDispatcher
+from panda.python.ccp import CcpClient, CcpDaqSession, DaqSignal, BYTE_ORDER, COMMAND_CODE as CC
+
+TX_ADDR, RX_ADDR = 0x600, 0x601
+FIRST_PID = 0x10
+SAMPLES_PER_RECV = 20  # 20 kHz with a 1 ms can_recv
+
+
+class SimCcpSlave:
+  """CCP slave with one DAQ list, sampled SAMPLES_PER_RECV times for every can_recv.
+  The u16 at 0x100 counts the samples."""
+  def __init__(self, drop_every=None):
+    self.mem = bytearray(0x1000)
+    self.mem[0x200] = 0xF6                              # i8 -10
+    self.mem[0x300:0x304] = struct.pack(">f", 1.5)
+    self.mem[0x400:0x404] = struct.pack(">I", 0xDEADBEEF)
+    self.odts = [[] for _ in range(8)]
+    self.ptr = None
+    self.running = False
+    self.last_odt = 0
+    self.sample = 0
+    self.drop_every = drop_every  # (n, odt): drop that ODT of every nth sample
+    self.dropped = 0
+
+  def cmd(self, dat):
+    cmd, ctr = dat[0], dat[1]
+    ret = b""
+    if cmd == CC.GET_DAQ_SIZE:
+      ret = bytes([len(self.odts), FIRST_PID])
+    elif cmd == CC.SET_DAQ_PTR:
+      self.ptr = [dat[3], dat[4]]
+      self.odts[dat[3]] = self.odts[dat[3]][:dat[4]]
+    elif cmd == CC.WRITE_DAQ:
+      self.odts[self.ptr[0]].append((struct.unpack(">I", dat[4:8])[0], dat[2]))
+    elif cmd == CC.START_STOP:
+      self.running = dat[2] == 1
+      self.last_odt = dat[4]
+    return (bytes([0xFF, 0x00, ctr]) + ret).ljust(8, b"\x00")
+
+  def dtos(self):
+    out = []
+    if self.running:
+      for _ in range(SAMPLES_PER_RECV):
+        self.mem[0x100:0x102] = struct.pack(">H", self.sample & 0xFFFF)
+        for i in range(self.last_odt + 1):
+          if self.drop_every is not None and self.sample % self.drop_every[0] == 0 and i == self.drop_every[1]:
+            self.dropped += 1
+            continue
+          dat = bytes([FIRST_PID + i]) + b"".join(bytes(self.mem[a:a + n]) for a, n in self.odts[i])
+          out.append((RX_ADDR, dat.ljust(8, b"\x00"), 0))
+        self.sample += 1
+    return out
+
+
+class SimBus:
+  def __init__(self, slave):
+    self.slave = slave
+    self.lock = threading.Lock()
+    self.pending = []
+    self.can_rx_dispatcher = CanRxDispatcher(self.can_recv)
+
+  def can_clear(self, bus):
+    pass
+
+  def can_send(self, addr, dat, bus, timeout=0):
+    with self.lock:
+      if addr == TX_ADDR:
+        self.pending.append((RX_ADDR, self.slave.cmd(bytes(dat)), bus))
+
+  def can_recv(self):
+    time.sleep(0.001)
+    with self.lock:
+      ret = self.pending + self.slave.dtos()
+      self.pending = []
+    return ret
+
+
+SIGNALS = [
+  DaqSignal("counter", 0x100, 2),
+  DaqSignal("temp", 0x200, 1, signed=True, scale=0.5, offset=40.),
+  DaqSignal("ratio", 0x300, 4, is_float=True),
+  DaqSignal("odometer", 0x400, 4),
+]
+
+
+class TestCcpDaq(unittest.TestCase):
+  def _run(self, slave, samples):
+    client = CcpClient(SimBus(slave), TX_ADDR, RX_ADDR, byte_order=BYTE_ORDER.BIG_ENDIAN)
+    t, values = [], {s.name: [] for s in SIGNALS}
+    with CcpDaqSession(client, SIGNALS, event_channel=1) as daq:
+      self.assertEqual([[s.name for s in odt] for odt in daq.odts], [["counter", "temp", "ratio"], ["odometer"]])
+      end = time.monotonic() + 10
+      while len(t) < samples and time.monotonic() < end:
+        time.sleep(0.01)
+        ts, vs = daq.read()
+        t += ts
+        for k, v in vs.items():
+          values[k] += v
+    self.assertFalse(slave.running)
+    return daq, t, values
+
+  def test_daq(self):
+    slave = SimCcpSlave()
+    daq, t, values = self._run(slave, 2000)
+    self.assertGreaterEqual(len(t), 2000)
+    self.assertEqual((daq.odts_lost, daq.samples_dropped), (0, 0))
+    self.assertEqual(t, sorted(t))
+
+    self.assertEqual(values["counter"], [float(i) for i in range(len(t))])
+    self.assertEqual(set(values["temp"]), {35.})
+    self.assertEqual(set(values["ratio"]), {1.5})
+    self.assertEqual(set(values["odometer"]), {float(0xDEADBEEF)})
+
+  def test_odt_loss(self):
+    slave = SimCcpSlave(drop_every=(10, 1))
+    daq, t, values = self._run(slave, 1000)
+    self.assertGreater(slave.dropped, 0)
+    # stopped while the last samples were still queued
+    self.assertAlmostEqual(daq.odts_lost, slave.dropped, delta=2 * SAMPLES_PER_RECV / 10)
+    self.assertEqual(daq.samples_dropped, daq.odts_lost)
+    self.assertTrue(all(c % 10 != 0 for c in values["counter"]))
+    self.assertEqual(len(values["counter"]), len(set(values["counter"])))
+
+  def test_odt_loss_first(self):
+    slave = SimCcpSlave(drop_every=(7, 0))
+    daq, t, values = self._run(slave, 500)
+    self.assertGreater(daq.odts_lost, 0)
+    self.assertTrue(all(c % 7 != 0 for c in values["counter"]))
+
+  def test_too_many_odts(self):
+    client = CcpClient(SimBus(SimCcpSlave()), TX_ADDR, RX_ADDR)
+    with self.assertRaisesRegex(ValueError, "ODTs needed"):
+      CcpDaqSession(client, [DaqSignal(str(i), 0x100, 4) for i in range(9)]).configure()
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -1,9 +1,16 @@
 #!/usr/bin/env python3
 import random
+import struct
+import threading
+import time
 import unittest
 
-from panda import Panda, DLC_TO_LEN, USBPACKET_MAX_SIZE, pack_can_buffer, unpack_can_buffer
+import usb1
+
+from panda import Panda, DLC_TO_LEN, USBPACKET_MAX_SIZE, CAN_RECORD_HEALTH, CAN_RECORD_CAN_HEALTH, \
+                  pack_can_buffer, unpack_can_buffer
 from panda.tests.libpanda import libpanda_py
+from panda.tests.libpanda.usb_emulator import UsbEmulator
 
 lpp = libpanda_py.libpanda
 
@@ -124,6 +131,72 @@ class TestPandaComms(unittest.TestCase):
           self.assertEqual(len(queue_msgs), len(msgs))
           self.assertEqual(queue_msgs, msgs)
 
+  def test_can_send_random_chunks(self):
+    lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+
+    for _ in range(50):
+      msgs = random_can_messages(200, bus=random.randint(0, 2))
+      buf = b"".join(pack_can_buffer(msgs))
+
+      # chunk boundaries anywhere, including inside the header of a frame
+      i = 0
+      while i < len(buf):
+        chunk_len = min(random.randint(1, 2 * CHUNK_SIZE), len(buf) - i)
+        lpp.comms_can_write(buf[i:i+chunk_len], chunk_len)
+        i += chunk_len
+
+      queue_msgs = []
+      pkt = libpanda_py.ffi.new('CANPacket_t *')
+      for q in TX_QUEUES:
+        while lpp.can_pop(q, pkt):
+          queue_msgs.append(unpackage_can_msg(pkt))
+      self.assertEqual(queue_msgs, msgs)
+
+  def test_can_send_blocked(self):
+    lpp.set_safety_hooks(Panda.SAFETY_NOOUTPUT, 0)
+    msgs = random_can_messages(50, bus=1)
+    for buf in pack_can_buffer(msgs):
+      lpp.comms_can_write(buf, len(buf))
+
+    # blocked frames don't take a TX slot and come back as rejected
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    self.assertFalse(lpp.can_pop(lpp.tx2_q, pkt))
+    rejected = []
+    while lpp.can_pop(lpp.rx_q, pkt):
+      self.assertTrue(pkt[0].rejected)
+      rejected.append(unpackage_can_msg(pkt))
+    self.assertEqual(rejected, msgs)
+    lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+
+  def test_can_send_queue_full(self):
+    lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+    free = lpp.can_slots_empty(lpp.tx1_q)
+    msgs = random_can_messages(free + 10, bus=0)
+    for buf in pack_can_buffer(msgs):
+      lpp.comms_can_write(buf, len(buf))
+
+    queue_msgs = []
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    while lpp.can_pop(lpp.tx1_q, pkt):
+      queue_msgs.append(unpackage_can_msg(pkt))
+    self.assertEqual(queue_msgs, msgs[:free])
+
+  def test_can_receive_timestamps(self):
+    msgs = random_can_messages(100)
+    timestamps = [random.getrandbits(32) for _ in msgs]
+    for m, ts in zip(msgs, timestamps, strict=True):
+      pkt = libpanda_py.make_CANPacket(m[0], m[2], m[1])
+      pkt[0].timestamp = ts
+      lpp.can_set_checksum(pkt)
+      lpp.can_push(lpp.rx_q, pkt)
+
+    dat = libpanda_py.ffi.new("uint8_t[16384]")
+    rx_len = lpp.comms_can_read(dat, 16384)
+    rx_msgs, overflow = unpack_can_buffer(bytes(dat[0:rx_len]), timestamps=True)
+
+    self.assertEqual(len(overflow), 0)
+    self.assertEqual(rx_msgs, [(*m, ts) for m, ts in zip(msgs, timestamps, strict=True)])
+
   def test_can_receive_usb(self):
     msgs = random_can_messages(50000)
     packets = [libpanda_py.make_CANPacket(m[0], m[2], m[1]) for m in msgs]
@@ -155,6 +228,198 @@ class TestPandaComms(unittest.TestCase):
     self.assertEqual(len(rx_msgs), len(msgs))
     self.assertEqual(rx_msgs, msgs)
 
+  def _push_record(self, record_type, index, payload):
+    return lpp.comms_can_push_record(record_type, index, payload, len(payload))
+
+  def test_inline_records(self):
+    health = bytes(random.getrandbits(8) for _ in range(Panda.HEALTH_STRUCT.size))
+    can_health = [bytes(random.getrandbits(8) for _ in range(Panda.CAN_HEALTH_STRUCT.size)) for _ in range(3)]
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    while lpp.can_pop(lpp.rx_q, pkt):
+      pass
+
+    # records are opt-in
+    self.assertFalse(self._push_record(CAN_RECORD_HEALTH, 0, health))
+    lpp.comms_can_set_records_period(500)
+    self.assertFalse(self._push_record(CAN_RECORD_CAN_HEALTH, 3, can_health[0]))
+    self.assertFalse(self._push_record(CAN_RECORD_HEALTH, 0, bytes(0x51)))
+
+    msgs = random_can_messages(200)
+    for m in msgs[:100]:
+      lpp.can_push(lpp.rx_q, libpanda_py.make_CANPacket(m[0], m[2], m[1]))
+    # only the latest unread record of each kind is sent
+    self.assertTrue(self._push_record(CAN_RECORD_HEALTH, 0, bytes(len(health))))
+    self.assertTrue(self._push_record(CAN_RECORD_HEALTH, 0, health))
+    for bus in range(3):
+      self.assertTrue(self._push_record(CAN_RECORD_CAN_HEALTH, bus, can_health[bus]))
+
+    records = []
+    rx_msgs = []
+    overflow_buf = b""
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    for i in range(1000):
+      if i == 20:
+        for m in msgs[100:]:
+          lpp.can_push(lpp.rx_q, libpanda_py.make_CANPacket(m[0], m[2], m[1]))
+        self.assertTrue(self._push_record(CAN_RECORD_CAN_HEALTH, 1, can_health[0]))
+      rx_len = lpp.comms_can_read(dat, random.randint(1, CHUNK_SIZE))
+      unpacked, overflow_buf = unpack_can_buffer(overflow_buf + bytes(dat[0:rx_len]),
+                                                 record_callback=lambda *r: records.append(r[:3]))
+      rx_msgs.extend(unpacked)
+
+    self.assertEqual(rx_msgs, msgs)
+    self.assertEqual(len(overflow_buf), 0)
+    self.assertEqual(records, [(CAN_RECORD_HEALTH, 0, health)] +
+                              [(CAN_RECORD_CAN_HEALTH, bus, can_health[bus]) for bus in range(3)] +
+                              [(CAN_RECORD_CAN_HEALTH, 1, can_health[0])])
+
+    # payloads decode like the polled health packets
+    self.assertEqual(Panda._parse_health(health)["uptime"], int.from_bytes(health[:4], "little"))
+    can_health_pkt = Panda.CAN_HEALTH_STRUCT.pack(1, *([0] * (len(Panda.CAN_HEALTH_STRUCT.unpack(can_health[0])) - 1)))
+    self.assertEqual(Panda._parse_can_health(can_health_pkt)["bus_off"], 1)
+
+    # records without a callback are dropped
+    self.assertTrue(self._push_record(CAN_RECORD_HEALTH, 0, health))
+    dat = libpanda_py.ffi.new("uint8_t[256]")
+    rx_len = lpp.comms_can_read(dat, 256)
+    self.assertEqual(unpack_can_buffer(bytes(dat[0:rx_len])), ([], b""))
+
+  def test_inline_records_reset(self):
+    lpp.comms_can_set_records_period(100)
+    self.assertTrue(self._push_record(CAN_RECORD_HEALTH, 0, b"\x01" * 10))
+    lpp.comms_can_reset()
+
+    # reset drops pending records and turns them off
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    self.assertEqual(lpp.comms_can_read(dat, CHUNK_SIZE), 0)
+    self.assertFalse(self._push_record(CAN_RECORD_HEALTH, 0, b"\x01" * 10))
+    self.assertFalse(lpp.comms_can_records_due(0))
+
+  def test_inline_records_period(self):
+    lpp.set_timer(0)
+    lpp.comms_can_set_records_period(100)
+    due = [t for t in range(0, 1000000, 1000) if lpp.comms_can_records_due(t)]
+    self.assertEqual(due, list(range(0, 1000000, 100000)))
+
+
+class LibpandaHandle:
+  """Just enough of a handle to run Panda.can_send_many against libpanda."""
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    assert request == 0xd9
+    dat = libpanda_py.ffi.new("uint8_t[6]")
+    return bytes(dat[0:lpp.comms_can_tx_credits(value != 0, dat)])
+
+  def bulkWrite(self, endpoint, data, timeout=0):
+    lpp.comms_can_write(libpanda_py.ffi.from_buffer(data), len(data))
+    return len(data)
+
+
+def drain(q):
+  sent = []
+  pkt = libpanda_py.ffi.new('CANPacket_t *')
+  while lpp.can_pop(q, pkt):
+    sent.append(bytes(pkt[0].data[0:DLC_TO_LEN[pkt[0].data_len_code]]))
+  return sent
+
+
+class TestCanTxCredits(unittest.TestCase):
+  def setUp(self):
+    lpp.comms_can_reset()
+    for q in TX_QUEUES:
+      drain(q)
+
+    self.handle = LibpandaHandle()
+    self.panda = Panda.__new__(Panda)
+    self.panda._handle = self.handle
+    self.panda.can_version = Panda.CAN_PACKET_VERSION
+    self.panda._can_tx_credits = False
+    self.panda._tx_credits = None
+    self.assertTrue(self.panda.set_can_tx_credits(True))
+
+  def _credits(self):
+    return list(struct.unpack("<3H", self.handle.controlRead(0xc0, 0xd9, 1, 0, 6)))
+
+  def test_credits(self):
+    self.assertTrue(lpp.comms_can_tx_credits_enabled())
+    full = self._credits()
+    self.assertEqual(full, [416 - 1 - 16] * 3)
+
+    for _ in range(100):
+      lpp.can_push(lpp.tx2_q, libpanda_py.make_CANPacket(0x100, 1, b""))
+    self.assertEqual(self._credits(), [full[0], full[1] - 100, full[2]])
+
+    # comms reset turns credits off again, so does 0xd9 with param1 0
+    lpp.comms_can_reset()
+    self.assertFalse(lpp.comms_can_tx_credits_enabled())
+    self.assertTrue(self.panda.set_can_tx_credits(True))
+    self.panda.set_can_tx_credits(False)
+    self.assertFalse(lpp.comms_can_tx_credits_enabled())
+    self.assertIsNone(self.panda._tx_credits)
+
+  def test_stalled_bus(self):
+    # nothing drains bus 2
+    stalled = [(0x200, b"\x02", 2)] * 1000
+    healthy = [(0x100, b"\x01", 0)] * 300
+
+    with self.assertRaises(usb1.USBErrorTimeout):
+      self.panda.can_send_many(stalled + healthy, timeout=20)
+    # the healthy bus went out in full, the stalled one up to its credits
+    self.assertEqual(len(drain(lpp.tx1_q)), 300)
+    self.assertEqual(self._credits()[2], 0)
+    self.assertEqual(len(drain(lpp.tx3_q)), 416 - 1 - 16)
+
+    # the rest was dropped, not left for the next call
+    self.panda.can_send_many(healthy)
+    self.assertEqual(len(drain(lpp.tx1_q)), 300)
+    self.assertEqual(drain(lpp.tx3_q), [])
+
+  def test_waits_for_credits(self):
+    msgs = [(0x200, bytes([i % 256]), 2) for i in range(1000)]
+    sent = []
+    done = threading.Event()
+
+    def bus():
+      while not done.is_set():
+        sent.extend(drain(lpp.tx3_q))
+        time.sleep(0.001)
+
+    t = threading.Thread(target=bus)
+    t.start()
+    try:
+      # 0 waits as long as it takes
+      self.panda.can_send_many(msgs, timeout=0)
+    finally:
+      done.set()
+      t.join()
+    sent.extend(drain(lpp.tx3_q))
+    self.assertEqual(sent, [m[1] for m in msgs])
+
+  def test_floor(self):
+    # a host ignoring its credits still gets backpressure
+    dat = b"".join(pack_can_buffer([(0x200, b"\x02", 2)] * (416 - 1 - 4)))
+    resumed = lpp.can_tx_comms_resume_usb_cnt
+    lpp.comms_can_write(libpanda_py.ffi.from_buffer(dat), len(dat))
+    self.assertEqual(lpp.can_tx_comms_resume_usb_cnt, resumed)
+
+    drain(lpp.tx3_q)
+    lpp.comms_can_write(libpanda_py.ffi.from_buffer(dat), 0)
+    self.assertEqual(lpp.can_tx_comms_resume_usb_cnt, resumed + 1)
+
+  def test_opt_in(self):
+    emu = UsbEmulator()
+    self.addCleanup(emu.stop)
+    with emu.panda() as p:
+      self.assertFalse(lpp.comms_can_tx_credits_enabled())
+      self.assertIsNone(p._tx_credits)
+      self.assertNotIn(0xd9, [r[1] for r in p._connect_requests()])
+      self.assertTrue(p.set_can_tx_credits(True))
+
+      # kept across comms resets and reconnects
+      p.can_reset_communications()
+      self.assertTrue(lpp.comms_can_tx_credits_enabled())
+      self.assertIsNotNone(p._tx_credits)
+      self.assertIn(0xd9, [r[1] for r in p._connect_requests()])
+
 
 if __name__ == "__main__":
   unittest.main()
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+import os
+import struct
+import unittest
+from unittest.mock import patch
+
+from panda import PandaDFU, McuType
+from panda.python.usb import STBootloaderUSBHandle
+
+DFU_DNLOAD, DFU_GETSTATUS, DFU_CLRSTATUS, DFU_ABORT = 1, 3, 4, 6
+STATE_IDLE, STATE_DNLOAD_SYNC, STATE_DNBUSY, STATE_DNLOAD_IDLE, STATE_ERROR = 2, 3, 4, 5, 10
+ERR_WRITE, ERR_TARGET = 0x03, 0x08
+
+CONTROL_S = 1e-3   # a control transfer on full-speed USB
+BLOCK_S = 10e-3    # programming a DFU block
+
+# modeled erase times by sector size, and a full mass erase
+ERASE_S = {0x4000: 0.25, 0x10000: 0.55, 0x20000: 1.1}
+MASS_ERASE_S = 12.0
+
+FLASH_DESCRIPTORS = {
+  McuType.F4: "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,011*128Kg",
+  McuType.H7: "@Internal Flash  /0x08000000/08*128Kg",
+}
+
+
+class FakeClock:
+  def __init__(self):
+    self.t = 0.
+
+  def monotonic(self):
+    return self.t
+
+  def sleep(self, s):
+    self.t += s
+
+
+class FakeDfuDevice:
+  """
+  ST's DfuSe bootloader from the host's side. Commands run on the first GETSTATUS after
+  a DNLOAD, which reports the time they take. Until then it answers busy.
+  """
+  def __init__(self, mcu_type, clock):
+    self.mcu_type = mcu_type
+    self.clock = clock
+    sizes = mcu_type.config.sector_sizes + ([0x20000] if mcu_type == McuType.H7 else [])
+    self.sectors = [(mcu_type.config.sector_address(i), size) for i, size in enumerate(sizes)]
+    self.flash = bytearray(os.urandom(sum(sizes)))
+    self.state = STATE_IDLE
+    self.status = 0
+    self.address = 0
+    self.pending = None
+    self.busy_until = 0.
+    self.getstatus_cnt = 0
+    self.erase_cmds = []
+
+  def getStringDescriptor(self, i, lang):
+    return FLASH_DESCRIPTORS[self.mcu_type] if i == 4 else None
+
+  def controlWrite(self, request_type, request, value, index, data, timeout=0):
+    self.clock.t += CONTROL_S
+    if request == DFU_DNLOAD:
+      assert self.state in (STATE_IDLE, STATE_DNLOAD_IDLE), f"DNLOAD while in state {self.state}"
+      self.pending = (value, bytes(data))
+      self.state = STATE_DNLOAD_SYNC
+    elif request == DFU_ABORT:
+      self.state = STATE_IDLE
+
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    self.clock.t += CONTROL_S
+    if request == DFU_CLRSTATUS:
+      self.state, self.status = STATE_IDLE, 0
+      return b""
+    assert request == DFU_GETSTATUS
+
+    self.getstatus_cnt += 1
+    poll_s = 0.
+    if self.state == STATE_DNLOAD_SYNC:
+      poll_s = self._run(*self.pending)
+      self.busy_until = self.clock.t + poll_s
+      self.state = STATE_DNBUSY if self.status == 0 else STATE_ERROR
+    elif self.state == STATE_DNBUSY:
+      if self.clock.t >= self.busy_until:
+        self.state = STATE_DNLOAD_IDLE
+      else:
+        poll_s = self.busy_until - self.clock.t
+    poll_ms = int(poll_s * 1000 + 0.999)
+    return struct.pack("<BI", self.status, poll_ms)[:4] + bytes([self.state, 0])
+
+  def _offset(self, address):
+    return address - self.mcu_type.config.bootstub_address
+
+  def _run(self, value, data):
+    if value == 0 and data[:1] == b"\x21":
+      self.address = struct.unpack("<I", data[1:5])[0]
+      return 0.
+    if value == 0 and data == b"\x41":
+      self.erase_cmds.append("mass")
+      self.flash[:] = b"\xff" * len(self.flash)
+      return MASS_ERASE_S
+    if value == 0 and data[:1] == b"\x41":
+      address = struct.unpack("<I", data[1:5])[0]
+      start, size = next(s for s in self.sectors if s[0] == address)
+      self.erase_cmds.append(address)
+      self.flash[self._offset(start):self._offset(start) + size] = b"\xff" * size
+      return ERASE_S[size]
+
+    # write block
+    off = self._offset(self.address) + (value - 2) * self.mcu_type.config.block_size
+    if any(b != 0xff for b in self.flash[off:off + len(data)]):
+      self.status = ERR_WRITE
+      return 0.
+    self.flash[off:off + len(data)] = data
+    return BLOCK_S
+
+
+class TestDfu(unittest.TestCase):
+  def _dfu(self, mcu_type):
+    clock = FakeClock()
+    dev = FakeDfuDevice(mcu_type, clock)
+    with patch.object(PandaDFU, "usb_connect", lambda serial: (None, STBootloaderUSBHandle(None, dev))):
+      dfu = PandaDFU(None)
+    return dfu, dev, clock
+
+  def _program(self, mcu_type):
+    dfu, dev, clock = self._dfu(mcu_type)
+    code = os.urandom(12345)
+    with patch("panda.python.usb.time", clock), patch("panda.python.dfu.time", clock):
+      times = dfu.program_bootstub(code)
+    self.assertEqual(bytes(dev.flash[:len(code)]), code)
+    self.assertEqual(set(dev.flash[len(code):sum(mcu_type.config.sector_sizes)]), {0xff})
+    return dev, clock, times
+
+  def test_f4_mass_erase(self):
+    dev, clock, times = self._program(McuType.F4)
+    self.assertEqual(dev.erase_cmds, ["mass"])
+    self.assertAlmostEqual(times["erase"], MASS_ERASE_S, delta=0.01)
+
+  def test_h7_keeps_provisioning_sector(self):
+    dfu, dev, clock = self._dfu(McuType.H7)
+    provisioning = bytes(dev.flash[-0x20000:])
+    with patch("panda.python.usb.time", clock), patch("panda.python.dfu.time", clock):
+      times = dfu.program_bootstub(os.urandom(5000))
+    self.assertEqual(dev.erase_cmds, [McuType.H7.config.sector_address(i) for i in range(7)])
+    self.assertEqual(bytes(dev.flash[-0x20000:]), provisioning)
+    self.assertAlmostEqual(times["erase"], 7 * ERASE_S[0x20000], delta=0.05)
+
+  def test_poll_timeout(self):
+    dev, clock, times = self._program(McuType.H7)
+    blocks = (12345 + 0x3ff) // 0x400
+
+    # one status to start each command and one once it's done, instead of spinning
+    cmds = len(dev.erase_cmds) + 1 + blocks
+    self.assertLessEqual(dev.getstatus_cnt, 2 * cmds + 2)
+    self.assertAlmostEqual(times["program"], blocks * (BLOCK_S + 3 * CONTROL_S) + 3 * CONTROL_S, delta=0.01)
+
+  def test_write_error(self):
+    dfu, dev, clock = self._dfu(McuType.H7)
+    with patch("panda.python.usb.time", clock):
+      # not erased
+      with self.assertRaisesRegex(AssertionError, "DFU error"):
+        dfu._handle.program(McuType.H7.config.bootstub_address, b"\x00" * 100)
+
+      # back to idle after a clear
+      dfu._handle.clear_status()
+      self.assertEqual(dev.state, STATE_IDLE)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+import hashlib
+import os
+import struct
+import unittest
+
+from panda import Panda, McuType
+from panda.python.base import BaseHandle
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+APP_MAX_LEN = 0xE0000
+SECTOR_SIZE = 0x20000
+
+# modeled H7 on full-speed USB
+XFER_OVERHEAD_S = 125e-6     # host round trip for a sync bulk transfer
+PACKET_S = 1e-3 / 19         # 64 byte packets, 19 per frame
+FLASH_WORD_S = 20e-6         # programming a 256 bit flash word
+SHA_BYTES_PER_S = 30e6
+
+
+class FakeFlasher(BaseHandle):
+  """
+  The bootstub's flasher endpoints on top of the libpanda flash stream, with a
+  modeled clock. Between USB packets, the main loop programs what's staged.
+  """
+  def __init__(self, legacy=False, corrupt=False):
+    self.legacy = legacy  # no 0xb3 - 0xb5
+    self.t = 0.
+    self.main_t = 0.
+    self.transfers = 0
+    self.bytes = 0
+    self.erased = []
+    self.inline_words = 0
+    self.reset = False
+    self.corrupt = corrupt
+
+  def _status(self, request):
+    return struct.pack("<BBBB4sI", 0xff, 0, request, ~request & 0xFF, b"\xde\xad\xd0\x0d", 0)
+
+  def _sha(self, start, n):
+    self.t += n / SHA_BYTES_PER_S
+    return hashlib.sha1(bytes(libpanda_py.ffi.buffer(lpp.fake_app_flash)[start:start + n])).digest()
+
+  def _flush(self):
+    self._main_loop(float("inf"))
+    self.t = self.main_t
+    lpp.flash_stream_flush()
+
+  def _main_loop(self, until):
+    self.main_t = max(self.main_t, self.t)
+    while self.main_t < until and lpp.flash_stream_program(False):
+      self.main_t += FLASH_WORD_S
+
+  def controlWrite(self, request_type, request, value, index, data, timeout=0, expect_disconnect=False):
+    self.t += XFER_OVERHEAD_S
+    if request == 0xb1:
+      lpp.flash_stream_reset()
+    elif request == 0xb2:
+      self.erased.append(value)
+      flash = libpanda_py.ffi.buffer(lpp.fake_app_flash)
+      flash[(value - 1) * SECTOR_SIZE:value * SECTOR_SIZE] = b"\xff" * SECTOR_SIZE
+    elif request == 0xb5 and not self.legacy:
+      self._flush()
+      lpp.flash_stream_seek((value - 1) * SECTOR_SIZE)
+    elif request == 0xd8:
+      lpp.flash_stream_flush()
+      self.reset = True
+
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    self.t += XFER_OVERHEAD_S
+    if request == 0xb3 and not self.legacy:
+      self._flush()
+      if self.corrupt:
+        lpp.fake_app_flash[100] ^= 1
+      return self._sha(0, value | (index << 16))
+    if request == 0xb4 and not self.legacy:
+      self._flush()
+      return self._sha((value - 1) * SECTOR_SIZE, SECTOR_SIZE)
+    return self._status(request)
+
+  def bulkWrite(self, endpoint, data, timeout=0):
+    assert endpoint == 2
+    self.transfers += 1
+    self.bytes += len(data)
+    self.t += XFER_OVERHEAD_S
+    for i in range(0, len(data), 64):
+      arrival = self.t + PACKET_S
+      self._main_loop(arrival)
+      # an interrupt waits for the flash word the main loop is on
+      self.t = max(arrival, self.main_t)
+      words = lpp.flash_blocks_programmed
+      lpp.flash_stream_write(data[i:i + 64], len(data[i:i + 64]))
+      self.inline_words += lpp.flash_blocks_programmed - words
+      self.t += (lpp.flash_blocks_programmed - words) * FLASH_WORD_S
+      self.main_t = max(self.main_t, self.t)
+    return len(data)
+
+  def bulkRead(self, endpoint, length, timeout=0):
+    raise NotImplementedError
+
+  def close(self):
+    pass
+
+
+class TestFlasher(unittest.TestCase):
+  def setUp(self):
+    lpp.flash_stream_reset()
+    libpanda_py.ffi.buffer(lpp.fake_app_flash)[:] = os.urandom(APP_MAX_LEN)
+
+  def _flash(self, code, **kwargs):
+    handle = FakeFlasher(**kwargs)
+    Panda.flash_static(handle, code, McuType.H7)
+    return handle
+
+  def _flashed(self, n):
+    return bytes(libpanda_py.ffi.buffer(lpp.fake_app_flash)[:n])
+
+  def test_flash(self):
+    code = os.urandom(300001)
+    handle = self._flash(code)
+    self.assertTrue(handle.reset)
+    # padded to a whole flash word with erased flash
+    self.assertEqual(self._flashed(300032), code + b"\xff" * 31)
+    self.assertEqual(lpp.flash_stream_offset(), 300032)
+
+  def test_verify_failed(self):
+    with self.assertRaisesRegex(AssertionError, "verify failed"):
+      self._flash(os.urandom(100000), corrupt=True)
+
+  def test_legacy_bootstub(self):
+    code = os.urandom(50000)
+    self._flash(code)
+    handle = self._flash(code, legacy=True)
+    self.assertEqual(handle.erased, [1])
+    self.assertTrue(handle.reset)
+    self.assertEqual(self._flashed(len(code)), code)
+
+  def test_delta(self):
+    old = os.urandom(600000)
+    full = self._flash(old)
+
+    # a few changes in sector 3
+    code = bytearray(old)
+    code[0x45000:0x45010] = os.urandom(16)
+    code[0x5ff00] ^= 0xFF
+    handle = self._flash(bytes(code))
+    self.assertEqual(handle.erased, [3])
+    self.assertEqual(handle.bytes, SECTOR_SIZE)
+    self.assertEqual(self._flashed(len(code)), code)
+    self.assertLess(handle.t * 3, full.t)
+
+    # same image, nothing to do
+    handle = self._flash(bytes(code))
+    self.assertEqual((handle.erased, handle.bytes), ([], 0))
+    self.assertTrue(handle.reset)
+
+  def test_delta_length_change(self):
+    old = os.urandom(500000)
+    self._flash(old)
+
+    # shorter, the last sector still held the end of the old image
+    code = old[:300001]
+    handle = self._flash(code)
+    self.assertEqual(handle.erased, [3])
+    self.assertEqual(self._flashed(3 * SECTOR_SIZE), code.ljust(3 * SECTOR_SIZE, b"\xff"))
+
+    # longer, with a change in the first sector too
+    code = b"\x00" + code[1:] + os.urandom(200000)
+    handle = self._flash(code)
+    self.assertEqual(handle.erased, [1, 3, 4])
+    self.assertEqual(self._flashed(len(code)), code)
+
+  def test_ring_full(self):
+    # nothing programmed by the main loop, the writes program inline once the ring is full
+    lpp.flash_stream_reset()
+    code = os.urandom(100000)
+    for i in range(0, len(code), 1000):
+      lpp.flash_stream_write(code[i:i + 1000], 1000)
+    lpp.flash_stream_flush()
+    self.assertEqual(self._flashed(len(code)), code)
+
+  def test_flash_time(self):
+    code = os.urandom(600000)
+    times = {}
+    for name, chunk in (("legacy", 0x10), ("streamed", Panda.FLASH_CHUNK_SIZE)):
+      self.setUp()
+      Panda.FLASH_CHUNK_SIZE, old = chunk, Panda.FLASH_CHUNK_SIZE
+      try:
+        handle = self._flash(code)
+      finally:
+        Panda.FLASH_CHUNK_SIZE = old
+      self.assertEqual(self._flashed(len(code)), code)
+      times[name] = handle.t
+
+    # streamed includes the on-device verify, and is limited by the link
+    self.assertLess(times["streamed"] * 5, times["legacy"], times)
+    self.assertLess(times["streamed"], 1.2 * len(code) / 64 * PACKET_S, times)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+import threading
+import time
+import unittest
+from unittest.mock import patch
+
+from panda import PandaFleet, discover
+
+LIST_S = 0.1     # enumerating a bus
+CONNECT_S = 0.1
+FLASH_S = 0.3
+DFU_S = 0.3      # entering DFU
+RECOVER_S = 0.5  # programming the bootstub
+
+# serial -> in DFU
+DEVICES: dict[str, bool] = {}
+lock = threading.Lock()
+
+
+def dfu_serial(serial):
+  return "DFU" + serial
+
+
+class FakePandaDFU:
+  def __init__(self, s):
+    self.serial = s[3:]
+    assert DEVICES[self.serial]
+
+  def __enter__(self):
+    return self
+
+  def __exit__(self, *args):
+    pass
+
+  def recover(self):
+    time.sleep(RECOVER_S)
+    # comes back up in the bootstub
+    with lock:
+      DEVICES[self.serial] = False
+
+  @staticmethod
+  def usb_list():
+    time.sleep(LIST_S)
+    with lock:
+      return [dfu_serial(s) for s, dfu in DEVICES.items() if dfu]
+
+  @staticmethod
+  def spi_list():
+    time.sleep(LIST_S)
+    return []
+
+
+class FakePanda:
+  flashed: list[str] = []
+
+  def __init__(self, serial, claim=True, cli=True):
+    self.serial = serial
+    self.connect()
+
+  def connect(self, claim=True, wait=False):
+    time.sleep(CONNECT_S)
+    if self.serial.startswith("bad"):
+      raise Exception("no response")
+    self.bootstub = DEVICES[self.serial]
+    self.closed = False
+
+  def close(self):
+    self.closed = True
+
+  def get_dfu_serial(self):
+    return dfu_serial(self.serial)
+
+  def get_type(self):
+    return b"\x07"
+
+  def up_to_date(self, fn=None):
+    return self.serial in FakePanda.flashed
+
+  def flash(self, fn=None, code=None, reconnect=True):
+    time.sleep(FLASH_S)
+    with lock:
+      FakePanda.flashed.append(self.serial)
+
+  def reconnect(self):
+    self.connect()
+
+  def reset(self, enter_bootstub=False, enter_bootloader=False, reconnect=True):
+    if enter_bootloader:
+      with lock:
+        DEVICES[self.serial] = True
+
+  @staticmethod
+  def wait_for_dfu(s, timeout=None):
+    time.sleep(DFU_S)
+    return True
+
+  @staticmethod
+  def usb_list():
+    time.sleep(LIST_S)
+    with lock:
+      return [s for s, dfu in DEVICES.items() if not dfu]
+
+  @staticmethod
+  def spi_list():
+    time.sleep(LIST_S)
+    return []
+
+
+class TestPandaFleet(unittest.TestCase):
+  def setUp(self):
+    DEVICES.clear()
+    DEVICES.update({f"{i:024d}": False for i in range(8)})
+    FakePanda.flashed = []
+    for target, fake in (("Panda", FakePanda), ("PandaDFU", FakePandaDFU)):
+      p = patch(f"panda.python.fleet.{target}", fake)
+      p.start()
+      self.addCleanup(p.stop)
+    self.stages = []
+
+  def _progress(self, serial, stage):
+    self.stages.append((serial, stage))
+
+  def test_discover(self):
+    DEVICES["dfu0"] = True
+    t = time.monotonic()
+    devices = discover()
+    self.assertLess(time.monotonic() - t, 2 * LIST_S)
+    self.assertEqual(devices.pandas, sorted(s for s in DEVICES if s != "dfu0"))
+    self.assertEqual(devices.dfu, ["DFUdfu0"])
+
+  def test_parallel_flash(self):
+    t = time.monotonic()
+    with PandaFleet(progress=self._progress) as fleet:
+      self.assertEqual(len(fleet), 8)
+      connect_s = time.monotonic() - t
+      ret = fleet.flash()
+      flash_s = time.monotonic() - t - connect_s
+
+      self.assertEqual(sorted(ret), fleet.serials)
+      self.assertTrue(all(r is None for r in ret.values()))
+      self.assertEqual(sorted(FakePanda.flashed), fleet.serials)
+
+      # already flashed, nothing to do
+      fleet.flash()
+      self.assertEqual(len(FakePanda.flashed), 8)
+    self.assertTrue(all(p.closed for p in fleet))
+
+    # as long as one device, not eight
+    self.assertLess(connect_s, LIST_S + 2 * CONNECT_S)
+    self.assertLess(flash_s, 2 * FLASH_S)
+
+    for s in fleet.serials:
+      stages = [st for serial, st in self.stages if serial == s]
+      self.assertEqual([st.split(" ")[0] for st in stages],
+                       ["connecting", "done", "flashing", "reconnecting", "done", "up", "done"])
+
+  def test_errors(self):
+    DEVICES["bad" + "0" * 21] = False
+    with PandaFleet(progress=self._progress) as fleet:
+      self.assertEqual(len(fleet), 8)
+      self.assertEqual(list(fleet.errors), ["bad" + "0" * 21])
+
+      ret = fleet.map(lambda p: p.serial if p.serial != fleet.serials[0] else 1 / 0)
+      self.assertIsInstance(ret[fleet.serials[0]], ZeroDivisionError)
+      self.assertEqual([r for r in ret.values() if isinstance(r, str)], fleet.serials[1:])
+      self.assertIn((fleet.serials[0], "failed: division by zero"), self.stages)
+
+  def test_recover(self):
+    DEVICES["dfu" + "0" * 21] = True
+    t = time.monotonic()
+    with PandaFleet(progress=self._progress) as fleet:
+      self.assertEqual(fleet.dfu, ["DFUdfu" + "0" * 21])
+      ret = fleet.recover()
+      self.assertTrue(all(r is None for r in ret.values()), ret)
+      # the panda that was in DFU joined the fleet
+      self.assertEqual(len(fleet), 9)
+      self.assertEqual(fleet.dfu, [])
+    self.assertEqual(sorted(FakePanda.flashed), sorted(DEVICES))
+    self.assertLess(time.monotonic() - t, 2 * (DFU_S + RECOVER_S + FLASH_S + CONNECT_S) + 4 * LIST_S)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+import time
+import unittest
+from unittest.mock import patch
+
+import usb1
+
+from panda.python import hotplug
+from panda.python.hotplug import wait_for_usb
+
+ARRIVE_S = 0.35  # the device enumerates
+OPEN_S = 0.02    # and opens this long after
+
+
+class FakeDevice:
+  """A panda coming back from a reset."""
+  def __init__(self, vid=0xbbaa):
+    self.vid = vid
+    self.t_start = time.monotonic()
+    self.checks = 0
+
+  def age(self):
+    return time.monotonic() - self.t_start
+
+  def check(self):
+    self.checks += 1
+    return self.age() >= ARRIVE_S + OPEN_S
+
+
+class FakeContext:
+  def __init__(self, device, capable=True):
+    self.device = device
+    self.capable = capable
+    self.callbacks = []
+    self.delivered = False
+
+  def __call__(self):
+    return self
+
+  def __enter__(self):
+    return self
+
+  def __exit__(self, *args):
+    pass
+
+  def hasCapability(self, cap):
+    return self.capable and cap == usb1.CAP_HAS_HOTPLUG
+
+  def hotplugRegisterCallback(self, callback, events, flags, vendor_id):
+    self.callbacks.append((callback, vendor_id))
+
+  def handleEventsTimeout(self, tv=0):
+    end = time.monotonic() + tv
+    while time.monotonic() < end:
+      if not self.delivered and self.device.age() >= ARRIVE_S:
+        self.delivered = True
+        for cb, vid in self.callbacks:
+          if vid == self.device.vid:
+            cb(self, self.device, usb1.HOTPLUG_EVENT_DEVICE_ARRIVED)
+        return
+      time.sleep(0.001)
+
+
+class TestHotplug(unittest.TestCase):
+  def _wait(self, capable=True, enabled=True, vid=0xbbaa, **kwargs):
+    device = FakeDevice(vid)
+    ctx = FakeContext(device, capable)
+    with patch.object(hotplug.usb1, "USBContext", ctx), patch.object(hotplug, "ENABLED", enabled):
+      ret = wait_for_usb(device.check, (0xbbaa, ), **kwargs)
+    return ret, device.age() - ARRIVE_S - OPEN_S, device.checks
+
+  def test_hotplug(self):
+    ret, latency, checks = self._wait(timeout=2, usb_only=True)
+    self.assertTrue(ret)
+    # right after it opens, without checking while it was gone
+    self.assertLess(latency, 0.015)
+    self.assertLess(checks, 5)
+
+  def test_hotplug_with_spi(self):
+    # SPI devices don't hotplug, so they're still polled
+    ret, latency, checks = self._wait(timeout=2, poll_s=0.1)
+    self.assertTrue(ret)
+    self.assertLess(latency, 0.015)
+    self.assertGreaterEqual(checks, 4)
+
+  def test_polling_fallback(self):
+    for kwargs in ({"capable": False}, {"enabled": False}):
+      ret, latency, checks = self._wait(timeout=2, usb_only=True, poll_s=0.1, **kwargs)
+      self.assertTrue(ret)
+      self.assertGreaterEqual(checks, 4)
+
+  def test_other_vendor(self):
+    # a DFU device arriving doesn't wake a wait for a panda, it's only seen on the recheck
+    ret, latency, checks = self._wait(vid=0x0483, timeout=0.6, usb_only=True)
+    self.assertTrue(ret)
+    self.assertGreater(latency, 0.15)
+    # the event still wakes the context once
+    self.assertLessEqual(checks, 3)
+
+  def test_timeout(self):
+    t = time.monotonic()
+    with patch.object(hotplug.usb1, "USBContext", FakeContext(FakeDevice())):
+      self.assertFalse(wait_for_usb(lambda: False, (0xbbaa, ), timeout=0.2, poll_s=0.05))
+    self.assertAlmostEqual(time.monotonic() - t, 0.2, delta=0.05)
+
+  def test_speedup(self):
+    latencies = {}
+    for enabled in (False, True):
+      ret, latencies[enabled], _ = self._wait(enabled=enabled, timeout=2, usb_only=True, poll_s=0.1)
+      self.assertTrue(ret)
+    # what's left of a 100ms poll against the moment it opened
+    self.assertLess(latencies[True], latencies[False], latencies)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+import unittest
+
+from panda import Panda
+from panda.tests.libpanda import libpanda_py
+from panda.tests.libpanda.usb_emulator import UsbEmulator
+
+lpp = libpanda_py.libpanda
+
+IRQ = 2
+
+
+class TestInterruptStats(unittest.TestCase):
+  def setUp(self):
+    lpp.init_interrupts(False)
+    lpp.fake_irq_register(IRQ)
+
+  def _run(self, durations):
+    for d in durations:
+      lpp.fake_irq_duration = d
+      lpp.handle_interrupt(IRQ)
+
+  def _second(self):
+    lpp.INTERRUPT_TIMER.SR = 1
+    lpp.interrupt_timer_handler()
+
+  def _stats(self, irq=IRQ):
+    stats = libpanda_py.ffi.new("interrupt_stats_t *")
+    lpp.get_interrupt_stats(irq, stats)
+    return stats
+
+  def test_buckets(self):
+    # the edges of each log4 bucket, the last one takes anything from 4.096ms up
+    self._run([0, 1, 3, 4, 15, 16, 63, 64, 255, 256, 1023, 1024, 4095, 4096, 100000])
+    self.assertEqual(list(self._stats().duration_hist), [1, 2, 2, 2, 2, 2, 2, 2])
+    self.assertEqual(list(self._stats(IRQ + 1).duration_hist), [0] * 8)
+
+  def test_per_second(self):
+    self._run([10, 200, 30])
+    # published once a second
+    self.assertEqual(self._stats().busy_time, 0)
+
+    self._second()
+    stats = self._stats()
+    self.assertEqual(stats.call_rate, 3)
+    self.assertEqual(stats.busy_time, 240)
+    self.assertEqual(stats.max_duration, 200)
+
+    # the busy time and longest run restart every second, the histogram doesn't
+    self._run([5])
+    self._second()
+    stats = self._stats()
+    self.assertEqual((stats.call_rate, stats.busy_time, stats.max_duration), (1, 5, 5))
+    self.assertEqual(sum(stats.duration_hist), 4)
+
+  def test_layout(self):
+    self.assertEqual(lpp.interrupt_stats_size, Panda.INTERRUPT_STATS_STRUCT.size)
+    self._run([3, 70, 5000])
+    self._second()
+
+    emu = UsbEmulator()
+    self.addCleanup(emu.stop)
+    with emu.panda() as p:
+      stats = p.get_interrupt_stats(IRQ)
+    self.assertEqual(stats, {
+      "call_rate": 3,
+      "busy_time": 5073,
+      "load": 5073 / 1e6,
+      "max_duration": 5000,
+      "duration_hist": [0, 1, 0, 0, 1, 0, 0, 1],
+    })
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+import unittest
+
+from panda import Panda, pack_isotp_open, pack_isotp_send, pack_isotp_close
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+TX_ADDR = 0x7E0
+RX_ADDR = 0x7E8
+
+
+def drain(q):
+  msgs = []
+  pkt = libpanda_py.ffi.new('CANPacket_t *')
+  while lpp.can_pop(q, pkt):
+    msgs.append((pkt[0].addr, bytes(pkt[0].data[0:8]), pkt[0].bus))
+  return msgs
+
+
+def comms_write(dat):
+  lpp.isotp_comms_write(libpanda_py.ffi.from_buffer(dat), len(dat))
+
+
+def status(channel=0):
+  st = libpanda_py.ffi.new('isotp_status_t *')
+  assert lpp.isotp_get_status(channel, st)
+  return st[0].tx_state, st[0].rx_state, st[0].error, st[0].rx_len
+
+
+def read_pdu(channel=0, chunk=0x80):
+  rx_len = status(channel)[3]
+  buf = libpanda_py.ffi.new('uint8_t[]', chunk)
+  dat = b""
+  while len(dat) < rx_len:
+    n = lpp.isotp_read(channel, len(dat), buf, chunk)
+    dat += bytes(buf[0:n])
+  return dat
+
+
+class SimEcu:
+  """ISO-TP peer on the CAN bus. Reassembles requests from the panda and sends
+  queued responses, honoring the panda's flow control."""
+  def __init__(self, ext_addr=None, block_size=0, st_min=0):
+    self.ext_addr = ext_addr
+    self.block_size = block_size
+    self.st_min = st_min
+    self.requests = []
+    self.cf_times = []
+    self.fc_received = []
+    self._rx = None
+    self._tx = None
+    self._tx_queue = []
+
+  def _frame(self, dat):
+    pre = b"" if self.ext_addr is None else bytes([self.ext_addr])
+    return (pre + dat).ljust(8, b"\x00")
+
+  def respond(self, dat):
+    self._tx_queue.append(dat)
+
+  # frame sent by the panda
+  def rx(self, dat, t):
+    if self.ext_addr is not None:
+      assert dat[0] == self.ext_addr
+      dat = dat[1:]
+    out = []
+    pci = dat[0] >> 4
+    if pci == 0:
+      self.requests.append(dat[1:1 + (dat[0] & 0xF)])
+    elif pci == 1:
+      self._rx = [((dat[0] & 0xF) << 8) | dat[1], dat[2:], 1, 0]
+      out.append(self._frame(bytes([0x30, self.block_size, self.st_min])))
+    elif pci == 2:
+      self.cf_times.append(t)
+      assert dat[0] & 0xF == self._rx[2]
+      self._rx[1] += dat[1:]
+      self._rx[2] = (self._rx[2] + 1) & 0xF
+      self._rx[3] += 1
+      if len(self._rx[1]) >= self._rx[0]:
+        self.requests.append(self._rx[1][:self._rx[0]])
+        self._rx = None
+      elif self.block_size and self._rx[3] % self.block_size == 0:
+        out.append(self._frame(bytes([0x30, self.block_size, self.st_min])))
+    elif pci == 3:
+      self.fc_received.append(dat[:3])
+      if dat[0] == 0x30 and self._tx is not None:
+        self._tx[1] = dat[1]
+    return out
+
+  # frames to send to the panda this tick
+  def tx(self):
+    out = []
+    if self._tx is None and self._tx_queue:
+      dat = self._tx_queue.pop(0)
+      n = 7 if self.ext_addr is None else 6
+      if len(dat) <= n:
+        out.append(self._frame(bytes([len(dat)]) + dat))
+      else:
+        out.append(self._frame(bytes([0x10 | (len(dat) >> 8), len(dat) & 0xFF]) + dat[:n - 1]))
+        # [remaining data, frames left in block (None until flow control), sequence]
+        self._tx = [dat[n - 1:], None, 1]
+    elif self._tx is not None and self._tx[1] is not None:
+      n = 7 if self.ext_addr is None else 6
+      while self._tx[0]:
+        out.append(self._frame(bytes([0x20 | self._tx[2]]) + self._tx[0][:n]))
+        self._tx[0] = self._tx[0][n:]
+        self._tx[2] = (self._tx[2] + 1) & 0xF
+        if self._tx[1] > 0:
+          self._tx[1] -= 1
+          if self._tx[1] == 0:
+            self._tx[1] = None
+            break
+      if not self._tx[0]:
+        self._tx = None
+    return out
+
+
+class TestIsoTp(unittest.TestCase):
+  def setUp(self):
+    lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+    lpp.isotp_clear()
+    self.t = 0
+    lpp.set_timer(0)
+    for q in (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q, lpp.rx_q):
+      drain(q)
+
+  def tearDown(self):
+    lpp.isotp_clear()
+
+  def _open(self, ecu, block_size=0, st_min=0, bus=0):
+    comms_write(pack_isotp_open(0, bus, TX_ADDR, RX_ADDR, ecu.ext_addr, block_size, st_min))
+    self.ecu = ecu
+    self.bus = bus
+
+  def _run(self, ms):
+    for _ in range(ms):
+      self.t += 1
+      lpp.set_timer(self.t * 1000)
+      lpp.isotp_tick(self.t * 1000)
+      self._exchange()
+
+  def _exchange(self):
+    # deliver frames both ways until the bus is idle
+    while True:
+      frames = []
+      for addr, dat, bus in drain(lpp.tx1_q) + drain(lpp.tx2_q) + drain(lpp.tx3_q):
+        self.assertEqual((addr, bus), (TX_ADDR, self.bus))
+        frames += self.ecu.rx(dat, self.t)
+      frames += self.ecu.tx()
+      if not frames:
+        break
+      for dat in frames:
+        self.assertTrue(lpp.isotp_rx_hook(libpanda_py.make_CANPacket(RX_ADDR, self.bus, dat)))
+
+  def _send(self, dat):
+    comms_write(pack_isotp_send(0, dat))
+    self._exchange()
+
+  def test_single_frame(self):
+    self._open(SimEcu())
+    self._send(b"\x3e\x00")
+    self.assertEqual(self.ecu.requests, [b"\x3e\x00"])
+    self.assertEqual(status()[0], Panda.ISOTP_TX_DONE)
+
+    self.ecu.respond(b"\x7e\x00")
+    self._run(1)
+    self.assertEqual(status(), (Panda.ISOTP_TX_DONE, Panda.ISOTP_RX_DONE, 0, 2))
+    self.assertEqual(read_pdu(), b"\x7e\x00")
+    self.assertEqual(status()[1], Panda.ISOTP_RX_IDLE)
+
+  def test_multi_frame_request(self):
+    req = bytes(range(256)) * 4
+    self._open(SimEcu())
+    self._send(req)
+    self._run(200)
+    self.assertEqual(self.ecu.requests, [req])
+    self.assertEqual(status()[0], Panda.ISOTP_TX_DONE)
+
+  def test_block_size_and_st_min(self):
+    # ECU asks for blocks of 3 frames, 5ms apart
+    self._open(SimEcu(block_size=3, st_min=5))
+    req = bytes(range(60))
+    self._send(req)
+    self._run(100)
+    self.assertEqual(self.ecu.requests, [req])
+    self.assertEqual(len(self.ecu.cf_times), 8)
+    gaps = [b - a for a, b in zip(self.ecu.cf_times, self.ecu.cf_times[1:])]
+    self.assertTrue(all(g == 5 for g in gaps), gaps)
+
+  def test_sub_ms_st_min(self):
+    # 0xF5 = 500us, consecutive frames go out on every tick
+    self._open(SimEcu(st_min=0xF5))
+    self._send(bytes(50))
+    self._run(20)
+    gaps = [b - a for a, b in zip(self.ecu.cf_times, self.ecu.cf_times[1:])]
+    self.assertEqual(gaps, [1] * 6)
+
+  def test_multi_frame_response(self):
+    # panda asks for blocks of 2 frames
+    self._open(SimEcu(), block_size=2, st_min=0)
+    resp = bytes(i & 0xFF for i in range(300))
+    self.ecu.respond(resp)
+    self._run(5)
+    self.assertEqual(status()[1:], (Panda.ISOTP_RX_DONE, 0, 300))
+    self.assertEqual(read_pdu(chunk=0x40), resp)
+    # one flow control after the first frame, then one every 2 consecutive frames
+    self.assertEqual(len(self.ecu.fc_received), 1 + (42 - 1) // 2)
+    self.assertTrue(all(fc == b"\x30\x02\x00" for fc in self.ecu.fc_received))
+
+  def test_response_not_read(self):
+    self._open(SimEcu())
+    self.ecu.respond(b"\x01")
+    self.ecu.respond(b"\x02" * 20)
+    self._run(1)
+    # second response is refused with an overflow flow control until the host reads the first
+    self.assertEqual(self.ecu.fc_received, [b"\x32\x00\x00"])
+    self.assertEqual(status()[2:], (5, 1))
+    self.assertEqual(read_pdu(), b"\x01")
+
+  def test_extended_addressing(self):
+    self._open(SimEcu(ext_addr=0x12))
+    req = bytes(range(20))
+    self._send(req)
+    self._run(10)
+    self.assertEqual(self.ecu.requests, [req])
+
+    self.ecu.respond(bytes(range(30)))
+    self._run(10)
+    self.assertEqual(read_pdu(), bytes(range(30)))
+
+    # frames for another extended address aren't for this channel
+    self.assertFalse(lpp.isotp_rx_hook(libpanda_py.make_CANPacket(RX_ADDR, 0, b"\x13\x01\x00")))
+
+  def test_other_frames_not_consumed(self):
+    self._open(SimEcu())
+    self.assertFalse(lpp.isotp_rx_hook(libpanda_py.make_CANPacket(RX_ADDR + 1, 0, b"\x01\x00")))
+    self.assertFalse(lpp.isotp_rx_hook(libpanda_py.make_CANPacket(RX_ADDR, 1, b"\x01\x00")))
+    comms_write(pack_isotp_close(0))
+    self.assertFalse(lpp.isotp_rx_hook(libpanda_py.make_CANPacket(RX_ADDR, 0, b"\x01\x00")))
+
+  def test_flow_control_timeout(self):
+    self._open(SimEcu())
+    comms_write(pack_isotp_send(0, bytes(20)))
+    self.assertEqual(len(drain(lpp.tx1_q)), 1)
+    self._run(999)
+    self.assertEqual(status()[0], Panda.ISOTP_TX_WAIT_FC)
+    self._run(2)
+    self.assertEqual(status()[0::2], (Panda.ISOTP_TX_ERROR, 1))
+    # errors are only reported once
+    self.assertEqual(status()[2], 0)
+
+  def test_flow_control_overflow(self):
+    self._open(SimEcu())
+    comms_write(pack_isotp_send(0, bytes(20)))
+    drain(lpp.tx1_q)
+    lpp.isotp_rx_hook(libpanda_py.make_CANPacket(RX_ADDR, 0, b"\x32\x00\x00"))
+    self.assertEqual(status()[0::2], (Panda.ISOTP_TX_ERROR, 3))
+
+  def test_consecutive_frame_errors(self):
+    self._open(SimEcu())
+    ff = libpanda_py.make_CANPacket(RX_ADDR, 0, b"\x10\x20" + bytes(6))
+    lpp.isotp_rx_hook(ff)
+    lpp.isotp_rx_hook(libpanda_py.make_CANPacket(RX_ADDR, 0, b"\x22" + bytes(7)))
+    self.assertEqual(status()[1:3], (Panda.ISOTP_RX_IDLE, 4))
+
+    lpp.isotp_rx_hook(ff)
+    self.assertEqual(status()[1], Panda.ISOTP_RX_RECEIVING)
+    self._run(1001)
+    self.assertEqual(status()[1:3], (Panda.ISOTP_RX_IDLE, 2))
+
+  def test_safety_blocks(self):
+    self._open(SimEcu())
+    lpp.set_safety_hooks(Panda.SAFETY_NOOUTPUT, 0)
+    self._send(bytes(4))
+    self.assertEqual(self.ecu.requests, [])
+    self.assertEqual(status()[0::2], (Panda.ISOTP_TX_ERROR, 6))
+    # rejected frames are reported to the host like any other
+    self.assertEqual(len(drain(lpp.rx_q)), 1)
+
+  def test_busy_channel(self):
+    self._open(SimEcu())
+    comms_write(pack_isotp_send(0, bytes(20)))
+    # rejected while the first PDU is waiting for flow control, and reported
+    self.assertFalse(lpp.isotp_send(0, 4))
+    comms_write(pack_isotp_send(0, b"\x01" * 20))
+    self.assertEqual(status()[0::2], (Panda.ISOTP_TX_WAIT_FC, 7))
+    self._exchange()
+    self._run(5)
+    # the first PDU wasn't overwritten
+    self.assertEqual(self.ecu.requests, [bytes(20)])
+    self.assertEqual(status()[0::2], (Panda.ISOTP_TX_DONE, 0))
+
+  def test_invalid_open(self):
+    self.assertFalse(lpp.isotp_open(4, 0, TX_ADDR, RX_ADDR, False, 0, 0, 0))
+    self.assertFalse(lpp.isotp_open(0, 3, TX_ADDR, RX_ADDR, False, 0, 0, 0))
+    self.assertFalse(lpp.isotp_send(0, 4))
+
+  def test_rejected_commands(self):
+    comms_write(pack_isotp_send(0, bytes(4)))
+    self.assertEqual(status()[0::2], (Panda.ISOTP_TX_IDLE, 8))
+    comms_write(pack_isotp_open(0, 3, TX_ADDR, RX_ADDR, None, 0, 0))
+    self.assertEqual(status()[2], 8)
+    self.assertEqual(drain(lpp.tx1_q), [])
+
+
+if __name__ == "__main__":
+  unittest.main()
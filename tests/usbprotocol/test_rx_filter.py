@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+import unittest
+
+from panda import Panda
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+
+def rx(addr, bus, dat, ts_ms):
+  pkt = libpanda_py.make_CANPacket(addr, bus, dat)
+  pkt[0].timestamp = int(ts_ms * 1000) & 0xFFFFFFFF
+  return lpp.can_rx_filter_check(pkt)
+
+
+class TestCanRxFilter(unittest.TestCase):
+  def setUp(self):
+    lpp.can_rx_filter_clear()
+
+  def test_no_policy_delivers_all(self):
+    for t in range(10):
+      self.assertTrue(rx(0x100, 0, b"\x01", t))
+    self.assertEqual(lpp.can_rx_filtered_cnt, 0)
+
+  def test_drop(self):
+    self.assertTrue(lpp.can_rx_filter_set(0, 0x100, Panda.CAN_RX_FILTER_DROP, 0))
+    self.assertFalse(rx(0x100, 0, b"\x01", 0))
+    # other buses and addresses are unaffected
+    self.assertTrue(rx(0x100, 1, b"\x01", 0))
+    self.assertTrue(rx(0x101, 0, b"\x01", 0))
+    self.assertEqual(lpp.can_rx_filtered_cnt, 1)
+
+    # setting ALL removes the policy
+    self.assertTrue(lpp.can_rx_filter_set(0, 0x100, Panda.CAN_RX_FILTER_ALL, 0))
+    self.assertTrue(rx(0x100, 0, b"\x01", 0))
+
+  def test_on_change(self):
+    self.assertTrue(lpp.can_rx_filter_set(0, 0x200, Panda.CAN_RX_FILTER_ON_CHANGE, 0))
+    self.assertTrue(rx(0x200, 0, b"\x01\x02", 0))
+    self.assertFalse(rx(0x200, 0, b"\x01\x02", 10))
+    self.assertTrue(rx(0x200, 0, b"\x01\x03", 20))
+    self.assertFalse(rx(0x200, 0, b"\x01\x03", 30))
+    # length change counts as a change
+    self.assertTrue(rx(0x200, 0, b"\x01\x03\x00", 40))
+    # no keyframes without an interval
+    self.assertFalse(rx(0x200, 0, b"\x01\x03\x00", 100000))
+
+  def test_on_change_keyframe(self):
+    self.assertTrue(lpp.can_rx_filter_set(0, 0x300, Panda.CAN_RX_FILTER_ON_CHANGE, 100))
+    delivered = [rx(0x300, 0, b"\x00", t) for t in range(0, 1000, 10)]
+    self.assertEqual(sum(delivered), 10)
+    self.assertEqual(delivered[::10], [True] * 10)
+
+  def test_rate_limit(self):
+    self.assertTrue(lpp.can_rx_filter_set(2, 0x18DAF110, Panda.CAN_RX_FILTER_RATE_LIMIT, 50))
+    delivered = [rx(0x18DAF110, 2, bytes([t % 256]), t) for t in range(0, 1000, 10)]
+    self.assertEqual(sum(delivered), 20)
+    self.assertEqual(lpp.can_rx_filtered_cnt, 80)
+
+  def test_timer_wraparound(self):
+    self.assertTrue(lpp.can_rx_filter_set(0, 0x400, Panda.CAN_RX_FILTER_RATE_LIMIT, 10))
+    t0 = (2**32 - 5000) / 1000
+    self.assertTrue(rx(0x400, 0, b"", t0))
+    self.assertFalse(rx(0x400, 0, b"", t0 + 5))
+    self.assertTrue(rx(0x400, 0, b"", t0 + 10))
+
+  def test_table_full(self):
+    for addr in range(64):
+      self.assertTrue(lpp.can_rx_filter_set(0, addr, Panda.CAN_RX_FILTER_DROP, 0))
+    self.assertFalse(lpp.can_rx_filter_set(0, 64, Panda.CAN_RX_FILTER_DROP, 0))
+
+    # updating an existing entry still works, and removing one frees a slot
+    self.assertTrue(lpp.can_rx_filter_set(0, 10, Panda.CAN_RX_FILTER_RATE_LIMIT, 10))
+    self.assertTrue(lpp.can_rx_filter_set(0, 0, Panda.CAN_RX_FILTER_ALL, 0))
+    self.assertTrue(lpp.can_rx_filter_set(0, 64, Panda.CAN_RX_FILTER_DROP, 0))
+    self.assertTrue(rx(0, 0, b"", 0))
+    self.assertFalse(rx(63, 0, b"", 0))
+
+  def test_invalid_mode(self):
+    self.assertFalse(lpp.can_rx_filter_set(0, 0x100, 4, 0))
+    self.assertTrue(rx(0x100, 0, b"", 0))
+
+  def test_comms_reset_clears(self):
+    # policies belong to the connection that set them
+    self.assertTrue(lpp.can_rx_filter_set(0, 0x100, Panda.CAN_RX_FILTER_DROP, 0))
+    self.assertFalse(rx(0x100, 0, b"", 0))
+    lpp.comms_can_reset()
+    self.assertTrue(rx(0x100, 0, b"", 1))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+import random
+import struct
+import unittest
+from contextlib import contextmanager
+from unittest.mock import patch
+
+from panda import Panda, DLC_TO_LEN, pack_can_buffer, unpack_can_buffer
+from panda.python.spi import PandaSpiHandle, PandaSpiException, XFER_SIZE
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+SPI_MAX_DATA_LEN = 8192 - 8
+UNDERRUN = 0xcd
+
+# modeled bus: 50MHz clock and a fixed cost per spidev transfer
+SPI_HZ = 50e6
+XFER_OVERHEAD_S = 20e-6
+
+
+class FakeSpiBus:
+  """
+  SPI protocol emulator, the host side of spidev against the firmware's SPI state machine.
+  DMA set up by the firmware during a transfer starts with the next one, the bytes in between
+  get drained, like on the hardware.
+  """
+  def __init__(self):
+    self.transfers = 0
+    self.bytes = 0
+    self.critical_frames = 0  # frames popped between receiving a request and starting the response
+    self.mosi_cnt = lpp.spi_mosi_cnt
+    self.mosi_pos = 0
+    self.miso_cnt = lpp.spi_miso_cnt
+    self.miso_pos = lpp.spi_miso_len + 1
+
+  def modeled_time(self):
+    return self.bytes * 8 / SPI_HZ + self.transfers * XFER_OVERHEAD_S
+
+  def xfer2(self, tx):
+    self.transfers += 1
+    self.bytes += len(tx)
+    mosi_active = self.mosi_cnt != lpp.spi_mosi_cnt or self.mosi_pos < lpp.spi_mosi_len
+    miso_active = self.miso_cnt != lpp.spi_miso_cnt or self.miso_pos < lpp.spi_miso_len
+    if self.mosi_cnt != lpp.spi_mosi_cnt:
+      self.mosi_cnt, self.mosi_pos = lpp.spi_mosi_cnt, 0
+    if self.miso_cnt != lpp.spi_miso_cnt:
+      self.miso_cnt, self.miso_pos = lpp.spi_miso_cnt, 0
+
+    rx = []
+    for b in tx:
+      if miso_active and self.miso_pos < lpp.spi_miso_len:
+        rx.append(lpp.spi_miso_addr[self.miso_pos])
+        self.miso_pos += 1
+      else:
+        rx.append(UNDERRUN)
+      if mosi_active and self.mosi_pos < lpp.spi_mosi_len:
+        lpp.spi_mosi_addr[self.mosi_pos] = b
+        self.mosi_pos += 1
+
+    if mosi_active and self.mosi_pos == lpp.spi_mosi_len:
+      self.mosi_pos += 1
+      rx_q_free = lpp.can_slots_empty(lpp.rx_q)
+      lpp.spi_rx_done()
+      if lpp.spi_miso_cnt != self.miso_cnt:
+        self.critical_frames += rx_q_free - lpp.spi_miso_rx_q_free
+    elif miso_active and self.miso_pos == lpp.spi_miso_len:
+      self.miso_pos += 1
+      lpp.spi_tx_done(False)
+    return rx
+
+  def readbytes(self, n):
+    return self.xfer2([0] * n)
+
+  def writebytes(self, dat):
+    self.xfer2(list(dat))
+
+
+class FakeSpiDevice:
+  def __init__(self, bus, max_xfer_len=4096):
+    self.bus = bus
+    self.max_xfer_len = max_xfer_len
+
+  @contextmanager
+  def acquire(self):
+    yield self.bus
+
+  def close(self):
+    pass
+
+
+def random_can_messages(n):
+  msgs = []
+  for _ in range(n):
+    data = bytes(random.getrandbits(8) for _ in range(DLC_TO_LEN[random.randrange(0, 9)]))
+    msgs.append((random.randint(1, 0x7ff), data, random.randint(0, 2)))
+  return msgs
+
+
+class TestSpiProtocol(unittest.TestCase):
+  def setUp(self):
+    lpp.comms_can_reset()
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    for q in (lpp.rx_q, lpp.tx1_q, lpp.tx2_q, lpp.tx3_q):
+      while lpp.can_pop(q, pkt):
+        pass
+    lpp.spi_init()
+    lpp.refresh_can_tx_slots_available()
+
+  def _handle(self, max_xfer_len=4096):
+    bus = FakeSpiBus()
+    with patch('panda.python.spi.SpiDevice', lambda: FakeSpiDevice(bus, max_xfer_len)):
+      handle = PandaSpiHandle()
+    return handle, bus
+
+  def _connect(self, max_xfer_len=4096):
+    handle, bus = self._handle(max_xfer_len)
+    dat = handle.get_protocol_version()
+    self.assertEqual(dat[14], PandaSpiHandle.PROTOCOL_VERSION)
+    handle.set_max_data_len(struct.unpack("<H", dat[15:17])[0])
+    return handle, bus
+
+  def _push_rx(self, msgs):
+    for m in msgs:
+      self.assertTrue(lpp.can_push(lpp.rx_q, libpanda_py.make_CANPacket(m[0], m[2], m[1])))
+
+  def _recv_all(self, handle, max_rx_len=None):
+    rx, buf = [], b""
+    while True:
+      if max_rx_len is None:
+        dat = handle.bulkRead(1, 16384)
+      else:
+        dat = handle._transfer(1, [], 1000, max_rx_len=max_rx_len)
+      if len(dat) == 0:
+        break
+      msgs, buf = unpack_can_buffer(buf + dat)
+      rx += msgs
+    self.assertEqual(buf, b"")
+    return rx
+
+  def test_version_packet(self):
+    handle, _ = self._handle()
+    dat = handle.get_protocol_version()
+    self.assertEqual(dat[13], 0xcc)
+    self.assertEqual(dat[14], 4)
+    self.assertEqual(struct.unpack("<H", dat[15:17])[0], SPI_MAX_DATA_LEN)
+
+  def test_xfer_size(self):
+    handle, _ = self._handle()
+    self.assertEqual(handle.xfer_size, XFER_SIZE)
+
+    # limited by spidev's buffer, then by the panda
+    for bufsiz, expected in ((4096, 4032), (65536, 8128), (1024, 960)):
+      handle, _ = self._connect(bufsiz)
+      self.assertEqual(handle.xfer_size, expected)
+
+  def test_control(self):
+    handle, _ = self._connect()
+    self.assertEqual(handle.controlRead(Panda.REQUEST_IN, 0xc1, 0, 0, 1), bytes([0]))
+
+  def test_prefetch_order(self):
+    handle, bus = self._connect()
+    msgs = random_can_messages(3000)
+    self._push_rx(msgs[:1500])
+    rx = self._recv_all(handle)
+
+    # frames queued after the prefetch still come after it
+    self._push_rx(msgs[1500:])
+    rx += self._recv_all(handle)
+    self.assertEqual(rx, msgs)
+
+  def test_prefetch_smaller_reads(self):
+    handle, _ = self._connect()
+    msgs = random_can_messages(2000)
+    self._push_rx(msgs)
+
+    rx, buf = [], b""
+    for max_len in [4000, 100, 64, 3000, 7, 1000] * 20:
+      msgs_rx, buf = unpack_can_buffer(buf + handle._transfer(1, [], 1000, max_rx_len=max_len))
+      rx += msgs_rx
+    rx += self._recv_all(handle)
+    self.assertEqual(rx, msgs)
+
+  def test_comms_reset_drops_prefetch(self):
+    handle, _ = self._connect()
+    self._push_rx(random_can_messages(1000))
+    handle.bulkRead(1, handle.xfer_size)
+
+    handle.controlWrite(Panda.REQUEST_OUT, 0xc0, 0, 0, b'')
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    while lpp.can_pop(lpp.rx_q, pkt):
+      pass
+    msgs = random_can_messages(10)
+    self._push_rx(msgs)
+    self.assertEqual(self._recv_all(handle), msgs)
+
+  def test_control_batch(self):
+    handle, bus = self._connect()
+    hw_type = (Panda.REQUEST_IN, 0xc1, 0, 0, 1)
+    transfers = bus.transfers
+    self.assertEqual(handle.controlBatch([hw_type] * 3), [bytes([0])] * 3)
+    batched = bus.transfers - transfers
+
+    # a response that might not fit comes back empty, only that request goes on its own
+    self.assertEqual(handle.controlBatch([hw_type, (Panda.REQUEST_IN, 0xc1, 0, 0, 2000)]), [bytes([0])] * 2)
+    self.assertTrue(handle._batch_supported)
+    transfers = bus.transfers
+    self.assertEqual(handle.controlBatch([hw_type] * 3), [bytes([0])] * 3)
+    self.assertEqual(bus.transfers - transfers, batched)
+
+  def test_control_batch_old_firmware(self):
+    handle, _ = self._connect()
+    hw_type = (Panda.REQUEST_IN, 0xc1, 0, 0, 1)
+    # before batching, 0xf0 was an unknown request with an empty response
+    handle._protocol_version = 2
+    with patch('panda.python.spi.CONTROL_BATCH', 0xf1):
+      self.assertEqual(handle.controlBatch([hw_type] * 3), [bytes([0])] * 3)
+    self.assertFalse(handle._batch_supported)
+    self.assertEqual(handle.controlBatch([hw_type] * 3), [bytes([0])] * 3)
+
+  def test_large_write(self):
+    lpp.set_safety_hooks(Panda.SAFETY_ALLOUTPUT, 0)
+    handle, bus = self._connect()
+    msgs = [(0x100 + i, bytes([i % 256]) * 8, 0) for i in range(300)]
+    dat = b"".join(pack_can_buffer(msgs))
+    self.assertGreater(len(dat), XFER_SIZE)
+    handle.bulkWrite(3, dat)
+    self.assertEqual(bus.transfers, 3 + 4 * 2)  # version packet, then two writes
+
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    sent = []
+    while lpp.can_pop(lpp.tx1_q, pkt):
+      sent.append((pkt[0].addr, bytes(pkt[0].data[0:8]), pkt[0].bus))
+    self.assertEqual(sent, msgs)
+
+  def test_oversized_transfer_nack(self):
+    handle, _ = self._connect()
+    with self.assertRaises(PandaSpiException):
+      handle._transfer(3, b"\x00" * (SPI_MAX_DATA_LEN + 1), 10)
+
+    # still in sync after
+    self.assertEqual(handle.controlRead(Panda.REQUEST_IN, 0xc1, 0, 0, 1), bytes([0]))
+
+  def test_throughput(self):
+    msgs = random_can_messages(4000)
+    stats = {}
+    for name, negotiate in (("legacy", False), ("negotiated", True)):
+      self.setUp()
+      handle, bus = self._connect() if negotiate else self._handle()
+      self._push_rx(msgs)
+      start = (bus.transfers, bus.bytes)
+      self.assertEqual(self._recv_all(handle), msgs)
+      bus.transfers -= start[0]
+      bus.bytes -= start[1]
+      stats[name] = bus
+
+    payload = sum(10 + len(m[1]) for m in msgs)
+    legacy, negotiated = payload / stats["legacy"].modeled_time(), payload / stats["negotiated"].modeled_time()
+    self.assertLess(stats["negotiated"].transfers, 0.6 * stats["legacy"].transfers)
+    self.assertGreater(negotiated, 1.1 * legacy, f"{legacy / 1e6:.2f} vs {negotiated / 1e6:.2f} MB/s")
+
+    # responses are assembled ahead, only the first read pops frames before it's clocked out
+    for bus in stats.values():
+      self.assertLess(bus.critical_frames, 0.1 * len(msgs))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+import heapq
+import itertools
+import unittest
+from unittest.mock import patch
+
+from panda import CanRxDispatcher
+from panda.python.uds import (UdsClient, UdsParallelQuery, UdsTarget, SERVICE_TYPE, DATA_IDENTIFIER_TYPE,
+                              MessageTimeoutError, NegativeResponseError)
+
+RECV_S = 1e-3  # a can_recv round trip
+TIMEOUT_S = 0.1
+VIN_DID = DATA_IDENTIFIER_TYPE.VIN
+
+
+class FakeClock:
+  def __init__(self):
+    self.t = 0.
+
+  def monotonic(self):
+    return self.t
+
+  def sleep(self, s):
+    self.t += s
+
+
+class SimEcu:
+  """Answers ReadDataByIdentifier after delay_s, optionally after a number of response pending replies."""
+  def __init__(self, target, data, delay_s=0.01, pending=0, pending_s=0.2, nrc=None, silent=False):
+    self.target = target
+    self.data = data
+    self.delay_s = delay_s
+    self.pending = pending
+    self.pending_s = pending_s
+    self.nrc = nrc
+    self.silent = silent
+    self.cfs = []
+
+  def rx(self, dat, t):
+    """Frames to send in reply, with their times."""
+    if dat[0] >> 4 == 3:
+      # flow control, send the rest
+      ret, self.cfs = [(t + 1e-4 * (i + 1), f) for i, f in enumerate(self.cfs)], []
+      return ret
+    if self.silent:
+      return []
+    assert dat[0] >> 4 == 0
+    req = dat[1:1 + dat[0]]
+    t += self.delay_s
+    out = []
+    for _ in range(self.pending):
+      out.append((t, bytes([0x03, 0x7F, req[0], 0x78]).ljust(8, b"\x00")))
+      t += self.pending_s
+    if self.nrc is not None:
+      out.append((t, bytes([0x03, 0x7F, req[0], self.nrc]).ljust(8, b"\x00")))
+      return out
+
+    resp = bytes([req[0] + 0x40]) + req[1:] + self.data
+    if len(resp) <= 7:
+      out.append((t, (bytes([len(resp)]) + resp).ljust(8, b"\x00")))
+    else:
+      out.append((t, bytes([0x10 | (len(resp) >> 8), len(resp) & 0xFF]) + resp[:6]))
+      rest = resp[6:]
+      self.cfs = [bytes([0x20 | ((i + 1) & 0xF)]) + rest[i * 7:i * 7 + 7] for i in range((len(rest) + 6) // 7)]
+      self.cfs = [f.ljust(8, b"\x00") for f in self.cfs]
+    return out
+
+
+class SimBus:
+  """Panda on a bus of simulated ECUs. Every can_recv takes RECV_S and returns what arrived by then."""
+  def __init__(self, ecus, clock):
+    self.ecus = {e.target.tx_addr: e for e in ecus}
+    self.clock = clock
+    self.pending = []
+    self.cnt = itertools.count()
+    self.can_rx_dispatcher = CanRxDispatcher(self.can_recv)
+
+  def can_send(self, addr, dat, bus, timeout=0):
+    ecu = self.ecus.get(addr)
+    if ecu is not None:
+      for t, f in ecu.rx(bytes(dat), self.clock.t):
+        heapq.heappush(self.pending, (t, next(self.cnt), (ecu.target.rx_addr, f, ecu.target.bus)))
+
+  def can_recv(self):
+    self.clock.t += RECV_S
+    ret = []
+    while self.pending and self.pending[0][0] <= self.clock.t and len(ret) < 254:
+      ret.append(heapq.heappop(self.pending)[2])
+    return ret
+
+
+def vehicle():
+  ecus = []
+  for i in range(20):
+    target = UdsTarget(0x700 + i, 0x780 + i)
+    data = f"ECU{i:02d}".encode().ljust(17, b"X")
+    if i < 3:
+      ecus.append(SimEcu(target, data, silent=True))
+    elif i < 5:
+      ecus.append(SimEcu(target, data, pending=1))
+    elif i == 5:
+      ecus.append(SimEcu(target, data, nrc=0x31))
+    else:
+      ecus.append(SimEcu(target, data, delay_s=0.005 + 0.001 * i))
+  return ecus
+
+
+class TestUdsParallelQuery(unittest.TestCase):
+  def setUp(self):
+    self.clock = FakeClock()
+    self.ecus = vehicle()
+    self.bus = SimBus(self.ecus, self.clock)
+    p = patch("panda.python.uds.time", self.clock)
+    p.start()
+    self.addCleanup(p.stop)
+
+  def _query(self):
+    query = UdsParallelQuery(self.bus, [e.target for e in self.ecus], timeout=TIMEOUT_S)
+    return list(query.request(SERVICE_TYPE.READ_DATA_BY_IDENTIFIER, data=VIN_DID.to_bytes(2, "big")))
+
+  def _check(self, ecu, resp):
+    if ecu.silent:
+      self.assertIsInstance(resp, MessageTimeoutError)
+    elif ecu.nrc is not None:
+      self.assertIsInstance(resp, NegativeResponseError)
+      self.assertEqual(resp.error_code, ecu.nrc)
+    else:
+      self.assertEqual(resp, VIN_DID.to_bytes(2, "big") + ecu.data)
+
+  def test_results(self):
+    results = self._query()
+    self.assertEqual(len(results), len(self.ecus))
+    for ecu in self.ecus:
+      self._check(ecu, dict(results)[ecu.target])
+
+    # yielded as they complete: the fast ECUs, the timeouts, then the response pending ones
+    order = [t.tx_addr - 0x700 for t, _ in results]
+    self.assertEqual(order[:15], [5] + list(range(6, 20)))
+    self.assertEqual(sorted(order[15:18]), [0, 1, 2])
+    self.assertEqual(sorted(order[18:]), [3, 4])
+
+  def test_speedup(self):
+    self._query()
+    parallel_s = self.clock.t
+
+    self.clock.t = 0.
+    for ecu in self.ecus:
+      client = UdsClient(self.bus, ecu.target.tx_addr, ecu.target.rx_addr, timeout=TIMEOUT_S)
+      try:
+        resp = VIN_DID.to_bytes(2, "big") + client.read_data_by_identifier(VIN_DID)
+      except (MessageTimeoutError, NegativeResponseError) as e:
+        resp = e
+      self._check(ecu, resp)
+    sequential_s = self.clock.t
+
+    # the slowest ECU instead of the sum of all of them
+    slowest_s = max(e.delay_s + e.pending * e.pending_s for e in self.ecus)
+    self.assertLess(parallel_s, slowest_s + 0.02)
+    self.assertLess(parallel_s * 3, sequential_s, (parallel_s, sequential_s))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+import heapq
+import itertools
+import os
+import struct
+import unittest
+from unittest.mock import patch
+
+from panda import CanRxDispatcher
+from panda.python.xcp import XcpClient, CommandResponseError, COMMAND_CODE as CC
+
+TX_ADDR, RX_ADDR, DAQ_ADDR = 0x550, 0x551, 0x552
+RECV_S = 1e-3   # a can_recv round trip
+SEND_S = 2e-4   # can_send and can_clear
+RESP_S = 5e-4   # the slave handling a command
+EVENT_S = 0.01  # DAQ event channel 0
+
+
+class FakeClock:
+  def __init__(self):
+    self.t = 0.
+
+  def time(self):
+    return self.t
+
+  def sleep(self, s):
+    self.t += s
+
+
+class SimXcpSlave:
+  """Scripted XCP on CAN slave: memory access with block modes, and dynamic DAQ with one event channel."""
+  def __init__(self, slave_block=True, master_block=True, max_bs=32, min_st=0, daq_addr=RX_ADDR):
+    self.slave_block = slave_block
+    self.master_block = master_block
+    self.max_bs = max_bs
+    self.min_st = min_st
+    self.daq_addr = daq_addr
+    self.mem = bytearray(os.urandom(0x10000))
+    self.mta = 0
+    self.download_left = 0
+    self.commands = 0
+    self.daq_odts = []
+    self.daq_ptr = None
+    self.daq_running = False
+    self.daq_selected = False
+
+  def _res(self, dat=b""):
+    return [(RX_ADDR, bytes([0xFF]) + dat)]
+
+  def _err(self, code):
+    return [(RX_ADDR, bytes([0xFE, code]))]
+
+  def _write(self, dat):
+    self.mem[self.mta:self.mta + len(dat)] = dat
+    self.mta += len(dat)
+    self.download_left -= len(dat)
+
+  def cmd(self, dat):
+    """Packets sent in reply to a command."""
+    self.commands += 1
+    pid = dat[0]
+    if pid == CC.CONNECT:
+      basic = (0x40 if self.slave_block else 0) | 0x80
+      return self._res(struct.pack("<BBBHBB", 0x15, basic, 8, 8, 1, 1))
+    if pid == CC.GET_COMM_MODE_INFO:
+      return self._res(bytes([0, 0x01 if self.master_block else 0, 0, self.max_bs, self.min_st, 0, 1]))
+    if pid == CC.SET_MTA:
+      self.mta = struct.unpack("<I", dat[4:8])[0]
+      return self._res()
+    if pid == CC.UPLOAD:
+      n = dat[1]
+      if n > 7 and not self.slave_block:
+        return self._err(0x22)
+      out = []
+      for i in range(0, n, 7):
+        out += self._res(bytes(self.mem[self.mta + i:self.mta + min(i + 7, n)]))
+      self.mta += n
+      return out
+    if pid == CC.DOWNLOAD:
+      n = dat[1]
+      self.download_left = n
+      self._write(dat[2:2 + min(n, 6)])
+      return self._res() if self.download_left == 0 else []
+    if pid == CC.DOWNLOAD_NEXT:
+      if dat[1] != self.download_left:
+        return self._err(0x29)
+      self._write(dat[2:2 + min(dat[1], 6)])
+      return self._res() if self.download_left == 0 else []
+
+    # DAQ
+    if pid == CC.FREE_DAQ:
+      self.daq_odts, self.daq_running, self.daq_selected = [], False, False
+      return self._res()
+    if pid == CC.ALLOC_DAQ:
+      assert struct.unpack("<H", dat[2:4])[0] == 1
+      return self._res()
+    if pid == CC.ALLOC_ODT:
+      self.daq_odts = [[] for _ in range(dat[4])]
+      return self._res()
+    if pid == CC.ALLOC_ODT_ENTRY:
+      self.daq_odts[dat[4]] = [None] * dat[5]
+      return self._res()
+    if pid == CC.SET_DAQ_PTR:
+      self.daq_ptr = [dat[4], dat[5]]
+      return self._res()
+    if pid == CC.WRITE_DAQ:
+      odt, entry = self.daq_ptr
+      self.daq_odts[odt][entry] = (struct.unpack("<I", dat[4:8])[0], dat[2])
+      self.daq_ptr[1] += 1
+      return self._res()
+    if pid == CC.SET_DAQ_LIST_MODE:
+      assert struct.unpack("<H", dat[4:6])[0] == 0  # event channel
+      return self._res()
+    if pid == CC.START_STOP_DAQ_LIST:
+      self.daq_selected = dat[1] == 2
+      return self._res(bytes([0]))
+    if pid == CC.START_STOP_SYNCH:
+      self.daq_running = dat[1] == 1 and self.daq_selected
+      return self._res()
+    return self._err(0x20)
+
+  def event(self):
+    """DTOs for one sample, PID is the absolute ODT number."""
+    out = []
+    if self.daq_running:
+      for i, odt in enumerate(self.daq_odts):
+        out.append((self.daq_addr, bytes([i]) + b"".join(bytes(self.mem[a:a + n]) for a, n in odt)))
+    return out
+
+
+class SimBus:
+  def __init__(self, slave, clock):
+    self.slave = slave
+    self.clock = clock
+    self.pending = []
+    self.cnt = itertools.count()
+    self.next_event = EVENT_S
+    self.can_rx_dispatcher = CanRxDispatcher(self.can_recv)
+
+  def _push(self, t, frames):
+    for addr, dat in frames:
+      heapq.heappush(self.pending, (t, next(self.cnt), (addr, dat.ljust(8, b"\x00"), 0)))
+
+  def can_clear(self, bus):
+    self.clock.t += SEND_S
+
+  def can_send(self, addr, dat, bus, timeout=0):
+    self.clock.t += SEND_S
+    if addr == TX_ADDR:
+      self._push(self.clock.t + RESP_S, self.slave.cmd(bytes(dat)))
+
+  def can_recv(self):
+    self.clock.t += RECV_S
+    while self.next_event <= self.clock.t:
+      self._push(self.next_event, self.slave.event())
+      self.next_event += EVENT_S
+    ret = []
+    while self.pending and self.pending[0][0] <= self.clock.t and len(ret) < 254:
+      ret.append(heapq.heappop(self.pending)[2])
+    return ret
+
+
+class TestXcp(unittest.TestCase):
+  def _client(self, **kwargs):
+    self.clock = FakeClock()
+    p = patch("panda.python.xcp.time", self.clock)
+    p.start()
+    self.addCleanup(p.stop)
+    daq_addr = kwargs.pop("daq_addr", RX_ADDR)
+    self.slave = SimXcpSlave(daq_addr=daq_addr, **kwargs)
+    self.bus = SimBus(self.slave, self.clock)
+    client = XcpClient(self.bus, TX_ADDR, RX_ADDR, daq_rx_addr=daq_addr)
+    info = client.connect()
+    self.assertEqual(info["byte_order"], "<")
+    client.get_comm_mode_info()
+    return client
+
+  def test_block_upload(self):
+    c = self._client()
+    self.assertEqual(c.upload_memory(0x1234, 3000), bytes(self.slave.mem[0x1234:0x1234 + 3000]))
+    # SET_MTA and one UPLOAD for every 255 bytes
+    self.assertEqual(self.slave.commands, 2 + 1 + 12)
+
+  def test_upload_speedup(self):
+    times = {}
+    for block in (False, True):
+      c = self._client(slave_block=block, master_block=block)
+      t = self.clock.t
+      self.assertEqual(c.upload_memory(0, 4096), bytes(self.slave.mem[:4096]))
+      times[block] = self.clock.t - t
+    self.assertLess(times[True] * 5, times[False], times)
+
+  def test_block_download(self):
+    c = self._client(max_bs=8, min_st=2)
+    dat = os.urandom(1000)
+    c.download_memory(0x2000, dat)
+    self.assertEqual(bytes(self.slave.mem[0x2000:0x2000 + 1000]), dat)
+    # 48 bytes per block with a MAX_BS of 8
+    self.assertEqual(self.slave.commands, 2 + 1 + 1000 // 6 + 1)
+
+    c = self._client(master_block=False)
+    c.download_memory(0x2000, dat)
+    self.assertEqual(bytes(self.slave.mem[0x2000:0x2000 + 1000]), dat)
+
+  def test_block_mode_not_supported(self):
+    c = self._client(slave_block=False, master_block=False)
+    with self.assertRaisesRegex(ValueError, "block mode"):
+      c.upload(100)
+    with self.assertRaisesRegex(ValueError, "block mode"):
+      c.download(bytes(10))
+
+  def test_error_response(self):
+    c = self._client()
+    with self.assertRaises(CommandResponseError) as e:
+      c._send_cto(0xC0)
+      c._recv_dto(c.timeout)
+    self.assertEqual(e.exception.return_code, 0x20)
+
+  def _daq(self, daq_addr):
+    c = self._client(daq_addr=daq_addr)
+    entries = [(0x100, 4), (0x200, 2), (0x300, 4), (0x400, 1), (0x500, 4)]
+    daq = c.configure_daq(entries)
+    self.assertEqual(daq.odts, [[4, 2], [4, 1], [4]])
+    c.start_daq()
+
+    samples = []
+    for i in range(20):
+      self.slave.mem[0x100:0x104] = struct.pack("<I", i)
+      samples += c.daq_recv(timeout=EVENT_S * 2)
+      # a command while DAQ is running doesn't lose DTOs
+      if i == 10:
+        self.assertEqual(c.upload_memory(0x400, 1), bytes(self.slave.mem[0x400:0x401]))
+    c.stop_daq()
+
+    self.assertGreaterEqual(len(samples), 15)
+    for s in samples:
+      self.assertEqual([len(v) for v in s], [4, 2, 4, 1, 4])
+      self.assertEqual(s[4], bytes(self.slave.mem[0x500:0x504]))
+    counters = [struct.unpack("<I", s[0])[0] for s in samples]
+    self.assertEqual(counters, sorted(counters))
+
+  def test_daq(self):
+    self._daq(RX_ADDR)
+
+  def test_daq_separate_id(self):
+    self._daq(DAQ_ADDR)
+
+
+if __name__ == "__main__":
+  unittest.main()